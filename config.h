@@ -0,0 +1,11 @@
+#undef SPDK_CONFIG_DEBUG
+#define SPDK_CONFIG_WERROR 1
+#undef SPDK_CONFIG_COVERAGE
+#undef SPDK_CONFIG_ADDRESS_SANITIZER
+#define SPDK_CONFIG_DPDK_DIR "/path/to/dpdk"
+#define SPDK_CONFIG_NVME_IMPL "nvme_impl.h"
+#define SPDK_CONFIG_IOAT_IMPL "ioat_impl.h"
+#define SPDK_CONFIG_PCIACCESS 1
+#undef SPDK_CONFIG_FIO_PLUGIN
+#define SPDK_FIO_SOURCE_DIR "/usr/src/fio"
+#undef SPDK_CONFIG_RDMA
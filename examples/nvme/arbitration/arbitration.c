@@ -878,6 +878,12 @@ register_workers(void)
 static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
+	if (dev == NULL) {
+		opts->arb_mechanism = g_arbitration.arbitration_mechanism;
+		printf("Attaching to software controller\n");
+		return true;
+	}
+
 	if (spdk_pci_device_has_non_uio_driver(dev)) {
 		fprintf(stderr, "non-uio kernel driver attached to NVMe\n");
 		fprintf(stderr, " controller at PCI address %04x:%02x:%02x.%02x\n",
@@ -905,11 +911,15 @@ static void
 attach_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr *ctrlr,
 	  const struct spdk_nvme_ctrlr_opts *opts)
 {
-	printf("Attached to %04x:%02x:%02x.%02x\n",
-	       spdk_pci_device_get_domain(dev),
-	       spdk_pci_device_get_bus(dev),
-	       spdk_pci_device_get_dev(dev),
-	       spdk_pci_device_get_func(dev));
+	if (dev == NULL) {
+		printf("Attached to software controller\n");
+	} else {
+		printf("Attached to %04x:%02x:%02x.%02x\n",
+		       spdk_pci_device_get_domain(dev),
+		       spdk_pci_device_get_bus(dev),
+		       spdk_pci_device_get_dev(dev),
+		       spdk_pci_device_get_func(dev));
+	}
 
 	/* Update with actual arbitration configuration in use */
 	g_arbitration.arbitration_mechanism = opts->arb_mechanism;
@@ -95,14 +95,21 @@ struct rte_mempool         *request_mempool;
 static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
-	int found_bus    = spdk_pci_device_get_bus(dev);
-	int found_slot   = spdk_pci_device_get_dev(dev);
-	int found_func   = spdk_pci_device_get_func(dev);
+	int found_bus, found_slot, found_func;
 	struct fio_file		*f;
 	unsigned int		i;
 	struct thread_data 	*td = cb_ctx;
 	int rc;
 
+	/* Filenames name PCI addresses, so a software controller is never requested. */
+	if (dev == NULL) {
+		return false;
+	}
+
+	found_bus = spdk_pci_device_get_bus(dev);
+	found_slot = spdk_pci_device_get_dev(dev);
+	found_func = spdk_pci_device_get_func(dev);
+
 	/* Check if we want to claim this device */
 	for_each_file(td, f, i) {
 		int domain, bus, slot, func, nsid;
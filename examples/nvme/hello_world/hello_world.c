@@ -242,6 +242,11 @@ hello_world(void)
 static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
+	if (dev == NULL) {
+		printf("Attaching to software controller\n");
+		return true;
+	}
+
 	if (spdk_pci_device_has_non_uio_driver(dev)) {
 		/*
 		 * If an NVMe controller is found, but it is attached to a non-uio
@@ -281,11 +286,15 @@ attach_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr *ctr
 		exit(1);
 	}
 
-	printf("Attached to %04x:%02x:%02x.%02x\n",
-	       spdk_pci_device_get_domain(dev),
-	       spdk_pci_device_get_bus(dev),
-	       spdk_pci_device_get_dev(dev),
-	       spdk_pci_device_get_func(dev));
+	if (dev == NULL) {
+		printf("Attached to software controller\n");
+	} else {
+		printf("Attached to %04x:%02x:%02x.%02x\n",
+		       spdk_pci_device_get_domain(dev),
+		       spdk_pci_device_get_bus(dev),
+		       spdk_pci_device_get_dev(dev),
+		       spdk_pci_device_get_func(dev));
+	}
 
 	snprintf(entry->name, sizeof(entry->name), "%-20.20s (%-20.20s)", cdata->mn, cdata->sn);
 
@@ -459,9 +459,13 @@ print_controller(struct spdk_nvme_ctrlr *ctrlr, struct spdk_pci_device *pci_dev)
 	cdata = spdk_nvme_ctrlr_get_data(ctrlr);
 
 	printf("=====================================================\n");
-	printf("NVMe Controller at PCI bus %d, device %d, function %d\n",
-	       spdk_pci_device_get_bus(pci_dev), spdk_pci_device_get_dev(pci_dev),
-	       spdk_pci_device_get_func(pci_dev));
+	if (pci_dev == NULL) {
+		printf("NVMe Software Controller\n");
+	} else {
+		printf("NVMe Controller at PCI bus %d, device %d, function %d\n",
+		       spdk_pci_device_get_bus(pci_dev), spdk_pci_device_get_dev(pci_dev),
+		       spdk_pci_device_get_func(pci_dev));
+	}
 	printf("=====================================================\n");
 
 	if (g_hex_dump) {
@@ -917,6 +921,10 @@ parse_args(int argc, char **argv)
 static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
+	if (dev == NULL) {
+		return true;
+	}
+
 	if (spdk_pci_device_has_non_uio_driver(dev)) {
 		fprintf(stderr, "non-uio kernel driver attached to NVMe\n");
 		fprintf(stderr, " controller at PCI address %04x:%02x:%02x.%02x\n",
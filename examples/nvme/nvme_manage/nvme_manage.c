@@ -103,6 +103,11 @@ cmp_devs(const void *ap, const void *bp)
 static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
+	/* Controllers are selected by PCI address, which a software controller does not have. */
+	if (dev == NULL) {
+		return false;
+	}
+
 	if (spdk_pci_device_has_non_uio_driver(dev)) {
 		fprintf(stderr, "non-uio kernel driver attached to NVMe\n");
 		fprintf(stderr, " controller at PCI address %04x:%02x:%02x.%02x\n",
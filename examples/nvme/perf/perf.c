@@ -95,6 +95,7 @@ struct ns_worker_ctx {
 	uint64_t		max_tsc;
 	uint64_t		current_queue_depth;
 	uint64_t		offset_in_ios;
+	uint64_t		sq_doorbell_writes;
 	bool			is_draining;
 
 	union {
@@ -132,6 +133,13 @@ static int g_outstanding_commands;
 
 static bool g_latency_tracking_enable = false;
 
+static bool g_delay_doorbell = false;
+
+static uint32_t g_sw_ctrlr_mib = 0;
+static struct spdk_nvme_sw_ctrlr *g_sw_ctrlr = NULL;
+
+static uint32_t g_hybrid_poll_min_sleep_us = 0;
+
 struct rte_mempool *request_mempool;
 static struct rte_mempool *task_pool;
 
@@ -554,6 +562,12 @@ init_ns_worker_ctx(struct ns_worker_ctx *ns_ctx)
 			printf("ERROR: spdk_nvme_ctrlr_alloc_io_qpair failed\n");
 			return -1;
 		}
+		spdk_nvme_qpair_set_delay_doorbell(ns_ctx->u.nvme.qpair, g_delay_doorbell);
+		if (spdk_nvme_qpair_set_hybrid_polling(ns_ctx->u.nvme.qpair,
+						       g_hybrid_poll_min_sleep_us) != 0) {
+			printf("ERROR: spdk_nvme_qpair_set_hybrid_polling failed\n");
+			return -1;
+		}
 	}
 
 	return 0;
@@ -568,6 +582,8 @@ cleanup_ns_worker_ctx(struct ns_worker_ctx *ns_ctx)
 		free(ns_ctx->u.aio.events);
 #endif
 	} else {
+		ns_ctx->sq_doorbell_writes =
+			spdk_nvme_qpair_get_num_sq_doorbell_writes(ns_ctx->u.nvme.qpair);
 		spdk_nvme_ctrlr_free_io_qpair(ns_ctx->u.nvme.qpair);
 	}
 }
@@ -597,6 +613,9 @@ work_fn(void *arg)
 	ns_ctx = worker->ns_ctx;
 	while (ns_ctx != NULL) {
 		submit_io(ns_ctx, g_queue_depth);
+		if (ns_ctx->entry->type == ENTRY_TYPE_NVME_NS && g_delay_doorbell) {
+			spdk_nvme_qpair_flush_submissions(ns_ctx->u.nvme.qpair);
+		}
 		ns_ctx = ns_ctx->next;
 	}
 
@@ -645,12 +664,16 @@ static void usage(char *program_name)
 	printf("\t\t(default: 1)]\n");
 	printf("\t[-m max completions per poll]\n");
 	printf("\t\t(default: 0 - unlimited)\n");
+	printf("\t[-b batch SQ doorbell writes, default: disabled]\n");
+	printf("\t[-E size in MiB of a memory-backed software controller to add]\n");
+	printf("\t[-H hybrid polling minimum sleep in microseconds]\n");
+	printf("\t\t(default: 0 - always busy poll)\n");
 }
 
 static void
 print_performance(void)
 {
-	uint64_t total_io_completed;
+	uint64_t total_io_completed, total_sq_doorbell_writes;
 	float io_per_second, mb_per_second, average_latency, min_latency, max_latency;
 	float total_io_per_second, total_mb_per_second;
 	float sum_ave_latency, sum_min_latency, sum_max_latency;
@@ -661,6 +684,7 @@ print_performance(void)
 	total_io_per_second = 0;
 	total_mb_per_second = 0;
 	total_io_completed = 0;
+	total_sq_doorbell_writes = 0;
 	sum_ave_latency = 0;
 	sum_min_latency = 0;
 	sum_max_latency = 0;
@@ -687,6 +711,7 @@ print_performance(void)
 			total_io_per_second += io_per_second;
 			total_mb_per_second += mb_per_second;
 			total_io_completed += ns_ctx->io_completed;
+			total_sq_doorbell_writes += ns_ctx->sq_doorbell_writes;
 			sum_ave_latency += average_latency;
 			sum_min_latency += min_latency;
 			sum_max_latency += max_latency;
@@ -702,6 +727,15 @@ print_performance(void)
 	       "Total", total_io_per_second, total_mb_per_second,
 	       sum_ave_latency / ns_count, sum_min_latency / ns_count,
 	       sum_max_latency / ns_count);
+	if (g_delay_doorbell && total_sq_doorbell_writes != 0) {
+		printf("%-55s: %10.2f\n", "Average I/O per SQ doorbell write",
+		       (float)total_io_completed / total_sq_doorbell_writes);
+	}
+	if (total_io_completed != 0) {
+		/* Each worker core polls continuously, so all of its cycles are spent on I/O. */
+		printf("%-55s: %10.2f\n", "Submitting core cycles per I/O",
+		       (float)g_tsc_rate * g_time_in_sec * g_num_workers / total_io_completed);
+	}
 	printf("\n");
 }
 
@@ -802,8 +836,11 @@ parse_args(int argc, char **argv)
 	g_core_mask = NULL;
 	g_max_completions = 0;
 
-	while ((op = getopt(argc, argv, "c:lm:q:s:t:w:M:")) != -1) {
+	while ((op = getopt(argc, argv, "bc:lm:q:s:t:w:E:H:M:")) != -1) {
 		switch (op) {
+		case 'b':
+			g_delay_doorbell = true;
+			break;
 		case 'c':
 			g_core_mask = optarg;
 			break;
@@ -825,6 +862,12 @@ parse_args(int argc, char **argv)
 		case 'w':
 			workload_type = optarg;
 			break;
+		case 'E':
+			g_sw_ctrlr_mib = atoi(optarg);
+			break;
+		case 'H':
+			g_hybrid_poll_min_sleep_us = atoi(optarg);
+			break;
 		case 'M':
 			g_rw_percentage = atoi(optarg);
 			mix_specified = true;
@@ -967,6 +1010,11 @@ unregister_workers(void)
 static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
+	if (dev == NULL) {
+		printf("Attaching to software controller\n");
+		return true;
+	}
+
 	if (spdk_pci_device_has_non_uio_driver(dev)) {
 		fprintf(stderr, "non-uio kernel driver attached to NVMe\n");
 		fprintf(stderr, " controller at PCI address %04x:%02x:%02x.%02x\n",
@@ -991,6 +1039,12 @@ static void
 attach_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr *ctrlr,
 	  const struct spdk_nvme_ctrlr_opts *opts)
 {
+	if (dev == NULL) {
+		printf("Attached to software controller\n");
+		register_ctrlr(ctrlr);
+		return;
+	}
+
 	printf("Attached to %04x:%02x:%02x.%02x\n",
 	       spdk_pci_device_get_domain(dev),
 	       spdk_pci_device_get_bus(dev),
@@ -1005,6 +1059,14 @@ register_controllers(void)
 {
 	printf("Initializing NVMe Controllers\n");
 
+	if (g_sw_ctrlr_mib != 0) {
+		g_sw_ctrlr = spdk_nvme_sw_ctrlr_create((uint64_t)g_sw_ctrlr_mib * 1024 * 1024 / 512, 512);
+		if (g_sw_ctrlr == NULL) {
+			fprintf(stderr, "spdk_nvme_sw_ctrlr_create() failed\n");
+			return 1;
+		}
+	}
+
 	if (spdk_nvme_probe(NULL, probe_cb, attach_cb, NULL) != 0) {
 		fprintf(stderr, "spdk_nvme_probe() failed\n");
 		return 1;
@@ -1028,6 +1090,10 @@ unregister_controllers(void)
 		free(entry);
 		entry = next;
 	}
+
+	if (g_sw_ctrlr != NULL) {
+		spdk_nvme_sw_ctrlr_destroy(g_sw_ctrlr);
+	}
 }
 
 static int
@@ -0,0 +1,210 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/** \file
+ * T10 DIF/DIX protection information generation and verification
+ */
+
+#ifndef SPDK_DIF_H
+#define SPDK_DIF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Check the guard tag (CRC-16 of the block) in spdk_dif_verify() and spdk_dix_verify(). */
+#define SPDK_DIF_FLAGS_GUARD_CHECK	(1U << 0)
+
+/** Check the application tag, under the application tag mask. */
+#define SPDK_DIF_FLAGS_APPTAG_CHECK	(1U << 1)
+
+/** Check the reference tag against the expected one (Type 1 and Type 2 only). */
+#define SPDK_DIF_FLAGS_REFTAG_CHECK	(1U << 2)
+
+/**
+ * Protection information type.  The values match the NVMe protection types.
+ */
+enum spdk_dif_type {
+	SPDK_DIF_DISABLE	= 0x0,
+	SPDK_DIF_TYPE1		= 0x1,
+	SPDK_DIF_TYPE2		= 0x2,
+	SPDK_DIF_TYPE3		= 0x3,
+};
+
+/**
+ * Protection information, stored big-endian in 8 bytes of each block's metadata.
+ */
+struct spdk_dif {
+	uint16_t	guard;
+	uint16_t	app_tag;
+	uint32_t	ref_tag;
+};
+
+enum spdk_dif_err_type {
+	SPDK_DIF_GUARD_ERROR	= 0x1,
+	SPDK_DIF_APPTAG_ERROR	= 0x2,
+	SPDK_DIF_REFTAG_ERROR	= 0x3,
+};
+
+/**
+ * \brief First protection information mismatch found by spdk_dif_verify() or
+ * spdk_dix_verify().
+ */
+struct spdk_dif_error {
+	enum spdk_dif_err_type	err_type;
+
+	/** Expected tag value (the application tag is masked) */
+	uint32_t		expected;
+
+	/** Tag value found in the block (the application tag is masked) */
+	uint32_t		actual;
+
+	/** Index of the failing block from the start of the buffer */
+	uint32_t		err_offset;
+};
+
+/**
+ * \brief Layout and tag values of the blocks that a DIF/DIX operation covers.
+ *
+ * Initialize it with spdk_dif_ctx_init().
+ */
+struct spdk_dif_ctx {
+	/** Bytes per block in the data buffer, including the metadata if it is interleaved */
+	uint32_t		block_size;
+
+	/** Metadata bytes per block */
+	uint32_t		md_size;
+
+	/** Metadata follows the data of each block (extended LBA) instead of a separate buffer */
+	bool			md_interleave;
+
+	/** Offset of the protection information within the metadata of a block */
+	uint32_t		dif_offset;
+
+	/** Bytes of data and metadata, from the start of the block, covered by the guard */
+	uint32_t		guard_interval;
+
+	enum spdk_dif_type	dif_type;
+
+	/** SPDK_DIF_FLAGS_* */
+	uint32_t		dif_flags;
+
+	/** Reference tag of the first block */
+	uint32_t		init_ref_tag;
+
+	uint16_t		apptag_mask;
+	uint16_t		app_tag;
+};
+
+/**
+ * Initialize a DIF/DIX context.
+ *
+ * \param ctx Context to initialize.
+ * \param block_size Bytes per block in the data buffer.  With md_interleave, this includes
+ * the md_size bytes of metadata at the end of each block.
+ * \param md_size Metadata bytes per block.  The protection information takes 8 of them.
+ * \param md_interleave true for the extended LBA layout (spdk_dif_generate() and
+ * spdk_dif_verify()), false for a separate metadata buffer (spdk_dix_generate() and
+ * spdk_dix_verify()).
+ * \param dif_loc_first true if the protection information is in the first 8 bytes of the
+ * metadata, false if it is in the last 8 bytes.  When it is last, the guard also covers the
+ * metadata bytes in front of it.
+ * \param dif_type Protection information type.
+ * \param dif_flags Tags to check on verification, as SPDK_DIF_FLAGS_* bits.
+ * \param init_ref_tag Reference tag of the first block.  For Type 1 and Type 2 it is
+ * incremented for each following block; for Type 3 all blocks use it as is.
+ * \param apptag_mask Bits of the application tag that are checked.
+ * \param app_tag Application tag to generate and check against.
+ *
+ * \return 0 on success, or -EINVAL if the layout or type is not valid.
+ */
+int spdk_dif_ctx_init(struct spdk_dif_ctx *ctx, uint32_t block_size, uint32_t md_size,
+		      bool md_interleave, bool dif_loc_first, enum spdk_dif_type dif_type,
+		      uint32_t dif_flags, uint32_t init_ref_tag, uint16_t apptag_mask,
+		      uint16_t app_tag);
+
+/**
+ * Generate the protection information of blocks with interleaved metadata.
+ *
+ * \param buf Buffer of num_blocks blocks of ctx->block_size bytes.  The guard, application
+ * tag and reference tag of each block are written into its metadata.
+ *
+ * \return 0 on success, or -EINVAL if ctx is not for interleaved metadata.
+ */
+int spdk_dif_generate(void *buf, uint32_t num_blocks, const struct spdk_dif_ctx *ctx);
+
+/**
+ * Verify the protection information of blocks with interleaved metadata.
+ *
+ * Only the tags selected by ctx->dif_flags are checked.  Blocks whose application tag is
+ * 0xFFFF (and, for Type 3, whose reference tag is also 0xFFFFFFFF) are not checked.
+ *
+ * \param err_blk If not NULL, filled in with the first mismatch.
+ *
+ * \return 0 if all blocks are valid, -EIO on a mismatch, or -EINVAL if ctx is not for
+ * interleaved metadata.
+ */
+int spdk_dif_verify(const void *buf, uint32_t num_blocks, const struct spdk_dif_ctx *ctx,
+		    struct spdk_dif_error *err_blk);
+
+/**
+ * Generate the protection information of blocks with separate metadata.
+ *
+ * \param buf Buffer of num_blocks blocks of ctx->block_size data bytes.
+ * \param md_buf Buffer of num_blocks times ctx->md_size metadata bytes, into which the
+ * protection information is written.
+ *
+ * \return 0 on success, or -EINVAL if ctx is for interleaved metadata.
+ */
+int spdk_dix_generate(const void *buf, void *md_buf, uint32_t num_blocks,
+		      const struct spdk_dif_ctx *ctx);
+
+/**
+ * Verify the protection information of blocks with separate metadata.
+ *
+ * The same tags are checked and skipped as in spdk_dif_verify().
+ *
+ * \return 0 if all blocks are valid, -EIO on a mismatch, or -EINVAL if ctx is for
+ * interleaved metadata.
+ */
+int spdk_dix_verify(const void *buf, const void *md_buf, uint32_t num_blocks,
+		    const struct spdk_dif_ctx *ctx, struct spdk_dif_error *err_blk);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPDK_DIF_H */
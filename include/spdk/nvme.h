@@ -45,6 +45,7 @@ extern "C" {
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include "spdk/pci.h"
 #include "nvme_spec.h"
 
@@ -56,6 +57,24 @@ extern int32_t		spdk_nvme_retry_count;
 /** \brief Opaque handle to a controller. Returned by \ref spdk_nvme_probe()'s attach_cb. */
 struct spdk_nvme_ctrlr;
 
+/** \brief Opaque handle to a software controller. Returned by \ref spdk_nvme_sw_ctrlr_create(). */
+struct spdk_nvme_sw_ctrlr;
+
+struct spdk_nvme_qpair;
+
+/**
+ * Signature for callback function invoked when an I/O command has been outstanding for longer
+ * than the timeout configured in spdk_nvme_ctrlr_opts::timeout_sec.
+ *
+ * The callback is invoked once per command submission from within
+ * spdk_nvme_qpair_process_completions() on the thread that owns \a qpair.  It may call
+ * spdk_nvme_ctrlr_cmd_abort() to abort the command identified by \a cid.  A controller reset
+ * must not be performed from the callback itself; instead, arrange for spdk_nvme_ctrlr_reset()
+ * to be called once no other threads are using the controller.
+ */
+typedef void (*spdk_nvme_timeout_cb)(void *cb_arg, struct spdk_nvme_ctrlr *ctrlr,
+				     struct spdk_nvme_qpair *qpair, uint16_t cid);
+
 /**
  * \brief NVMe controller initialization options.
  *
@@ -76,6 +95,27 @@ struct spdk_nvme_ctrlr_opts {
 	 * Type of arbitration mechanism
 	 */
 	enum spdk_nvme_cc_ams arb_mechanism;
+	/**
+	 * Timeout in seconds for commands submitted on I/O queue pairs, or 0 to disable timeout
+	 * detection.  Nonzero values are limited to the range 5 to 120 seconds.
+	 */
+	uint32_t timeout_sec;
+	/**
+	 * Function called for each I/O command that exceeds timeout_sec.  If NULL, the driver
+	 * sends an Abort command for the timed out command itself.
+	 */
+	spdk_nvme_timeout_cb timeout_cb_fn;
+	/**
+	 * Argument passed to timeout_cb_fn.
+	 */
+	void *timeout_cb_arg;
+	/**
+	 * Number of 4 KiB PRP/SGL list pages per I/O queue pair, or 0 for one per command slot.
+	 * Only commands that need more than two PRP entries or more than one SGL descriptor use a
+	 * list page.  With fewer pages than command slots, such commands beyond the number of pages
+	 * wait inside the driver for a page, even though command slots are free.
+	 */
+	uint32_t io_queue_prp_lists;
 };
 
 /**
@@ -123,6 +163,9 @@ typedef void (*spdk_nvme_remove_cb)(void *cb_ctx, struct spdk_nvme_ctrlr *ctrlr)
  * If called more than once, only devices that are not already attached to the SPDK NVMe driver
  * will be reported.
  *
+ * Software controllers created with \ref spdk_nvme_sw_ctrlr_create() are enumerated after the
+ * PCI devices and are reported to probe_cb and attach_cb with a NULL pci_dev.
+ *
  * To stop using the the controller and release its associated resources,
  * call \ref spdk_nvme_detach with the spdk_nvme_ctrlr instance returned by this function.
  */
@@ -131,6 +174,34 @@ int spdk_nvme_probe(void *cb_ctx,
 		    spdk_nvme_attach_cb attach_cb,
 		    spdk_nvme_remove_cb remove_cb);
 
+/**
+ * \brief Create a memory-backed software NVMe controller.
+ *
+ * \param num_blocks Number of logical blocks in the controller's single namespace.
+ * \param block_size Logical block size in bytes; must be a power of 2 and at least 512.
+ *
+ * The controller emulates the NVMe register interface and queues in host memory and services
+ * commands from a background thread against a RAM namespace, so the driver I/O path can be
+ * exercised and benchmarked without hardware.  It is attached by the next call to
+ * \ref spdk_nvme_probe(), and its thread runs only while it is attached.  Namespace contents
+ * persist across detach and re-attach.
+ *
+ * I/O buffers must be allocated from the same hugepage memory as other NVMe I/O buffers.
+ *
+ * \return Handle to pass to spdk_nvme_sw_ctrlr_destroy(), or NULL if the parameters are invalid
+ * or the namespace could not be allocated.
+ */
+struct spdk_nvme_sw_ctrlr *spdk_nvme_sw_ctrlr_create(uint64_t num_blocks, uint32_t block_size);
+
+/**
+ * \brief Destroy a software NVMe controller and free its namespace.
+ *
+ * The controller must not be attached; detach it with \ref spdk_nvme_detach() first.
+ *
+ * \return 0 on success, or -EBUSY if the controller is attached.
+ */
+int spdk_nvme_sw_ctrlr_destroy(struct spdk_nvme_sw_ctrlr *sw_ctrlr);
+
 /**
  * \brief Detaches specified device returned by \ref spdk_nvme_probe()'s attach_cb from the NVMe driver.
  *
@@ -228,6 +299,29 @@ void spdk_nvme_ctrlr_register_aer_callback(struct spdk_nvme_ctrlr *ctrlr,
 		spdk_nvme_aer_cb aer_cb_fn,
 		void *aer_cb_arg);
 
+/**
+ * \brief Abort a specific previously-submitted NVMe command.
+ *
+ * \param ctrlr NVMe controller to which the command was submitted.
+ * \param qpair NVMe queue pair to which the command was submitted.
+ *  For admin commands, pass NULL for the qpair.
+ * \param cid Command ID of the command to abort, as passed to the timeout callback.
+ * \param cb_fn Callback function to invoke when the abort has completed.
+ * \param cb_arg Argument to pass to the callback function.
+ *
+ * \return 0 if successfully submitted, ENOMEM if resources could not be allocated for this request
+ *
+ * Bit 0 of cdw0 in the completion of the Abort command is cleared if the command was aborted.
+ *
+ * This function is thread safe and can be called at any point while the controller is attached to
+ *  the SPDK NVMe driver.
+ *
+ * Call \ref spdk_nvme_ctrlr_process_admin_completions() to poll for completion
+ * of the abort.
+ */
+int spdk_nvme_ctrlr_cmd_abort(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_qpair *qpair,
+			      uint16_t cid, spdk_nvme_cmd_cb cb_fn, void *cb_arg);
+
 /**
  * \brief Opaque handle to a queue pair.
  *
@@ -241,6 +335,9 @@ struct spdk_nvme_qpair;
  * Each queue pair should only be used from a single thread at a time (mutual exclusion must be
  * enforced by the user).
  *
+ * The memory of the queue pair is allocated on the NUMA socket of the calling thread's lcore;
+ * use spdk_nvme_ctrlr_alloc_io_qpair_on_socket() to choose another socket.
+ *
  * \param ctrlr NVMe controller for which to allocate the I/O queue pair.
  * \param qprio Queue priority for weighted round robin arbitration.  If a different arbitration
  * method is in use, pass 0.
@@ -248,6 +345,33 @@ struct spdk_nvme_qpair;
 struct spdk_nvme_qpair *spdk_nvme_ctrlr_alloc_io_qpair(struct spdk_nvme_ctrlr *ctrlr,
 		enum spdk_nvme_qprio qprio);
 
+/**
+ * Allocate on the NUMA socket of the calling thread's lcore.  Unlike DPDK's SOCKET_ID_ANY,
+ *  which has the same value, this does not mean "any socket".
+ */
+#define SPDK_NVME_SOCKET_ID_LOCAL	(-1)
+
+/**
+ * \brief Allocate an I/O queue pair whose memory is local to a NUMA socket.
+ *
+ * This is the same as spdk_nvme_ctrlr_alloc_io_qpair(), except that the submission and
+ * completion queues, trackers, PRP/SGL list pages and request cache of the queue pair are
+ * allocated from memory on socket_id.  This should be the socket of the core that will
+ * submit I/O on the queue pair, which is not necessarily the calling thread.  If the socket
+ * has no free memory left, memory from any socket is used instead.
+ *
+ * \param ctrlr NVMe controller for which to allocate the I/O queue pair.
+ * \param qprio Queue priority for weighted round robin arbitration.  If a different arbitration
+ * method is in use, pass 0.
+ * \param socket_id NUMA socket to allocate the queue pair memory on, or SPDK_NVME_SOCKET_ID_LOCAL
+ * for the socket of the calling thread's lcore, which is what spdk_nvme_ctrlr_alloc_io_qpair()
+ * uses.
+ *
+ * spdk_pci_device_get_socket_id() returns the socket the controller itself is attached to.
+ */
+struct spdk_nvme_qpair *spdk_nvme_ctrlr_alloc_io_qpair_on_socket(struct spdk_nvme_ctrlr *ctrlr,
+		enum spdk_nvme_qprio qprio, int socket_id);
+
 /**
  * \brief Free an I/O queue pair that was allocated by spdk_nvme_ctrlr_alloc_io_qpair().
  */
@@ -298,6 +422,440 @@ int spdk_nvme_ctrlr_cmd_io_raw(struct spdk_nvme_ctrlr *ctrlr,
 int32_t spdk_nvme_qpair_process_completions(struct spdk_nvme_qpair *qpair,
 		uint32_t max_completions);
 
+/**
+ * \brief Enable or disable batching of submission queue doorbell writes on an I/O queue pair.
+ *
+ * By default, the submission queue tail doorbell is written for every command submitted.
+ * When doorbell batching is enabled, commands are only copied into the submission queue,
+ * and the doorbell is written once for all of them by spdk_nvme_qpair_flush_submissions()
+ * or by the next call to spdk_nvme_qpair_process_completions(), which rings the doorbell
+ * both before and after processing completions.  This trades a small amount of submission
+ * latency for fewer uncached MMIO writes when many commands are submitted at once.
+ *
+ * Disabling batching rings the doorbell for any commands that are still pending.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+void spdk_nvme_qpair_set_delay_doorbell(struct spdk_nvme_qpair *qpair, bool enable);
+
+/**
+ * \brief Ring the submission queue doorbell for commands batched up on a queue pair.
+ *
+ * This is a no-op if doorbell batching is not enabled or no commands are pending.
+ *
+ * \sa spdk_nvme_qpair_set_delay_doorbell()
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+void spdk_nvme_qpair_flush_submissions(struct spdk_nvme_qpair *qpair);
+
+/**
+ * \brief Get the number of times the submission queue tail doorbell of a queue pair was written.
+ *
+ * The count starts at 0 when the queue pair is allocated.  Divided into the number of commands
+ * submitted, it gives the average batch size achieved with spdk_nvme_qpair_set_delay_doorbell().
+ */
+uint64_t spdk_nvme_qpair_get_num_sq_doorbell_writes(struct spdk_nvme_qpair *qpair);
+
+/**
+ * \brief Get the number of commands that can be submitted to a queue pair right now.
+ *
+ * This is the number of free command slots, or 0 if earlier commands are already waiting
+ * inside the driver for a slot.  A command split into N child commands uses N slots.  Each
+ * slot is counted only if a PRP/SGL list page is also free for it, so the count holds for
+ * commands that need at most one list page; a command whose data needs several list pages
+ * (see io_queue_prp_lists in spdk_nvme_ctrlr_opts) may still be queued inside the driver.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+uint16_t spdk_nvme_qpair_get_num_free_slots(struct spdk_nvme_qpair *qpair);
+
+/**
+ * \brief Choose what happens to commands submitted to a full I/O queue pair.
+ *
+ * By default, a command that finds no free slot is queued inside the driver and submitted
+ * when an earlier command completes; the submission function still returns 0.  When
+ * fail_when_full is enabled, the submission function instead returns -EAGAIN without
+ * queueing the command (its callback will not be called), so that the caller can retry later
+ * or send the I/O somewhere else.  A split command is rejected as a whole if there are not
+ * enough free slots for all of its child commands.
+ *
+ * Commands submitted while the controller is being reset, or that need more PRP/SGL list
+ * pages than spdk_nvme_qpair_get_num_free_slots() accounts for, are still queued in either mode.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+void spdk_nvme_qpair_set_fail_when_full(struct spdk_nvme_qpair *qpair, bool fail_when_full);
+
+/**
+ * Signature for a callback function invoked when a full queue pair has free submission slots
+ * again.
+ */
+typedef void (*spdk_nvme_qpair_slots_available_cb)(void *cb_arg, struct spdk_nvme_qpair *qpair);
+
+/**
+ * \brief Register a callback for when a full queue pair has free submission slots again.
+ *
+ * Whenever a command is submitted to the queue pair while it has no free slot (whether the
+ * command is then queued or rejected with -EAGAIN), the callback is armed.  It is then called
+ * once, from spdk_nvme_qpair_process_completions(), as soon as completions have freed slots
+ * and no commands are left waiting inside the driver.  spdk_nvme_qpair_get_num_free_slots()
+ * may be used from the callback to find out how many commands can be submitted.
+ *
+ * Pass a NULL cb_fn to unregister the callback.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+void spdk_nvme_qpair_register_slots_available_cb(struct spdk_nvme_qpair *qpair,
+		spdk_nvme_qpair_slots_available_cb cb_fn, void *cb_arg);
+
+/**
+ * \brief Rate limits for read and write commands.  A value of 0 means unlimited.
+ *
+ * \sa spdk_nvme_qpair_set_qos_limits(), spdk_nvme_ns_set_qos_limits()
+ */
+struct spdk_nvme_qos_limits {
+	/** Read commands per second */
+	uint64_t read_iops;
+
+	/** Write commands per second */
+	uint64_t write_iops;
+
+	/** Bytes read per second */
+	uint64_t read_bytes_per_sec;
+
+	/** Bytes written per second */
+	uint64_t write_bytes_per_sec;
+};
+
+/**
+ * \brief Set or change the rate limits for read and write commands submitted on an I/O queue pair.
+ *
+ * \param limits New limits, or NULL to remove all limits from the queue pair.
+ *
+ * Read and write commands that would exceed a limit (of the queue pair, or of the namespace
+ * they are submitted to; see spdk_nvme_ns_set_qos_limits()) are held back inside the driver,
+ * in submission order, and submitted later from spdk_nvme_qpair_process_completions() once
+ * the limits allow it.  The submission function still returns 0 for them.  Commands in a
+ * direction (read or write) that has no limits, and commands other than reads and writes,
+ * are never held back.
+ *
+ * Limits are enforced with token buckets that refill continuously and hold at most 10 ms worth
+ * of tokens, so short bursts above the limit are allowed.  A command larger than the remaining
+ * byte budget is submitted as soon as the budget is positive, and the overdraft is paid back
+ * before the next command.
+ *
+ * Limits may be changed at any time; commands already held back are released at the new rate.
+ * Removing the limits submits the held-back commands right away.
+ *
+ * \return 0 on success, or -ENOMEM if the limiter state could not be allocated.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+int spdk_nvme_qpair_set_qos_limits(struct spdk_nvme_qpair *qpair,
+				   const struct spdk_nvme_qos_limits *limits);
+
+/**
+ * \brief Enable, change or disable coalescing of deallocate commands on an I/O queue pair.
+ *
+ * \param max_ranges Number of LBA ranges at which a batch is sent, between 1 and
+ *                   \ref SPDK_NVME_DATASET_MANAGEMENT_MAX_RANGES, or 0 to disable coalescing.
+ * \param window_us Longest time in microseconds that a deallocate waits in a batch.
+ *
+ * While coalescing is enabled, spdk_nvme_ns_cmd_deallocate() copies its ranges into a batch
+ *  for the namespace instead of sending a command, merging each range with an adjacent range
+ *  already in the batch.  The batch is sent as one Dataset Management command when it holds
+ *  max_ranges ranges, when a deallocate for another namespace or one that does not fit is
+ *  submitted, when window_us has passed (checked in spdk_nvme_qpair_process_completions()), or
+ *  on spdk_nvme_qpair_flush_submissions().  The callbacks of all deallocates in a batch are
+ *  called with the completion of that command.  The payload may be reused as soon as
+ *  spdk_nvme_ns_cmd_deallocate() returns.
+ *
+ * Disabling coalescing sends the pending batch right away.
+ *
+ * \return 0 on success, -EINVAL if max_ranges is too large, or -ENOMEM if the batches could
+ *  not be allocated.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+int spdk_nvme_qpair_set_dsm_coalescing(struct spdk_nvme_qpair *qpair, uint16_t max_ranges,
+				       uint32_t window_us);
+
+/**
+ * Largest number of writes that may be merged into one command.
+ *
+ * \sa spdk_nvme_qpair_set_write_merging()
+ */
+#define SPDK_NVME_QPAIR_MAX_MERGED_WRITES	32
+
+/**
+ * \brief Enable, change or disable merging of LBA-adjacent writes on an I/O queue pair.
+ *
+ * \param max_writes Number of writes at which a merged command is sent, between 1 and
+ *                   \ref SPDK_NVME_QPAIR_MAX_MERGED_WRITES, or 0 to disable merging.
+ * \param window_us Longest time in microseconds that a write waits to be merged.
+ *
+ * While merging is enabled, a write submitted with spdk_nvme_ns_cmd_write() that starts at
+ *  the LBA right after the pending write(s) to the same namespace, with the same io_flags,
+ *  is added to them instead of being sent.  The pending writes are sent as one write command
+ *  over their separate buffers when max_writes have been merged, when the next write would
+ *  exceed the maximum transfer size or cross a stripe boundary of the namespace, when another
+ *  write that does not follow them is submitted, when window_us has passed (checked in
+ *  spdk_nvme_qpair_process_completions()), or on spdk_nvme_qpair_flush_submissions().  The
+ *  callbacks of all merged writes are called with the completion of that command.
+ *
+ * Without hardware SGL support, a buffer is only merged with the previous one if it follows
+ *  it directly in virtual memory, or if the previous buffer ends and the new one starts on a
+ *  page boundary.  Writes to namespaces formatted with metadata are never merged.
+ *
+ * Disabling merging sends the pending writes right away.
+ *
+ * \return 0 on success, -EINVAL if max_writes is too large, or -ENOMEM if the merge state
+ *  could not be allocated.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+int spdk_nvme_qpair_set_write_merging(struct spdk_nvme_qpair *qpair, uint16_t max_writes,
+				      uint32_t window_us);
+
+/**
+ * \brief Read cache counters of a queue pair.
+ *
+ * \sa spdk_nvme_qpair_get_read_cache_stats()
+ */
+struct spdk_nvme_read_cache_stats {
+	/** Reads served from the cache */
+	uint64_t hits;
+
+	/** Cacheable reads that were sent to the namespace and their block cached */
+	uint64_t misses;
+
+	/** Reads that could not be cached and were sent to the namespace as is */
+	uint64_t bypasses;
+
+	/** Blocks dropped to make room for other blocks */
+	uint64_t evictions;
+
+	/** Blocks dropped because they were written */
+	uint64_t invalidations;
+};
+
+/**
+ * \brief Enable, resize or disable the read cache of an I/O queue pair.
+ *
+ * \param num_blocks Number of 4 KiB blocks to cache, or 0 to disable the cache.
+ *
+ * While the cache is enabled, a spdk_nvme_ns_cmd_read() without io_flags that reads exactly
+ *  one 4 KiB-aligned 4 KiB block of a namespace without metadata is served from the cache
+ *  if the block is there: the data is copied to the caller's buffer right away and the
+ *  callback is called from the next spdk_nvme_qpair_process_completions().  Otherwise the
+ *  block is read into the cache and then copied.  Blocks are evicted with the CLOCK
+ *  algorithm.
+ *
+ * Blocks are dropped from the cache when a write, write zeroes, write uncorrectable or
+ *  deallocate command that covers them is submitted or completed on the same queue pair.
+ *  Such commands on other queue pairs of the same controller in this process are caught
+ *  when a block is next looked up, and the block is read again.  While any queue pair
+ *  caches reads, every write on the controller also updates a per-namespace table shared
+ *  by its queue pairs.  Writes by other processes or hosts are not seen.
+ *
+ * Each queue pair has its own cache, which is only used by the thread that owns the queue
+ *  pair, so lookups take no locks.  Changing the cache drops all cached blocks, and
+ *  resets its counters.
+ *
+ * \return 0 on success, -EINVAL if num_blocks is too large, -ENOMEM if the cache could not
+ *  be allocated, or -EBUSY if reads through the cache are still outstanding.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+int spdk_nvme_qpair_set_read_cache(struct spdk_nvme_qpair *qpair, uint32_t num_blocks);
+
+/**
+ * \brief Get the read cache counters of a queue pair.
+ *
+ * \return 0 on success, or -EINVAL if the queue pair has no read cache.
+ */
+int spdk_nvme_qpair_get_read_cache_stats(struct spdk_nvme_qpair *qpair,
+		struct spdk_nvme_read_cache_stats *stats);
+
+/**
+ * Size in bytes of each readahead buffer.
+ *
+ * \sa spdk_nvme_qpair_set_readahead()
+ */
+#define SPDK_NVME_READAHEAD_BUFFER_SIZE	(128 * 1024)
+
+/**
+ * \brief Readahead counters of a queue pair.
+ *
+ * \sa spdk_nvme_qpair_get_readahead_stats()
+ */
+struct spdk_nvme_readahead_stats {
+	/** Reads copied from a readahead buffer that was already filled */
+	uint64_t hits;
+
+	/** Reads that waited for the readahead covering them to complete */
+	uint64_t waits;
+
+	/** Reads that no readahead covered and were sent to the namespace */
+	uint64_t misses;
+
+	/** Read commands issued ahead of a sequential stream */
+	uint64_t readaheads;
+
+	/** Streams whose readahead window was dropped because of a non-sequential read */
+	uint64_t collapses;
+
+	/** Readahead buffers dropped because they were written */
+	uint64_t invalidations;
+};
+
+/**
+ * \brief Enable, change or disable sequential readahead on an I/O queue pair.
+ *
+ * \param num_streams Number of sequential streams tracked at the same time, or 0 to disable
+ *                    readahead.
+ * \param max_window_size Largest amount of data, in bytes, read ahead of one stream.  It is
+ *                        rounded up to a multiple of \ref SPDK_NVME_READAHEAD_BUFFER_SIZE.
+ *
+ * While readahead is enabled, spdk_nvme_ns_cmd_read() without io_flags on a namespace
+ *  without metadata remembers where each of the last num_streams streams of reads will
+ *  continue.  Once a stream has read two ranges back to back, the driver reads ahead of it
+ *  into buffers of \ref SPDK_NVME_READAHEAD_BUFFER_SIZE bytes.  The first window is four
+ *  reads long.  It doubles, up to max_window_size, each time the stream has consumed half
+ *  of it.  A read that continues no stream takes over the least recently used one, whose
+ *  window collapses.
+ *
+ * A read that lies within one filled buffer is copied from it right away, and its callback
+ *  is called from the next spdk_nvme_qpair_process_completions().  A read within a buffer
+ *  still being filled is completed, with a copy, when the fill completes.  Any other read is
+ *  sent to the namespace as usual.
+ *
+ * As with spdk_nvme_qpair_set_read_cache(), buffers are dropped when a write, write zeroes,
+ *  write uncorrectable or deallocate command that overlaps them is submitted or completed on
+ *  the same queue pair.  Writes through other queue pairs of the same controller in this
+ *  process are caught through the same per-namespace table, when a buffer is next looked
+ *  up or its fill completes.  Writes by other processes or hosts are not seen.
+ *
+ * Changing the settings drops all buffers and streams, and resets the counters.
+ *
+ * \return 0 on success, -EINVAL if the parameters are too large, -ENOMEM if the buffers could
+ *  not be allocated, or -EBUSY if reads through the readahead buffers are still outstanding.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+int spdk_nvme_qpair_set_readahead(struct spdk_nvme_qpair *qpair, uint32_t num_streams,
+				  uint32_t max_window_size);
+
+/**
+ * \brief Get the readahead counters of a queue pair.
+ *
+ * \return 0 on success, or -EINVAL if readahead is not enabled on the queue pair.
+ */
+int spdk_nvme_qpair_get_readahead_stats(struct spdk_nvme_qpair *qpair,
+					struct spdk_nvme_readahead_stats *stats);
+
+/**
+ * Number of linear sub-buckets per power-of-two range in a latency histogram, as a power of 2.
+ */
+#define SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS	4
+
+/**
+ * Number of buckets per I/O class in a latency histogram.
+ *
+ * Latencies below 2^SUB_BITS ticks each get their own bucket; above that, every power-of-two
+ * range of latencies is split into 2^SUB_BITS equally sized buckets.
+ */
+#define SPDK_NVME_LATENCY_HISTOGRAM_NUM_BUCKETS \
+	((64 - SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS + 1) << SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS)
+
+/**
+ * \brief Classes of commands tracked separately in a latency histogram.
+ */
+enum spdk_nvme_io_class {
+	SPDK_NVME_IO_CLASS_READ		= 0,
+	SPDK_NVME_IO_CLASS_WRITE	= 1,
+	SPDK_NVME_IO_CLASS_OTHER	= 2,
+	SPDK_NVME_IO_CLASS_COUNT	= 3,
+};
+
+/**
+ * \brief Snapshot of the command latency histogram of a queue pair.
+ */
+struct spdk_nvme_latency_histogram {
+	/** Number of ticks per second of the latency values */
+	uint64_t tick_rate;
+
+	/** Number of commands completed in each latency bucket */
+	uint64_t bucket[SPDK_NVME_IO_CLASS_COUNT][SPDK_NVME_LATENCY_HISTOGRAM_NUM_BUCKETS];
+};
+
+/**
+ * \brief Enable or disable the command latency histogram of an I/O queue pair.
+ *
+ * While enabled, the time from submission to completion of every command on the queue pair is
+ * recorded in a log-linear histogram, separately for reads, writes and all other commands.
+ * Enabling an already-enabled histogram leaves its contents intact; disabling it frees it.
+ * Queue pairs do not record latencies by default and pay no cost for the feature in that case.
+ *
+ * \return 0 on success, -EBUSY if the histogram is being enabled while commands are
+ * outstanding, or -ENOMEM if the histogram could not be allocated.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+int spdk_nvme_qpair_enable_latency_histogram(struct spdk_nvme_qpair *qpair, bool enable);
+
+/**
+ * \brief Copy the current command latency histogram of an I/O queue pair.
+ *
+ * \return 0 on success, or -EINVAL if the histogram is not enabled on this queue pair.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+int spdk_nvme_qpair_get_latency_histogram(struct spdk_nvme_qpair *qpair,
+		struct spdk_nvme_latency_histogram *histogram);
+
+/**
+ * \brief Clear all recorded latencies in the command latency histogram of an I/O queue pair.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+void spdk_nvme_qpair_reset_latency_histogram(struct spdk_nvme_qpair *qpair);
+
+/**
+ * \brief Get a latency percentile from a histogram snapshot.
+ *
+ * \param histogram Snapshot filled in by spdk_nvme_qpair_get_latency_histogram().
+ * \param io_class Class of commands to examine.
+ * \param percentile Percentile to compute, between 0 and 100 (e.g. 99.9).
+ *
+ * \return Upper bound, in ticks of histogram->tick_rate, of the bucket containing the requested
+ * percentile, or 0 if no commands of this class have been recorded.
+ */
+uint64_t spdk_nvme_latency_histogram_get_percentile(const struct spdk_nvme_latency_histogram *histogram,
+		enum spdk_nvme_io_class io_class, double percentile);
+
+/**
+ * \brief Enable or disable hybrid polling on an I/O queue pair.
+ *
+ * \param min_sleep_us Shortest sleep worth taking, in microseconds; 0 disables hybrid polling.
+ *
+ * With hybrid polling, the queue pair keeps a moving average of the service time of its commands
+ * for each I/O size class.  When spdk_nvme_qpair_process_completions() finds no completions and
+ * every outstanding command is predicted to finish at least 2 * min_sleep_us from now, it sleeps
+ * until min_sleep_us before the earliest predicted completion instead of returning immediately.
+ * This trades some latency and submission responsiveness for much lower CPU use at low load, so
+ * it is off by default; latency-critical queue pairs should keep pure busy polling.
+ *
+ * Calling this again while enabled only changes min_sleep_us and keeps the learned estimates.
+ *
+ * \return 0 on success, -EBUSY if hybrid polling is being enabled while commands are outstanding,
+ * or -ENOMEM if its state could not be allocated.
+ *
+ * The caller must ensure that each queue pair is only used from one thread at a time.
+ */
+int spdk_nvme_qpair_set_hybrid_polling(struct spdk_nvme_qpair *qpair, uint32_t min_sleep_us);
+
 /**
  * \brief Send the given admin command to the NVMe controller.
  *
@@ -626,6 +1184,53 @@ enum spdk_nvme_ns_flags {
  */
 uint32_t spdk_nvme_ns_get_flags(struct spdk_nvme_ns *ns);
 
+/**
+ * \brief Set or change the rate limits for read and write commands submitted to a namespace.
+ *
+ * \param limits New limits, or NULL to remove all limits from the namespace.
+ *
+ * The limits are shared by all I/O queue pairs of the controller.  Commands over the limit are
+ * held back on the queue pair they were submitted to, as described for
+ * spdk_nvme_qpair_set_qos_limits().  Once a namespace has had limits set, every I/O command on
+ * the controller checks for them, which costs a lock per read or write command on a limited
+ * namespace.
+ *
+ * \return 0 on success, or -ENOMEM if the limiter state could not be allocated.
+ *
+ * This function is thread safe and can be called at any point while the controller is attached to
+ *  the SPDK NVMe driver.
+ */
+int spdk_nvme_ns_set_qos_limits(struct spdk_nvme_ns *ns, const struct spdk_nvme_qos_limits *limits);
+
+/**
+ * \brief Enable or disable software generation and verification of protection information.
+ *
+ * While enabled, reads and writes with a contiguous payload and without
+ *  SPDK_NVME_IO_FLAGS_PRACT carry protection information computed by the driver with the
+ *  spdk_dif_* functions (see spdk/dif.h) instead of by the caller:
+ *
+ * - Before a write is submitted, the guard, application tag (apptag) and reference tag (the
+ *   low 32 bits of the LBA, incremented per block for Type 1 and 2) of every block are written
+ *   into the metadata of the caller's buffer, interleaved on an extended LBA namespace or in the
+ *   separate metadata buffer otherwise.
+ * - When a read completes successfully, the tags selected by its SPDK_NVME_IO_FLAGS_PRCHK_*
+ *   flags are checked against the data in host memory.  A mismatch completes the read with a
+ *   media error status of SPDK_NVME_SC_GUARD_CHECK_ERROR,
+ *   SPDK_NVME_SC_APPLICATION_TAG_CHECK_ERROR or SPDK_NVME_SC_REFERENCE_TAG_CHECK_ERROR.
+ *
+ * The PRCHK flags are still sent to the controller, which checks the same tags.  While
+ *  enabled, a read or write without SPDK_NVME_IO_FLAGS_PRACT fails with -ENOTSUP if its
+ *  payload is scattered (spdk_nvme_ns_cmd_readv(), spdk_nvme_ns_cmd_writev() and their
+ *  _iov variants), and with -EINVAL if it has no metadata buffer on a namespace with
+ *  separate metadata.
+ *
+ * The setting applies to commands submitted after the call.
+ *
+ * \return 0 on success, or -ENOTSUP if enable is true and the namespace is not formatted with
+ *  protection information.
+ */
+int spdk_nvme_ns_set_sw_pi(struct spdk_nvme_ns *ns, bool enable);
+
 /**
  * Restart the SGL walk to the specified offset when the command has scattered payloads.
  *
@@ -659,6 +1264,9 @@ typedef int (*spdk_nvme_req_next_sge_cb)(void *cb_arg, uint64_t *address, uint32
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
  *	     structure cannot be allocated for the I/O request
  *
+ * If write merging is enabled on the qpair (see spdk_nvme_qpair_set_write_merging()),
+ * the write may be sent later as part of one command with adjacent writes.
+ *
  * The command is submitted to a qpair allocated by spdk_nvme_ctrlr_alloc_io_qpair().
  * The user must ensure that only one thread submits I/O on a given qpair at any given time.
  */
@@ -692,6 +1300,38 @@ int spdk_nvme_ns_cmd_writev(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpa
 			    spdk_nvme_req_reset_sgl_cb reset_sgl_fn,
 			    spdk_nvme_req_next_sge_cb next_sge_fn);
 
+/**
+ * \brief Submits a write I/O from an array of iovecs to the specified NVMe namespace.
+ *
+ * \param ns NVMe namespace to submit the write I/O
+ * \param qpair I/O queue pair to submit the request
+ * \param lba starting LBA to write the data
+ * \param lba_count length (in sectors) for the write operation
+ * \param cb_fn callback function to invoke when the I/O is completed
+ * \param cb_arg argument to pass to the callback function
+ * \param io_flags set flags, defined in nvme_spec.h, for this I/O
+ * \param iov array of iovecs describing the payload; each element must be
+ * physically contiguous
+ * \param phys_addrs optional array of the physical address of each iov_base,
+ * or NULL to have the driver translate them
+ * \param iovcnt number of elements in iov (and phys_addrs)
+ *
+ * \return 0 if successfully submitted, ENOMEM if an nvme_request
+ *	     structure cannot be allocated for the I/O request, EINVAL if
+ *	     iov is NULL or iovcnt is not positive
+ *
+ * This is equivalent to spdk_nvme_ns_cmd_writev(), but the driver walks the
+ *  iovec array itself instead of calling back for each element.  iov and
+ *  phys_addrs are referenced, not copied, and must remain valid until cb_fn is called.
+ *
+ * The command is submitted to a qpair allocated by spdk_nvme_ctrlr_alloc_io_qpair().
+ * The user must ensure that only one thread submits I/O on a given qpair at any given time.
+ */
+int spdk_nvme_ns_cmd_writev_iov(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
+				uint64_t lba, uint32_t lba_count,
+				spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags,
+				const struct iovec *iov, const uint64_t *phys_addrs, int iovcnt);
+
 /**
  * \brief Submits a write I/O to the specified NVMe namespace.
  *
@@ -759,6 +1399,9 @@ int spdk_nvme_ns_cmd_write_zeroes(struct spdk_nvme_ns *ns, struct spdk_nvme_qpai
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
  *	     structure cannot be allocated for the I/O request
  *
+ * If the qpair has a read cache (see spdk_nvme_qpair_set_read_cache()) or readahead enabled
+ * (see spdk_nvme_qpair_set_readahead()), the read may be served from it.
+ *
  * The command is submitted to a qpair allocated by spdk_nvme_ctrlr_alloc_io_qpair().
  * The user must ensure that only one thread submits I/O on a given qpair at any given time.
  */
@@ -792,6 +1435,38 @@ int spdk_nvme_ns_cmd_readv(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpai
 			   spdk_nvme_req_reset_sgl_cb reset_sgl_fn,
 			   spdk_nvme_req_next_sge_cb next_sge_fn);
 
+/**
+ * \brief Submits a read I/O into an array of iovecs from the specified NVMe namespace.
+ *
+ * \param ns NVMe namespace to submit the read I/O
+ * \param qpair I/O queue pair to submit the request
+ * \param lba starting LBA to read the data
+ * \param lba_count length (in sectors) for the read operation
+ * \param cb_fn callback function to invoke when the I/O is completed
+ * \param cb_arg argument to pass to the callback function
+ * \param io_flags set flags, defined in nvme_spec.h, for this I/O
+ * \param iov array of iovecs describing the payload; each element must be
+ * physically contiguous
+ * \param phys_addrs optional array of the physical address of each iov_base,
+ * or NULL to have the driver translate them
+ * \param iovcnt number of elements in iov (and phys_addrs)
+ *
+ * \return 0 if successfully submitted, ENOMEM if an nvme_request
+ *	     structure cannot be allocated for the I/O request, EINVAL if
+ *	     iov is NULL or iovcnt is not positive
+ *
+ * This is equivalent to spdk_nvme_ns_cmd_readv(), but the driver walks the
+ *  iovec array itself instead of calling back for each element.  iov and
+ *  phys_addrs are referenced, not copied, and must remain valid until cb_fn is called.
+ *
+ * The command is submitted to a qpair allocated by spdk_nvme_ctrlr_alloc_io_qpair().
+ * The user must ensure that only one thread submits I/O on a given qpair at any given time.
+ */
+int spdk_nvme_ns_cmd_readv_iov(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
+			       uint64_t lba, uint32_t lba_count,
+			       spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags,
+			       const struct iovec *iov, const uint64_t *phys_addrs, int iovcnt);
+
 /**
  * \brief Submits a read I/O to the specified NVMe namespace.
  *
@@ -835,6 +1510,9 @@ int spdk_nvme_ns_cmd_read_with_md(struct spdk_nvme_ns *ns, struct spdk_nvme_qpai
  * \return 0 if successfully submitted, ENOMEM if an nvme_request
  *	     structure cannot be allocated for the I/O request
  *
+ * If deallocate coalescing is enabled on the qpair (see spdk_nvme_qpair_set_dsm_coalescing()),
+ * the ranges may be sent later together with those of other deallocate requests.
+ *
  * The command is submitted to a qpair allocated by spdk_nvme_ctrlr_alloc_io_qpair().
  * The user must ensure that only one thread submits I/O on a given qpair at any given time.
  */
@@ -962,12 +1640,226 @@ int spdk_nvme_ns_cmd_reservation_report(struct spdk_nvme_ns *ns,
  * \brief Get the size, in bytes, of an nvme_request.
  *
  * This is the size of the request objects that need to be allocated by the
- * nvme_alloc_request macro in nvme_impl.h
+ * nvme_alloc_request macro in nvme_impl.h.  Each I/O queue pair also keeps a
+ * private cache of requests sized to its queue depth, so the global pool is only
+ * used for admin commands, split requests, and I/O beyond that depth.
  *
  * This function is thread safe and can be called at any time.
  */
 size_t spdk_nvme_request_size(void);
 
+/** \brief Opaque handle to a virtual namespace built from several NVMe namespaces. */
+struct spdk_nvme_vns;
+
+/** \brief Opaque handle to a set of I/O queue pairs, one per member of a virtual namespace. */
+struct spdk_nvme_vns_qpair;
+
+/**
+ * \brief Data layouts of a virtual namespace.
+ */
+enum spdk_nvme_vns_level {
+	/** Blocks are striped across the members in strips of a configurable size. */
+	SPDK_NVME_VNS_RAID0	= 0,
+
+	/** Every member holds a full copy of the data. */
+	SPDK_NVME_VNS_RAID1	= 1,
+};
+
+/**
+ * \brief Create a virtual namespace from several namespaces, typically on different controllers.
+ *
+ * \param level Data layout across the members.
+ * \param ns Array of member namespaces, in strip order for RAID-0.
+ * \param num_ns Number of member namespaces (at least 1 and at most 32).
+ * \param strip_sectors Strip size in sectors for RAID-0; ignored for RAID-1.
+ *
+ * All members must have the same sector size and no metadata or protection information.
+ * The virtual namespace is as large as the smallest member allows: num_ns times the whole
+ * strips of the smallest member for RAID-0, or the smallest member for RAID-1.
+ *
+ * The members must stay attached until the virtual namespace is destroyed.
+ *
+ * \return the virtual namespace, or NULL if the parameters are invalid or memory could not be
+ * allocated.
+ */
+struct spdk_nvme_vns *spdk_nvme_vns_create(enum spdk_nvme_vns_level level,
+		struct spdk_nvme_ns **ns, uint32_t num_ns,
+		uint32_t strip_sectors);
+
+/**
+ * \brief Destroy a virtual namespace.  All of its queue pairs must have been freed.
+ */
+void spdk_nvme_vns_destroy(struct spdk_nvme_vns *vns);
+
+/**
+ * \brief Get the number of sectors of a virtual namespace.
+ */
+uint64_t spdk_nvme_vns_get_num_sectors(struct spdk_nvme_vns *vns);
+
+/**
+ * \brief Get the sector size, in bytes, of a virtual namespace.
+ */
+uint32_t spdk_nvme_vns_get_sector_size(struct spdk_nvme_vns *vns);
+
+/**
+ * \brief Allocate an I/O queue pair on the controller of each member of a virtual namespace.
+ *
+ * \return the queue pair set, or NULL if any queue pair or memory could not be allocated.
+ *
+ * Like other I/O queue pairs, the returned set must only be used from one thread at a time.
+ */
+struct spdk_nvme_vns_qpair *spdk_nvme_vns_alloc_qpair(struct spdk_nvme_vns *vns,
+		enum spdk_nvme_qprio qprio);
+
+/**
+ * \brief Free a queue pair set allocated by spdk_nvme_vns_alloc_qpair().
+ *
+ * No I/O may be outstanding on it.
+ */
+void spdk_nvme_vns_free_qpair(struct spdk_nvme_vns_qpair *vqpair);
+
+/**
+ * \brief Submit a read I/O to a virtual namespace.
+ *
+ * Takes the same arguments as spdk_nvme_ns_cmd_read().  The I/O is split at strip
+ * boundaries for RAID-0; for RAID-1 it is sent to the member whose queue pair has the fewest
+ * commands outstanding.  cb_fn is called once, after all parts have completed, with the first
+ * error status if any part failed.
+ *
+ * \return 0 if successfully submitted, -ENOMEM if the queue pair set has too many I/O
+ * outstanding or a request could not be allocated, or -EINVAL if the LBA range is invalid.
+ */
+int spdk_nvme_vns_cmd_read(struct spdk_nvme_vns *vns, struct spdk_nvme_vns_qpair *vqpair,
+			   void *payload, uint64_t lba, uint32_t lba_count,
+			   spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Submit a write I/O to a virtual namespace.
+ *
+ * Takes the same arguments as spdk_nvme_ns_cmd_write().  The I/O is split at strip
+ * boundaries for RAID-0 and written to every member for RAID-1.
+ *
+ * \return 0 if successfully submitted, -ENOMEM if the queue pair set has too many I/O
+ * outstanding or a request could not be allocated, or -EINVAL if the LBA range is invalid.
+ */
+int spdk_nvme_vns_cmd_write(struct spdk_nvme_vns *vns, struct spdk_nvme_vns_qpair *vqpair,
+			    void *payload, uint64_t lba, uint32_t lba_count,
+			    spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags);
+
+/**
+ * \brief Process completions on every queue pair of a queue pair set.
+ *
+ * \param max_completions Limit on completions processed per member queue pair, or 0 for no
+ * limit.
+ *
+ * \return total number of completions processed on the member queue pairs.
+ */
+int32_t spdk_nvme_vns_qpair_process_completions(struct spdk_nvme_vns_qpair *vqpair,
+		uint32_t max_completions);
+
+/** \brief Opaque handle to a write-ahead log that stages writes to a namespace on another one. */
+struct spdk_nvme_wal;
+
+/**
+ * \brief Options for spdk_nvme_wal_create().
+ */
+struct spdk_nvme_wal_opts {
+	/**
+	 * Size in bytes of the log ring when the log is formatted, limited to the log namespace
+	 * minus one sector.  The ring is also kept in memory.  Ignored for an existing log.
+	 */
+	uint64_t	log_size;
+
+	/** Largest amount of data, in bytes, destaged to the data namespace in one batch. */
+	uint32_t	destage_batch_size;
+
+	/**
+	 * Logged data, in bytes, that starts a destage batch.  Destaging also starts when half
+	 * of the ring is in use.
+	 */
+	uint32_t	destage_threshold;
+
+	/** Format the log namespace if it does not hold a valid log. */
+	bool		format;
+};
+
+/**
+ * \brief Fill in the default write-ahead log options: a 64 MiB log, 1 MiB destage batches and
+ * a 256 KiB destage threshold, without formatting.
+ */
+void spdk_nvme_wal_get_default_opts(struct spdk_nvme_wal_opts *opts);
+
+/**
+ * \brief Create a write-ahead log that stages writes to data_ns on the lower latency log_ns.
+ *
+ * \param log_ns Namespace that holds the log.  Its contents are overwritten when formatted.
+ * \param data_ns Namespace the logged writes are destaged to.
+ * \param opts Options, or NULL for the defaults.
+ *
+ * Writes are appended to a ring on log_ns with FUA and complete once they are logged.
+ * spdk_nvme_wal_process_completions() destages them to data_ns in batches sorted by LBA.
+ *
+ * If log_ns holds a log, every write it still contains is replayed to data_ns before this
+ * function returns, so data that was acknowledged before a crash is not lost.  The replay and
+ * the other commands issued here are polled synchronously.
+ *
+ * Both namespaces must have the same sector size and no metadata.  The write-ahead log
+ * allocates one I/O queue pair on the controller of each namespace, and must only be used from
+ * one thread at a time.
+ *
+ * \return the write-ahead log, or NULL if the parameters are invalid, log_ns holds no valid log
+ * and format is not set, or the log could not be replayed or memory allocated.
+ */
+struct spdk_nvme_wal *spdk_nvme_wal_create(struct spdk_nvme_ns *log_ns,
+		struct spdk_nvme_ns *data_ns,
+		const struct spdk_nvme_wal_opts *opts);
+
+/**
+ * \brief Destroy a write-ahead log.
+ *
+ * Outstanding writes are completed and all logged data is destaged to the data namespace first.
+ * No reads may be outstanding.
+ */
+void spdk_nvme_wal_destroy(struct spdk_nvme_wal *wal);
+
+/**
+ * \brief Get the largest number of sectors that one spdk_nvme_wal_cmd_write() can write.
+ */
+uint32_t spdk_nvme_wal_get_max_write_sectors(struct spdk_nvme_wal *wal);
+
+/**
+ * \brief Submit a write through a write-ahead log.
+ *
+ * The payload is copied into the log before this function returns, so it may be reused
+ * immediately.  cb_fn is called once the write is logged, and writes complete in the order they
+ * were submitted.
+ *
+ * \return 0 if successfully submitted, -ENOMEM if the log has no room until more data is
+ * destaged or a request could not be allocated, -EIO if an earlier log write failed, or -EINVAL
+ * if the LBA range is invalid or larger than spdk_nvme_wal_get_max_write_sectors().
+ */
+int spdk_nvme_wal_cmd_write(struct spdk_nvme_wal *wal, void *payload, uint64_t lba,
+			    uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg);
+
+/**
+ * \brief Submit a read through a write-ahead log.
+ *
+ * The data is read from the data namespace, with any part still staged in the log copied over
+ * it from memory.
+ *
+ * \return 0 if successfully submitted, -ENOMEM if too many reads of staged data are outstanding
+ * or a request could not be allocated, or -EINVAL if the LBA range is invalid.
+ */
+int spdk_nvme_wal_cmd_read(struct spdk_nvme_wal *wal, void *payload, uint64_t lba,
+			   uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg);
+
+/**
+ * \brief Process completions on the queue pairs of a write-ahead log and destage logged data.
+ *
+ * \return number of completions processed on the two queue pairs.
+ */
+int32_t spdk_nvme_wal_process_completions(struct spdk_nvme_wal *wal);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,11 +43,53 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define SPDK_VTOPHYS_ERROR	(0xFFFFFFFFFFFFFFFFULL)
 
+/**
+ * Translate a virtual address to a physical address.
+ *
+ * Works for DPDK hugepage memory and for memory added with spdk_mem_register().
+ * Returns SPDK_VTOPHYS_ERROR if buf cannot be translated.
+ */
 uint64_t spdk_vtophys(void *buf);
 
+/**
+ * Translate a virtual address range to the physical extent that starts at buf.
+ *
+ * \param buf start of the virtual range
+ * \param size on input, the length of the range; on output, the number of bytes
+ *  starting at buf that are physically contiguous (at most the input value)
+ *
+ * \return physical address of buf, or SPDK_VTOPHYS_ERROR if buf cannot be
+ *  translated (*size is then unchanged)
+ */
+uint64_t spdk_vtophys_range(void *buf, uint64_t *size);
+
+/**
+ * Make memory outside of DPDK's memsegs translatable by spdk_vtophys(), so it
+ *  can be used directly for NVMe and I/OAT DMA.
+ *
+ * vaddr and len must be 2MB aligned, and the memory must be pinned and already
+ *  faulted in (for example, MAP_POPULATE hugetlbfs or memfd hugepage mappings).
+ *
+ * \return 0 on success, -EINVAL for a misaligned range, -EFAULT if a 2MB page
+ *  is not present, not physically contiguous, or its physical address cannot
+ *  be read (which requires CAP_SYS_ADMIN), -EEXIST if the range overlaps
+ *  known memory, or -ENOMEM.
+ */
+int spdk_mem_register(void *vaddr, size_t len);
+
+/**
+ * Remove memory added with spdk_mem_register().  The memory must no longer be
+ *  in use for I/O.
+ *
+ * \return 0 on success, -EINVAL if any part of the range was not registered
+ *  with spdk_mem_register(), or -ENOMEM.  On failure no translation is removed.
+ */
+int spdk_mem_unregister(void *vaddr, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,6 +31,8 @@
  *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -83,7 +85,25 @@ struct map_128tb {
 	struct map_1gb *map[1ULL << (SHIFT_128TB - SHIFT_1GB + 1)];
 };
 
+/* A virtually and physically contiguous range of memory that can be translated. */
+struct vtophys_region {
+	uint64_t vaddr;
+	uint64_t len;
+	uint64_t paddr;
+	/* Added by spdk_mem_register() rather than taken from the DPDK memsegs. */
+	int registered;
+};
+
+/* Known regions, sorted by vaddr and non-overlapping.  Protected by vtophys_mutex. */
+struct vtophys_region_table {
+	struct vtophys_region *regions;
+	uint32_t num_regions;
+	uint32_t max_regions;
+	int memsegs_loaded;
+};
+
 static struct map_128tb vtophys_map_128tb = {};
+static struct vtophys_region_table vtophys_regions = {};
 static pthread_mutex_t vtophys_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static struct map_2mb *
@@ -122,16 +142,223 @@ vtophys_get_map(uint64_t vfn_2mb)
 	return map_2mb;
 }
 
-static uint64_t
-vtophys_get_pfn_2mb(uint64_t vfn_2mb)
+/*
+ * Return the index of the region containing vaddr, or -1.
+ *  Must be called with vtophys_mutex held.
+ */
+static int
+vtophys_region_find(uint64_t vaddr)
+{
+	struct vtophys_region *region;
+	int lo = 0, hi = (int)vtophys_regions.num_regions - 1, mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		region = &vtophys_regions.regions[mid];
+		if (vaddr < region->vaddr) {
+			hi = mid - 1;
+		} else if (vaddr >= region->vaddr + region->len) {
+			lo = mid + 1;
+		} else {
+			return mid;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Make room for count more regions without changing the table contents.
+ *  Must be called with vtophys_mutex held.
+ */
+static int
+vtophys_region_reserve(uint32_t count)
+{
+	struct vtophys_region *regions;
+	uint32_t max_regions;
+
+	if (vtophys_regions.num_regions + count <= vtophys_regions.max_regions) {
+		return 0;
+	}
+
+	max_regions = vtophys_regions.max_regions ? vtophys_regions.max_regions : 64;
+	while (max_regions < vtophys_regions.num_regions + count) {
+		max_regions *= 2;
+	}
+
+	regions = realloc(vtophys_regions.regions, max_regions * sizeof(*regions));
+	if (regions == NULL) {
+		return -ENOMEM;
+	}
+	vtophys_regions.regions = regions;
+	vtophys_regions.max_regions = max_regions;
+
+	return 0;
+}
+
+/*
+ * Add a region, merging it with its neighbors when both its virtual and
+ *  physical ranges are contiguous with theirs and they came from the same
+ *  source.  Must be called with vtophys_mutex held.
+ */
+static int
+vtophys_region_insert(uint64_t vaddr, uint64_t len, uint64_t paddr, int registered)
+{
+	struct vtophys_region *prev, *next;
+	uint32_t idx;
+	int rc;
+
+	/* Find the first region that starts after vaddr. */
+	for (idx = 0; idx < vtophys_regions.num_regions; idx++) {
+		if (vtophys_regions.regions[idx].vaddr > vaddr) {
+			break;
+		}
+	}
+
+	prev = idx > 0 ? &vtophys_regions.regions[idx - 1] : NULL;
+	next = idx < vtophys_regions.num_regions ? &vtophys_regions.regions[idx] : NULL;
+
+	if ((prev && prev->vaddr + prev->len > vaddr) ||
+	    (next && vaddr + len > next->vaddr)) {
+		return -EEXIST;
+	}
+
+	if (prev && prev->registered == registered &&
+	    prev->vaddr + prev->len == vaddr && prev->paddr + prev->len == paddr) {
+		prev->len += len;
+		if (next && next->registered == registered &&
+		    prev->vaddr + prev->len == next->vaddr &&
+		    prev->paddr + prev->len == next->paddr) {
+			prev->len += next->len;
+			memmove(next, next + 1,
+				(vtophys_regions.num_regions - idx - 1) * sizeof(*next));
+			vtophys_regions.num_regions--;
+		}
+		return 0;
+	}
+
+	if (next && next->registered == registered &&
+	    vaddr + len == next->vaddr && paddr + len == next->paddr) {
+		next->vaddr = vaddr;
+		next->paddr = paddr;
+		next->len += len;
+		return 0;
+	}
+
+	rc = vtophys_region_reserve(1);
+	if (rc != 0) {
+		return rc;
+	}
+
+	memmove(&vtophys_regions.regions[idx + 1], &vtophys_regions.regions[idx],
+		(vtophys_regions.num_regions - idx) * sizeof(struct vtophys_region));
+	vtophys_regions.regions[idx].vaddr = vaddr;
+	vtophys_regions.regions[idx].len = len;
+	vtophys_regions.regions[idx].paddr = paddr;
+	vtophys_regions.regions[idx].registered = registered;
+	vtophys_regions.num_regions++;
+
+	return 0;
+}
+
+/*
+ * Remove [vaddr, vaddr + len) from the table, splitting a region if the range
+ *  falls in its middle.  The whole range must be covered by registered
+ *  regions; otherwise, or if a split cannot be allocated, the table is left
+ *  unchanged.  Must be called with vtophys_mutex held.
+ */
+static int
+vtophys_region_remove(uint64_t vaddr, uint64_t len)
+{
+	struct vtophys_region *region;
+	uint64_t end = vaddr + len, region_end;
+	int first, idx, rc;
+
+	/* Check the whole range before touching anything. */
+	first = vtophys_region_find(vaddr);
+	if (first < 0) {
+		return -EINVAL;
+	}
+	for (idx = first; ; idx++) {
+		region = &vtophys_regions.regions[idx];
+		region_end = region->vaddr + region->len;
+		if (!region->registered) {
+			return -EINVAL;
+		}
+		if (region_end >= end) {
+			break;
+		}
+		if ((uint32_t)idx + 1 == vtophys_regions.num_regions ||
+		    region[1].vaddr != region_end) {
+			return -EINVAL;
+		}
+	}
+
+	region = &vtophys_regions.regions[first];
+	if (vaddr > region->vaddr && end < region->vaddr + region->len) {
+		rc = vtophys_region_reserve(1);
+		if (rc != 0) {
+			return rc;
+		}
+	}
+
+	while (len > 0) {
+		idx = vtophys_region_find(vaddr);
+		region = &vtophys_regions.regions[idx];
+		region_end = region->vaddr + region->len;
+
+		if (vaddr > region->vaddr && end < region_end) {
+			/* Split: keep the head in place and insert the tail after it.
+			 *  Room was reserved above, so this cannot fail.
+			 */
+			region->len = vaddr - region->vaddr;
+			return vtophys_region_insert(end, region_end - end,
+						     region->paddr + (end - region->vaddr), 1);
+		}
+
+		if (vaddr > region->vaddr) {
+			/* Trim the tail. */
+			region->len = vaddr - region->vaddr;
+		} else if (end < region_end) {
+			/* Trim the head. */
+			region->paddr += end - region->vaddr;
+			region->len = region_end - end;
+			region->vaddr = end;
+		} else {
+			memmove(region, region + 1,
+				(vtophys_regions.num_regions - idx - 1) * sizeof(*region));
+			vtophys_regions.num_regions--;
+		}
+
+		if (region_end >= end) {
+			break;
+		}
+		len = end - region_end;
+		vaddr = region_end;
+	}
+
+	return 0;
+}
+
+/*
+ * Add the DPDK memsegs to the region table the first time a translation is
+ *  needed after the EAL has set them up.  Must be called with vtophys_mutex held.
+ */
+static void
+vtophys_load_memsegs(void)
 {
-	uintptr_t vaddr, paddr;
 	struct rte_mem_config *mcfg;
 	struct rte_memseg *seg;
 	uint32_t seg_idx;
 
-	vaddr = vfn_2mb << SHIFT_2MB;
+	if (vtophys_regions.memsegs_loaded) {
+		return;
+	}
+
 	mcfg = rte_eal_get_configuration()->mem_config;
+	if (mcfg == NULL) {
+		return;
+	}
 
 	for (seg_idx = 0; seg_idx < RTE_MAX_MEMSEG; seg_idx++) {
 		seg = &mcfg->memseg[seg_idx];
@@ -139,16 +366,147 @@ vtophys_get_pfn_2mb(uint64_t vfn_2mb)
 			break;
 		}
 
-		if (vaddr >= (uintptr_t)seg->addr &&
-		    vaddr < ((uintptr_t)seg->addr + seg->len)) {
-			paddr = seg->phys_addr;
-			paddr += (vaddr - (uintptr_t)seg->addr);
-			return paddr >> SHIFT_2MB;
+		if (vtophys_region_insert((uintptr_t)seg->addr, seg->len, seg->phys_addr, 0) != 0) {
+			fprintf(stderr, "could not add DPDK memseg %u to vtophys map\n", seg_idx);
 		}
+		vtophys_regions.memsegs_loaded = 1;
 	}
+}
 
-	fprintf(stderr, "could not find 2MB vfn 0x%jx in DPDK mem config\n", vfn_2mb);
-	return -1;
+static uint64_t
+vtophys_get_pfn_2mb(uint64_t vfn_2mb)
+{
+	struct vtophys_region *region;
+	uint64_t vaddr, paddr = SPDK_VTOPHYS_ERROR;
+	int idx;
+
+	vaddr = vfn_2mb << SHIFT_2MB;
+
+	pthread_mutex_lock(&vtophys_mutex);
+	vtophys_load_memsegs();
+	idx = vtophys_region_find(vaddr);
+	if (idx >= 0) {
+		region = &vtophys_regions.regions[idx];
+		paddr = region->paddr + (vaddr - region->vaddr);
+	}
+	pthread_mutex_unlock(&vtophys_mutex);
+
+	if (paddr == SPDK_VTOPHYS_ERROR) {
+		fprintf(stderr, "could not find 2MB vfn 0x%jx in DPDK mem config or registered memory\n",
+			vfn_2mb);
+		return -1;
+	}
+
+	return paddr >> SHIFT_2MB;
+}
+
+/*
+ * Look up the physical address backing a 2MB page through /proc/self/pagemap.
+ *  Every 4KB page in it must be present and physically contiguous, as is the
+ *  case for pinned hugepage memory.
+ */
+static uint64_t
+vtophys_pagemap_lookup(int fd, uint64_t vaddr)
+{
+	uint64_t entries[1ULL << (SHIFT_2MB - SHIFT_4KB)];
+	uint64_t pfn, first_pfn = 0;
+	uint32_t i;
+
+	if (pread(fd, entries, sizeof(entries), (vaddr >> SHIFT_4KB) * sizeof(entries[0])) !=
+	    sizeof(entries)) {
+		return SPDK_VTOPHYS_ERROR;
+	}
+
+	for (i = 0; i < sizeof(entries) / sizeof(entries[0]); i++) {
+		/* Bit 63 is "page present"; bits 0-54 are the page frame number. */
+		pfn = entries[i] & ((1ULL << 55) - 1);
+		if (!(entries[i] & (1ULL << 63)) || pfn == 0) {
+			return SPDK_VTOPHYS_ERROR;
+		}
+
+		if (i == 0) {
+			first_pfn = pfn;
+		} else if (pfn != first_pfn + i) {
+			return SPDK_VTOPHYS_ERROR;
+		}
+	}
+
+	return first_pfn << SHIFT_4KB;
+}
+
+int
+spdk_mem_register(void *vaddr, size_t len)
+{
+	uint64_t addr = (uintptr_t)vaddr, offset, paddr;
+	int fd, rc = 0;
+
+	if (vaddr == NULL || len == 0 || (addr & MASK_2MB) || (len & MASK_2MB) ||
+	    ((addr + len - 1) & ~MASK_128TB)) {
+		return -EINVAL;
+	}
+
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	pthread_mutex_lock(&vtophys_mutex);
+	vtophys_load_memsegs();
+
+	for (offset = 0; offset < len; offset += (1ULL << SHIFT_2MB)) {
+		paddr = vtophys_pagemap_lookup(fd, addr + offset);
+		if (paddr == SPDK_VTOPHYS_ERROR) {
+			rc = -EFAULT;
+			break;
+		}
+
+		rc = vtophys_region_insert(addr + offset, 1ULL << SHIFT_2MB, paddr, 1);
+		if (rc != 0) {
+			break;
+		}
+	}
+
+	if (rc != 0 && offset > 0) {
+		vtophys_region_remove(addr, offset);
+	}
+
+	pthread_mutex_unlock(&vtophys_mutex);
+	close(fd);
+
+	return rc;
+}
+
+int
+spdk_mem_unregister(void *vaddr, size_t len)
+{
+	struct map_1gb *map_1gb;
+	uint64_t addr = (uintptr_t)vaddr, vfn_2mb;
+	int rc;
+
+	if (vaddr == NULL || len == 0 || (addr & MASK_2MB) || (len & MASK_2MB) ||
+	    ((addr + len - 1) & ~MASK_128TB)) {
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&vtophys_mutex);
+
+	rc = vtophys_region_remove(addr, len);
+	if (rc != 0) {
+		pthread_mutex_unlock(&vtophys_mutex);
+		return rc;
+	}
+
+	/* Forget any cached translations so later lookups fail. */
+	for (vfn_2mb = addr >> SHIFT_2MB; vfn_2mb < (addr + len) >> SHIFT_2MB; vfn_2mb++) {
+		map_1gb = vtophys_map_128tb.map[MAP_128TB_IDX(vfn_2mb)];
+		if (map_1gb) {
+			map_1gb->map[MAP_1GB_IDX(vfn_2mb)].pfn_2mb = SPDK_VTOPHYS_ERROR;
+		}
+	}
+
+	pthread_mutex_unlock(&vtophys_mutex);
+
+	return 0;
 }
 
 uint64_t
@@ -181,3 +539,33 @@ spdk_vtophys(void *buf)
 
 	return (pfn_2mb << SHIFT_2MB) | ((uint64_t)buf & MASK_2MB);
 }
+
+uint64_t
+spdk_vtophys_range(void *buf, uint64_t *size)
+{
+	uint64_t vaddr = (uint64_t)buf, paddr, contig;
+
+	paddr = spdk_vtophys(buf);
+	if (paddr == SPDK_VTOPHYS_ERROR) {
+		return SPDK_VTOPHYS_ERROR;
+	}
+
+	/*
+	 * Extend the extent one 2MB page at a time for as long as the next page
+	 *  follows the previous one physically.  Each step is a lookup in the 2MB
+	 *  map, so a whole hugepage costs a single translation.
+	 */
+	contig = (1ULL << SHIFT_2MB) - (vaddr & MASK_2MB);
+	while (contig < *size) {
+		if (spdk_vtophys((void *)(vaddr + contig)) != paddr + contig) {
+			break;
+		}
+		contig += 1ULL << SHIFT_2MB;
+	}
+
+	if (contig < *size) {
+		*size = contig;
+	}
+
+	return paddr;
+}
@@ -42,7 +42,7 @@ struct nvme_driver g_nvme_driver = {
 int32_t		spdk_nvme_retry_count;
 
 static struct spdk_nvme_ctrlr *
-nvme_attach(void *devhandle)
+nvme_attach(void *devhandle, struct spdk_nvme_sw_ctrlr *sw_dev)
 {
 	struct spdk_nvme_ctrlr	*ctrlr;
 	int			status;
@@ -55,8 +55,12 @@ nvme_attach(void *devhandle)
 		return NULL;
 	}
 
+	ctrlr->sw_dev = sw_dev;
 	status = nvme_ctrlr_construct(ctrlr, devhandle);
 	if (status != 0) {
+		if (sw_dev) {
+			nvme_sw_dev_detach(sw_dev);
+		}
 		nvme_free(ctrlr);
 		return NULL;
 	}
@@ -99,27 +103,80 @@ spdk_nvme_request_size(void)
 	return sizeof(struct nvme_request);
 }
 
+int
+nvme_request_cache_construct(struct spdk_nvme_qpair *qpair, uint32_t num_reqs)
+{
+	struct nvme_request_cache	*cache;
+	uint64_t			phys_addr;
+	uint32_t			i;
+
+	cache = calloc(1, sizeof(*cache) + num_reqs * sizeof(cache->free_reqs[0]));
+	if (cache == NULL) {
+		return -ENOMEM;
+	}
+
+	cache->reqs = nvme_malloc_socket("nvme_req_cache", num_reqs * sizeof(struct nvme_request),
+					 64, &phys_addr, qpair->socket_id);
+	if (cache->reqs == NULL) {
+		free(cache);
+		return -ENOMEM;
+	}
+
+	cache->num_reqs = num_reqs;
+	for (i = 0; i < num_reqs; i++) {
+		cache->free_reqs[i] = &cache->reqs[num_reqs - 1 - i];
+	}
+	cache->num_free = num_reqs;
+
+	qpair->req_cache = cache;
+	return 0;
+}
+
+void
+nvme_request_cache_destroy(struct spdk_nvme_qpair *qpair)
+{
+	struct nvme_request_cache *cache = qpair->req_cache;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	nvme_free(cache->reqs);
+	free(cache);
+	qpair->req_cache = NULL;
+}
+
+/*
+ * Requests come from the qpair's own cache while it lasts, so the common case does not
+ *  touch the global request_mempool that is shared by every core.  qpair may be NULL to
+ *  allocate from the global pool directly.
+ */
 struct nvme_request *
-nvme_allocate_request(const struct nvme_payload *payload, uint32_t payload_size,
-		      spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+nvme_allocate_request(struct spdk_nvme_qpair *qpair, const struct nvme_payload *payload,
+		      uint32_t payload_size, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
 {
 	struct nvme_request *req = NULL;
+	struct nvme_request_cache *cache = qpair ? qpair->req_cache : NULL;
 
-	nvme_alloc_request(&req);
+	if (cache != NULL && cache->num_free != 0) {
+		req = cache->free_reqs[--cache->num_free];
+	} else {
+		nvme_alloc_request(&req);
+	}
 
 	if (req == NULL) {
 		return req;
 	}
 
 	/*
-	 * Only memset up to (but not including) the children
-	 *  TAILQ_ENTRY.  children, and following members, are
-	 *  only used as part of I/O splitting so we avoid
+	 * Only memset up to (but not including) the stailq
+	 *  STAILQ_ENTRY.  stailq, and following members, are
+	 *  only used when queueing or splitting requests so we avoid
 	 *  memsetting them until it is actually needed.
-	 *  They will be initialized in nvme_request_add_child()
+	 *  The split members will be initialized in nvme_request_add_child()
 	 *  if the request is split.
 	 */
-	memset(req, 0, offsetof(struct nvme_request, children));
+	memset(req, 0, offsetof(struct nvme_request, stailq));
 	req->cb_fn = cb_fn;
 	req->cb_arg = cb_arg;
 	req->payload = *payload;
@@ -128,9 +185,35 @@ nvme_allocate_request(const struct nvme_payload *payload, uint32_t payload_size,
 	return req;
 }
 
+/*
+ * Get num uninitialized requests for the children of a split request, all
+ *  from the qpair's cache if it has enough of them, otherwise all from the
+ *  global pool.  Returns -ENOMEM (and allocates nothing) if neither can
+ *  supply all of them.
+ */
+int
+nvme_allocate_request_bulk(struct spdk_nvme_qpair *qpair, struct nvme_request **reqs,
+			   uint32_t num)
+{
+	struct nvme_request_cache *cache = qpair ? qpair->req_cache : NULL;
+	uint32_t i;
+
+	if (cache != NULL && cache->num_free >= num) {
+		for (i = 0; i < num; i++) {
+			reqs[i] = cache->free_reqs[--cache->num_free];
+		}
+		return 0;
+	}
+
+	if (nvme_alloc_request_bulk(reqs, num) != 0) {
+		return -ENOMEM;
+	}
+	return 0;
+}
+
 struct nvme_request *
-nvme_allocate_request_contig(void *buffer, uint32_t payload_size, spdk_nvme_cmd_cb cb_fn,
-			     void *cb_arg)
+nvme_allocate_request_contig(struct spdk_nvme_qpair *qpair, void *buffer, uint32_t payload_size,
+			     spdk_nvme_cmd_cb cb_fn, void *cb_arg)
 {
 	struct nvme_payload payload;
 
@@ -138,21 +221,33 @@ nvme_allocate_request_contig(void *buffer, uint32_t payload_size, spdk_nvme_cmd_
 	payload.u.contig = buffer;
 	payload.md = NULL;
 
-	return nvme_allocate_request(&payload, payload_size, cb_fn, cb_arg);
+	return nvme_allocate_request(qpair, &payload, payload_size, cb_fn, cb_arg);
 }
 
 struct nvme_request *
-nvme_allocate_request_null(spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+nvme_allocate_request_null(struct spdk_nvme_qpair *qpair, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
 {
-	return nvme_allocate_request_contig(NULL, 0, cb_fn, cb_arg);
+	return nvme_allocate_request_contig(qpair, NULL, 0, cb_fn, cb_arg);
 }
 
+/*
+ * qpair must be the qpair the request was allocated for (or NULL if it was allocated
+ *  from the global pool).
+ */
 void
-nvme_free_request(struct nvme_request *req)
+nvme_free_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
 {
+	struct nvme_request_cache *cache = qpair ? qpair->req_cache : NULL;
+
 	nvme_assert(req != NULL, ("nvme_free_request(NULL)\n"));
 	nvme_assert(req->num_children == 0, ("num_children != 0\n"));
 
+	if (cache != NULL &&
+	    (uintptr_t)req - (uintptr_t)cache->reqs < cache->num_reqs * sizeof(struct nvme_request)) {
+		cache->free_reqs[cache->num_free++] = req;
+		return;
+	}
+
 	nvme_dealloc_request(req);
 }
 
@@ -182,7 +277,33 @@ nvme_enum_cb(void *ctx, struct spdk_pci_device *pci_dev)
 	spdk_nvme_ctrlr_opts_set_defaults(&opts);
 
 	if (enum_ctx->probe_cb(enum_ctx->cb_ctx, pci_dev, &opts)) {
-		ctrlr = nvme_attach(pci_dev);
+		ctrlr = nvme_attach(pci_dev, NULL);
+		if (ctrlr == NULL) {
+			nvme_printf(NULL, "nvme_attach() failed\n");
+			return -1;
+		}
+
+		ctrlr->opts = opts;
+
+		TAILQ_INSERT_TAIL(&g_nvme_driver.init_ctrlrs, ctrlr, tailq);
+	}
+
+	return 0;
+}
+
+/* This function must only be called while holding g_nvme_driver.lock */
+static int
+nvme_sw_enum_cb(void *ctx, struct spdk_nvme_sw_ctrlr *sw_dev)
+{
+	struct nvme_enum_ctx *enum_ctx = ctx;
+	struct spdk_nvme_ctrlr *ctrlr;
+	struct spdk_nvme_ctrlr_opts opts;
+
+	spdk_nvme_ctrlr_opts_set_defaults(&opts);
+
+	/* Software controllers have no PCI device, so probe_cb() gets a NULL handle. */
+	if (enum_ctx->probe_cb(enum_ctx->cb_ctx, NULL, &opts)) {
+		ctrlr = nvme_attach(NULL, sw_dev);
 		if (ctrlr == NULL) {
 			nvme_printf(NULL, "nvme_attach() failed\n");
 			return -1;
@@ -210,12 +331,20 @@ spdk_nvme_probe(void *cb_ctx, spdk_nvme_probe_cb probe_cb, spdk_nvme_attach_cb a
 	enum_ctx.cb_ctx = cb_ctx;
 
 	rc = nvme_pci_enumerate(nvme_enum_cb, &enum_ctx);
+	if (nvme_sw_enumerate(nvme_sw_enum_cb, &enum_ctx) != 0) {
+		rc = -1;
+	}
 	/*
 	 * Keep going even if one or more nvme_attach() calls failed,
 	 *  but maintain the value of rc to signal errors when we return.
 	 */
 
-	/* Initialize all new controllers in the init_ctrlrs list in parallel. */
+	/*
+	 * Initialize all new controllers in the init_ctrlrs list in parallel.
+	 *  nvme_ctrlr_process_init() never waits for the hardware or for an admin
+	 *  command, so every controller's initialization commands are outstanding
+	 *  at the same time.
+	 */
 	while (!TAILQ_EMPTY(&g_nvme_driver.init_ctrlrs)) {
 		TAILQ_FOREACH_SAFE(ctrlr, &g_nvme_driver.init_ctrlrs, tailq, ctrlr_tmp) {
 			/* Drop the driver lock while calling nvme_ctrlr_process_init()
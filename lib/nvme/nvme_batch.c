@@ -0,0 +1,194 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "nvme_internal.h"
+
+
+/*
+ * Batching of commands on a qpair.  Callers add their command to the open
+ *  batch, which is sent as one command once the caller finds it full, when
+ *  it has been open for the batcher's window, or when submissions are
+ *  flushed.  The callbacks of all commands in a batch are called when that
+ *  command completes.
+ */
+
+void
+nvme_batcher_init(struct nvme_batcher *batcher, struct spdk_nvme_qpair *qpair,
+		  struct nvme_request *(*build_request)(struct nvme_batch *batch, spdk_nvme_cmd_cb cb_fn))
+{
+	batcher->qpair = qpair;
+	batcher->build_request = build_request;
+	STAILQ_INIT(&batcher->free_batches);
+}
+
+void
+nvme_batcher_add_batch(struct nvme_batcher *batcher, struct nvme_batch *batch,
+		       struct nvme_batch_cb *cbs, uint16_t max_cbs)
+{
+	batch->batcher = batcher;
+	batch->cbs = cbs;
+	batch->max_cbs = max_cbs;
+	STAILQ_INSERT_TAIL(&batcher->free_batches, batch, stailq);
+}
+
+void
+nvme_batcher_set_window(struct nvme_batcher *batcher, uint32_t window_us)
+{
+	batcher->window_ticks = (uint64_t)window_us * nvme_get_tsc_hz() / 1000000;
+}
+
+/*
+ * Open a free batch for ns.  Returns NULL if every batch is open or
+ *  outstanding.
+ */
+struct nvme_batch *
+nvme_batcher_open_batch(struct nvme_batcher *batcher, struct spdk_nvme_ns *ns)
+{
+	struct nvme_batch *batch = STAILQ_FIRST(&batcher->free_batches);
+
+	if (batch == NULL) {
+		return NULL;
+	}
+
+	STAILQ_REMOVE_HEAD(&batcher->free_batches, stailq);
+	batch->ns = ns;
+	batch->num_cbs = 0;
+	batch->first_tick = nvme_get_tsc();
+	batcher->open = batch;
+
+	return batch;
+}
+
+void
+nvme_batch_add_cb(struct nvme_batch *batch, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	nvme_assert(batch->num_cbs < batch->max_cbs, ("batch callbacks full\n"));
+
+	batch->cbs[batch->num_cbs].cb_fn = cb_fn;
+	batch->cbs[batch->num_cbs].cb_arg = cb_arg;
+	batch->num_cbs++;
+}
+
+static void
+nvme_batch_complete(struct nvme_batch *batch, const struct spdk_nvme_cpl *cpl)
+{
+	uint16_t i;
+
+	for (i = 0; i < batch->num_cbs; i++) {
+		batch->cbs[i].cb_fn(batch->cbs[i].cb_arg, cpl);
+	}
+
+	STAILQ_INSERT_HEAD(&batch->batcher->free_batches, batch, stailq);
+}
+
+static void
+nvme_batch_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct nvme_batch *batch = cb_arg;
+
+	batch->in_flight = false;
+	batch->batcher->num_in_flight--;
+	nvme_batch_complete(batch, cpl);
+}
+
+/*
+ * Send the open batch.  If it cannot be sent now, it stays open so that it
+ *  is retried later.
+ */
+int
+nvme_batcher_submit_open(struct nvme_batcher *batcher)
+{
+	struct nvme_batch	*batch = batcher->open;
+	struct nvme_request	*req;
+	int			rc;
+
+	req = batcher->build_request(batch, nvme_batch_done);
+	if (req == NULL) {
+		return -ENOMEM;
+	}
+
+	batcher->open = NULL;
+	batch->in_flight = true;
+	batcher->num_in_flight++;
+
+	rc = nvme_qpair_submit_request(batcher->qpair, req);
+	if (rc != 0 && batch->in_flight) {
+		/* A failed submission that did not call nvme_batch_done() leaves the batch ours. */
+		batch->in_flight = false;
+		batcher->num_in_flight--;
+		batcher->open = batch;
+		return rc;
+	}
+
+	return 0;
+}
+
+void
+nvme_batcher_poll(struct nvme_batcher *batcher)
+{
+	if (batcher->open != NULL &&
+	    nvme_get_tsc() - batcher->open->first_tick >= batcher->window_ticks) {
+		nvme_batcher_submit_open(batcher);
+	}
+}
+
+void
+nvme_batcher_flush(struct nvme_batcher *batcher)
+{
+	if (batcher->open != NULL) {
+		nvme_batcher_submit_open(batcher);
+	}
+}
+
+/*
+ * Complete the commands in the open batch as aborted, for when the batch can
+ *  no longer be sent.
+ */
+void
+nvme_batcher_fail(struct nvme_batcher *batcher)
+{
+	struct nvme_batch	*batch = batcher->open;
+	struct spdk_nvme_cpl	cpl = {};
+
+	if (batch == NULL) {
+		return;
+	}
+
+	batcher->open = NULL;
+
+	cpl.status.sct = SPDK_NVME_SCT_GENERIC;
+	cpl.status.sc = SPDK_NVME_SC_ABORTED_BY_REQUEST;
+	cpl.status.dnr = 1;
+	nvme_batch_complete(batch, &cpl);
+}
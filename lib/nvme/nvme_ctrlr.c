@@ -44,6 +44,10 @@ spdk_nvme_ctrlr_opts_set_defaults(struct spdk_nvme_ctrlr_opts *opts)
 	opts->num_io_queues = DEFAULT_MAX_IO_QUEUES;
 	opts->use_cmb_sqs = false;
 	opts->arb_mechanism = SPDK_NVME_CC_AMS_RR;
+	opts->timeout_sec = 0;
+	opts->timeout_cb_fn = NULL;
+	opts->timeout_cb_arg = NULL;
+	opts->io_queue_prp_lists = 0;
 }
 
 static int
@@ -97,6 +101,13 @@ spdk_nvme_ctrlr_create_qpair(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_qpa
 struct spdk_nvme_qpair *
 spdk_nvme_ctrlr_alloc_io_qpair(struct spdk_nvme_ctrlr *ctrlr,
 			       enum spdk_nvme_qprio qprio)
+{
+	return spdk_nvme_ctrlr_alloc_io_qpair_on_socket(ctrlr, qprio, SPDK_NVME_SOCKET_ID_LOCAL);
+}
+
+struct spdk_nvme_qpair *
+spdk_nvme_ctrlr_alloc_io_qpair_on_socket(struct spdk_nvme_ctrlr *ctrlr,
+		enum spdk_nvme_qprio qprio, int socket_id)
 {
 	struct spdk_nvme_qpair			*qpair;
 	union spdk_nvme_cc_register		cc;
@@ -131,9 +142,20 @@ spdk_nvme_ctrlr_alloc_io_qpair(struct spdk_nvme_ctrlr *ctrlr,
 	}
 
 	/*
-	 * At this point, qpair contains a preallocated submission and completion queue and a
-	 *  unique queue ID, but it is not yet created on the controller.
-	 *
+	 * At this point, qpair only has a unique queue ID and its queue sizes.
+	 *  Allocate its submission and completion queues and trackers now, on the
+	 *  socket of the calling lcore unless the caller asked for another one.
+	 */
+	if (socket_id == SPDK_NVME_SOCKET_ID_LOCAL) {
+		socket_id = nvme_get_socket_id();
+	}
+	if (nvme_qpair_construct(qpair, qpair->id, qpair->num_entries, qpair->num_trackers,
+				 ctrlr, socket_id) != 0) {
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+		return NULL;
+	}
+
+	/*
 	 * Fill out the submission queue priority and send out the Create I/O Queue commands.
 	 */
 	qpair->qprio = qprio;
@@ -142,6 +164,7 @@ spdk_nvme_ctrlr_alloc_io_qpair(struct spdk_nvme_ctrlr *ctrlr,
 		 * spdk_nvme_ctrlr_create_qpair() failed, so the qpair structure is still unused.
 		 * Exit here so we don't insert it into the active_io_qpairs list.
 		 */
+		nvme_qpair_destroy(qpair);
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return NULL;
 	}
@@ -198,6 +221,9 @@ spdk_nvme_ctrlr_free_io_qpair(struct spdk_nvme_qpair *qpair)
 		return -1;
 	}
 
+	/* Release the queues and trackers; the next allocation constructs them anew. */
+	nvme_qpair_destroy(qpair);
+
 	TAILQ_REMOVE(&ctrlr->active_io_qpairs, qpair, tailq);
 	TAILQ_INSERT_HEAD(&ctrlr->free_io_qpairs, qpair, tailq);
 
@@ -205,6 +231,31 @@ spdk_nvme_ctrlr_free_io_qpair(struct spdk_nvme_qpair *qpair)
 	return 0;
 }
 
+static void
+nvme_ctrlr_init_cmd_done(void *arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct spdk_nvme_ctrlr *ctrlr = arg;
+
+	if (!spdk_nvme_cpl_is_error(&ctrlr->init_cpl)) {
+		ctrlr->init_cpl = *cpl;
+	}
+	ctrlr->num_init_cmds--;
+}
+
+/*
+ * Returns true once all admin commands of the current initialization step
+ *  have completed.  Never waits.
+ */
+static bool
+nvme_ctrlr_init_cmds_done(struct spdk_nvme_ctrlr *ctrlr)
+{
+	if (ctrlr->num_init_cmds != 0) {
+		spdk_nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	}
+
+	return ctrlr->num_init_cmds == 0;
+}
+
 static void
 nvme_ctrlr_construct_intel_support_log_page_list(struct spdk_nvme_ctrlr *ctrlr,
 		struct spdk_nvme_intel_log_page_directory *log_page_directory)
@@ -245,34 +296,41 @@ nvme_ctrlr_construct_intel_support_log_page_list(struct spdk_nvme_ctrlr *ctrlr,
 static int nvme_ctrlr_set_intel_support_log_pages(struct spdk_nvme_ctrlr *ctrlr)
 {
 	uint64_t phys_addr = 0;
-	struct nvme_completion_poll_status	status;
-	struct spdk_nvme_intel_log_page_directory *log_page_directory;
+	int rc;
 
-	log_page_directory = nvme_malloc("nvme_log_page_directory",
-					 sizeof(struct spdk_nvme_intel_log_page_directory),
-					 64, &phys_addr);
-	if (log_page_directory == NULL) {
+	ctrlr->log_page_directory = nvme_malloc("nvme_log_page_directory",
+						sizeof(struct spdk_nvme_intel_log_page_directory),
+						64, &phys_addr);
+	if (ctrlr->log_page_directory == NULL) {
 		nvme_printf(NULL, "could not allocate log_page_directory\n");
 		return -ENXIO;
 	}
 
-	status.done = false;
-	spdk_nvme_ctrlr_cmd_get_log_page(ctrlr, SPDK_NVME_INTEL_LOG_PAGE_DIRECTORY, SPDK_NVME_GLOBAL_NS_TAG,
-					 log_page_directory, sizeof(struct spdk_nvme_intel_log_page_directory),
-					 nvme_completion_poll_cb,
-					 &status);
-	while (status.done == false) {
-		spdk_nvme_qpair_process_completions(&ctrlr->adminq, 0);
+	ctrlr->num_init_cmds++;
+	rc = spdk_nvme_ctrlr_cmd_get_log_page(ctrlr, SPDK_NVME_INTEL_LOG_PAGE_DIRECTORY,
+					      SPDK_NVME_GLOBAL_NS_TAG, ctrlr->log_page_directory,
+					      sizeof(struct spdk_nvme_intel_log_page_directory),
+					      nvme_ctrlr_init_cmd_done, ctrlr);
+	if (rc != 0) {
+		ctrlr->num_init_cmds--;
+		nvme_free(ctrlr->log_page_directory);
+		ctrlr->log_page_directory = NULL;
 	}
-	if (spdk_nvme_cpl_is_error(&status.cpl)) {
-		nvme_free(log_page_directory);
+
+	return rc;
+}
+
+static void
+nvme_ctrlr_set_intel_support_log_pages_done(struct spdk_nvme_ctrlr *ctrlr)
+{
+	if (spdk_nvme_cpl_is_error(&ctrlr->init_cpl)) {
 		nvme_printf(ctrlr, "nvme_ctrlr_cmd_get_log_page failed!\n");
-		return -ENXIO;
+	} else {
+		nvme_ctrlr_construct_intel_support_log_page_list(ctrlr, ctrlr->log_page_directory);
 	}
 
-	nvme_ctrlr_construct_intel_support_log_page_list(ctrlr, log_page_directory);
-	nvme_free(log_page_directory);
-	return 0;
+	nvme_free(ctrlr->log_page_directory);
+	ctrlr->log_page_directory = NULL;
 }
 
 static void
@@ -339,16 +397,20 @@ nvme_ctrlr_construct_admin_qpair(struct spdk_nvme_ctrlr *ctrlr)
 				    0, /* qpair ID */
 				    NVME_ADMIN_ENTRIES,
 				    NVME_ADMIN_TRACKERS,
-				    ctrlr);
+				    ctrlr,
+				    NVME_SOCKET_ID_ANY);
 }
 
+/*
+ * Set up the I/O qpair structures.  Their queues and trackers are only
+ *  allocated by spdk_nvme_ctrlr_alloc_io_qpair().
+ */
 static int
 nvme_ctrlr_construct_io_qpairs(struct spdk_nvme_ctrlr *ctrlr)
 {
 	struct spdk_nvme_qpair		*qpair;
 	union spdk_nvme_cap_register	cap;
 	uint32_t			i, num_entries, num_trackers;
-	int				rc;
 
 	if (ctrlr->ioq != NULL) {
 		/*
@@ -377,6 +439,14 @@ nvme_ctrlr_construct_io_qpairs(struct spdk_nvme_ctrlr *ctrlr)
 
 	ctrlr->max_xfer_size = NVME_MAX_XFER_SIZE;
 
+	if (ctrlr->opts.timeout_sec != 0) {
+		if (ctrlr->opts.timeout_sec < NVME_MIN_TIMEOUT_PERIOD) {
+			ctrlr->opts.timeout_sec = NVME_MIN_TIMEOUT_PERIOD;
+		} else if (ctrlr->opts.timeout_sec > NVME_MAX_TIMEOUT_PERIOD) {
+			ctrlr->opts.timeout_sec = NVME_MAX_TIMEOUT_PERIOD;
+		}
+	}
+
 	ctrlr->ioq = calloc(ctrlr->opts.num_io_queues, sizeof(struct spdk_nvme_qpair));
 
 	if (ctrlr->ioq == NULL)
@@ -389,13 +459,10 @@ nvme_ctrlr_construct_io_qpairs(struct spdk_nvme_ctrlr *ctrlr)
 		 * Admin queue has ID=0. IO queues start at ID=1 -
 		 *  hence the 'i+1' here.
 		 */
-		rc = nvme_qpair_construct(qpair,
-					  i + 1, /* qpair ID */
-					  num_entries,
-					  num_trackers,
-					  ctrlr);
-		if (rc)
-			return -1;
+		qpair->id = i + 1;
+		qpair->num_entries = num_entries;
+		qpair->num_trackers = num_trackers;
+		qpair->ctrlr = ctrlr;
 
 		TAILQ_INSERT_TAIL(&ctrlr->free_io_qpairs, qpair, tailq);
 	}
@@ -406,14 +473,12 @@ nvme_ctrlr_construct_io_qpairs(struct spdk_nvme_ctrlr *ctrlr)
 static void
 nvme_ctrlr_fail(struct spdk_nvme_ctrlr *ctrlr)
 {
-	uint32_t i;
+	struct spdk_nvme_qpair *qpair;
 
 	ctrlr->is_failed = true;
 	nvme_qpair_fail(&ctrlr->adminq);
-	if (ctrlr->ioq) {
-		for (i = 0; i < ctrlr->opts.num_io_queues; i++) {
-			nvme_qpair_fail(&ctrlr->ioq[i]);
-		}
+	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
+		nvme_qpair_fail(qpair);
 	}
 }
 
@@ -519,7 +584,6 @@ int
 spdk_nvme_ctrlr_reset(struct spdk_nvme_ctrlr *ctrlr)
 {
 	int rc = 0;
-	uint32_t i;
 	struct spdk_nvme_qpair *qpair;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
@@ -540,8 +604,8 @@ spdk_nvme_ctrlr_reset(struct spdk_nvme_ctrlr *ctrlr)
 
 	/* Disable all queues before disabling the controller hardware. */
 	nvme_qpair_disable(&ctrlr->adminq);
-	for (i = 0; i < ctrlr->opts.num_io_queues; i++) {
-		nvme_qpair_disable(&ctrlr->ioq[i]);
+	TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
+		nvme_qpair_disable(qpair);
 	}
 
 	/* Set the state back to INIT to cause a full hardware reset. */
@@ -576,20 +640,22 @@ spdk_nvme_ctrlr_reset(struct spdk_nvme_ctrlr *ctrlr)
 static int
 nvme_ctrlr_identify(struct spdk_nvme_ctrlr *ctrlr)
 {
-	struct nvme_completion_poll_status	status;
-	int					rc;
+	int rc;
 
-	status.done = false;
+	ctrlr->num_init_cmds++;
 	rc = nvme_ctrlr_cmd_identify_controller(ctrlr, &ctrlr->cdata,
-						nvme_completion_poll_cb, &status);
+						nvme_ctrlr_init_cmd_done, ctrlr);
 	if (rc != 0) {
-		return rc;
+		ctrlr->num_init_cmds--;
 	}
 
-	while (status.done == false) {
-		spdk_nvme_qpair_process_completions(&ctrlr->adminq, 0);
-	}
-	if (spdk_nvme_cpl_is_error(&status.cpl)) {
+	return rc;
+}
+
+static int
+nvme_ctrlr_identify_done(struct spdk_nvme_ctrlr *ctrlr)
+{
+	if (spdk_nvme_cpl_is_error(&ctrlr->init_cpl)) {
 		nvme_printf(ctrlr, "nvme_identify_controller failed!\n");
 		return -ENXIO;
 	}
@@ -609,11 +675,7 @@ nvme_ctrlr_identify(struct spdk_nvme_ctrlr *ctrlr)
 static int
 nvme_ctrlr_set_num_qpairs(struct spdk_nvme_ctrlr *ctrlr)
 {
-	struct nvme_completion_poll_status	status;
-	int					cq_allocated, sq_allocated;
-	int					rc;
-
-	status.done = false;
+	int rc;
 
 	if (ctrlr->opts.num_io_queues > SPDK_NVME_MAX_IO_QUEUES) {
 		nvme_printf(ctrlr, "Limiting requested num_io_queues %u to max %d\n",
@@ -624,16 +686,22 @@ nvme_ctrlr_set_num_qpairs(struct spdk_nvme_ctrlr *ctrlr)
 		ctrlr->opts.num_io_queues = 1;
 	}
 
+	ctrlr->num_init_cmds++;
 	rc = nvme_ctrlr_cmd_set_num_queues(ctrlr, ctrlr->opts.num_io_queues,
-					   nvme_completion_poll_cb, &status);
+					   nvme_ctrlr_init_cmd_done, ctrlr);
 	if (rc != 0) {
-		return rc;
+		ctrlr->num_init_cmds--;
 	}
 
-	while (status.done == false) {
-		spdk_nvme_qpair_process_completions(&ctrlr->adminq, 0);
-	}
-	if (spdk_nvme_cpl_is_error(&status.cpl)) {
+	return rc;
+}
+
+static int
+nvme_ctrlr_set_num_qpairs_done(struct spdk_nvme_ctrlr *ctrlr)
+{
+	int cq_allocated, sq_allocated;
+
+	if (spdk_nvme_cpl_is_error(&ctrlr->init_cpl)) {
 		nvme_printf(ctrlr, "nvme_set_num_queues failed!\n");
 		return -ENXIO;
 	}
@@ -643,8 +711,8 @@ nvme_ctrlr_set_num_qpairs(struct spdk_nvme_ctrlr *ctrlr)
 	 * Lower 16-bits indicate number of submission queues allocated.
 	 * Upper 16-bits indicate number of completion queues allocated.
 	 */
-	sq_allocated = (status.cpl.cdw0 & 0xFFFF) + 1;
-	cq_allocated = (status.cpl.cdw0 >> 16) + 1;
+	sq_allocated = (ctrlr->init_cpl.cdw0 & 0xFFFF) + 1;
+	cq_allocated = (ctrlr->init_cpl.cdw0 >> 16) + 1;
 
 	ctrlr->opts.num_io_queues = nvme_min(sq_allocated, cq_allocated);
 
@@ -720,6 +788,46 @@ fail:
 	return -1;
 }
 
+/*
+ * Read the Identify Namespace data of all namespaces, with all of the
+ *  commands outstanding at once.
+ */
+static int
+nvme_ctrlr_identify_namespaces(struct spdk_nvme_ctrlr *ctrlr)
+{
+	uint32_t	i;
+	int		rc;
+
+	for (i = 0; i < ctrlr->num_ns; i++) {
+		ctrlr->num_init_cmds++;
+		rc = nvme_ctrlr_cmd_identify_namespace(ctrlr, i + 1, &ctrlr->nsdata[i],
+						       nvme_ctrlr_init_cmd_done, ctrlr);
+		if (rc != 0) {
+			ctrlr->num_init_cmds--;
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int
+nvme_ctrlr_identify_namespaces_done(struct spdk_nvme_ctrlr *ctrlr)
+{
+	uint32_t i;
+
+	if (spdk_nvme_cpl_is_error(&ctrlr->init_cpl)) {
+		nvme_printf(ctrlr, "nvme_identify_namespace failed\n");
+		return -ENXIO;
+	}
+
+	for (i = 0; i < ctrlr->num_ns; i++) {
+		nvme_ns_set_identify_data(&ctrlr->ns[i]);
+	}
+
+	return 0;
+}
+
 static void
 nvme_ctrlr_async_event_cb(void *arg, const struct spdk_nvme_cpl *cpl)
 {
@@ -760,7 +868,7 @@ nvme_ctrlr_construct_and_submit_aer(struct spdk_nvme_ctrlr *ctrlr,
 	struct nvme_request *req;
 
 	aer->ctrlr = ctrlr;
-	req = nvme_allocate_request_null(nvme_ctrlr_async_event_cb, aer);
+	req = nvme_allocate_request_null(&ctrlr->adminq, nvme_ctrlr_async_event_cb, aer);
 	aer->req = req;
 	if (req == NULL) {
 		return -1;
@@ -774,24 +882,27 @@ static int
 nvme_ctrlr_configure_aer(struct spdk_nvme_ctrlr *ctrlr)
 {
 	union spdk_nvme_critical_warning_state	state;
-	struct nvme_async_event_request		*aer;
-	uint32_t				i;
-	struct nvme_completion_poll_status	status;
 	int					rc;
 
-	status.done = false;
-
 	state.raw = 0xFF;
 	state.bits.reserved = 0;
-	rc = nvme_ctrlr_cmd_set_async_event_config(ctrlr, state, nvme_completion_poll_cb, &status);
+
+	ctrlr->num_init_cmds++;
+	rc = nvme_ctrlr_cmd_set_async_event_config(ctrlr, state, nvme_ctrlr_init_cmd_done, ctrlr);
 	if (rc != 0) {
-		return rc;
+		ctrlr->num_init_cmds--;
 	}
 
-	while (status.done == false) {
-		spdk_nvme_qpair_process_completions(&ctrlr->adminq, 0);
-	}
-	if (spdk_nvme_cpl_is_error(&status.cpl)) {
+	return rc;
+}
+
+static int
+nvme_ctrlr_configure_aer_done(struct spdk_nvme_ctrlr *ctrlr)
+{
+	struct nvme_async_event_request		*aer;
+	uint32_t				i;
+
+	if (spdk_nvme_cpl_is_error(&ctrlr->init_cpl)) {
 		nvme_printf(ctrlr, "nvme_ctrlr_cmd_set_async_event_config failed!\n");
 		return -ENXIO;
 	}
@@ -893,10 +1004,29 @@ nvme_ctrlr_process_init(struct spdk_nvme_ctrlr *ctrlr)
 		if (csts.bits.rdy == 1) {
 			/*
 			 * The controller has been enabled.
-			 *  Perform the rest of initialization in nvme_ctrlr_start() serially.
+			 *  Perform the rest of initialization in nvme_ctrlr_start().
 			 */
-			rc = nvme_ctrlr_start(ctrlr);
-			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_READY, NVME_TIMEOUT_INFINITE);
+			nvme_qpair_reset(&ctrlr->adminq);
+			nvme_qpair_enable(&ctrlr->adminq);
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_IDENTIFY, NVME_TIMEOUT_INFINITE);
+			return nvme_ctrlr_start(ctrlr);
+		}
+		break;
+
+	case NVME_CTRLR_STATE_IDENTIFY:
+	case NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY:
+	case NVME_CTRLR_STATE_SET_NUM_QUEUES:
+	case NVME_CTRLR_STATE_WAIT_FOR_SET_NUM_QUEUES:
+	case NVME_CTRLR_STATE_CONSTRUCT_NS:
+	case NVME_CTRLR_STATE_IDENTIFY_NS:
+	case NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS:
+	case NVME_CTRLR_STATE_CONFIGURE_AER:
+	case NVME_CTRLR_STATE_WAIT_FOR_CONFIGURE_AER:
+	case NVME_CTRLR_STATE_SET_SUPPORTED_LOG_PAGES:
+	case NVME_CTRLR_STATE_WAIT_FOR_SUPPORTED_LOG_PAGES:
+	case NVME_CTRLR_STATE_SET_SUPPORTED_FEATURES:
+		rc = nvme_ctrlr_start(ctrlr);
+		if (rc != 0) {
 			return rc;
 		}
 		break;
@@ -917,41 +1047,126 @@ nvme_ctrlr_process_init(struct spdk_nvme_ctrlr *ctrlr)
 	return 0;
 }
 
+/*
+ * Submit the admin command of a step and move to the state that waits for it.
+ */
+static int
+nvme_ctrlr_start_step(struct spdk_nvme_ctrlr *ctrlr, int (*submit_fn)(struct spdk_nvme_ctrlr *),
+		      enum nvme_ctrlr_state wait_state)
+{
+	memset(&ctrlr->init_cpl, 0, sizeof(ctrlr->init_cpl));
+	nvme_ctrlr_set_state(ctrlr, wait_state, NVME_TIMEOUT_INFINITE);
+
+	return submit_fn(ctrlr) != 0 ? -1 : 0;
+}
+
+/*
+ * Run the initialization steps that follow CSTS.RDY = 1, as far as they can go
+ *  without waiting for an admin command to complete.  Called repeatedly from
+ *  nvme_ctrlr_process_init() until the controller is ready, so controllers being
+ *  initialized together have their admin commands outstanding at the same time.
+ */
 int
 nvme_ctrlr_start(struct spdk_nvme_ctrlr *ctrlr)
 {
-	nvme_qpair_reset(&ctrlr->adminq);
+	enum nvme_ctrlr_state	state;
+	int			rc = 0;
 
-	nvme_qpair_enable(&ctrlr->adminq);
+	do {
+		state = ctrlr->state;
 
-	if (nvme_ctrlr_identify(ctrlr) != 0) {
-		return -1;
-	}
+		switch (state) {
+		case NVME_CTRLR_STATE_IDENTIFY:
+			rc = nvme_ctrlr_start_step(ctrlr, nvme_ctrlr_identify,
+						   NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY);
+			break;
 
-	if (nvme_ctrlr_set_num_qpairs(ctrlr) != 0) {
-		return -1;
-	}
+		case NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY:
+			if (nvme_ctrlr_init_cmds_done(ctrlr)) {
+				rc = nvme_ctrlr_identify_done(ctrlr);
+				nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_SET_NUM_QUEUES, NVME_TIMEOUT_INFINITE);
+			}
+			break;
 
-	if (nvme_ctrlr_construct_io_qpairs(ctrlr)) {
-		return -1;
-	}
+		case NVME_CTRLR_STATE_SET_NUM_QUEUES:
+			rc = nvme_ctrlr_start_step(ctrlr, nvme_ctrlr_set_num_qpairs,
+						   NVME_CTRLR_STATE_WAIT_FOR_SET_NUM_QUEUES);
+			break;
 
-	if (nvme_ctrlr_construct_namespaces(ctrlr) != 0) {
-		return -1;
-	}
+		case NVME_CTRLR_STATE_WAIT_FOR_SET_NUM_QUEUES:
+			if (nvme_ctrlr_init_cmds_done(ctrlr)) {
+				rc = nvme_ctrlr_set_num_qpairs_done(ctrlr);
+				nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_CONSTRUCT_NS, NVME_TIMEOUT_INFINITE);
+			}
+			break;
 
-	if (nvme_ctrlr_configure_aer(ctrlr) != 0) {
-		return -1;
-	}
+		case NVME_CTRLR_STATE_CONSTRUCT_NS:
+			if (nvme_ctrlr_construct_io_qpairs(ctrlr) != 0 ||
+			    nvme_ctrlr_construct_namespaces(ctrlr) != 0) {
+				rc = -1;
+			}
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_IDENTIFY_NS, NVME_TIMEOUT_INFINITE);
+			break;
 
-	nvme_ctrlr_set_supported_log_pages(ctrlr);
-	nvme_ctrlr_set_supported_features(ctrlr);
+		case NVME_CTRLR_STATE_IDENTIFY_NS:
+			rc = nvme_ctrlr_start_step(ctrlr, nvme_ctrlr_identify_namespaces,
+						   NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS);
+			break;
 
-	if (ctrlr->cdata.sgls.supported) {
-		ctrlr->flags |= SPDK_NVME_CTRLR_SGL_SUPPORTED;
-	}
+		case NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS:
+			if (nvme_ctrlr_init_cmds_done(ctrlr)) {
+				rc = nvme_ctrlr_identify_namespaces_done(ctrlr);
+				nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_CONFIGURE_AER, NVME_TIMEOUT_INFINITE);
+			}
+			break;
 
-	return 0;
+		case NVME_CTRLR_STATE_CONFIGURE_AER:
+			rc = nvme_ctrlr_start_step(ctrlr, nvme_ctrlr_configure_aer,
+						   NVME_CTRLR_STATE_WAIT_FOR_CONFIGURE_AER);
+			break;
+
+		case NVME_CTRLR_STATE_WAIT_FOR_CONFIGURE_AER:
+			if (nvme_ctrlr_init_cmds_done(ctrlr)) {
+				rc = nvme_ctrlr_configure_aer_done(ctrlr);
+				nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_SET_SUPPORTED_LOG_PAGES,
+						     NVME_TIMEOUT_INFINITE);
+			}
+			break;
+
+		case NVME_CTRLR_STATE_SET_SUPPORTED_LOG_PAGES:
+			/* Failing to read a vendor log page directory is not fatal. */
+			memset(&ctrlr->init_cpl, 0, sizeof(ctrlr->init_cpl));
+			nvme_ctrlr_set_supported_log_pages(ctrlr);
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_WAIT_FOR_SUPPORTED_LOG_PAGES,
+					     NVME_TIMEOUT_INFINITE);
+			break;
+
+		case NVME_CTRLR_STATE_WAIT_FOR_SUPPORTED_LOG_PAGES:
+			if (nvme_ctrlr_init_cmds_done(ctrlr)) {
+				if (ctrlr->log_page_directory != NULL) {
+					nvme_ctrlr_set_intel_support_log_pages_done(ctrlr);
+				}
+				nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_SET_SUPPORTED_FEATURES,
+						     NVME_TIMEOUT_INFINITE);
+			}
+			break;
+
+		case NVME_CTRLR_STATE_SET_SUPPORTED_FEATURES:
+			nvme_ctrlr_set_supported_features(ctrlr);
+
+			if (ctrlr->cdata.sgls.supported) {
+				ctrlr->flags |= SPDK_NVME_CTRLR_SGL_SUPPORTED;
+			}
+
+			nvme_ctrlr_set_state(ctrlr, NVME_CTRLR_STATE_READY, NVME_TIMEOUT_INFINITE);
+			break;
+
+		default:
+			return 0;
+		}
+	} while (rc == 0 && ctrlr->state != state);
+
+	return rc;
 }
 
 static void
@@ -1047,6 +1262,11 @@ nvme_ctrlr_allocate_bars(struct spdk_nvme_ctrlr *ctrlr)
 	int rc;
 	void *addr;
 
+	if (ctrlr->sw_dev) {
+		ctrlr->regs = nvme_sw_dev_attach(ctrlr->sw_dev);
+		return ctrlr->regs ? 0 : -1;
+	}
+
 	rc = nvme_pcicfg_map_bar(ctrlr->devhandle, 0, 0 /* writable */, &addr);
 	ctrlr->regs = (volatile struct spdk_nvme_registers *)addr;
 	if ((ctrlr->regs == NULL) || (rc != 0)) {
@@ -1065,6 +1285,11 @@ nvme_ctrlr_free_bars(struct spdk_nvme_ctrlr *ctrlr)
 	int rc = 0;
 	void *addr = (void *)ctrlr->regs;
 
+	if (ctrlr->sw_dev) {
+		nvme_sw_dev_detach(ctrlr->sw_dev);
+		return 0;
+	}
+
 	rc = nvme_ctrlr_unmap_cmb(ctrlr);
 	if (rc != 0) {
 		nvme_printf(ctrlr, "nvme_ctrlr_unmap_cmb failed with error code %d\n", rc);
@@ -1094,10 +1319,12 @@ nvme_ctrlr_construct(struct spdk_nvme_ctrlr *ctrlr, void *devhandle)
 		return status;
 	}
 
-	/* Enable PCI busmaster. */
-	nvme_pcicfg_read32(devhandle, &cmd_reg, 4);
-	cmd_reg |= 0x4;
-	nvme_pcicfg_write32(devhandle, cmd_reg, 4);
+	if (devhandle != NULL) {
+		/* Enable PCI busmaster. */
+		nvme_pcicfg_read32(devhandle, &cmd_reg, 4);
+		cmd_reg |= 0x4;
+		nvme_pcicfg_write32(devhandle, cmd_reg, 4);
+	}
 
 	cap.raw = nvme_mmio_read_8(ctrlr, cap.raw);
 
@@ -1116,6 +1343,7 @@ nvme_ctrlr_construct(struct spdk_nvme_ctrlr *ctrlr, void *devhandle)
 
 	TAILQ_INIT(&ctrlr->free_io_qpairs);
 	TAILQ_INIT(&ctrlr->active_io_qpairs);
+	ctrlr->ns_qos_enabled = false;
 
 	nvme_mutex_init_recursive(&ctrlr->ctrlr_lock);
 
@@ -1136,6 +1364,10 @@ nvme_ctrlr_destruct(struct spdk_nvme_ctrlr *ctrlr)
 	nvme_ctrlr_shutdown(ctrlr);
 
 	nvme_ctrlr_destruct_namespaces(ctrlr);
+	if (ctrlr->log_page_directory) {
+		nvme_free(ctrlr->log_page_directory);
+		ctrlr->log_page_directory = NULL;
+	}
 	if (ctrlr->ioq) {
 		for (i = 0; i < ctrlr->opts.num_io_queues; i++) {
 			nvme_qpair_destroy(&ctrlr->ioq[i]);
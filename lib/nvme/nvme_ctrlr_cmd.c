@@ -42,7 +42,7 @@ spdk_nvme_ctrlr_cmd_io_raw(struct spdk_nvme_ctrlr *ctrlr,
 {
 	struct nvme_request	*req;
 
-	req = nvme_allocate_request_contig(buf, len, cb_fn, cb_arg);
+	req = nvme_allocate_request_contig(&ctrlr->adminq, buf, len, cb_fn, cb_arg);
 
 	if (req == NULL) {
 		return -ENOMEM;
@@ -63,7 +63,7 @@ spdk_nvme_ctrlr_cmd_admin_raw(struct spdk_nvme_ctrlr *ctrlr,
 	int			rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_contig(buf, len, cb_fn, cb_arg);
+	req = nvme_allocate_request_contig(&ctrlr->adminq, buf, len, cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return -ENOMEM;
@@ -84,7 +84,7 @@ nvme_ctrlr_cmd_identify_controller(struct spdk_nvme_ctrlr *ctrlr, void *payload,
 	struct nvme_request *req;
 	struct spdk_nvme_cmd *cmd;
 
-	req = nvme_allocate_request_contig(payload,
+	req = nvme_allocate_request_contig(&ctrlr->adminq, payload,
 					   sizeof(struct spdk_nvme_ctrlr_data),
 					   cb_fn, cb_arg);
 	if (req == NULL) {
@@ -110,7 +110,7 @@ nvme_ctrlr_cmd_identify_namespace(struct spdk_nvme_ctrlr *ctrlr, uint16_t nsid,
 	struct nvme_request *req;
 	struct spdk_nvme_cmd *cmd;
 
-	req = nvme_allocate_request_contig(payload,
+	req = nvme_allocate_request_contig(&ctrlr->adminq, payload,
 					   sizeof(struct spdk_nvme_ns_data),
 					   cb_fn, cb_arg);
 	if (req == NULL) {
@@ -137,7 +137,7 @@ nvme_ctrlr_cmd_create_io_cq(struct spdk_nvme_ctrlr *ctrlr,
 	struct nvme_request *req;
 	struct spdk_nvme_cmd *cmd;
 
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
 		return -ENOMEM;
 	}
@@ -167,7 +167,7 @@ nvme_ctrlr_cmd_create_io_sq(struct spdk_nvme_ctrlr *ctrlr,
 	struct nvme_request *req;
 	struct spdk_nvme_cmd *cmd;
 
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
 		return -ENOMEM;
 	}
@@ -194,7 +194,7 @@ nvme_ctrlr_cmd_delete_io_cq(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_qpai
 	struct nvme_request *req;
 	struct spdk_nvme_cmd *cmd;
 
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
 		return -ENOMEM;
 	}
@@ -213,7 +213,7 @@ nvme_ctrlr_cmd_delete_io_sq(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_qpai
 	struct nvme_request *req;
 	struct spdk_nvme_cmd *cmd;
 
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
 		return -ENOMEM;
 	}
@@ -234,7 +234,7 @@ nvme_ctrlr_cmd_attach_ns(struct spdk_nvme_ctrlr *ctrlr, uint32_t nsid,
 	int					rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_contig(payload, sizeof(struct spdk_nvme_ctrlr_list),
+	req = nvme_allocate_request_contig(&ctrlr->adminq, payload, sizeof(struct spdk_nvme_ctrlr_list),
 					   cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
@@ -261,7 +261,7 @@ nvme_ctrlr_cmd_detach_ns(struct spdk_nvme_ctrlr *ctrlr, uint32_t nsid,
 	int					rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_contig(payload, sizeof(struct spdk_nvme_ctrlr_list),
+	req = nvme_allocate_request_contig(&ctrlr->adminq, payload, sizeof(struct spdk_nvme_ctrlr_list),
 					   cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
@@ -288,7 +288,7 @@ nvme_ctrlr_cmd_create_ns(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_ns_data
 	int					rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_contig(payload, sizeof(struct spdk_nvme_ns_data),
+	req = nvme_allocate_request_contig(&ctrlr->adminq, payload, sizeof(struct spdk_nvme_ns_data),
 					   cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
@@ -314,7 +314,7 @@ nvme_ctrlr_cmd_delete_ns(struct spdk_nvme_ctrlr *ctrlr, uint32_t nsid, spdk_nvme
 	int					rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return -ENOMEM;
@@ -339,7 +339,7 @@ nvme_ctrlr_cmd_format(struct spdk_nvme_ctrlr *ctrlr, uint32_t nsid, struct spdk_
 	struct spdk_nvme_cmd *cmd;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return -ENOMEM;
@@ -366,7 +366,7 @@ spdk_nvme_ctrlr_cmd_set_feature(struct spdk_nvme_ctrlr *ctrlr, uint8_t feature,
 	int rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return -ENOMEM;
@@ -394,7 +394,7 @@ spdk_nvme_ctrlr_cmd_get_feature(struct spdk_nvme_ctrlr *ctrlr, uint8_t feature,
 	int rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return -ENOMEM;
@@ -445,7 +445,7 @@ spdk_nvme_ctrlr_cmd_get_log_page(struct spdk_nvme_ctrlr *ctrlr, uint8_t log_page
 	int rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_contig(payload, payload_size, cb_fn, cb_arg);
+	req = nvme_allocate_request_contig(&ctrlr->adminq, payload, payload_size, cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return -ENOMEM;
@@ -469,9 +469,13 @@ nvme_ctrlr_cmd_abort(struct spdk_nvme_ctrlr *ctrlr, uint16_t cid,
 {
 	struct nvme_request *req;
 	struct spdk_nvme_cmd *cmd;
+	int rc;
 
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	/* May be called from an I/O thread on timeout, so take the admin queue lock. */
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
+		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return -ENOMEM;
 	}
 
@@ -479,7 +483,21 @@ nvme_ctrlr_cmd_abort(struct spdk_nvme_ctrlr *ctrlr, uint16_t cid,
 	cmd->opc = SPDK_NVME_OPC_ABORT;
 	cmd->cdw10 = (cid << 16) | sqid;
 
-	return nvme_ctrlr_submit_admin_request(ctrlr, req);
+	rc = nvme_ctrlr_submit_admin_request(ctrlr, req);
+
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+	return rc;
+}
+
+int
+spdk_nvme_ctrlr_cmd_abort(struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_qpair *qpair,
+			  uint16_t cid, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	if (qpair == NULL) {
+		qpair = &ctrlr->adminq;
+	}
+
+	return nvme_ctrlr_cmd_abort(ctrlr, cid, qpair->id, cb_fn, cb_arg);
 }
 
 int
@@ -492,7 +510,7 @@ nvme_ctrlr_cmd_fw_commit(struct spdk_nvme_ctrlr *ctrlr,
 	int rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(&ctrlr->adminq, cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
 		return -ENOMEM;
@@ -519,7 +537,7 @@ nvme_ctrlr_cmd_fw_image_download(struct spdk_nvme_ctrlr *ctrlr,
 	int rc;
 
 	nvme_mutex_lock(&ctrlr->ctrlr_lock);
-	req = nvme_allocate_request_contig(payload, size,
+	req = nvme_allocate_request_contig(&ctrlr->adminq, payload, size,
 					   cb_fn, cb_arg);
 	if (req == NULL) {
 		nvme_mutex_unlock(&ctrlr->ctrlr_lock);
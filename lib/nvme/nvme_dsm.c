@@ -0,0 +1,218 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "nvme_internal.h"
+
+/*
+ * Coalescing of deallocate commands.  While it is enabled on a qpair,
+ *  spdk_nvme_ns_cmd_deallocate() copies its ranges into the open batch,
+ *  merging each with an adjacent range that is already there, and one
+ *  Dataset Management command is sent per batch.
+ */
+
+static struct nvme_request *
+nvme_dsm_build_request(struct nvme_batch *batch, spdk_nvme_cmd_cb cb_fn)
+{
+	struct nvme_dsm_batch	*dsm_batch = (struct nvme_dsm_batch *)batch;
+	struct nvme_request	*req;
+	struct spdk_nvme_cmd	*cmd;
+
+	req = nvme_allocate_request_contig(batch->batcher->qpair, dsm_batch->ranges,
+					   dsm_batch->num_ranges * sizeof(struct spdk_nvme_dsm_range),
+					   cb_fn, batch);
+	if (req == NULL) {
+		return NULL;
+	}
+
+	cmd = &req->cmd;
+	cmd->opc = SPDK_NVME_OPC_DATASET_MANAGEMENT;
+	cmd->nsid = batch->ns->id;
+	cmd->cdw10 = dsm_batch->num_ranges - 1;
+	cmd->cdw11 = SPDK_NVME_DSM_ATTR_DEALLOCATE;
+
+	return req;
+}
+
+static void
+nvme_dsm_batch_add_range(struct nvme_dsm_batch *batch, const struct spdk_nvme_dsm_range *range)
+{
+	struct spdk_nvme_dsm_range	*r;
+	uint16_t			i;
+
+	for (i = 0; i < batch->num_ranges; i++) {
+		r = &batch->ranges[i];
+		if (r->attributes != range->attributes ||
+		    (uint64_t)r->length + range->length > UINT32_MAX) {
+			continue;
+		}
+
+		if (r->starting_lba + r->length == range->starting_lba) {
+			r->length += range->length;
+			return;
+		}
+		if (range->starting_lba + range->length == r->starting_lba) {
+			r->starting_lba = range->starting_lba;
+			r->length += range->length;
+			return;
+		}
+	}
+
+	batch->ranges[batch->num_ranges++] = *range;
+}
+
+/*
+ * Returns 0 if the ranges were added to a batch, 1 if there is no batch
+ *  available and the deallocate must be submitted on its own, or a negative
+ *  errno if the open batch had to be sent to make room but could not be.
+ */
+int
+nvme_qpair_dsm_deallocate(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+			  const struct spdk_nvme_dsm_range *ranges, uint16_t num_ranges,
+			  spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	struct nvme_dsm_coalesce	*dsm = qpair->dsm;
+	struct nvme_dsm_batch		*batch = (struct nvme_dsm_batch *)dsm->batcher.open;
+	uint16_t			i;
+	int				rc;
+
+	if (batch != NULL &&
+	    (batch->batch.ns != ns ||
+	     batch->num_ranges + num_ranges > SPDK_NVME_DATASET_MANAGEMENT_MAX_RANGES ||
+	     batch->batch.num_cbs == NVME_DSM_COALESCE_MAX_CBS)) {
+		rc = nvme_batcher_submit_open(&dsm->batcher);
+		if (rc != 0) {
+			return rc;
+		}
+		batch = NULL;
+	}
+
+	if (batch == NULL) {
+		batch = (struct nvme_dsm_batch *)nvme_batcher_open_batch(&dsm->batcher, ns);
+		if (batch == NULL) {
+			return 1;
+		}
+		batch->num_ranges = 0;
+	}
+
+	for (i = 0; i < num_ranges; i++) {
+		nvme_dsm_batch_add_range(batch, &ranges[i]);
+	}
+	nvme_batch_add_cb(&batch->batch, cb_fn, cb_arg);
+
+	if (batch->num_ranges >= dsm->max_ranges ||
+	    batch->batch.num_cbs == NVME_DSM_COALESCE_MAX_CBS) {
+		/* If this fails, nvme_batcher_poll() retries it. */
+		nvme_batcher_submit_open(&dsm->batcher);
+	}
+
+	return 0;
+}
+
+void
+nvme_qpair_dsm_destroy(struct spdk_nvme_qpair *qpair)
+{
+	struct nvme_dsm_coalesce	*dsm = qpair->dsm;
+	uint32_t			i;
+
+	if (dsm == NULL) {
+		return;
+	}
+
+	for (i = 0; i < NVME_DSM_COALESCE_BATCHES; i++) {
+		if (dsm->batches[i].ranges != NULL) {
+			nvme_free(dsm->batches[i].ranges);
+		}
+	}
+	free(dsm);
+	qpair->dsm = NULL;
+	qpair->dsm_coalescing = false;
+}
+
+int
+spdk_nvme_qpair_set_dsm_coalescing(struct spdk_nvme_qpair *qpair, uint16_t max_ranges,
+				   uint32_t window_us)
+{
+	struct nvme_dsm_coalesce	*dsm = qpair->dsm;
+	uint64_t			phys_addr = 0;
+	uint32_t			i;
+
+	if (max_ranges > SPDK_NVME_DATASET_MANAGEMENT_MAX_RANGES) {
+		return -EINVAL;
+	}
+
+	if (max_ranges == 0) {
+		if (dsm == NULL) {
+			return 0;
+		}
+
+		qpair->dsm_coalescing = false;
+		dsm->max_ranges = 0;
+		nvme_batcher_flush(&dsm->batcher);
+		nvme_batcher_fail(&dsm->batcher);
+
+		/* Batches still outstanding keep the state until the qpair is destroyed. */
+		if (dsm->batcher.num_in_flight == 0) {
+			nvme_qpair_dsm_destroy(qpair);
+		}
+		return 0;
+	}
+
+	if (dsm == NULL) {
+		dsm = calloc(1, sizeof(*dsm));
+		if (dsm == NULL) {
+			return -ENOMEM;
+		}
+		nvme_batcher_init(&dsm->batcher, qpair, nvme_dsm_build_request);
+		qpair->dsm = dsm;
+
+		for (i = 0; i < NVME_DSM_COALESCE_BATCHES; i++) {
+			dsm->batches[i].ranges = nvme_malloc_socket("nvme_dsm_ranges",
+						 SPDK_NVME_DATASET_MANAGEMENT_MAX_RANGES *
+						 sizeof(struct spdk_nvme_dsm_range),
+						 0x1000, &phys_addr, qpair->socket_id);
+			if (dsm->batches[i].ranges == NULL) {
+				nvme_qpair_dsm_destroy(qpair);
+				return -ENOMEM;
+			}
+			nvme_batcher_add_batch(&dsm->batcher, &dsm->batches[i].batch, dsm->batches[i].cbs,
+					       NVME_DSM_COALESCE_MAX_CBS);
+		}
+	}
+
+	dsm->max_ranges = max_ranges;
+	nvme_batcher_set_window(&dsm->batcher, window_us);
+	qpair->dsm_coalescing = true;
+
+	return 0;
+}
@@ -52,8 +52,11 @@
 #include <unistd.h>
 #include <rte_config.h>
 #include <rte_cycles.h>
+#include <rte_lcore.h>
 #include <rte_malloc.h>
+#include <rte_memory.h>
 #include <rte_mempool.h>
+#include <rte_prefetch.h>
 
 #ifdef SPDK_CONFIG_PCIACCESS
 #include <pciaccess.h>
@@ -90,6 +93,33 @@ nvme_malloc(const char *tag, size_t size, unsigned align, uint64_t *phys_addr)
 	return buf;
 }
 
+/**
+ * Socket ID that lets nvme_malloc_socket() use memory from any NUMA socket.
+ */
+#define NVME_SOCKET_ID_ANY		SOCKET_ID_ANY
+
+/**
+ * Allocate a buffer like nvme_malloc(), but from memory local to the given
+ *  NUMA socket.  If that socket has no free memory left, fall back to any socket.
+ */
+static inline void *
+nvme_malloc_socket(const char *tag, size_t size, unsigned align, uint64_t *phys_addr,
+		   int socket_id)
+{
+	void *buf = rte_zmalloc_socket(tag, size, align, socket_id);
+
+	if (buf == NULL && socket_id != NVME_SOCKET_ID_ANY) {
+		buf = rte_zmalloc_socket(tag, size, align, NVME_SOCKET_ID_ANY);
+	}
+	*phys_addr = rte_malloc_virt2phy(buf);
+	return buf;
+}
+
+/**
+ * Return the NUMA socket of the calling thread's lcore.
+ */
+#define nvme_get_socket_id()		((int)rte_socket_id())
+
 /**
  * Free a memory buffer previously allocated with nvme_malloc.
  */
@@ -110,13 +140,42 @@ nvme_malloc(const char *tag, size_t size, unsigned align, uint64_t *phys_addr)
  * Return the physical address for the specified virtual address.
  */
 #define nvme_vtophys(buf)		spdk_vtophys(buf)
+
+/**
+ * Return the physical address for the specified virtual address, and reduce
+ *  *size to the length of the physically contiguous extent starting there.
+ */
+#define nvme_vtophys_range(buf, size)	spdk_vtophys_range(buf, size)
 #define NVME_VTOPHYS_ERROR		SPDK_VTOPHYS_ERROR
 
+/**
+ * Return the virtual address for the specified physical address, or NULL
+ *  if it is not part of the memory handed out by nvme_malloc().
+ *  This is only used by the software controller to access queues and
+ *  data buffers the driver describes by physical address.
+ */
+static inline void *
+nvme_phys_to_virt(uint64_t phys_addr)
+{
+	const struct rte_memseg *seg = rte_eal_get_physmem_layout();
+	int i;
+
+	for (i = 0; i < RTE_MAX_MEMSEG && seg[i].addr != NULL; i++) {
+		if (phys_addr >= seg[i].phys_addr && phys_addr - seg[i].phys_addr < seg[i].len) {
+			return (uint8_t *)seg[i].addr + (phys_addr - seg[i].phys_addr);
+		}
+	}
+
+	return NULL;
+}
+
 extern struct rte_mempool *request_mempool;
 
 /**
  * Return a buffer for an nvme_request object.  These objects are allocated
  *  for each I/O.  They do not need to be pinned nor physically contiguous.
+ *  I/O qpairs keep their own cache of requests and only use this when
+ *  their cache is exhausted.
  */
 #define nvme_alloc_request(bufp)	rte_mempool_get(request_mempool, (void **)(bufp));
 
@@ -125,6 +184,12 @@ extern struct rte_mempool *request_mempool;
  */
 #define nvme_dealloc_request(buf)	rte_mempool_put(request_mempool, buf)
 
+/**
+ * Get n nvme_request buffers at once; either all of them are returned in bufs
+ *  (and 0 is returned) or none are.
+ */
+#define nvme_alloc_request_bulk(bufs, n)	rte_mempool_get_bulk(request_mempool, (void **)(bufs), n)
+
 /**
  * Get a monotonic timestamp counter (used for measuring timeouts during initialization).
  */
@@ -135,6 +200,11 @@ extern struct rte_mempool *request_mempool;
  */
 #define nvme_get_tsc_hz()		rte_get_timer_hz()
 
+/**
+ * Hint that the cache line containing addr will be read soon.
+ */
+#define nvme_prefetch(addr)		rte_prefetch0(addr)
+
 /**
  *
  */
@@ -67,14 +67,14 @@
  */
 #define NVME_INTEL_QUIRK_WRITE_LATENCY 0x2
 
-#define NVME_MAX_PRP_LIST_ENTRIES	(506)
+#define NVME_MAX_PRP_LIST_ENTRIES	(512)
 
 /*
  * For commands requiring more than 2 PRP entries, one PRP will be
  *  embedded in the command (prp1), and the rest of the PRP entries
  *  will be in a list pointed to by the command (prp2).  This means
- *  that real max number of PRP entries we support is 506+1, which
- *  results in a max xfer size of 506*PAGE_SIZE.
+ *  that real max number of PRP entries we support is 512+1, which
+ *  results in a max xfer size of 512*PAGE_SIZE.
  */
 #define NVME_MAX_XFER_SIZE	NVME_MAX_PRP_LIST_ENTRIES * PAGE_SIZE
 
@@ -97,11 +97,31 @@
 #define NVME_MIN_IO_TRACKERS	(4)
 #define NVME_MAX_IO_TRACKERS	(1024)
 
+/*
+ * Most commands need at most two PRP entries (or one SGL descriptor), which fit
+ *  in the command itself, so PRP/SGL list pages are kept in a separate per-qpair
+ *  pool and only attached to a tracker when a request needs one.  I/O qpairs get
+ *  one page per tracker unless spdk_nvme_ctrlr_opts::io_queue_prp_lists asks for
+ *  fewer.  Requests that cannot get a list page wait on the qpair's queued_req
+ *  list, the same as requests that cannot get a tracker.
+ */
+#define NVME_ADMIN_PRP_LISTS		(4)
+
+/* Tracker prp_list value meaning no PRP/SGL list page is attached. */
+#define NVME_NO_PRP_LIST		(0xFFFF)
+
 /*
  * NVME_MAX_SGL_DESCRIPTORS defines the maximum number of descriptors in one SGL
  *  segment.
  */
-#define NVME_MAX_SGL_DESCRIPTORS	(253)
+#define NVME_MAX_SGL_DESCRIPTORS	(256)
+
+/*
+ * NVME_MAX_SGL_SEGMENTS defines the maximum number of list pages one request
+ *  may chain together for a hardware SGL.  Every segment but the last gives
+ *  up its final descriptor to point at the next one.
+ */
+#define NVME_MAX_SGL_SEGMENTS		(8)
 
 /*
  * NVME_MAX_IO_ENTRIES is not defined, since it is specified in CC.MQES
@@ -116,6 +136,12 @@
 /* Maximum log page size to fetch for AERs. */
 #define NVME_MAX_AER_LOG_SIZE		(4096)
 
+/*
+ * Number of completion queue entries scanned and prefetched ahead of running
+ *  their callbacks in spdk_nvme_qpair_process_completions().
+ */
+#define NVME_COMPLETION_BATCH_SIZE	(32)
+
 /*
  * NVME_MAX_IO_QUEUES in nvme_spec.h defines the 64K spec-limit, but this
  *  define specifies the maximum number of queues this driver will actually
@@ -131,6 +157,9 @@ enum nvme_payload_type {
 
 	/** nvme_request::u.sgl is valid for this request */
 	NVME_PAYLOAD_TYPE_SGL,
+
+	/** nvme_request::u.iov is valid for this request */
+	NVME_PAYLOAD_TYPE_IOV,
 };
 
 /*
@@ -158,6 +187,16 @@ struct __attribute__((packed)) nvme_payload {
 			spdk_nvme_req_next_sge_cb next_sge_fn;
 			void *cb_arg;
 		} sgl;
+
+		/**
+		 * Caller's iovec array, walked directly by the driver, and optionally
+		 *  the physical address of each element's iov_base.
+		 */
+		struct {
+			const struct iovec *iov;
+			const uint64_t *phys;
+			uint32_t iovcnt;
+		} iov;
 	} u;
 
 	/** Virtual memory address of a single physically contiguous metadata buffer */
@@ -170,6 +209,12 @@ struct __attribute__((packed)) nvme_payload {
 struct nvme_request {
 	struct spdk_nvme_cmd		cmd;
 
+	/*
+	 * The members from here up to stailq are everything a non-split request
+	 *  touches between allocation and completion, and fill exactly the one
+	 *  cacheline following cmd.
+	 */
+
 	/**
 	 * Data payload for this request's command.
 	 */
@@ -193,16 +238,20 @@ struct nvme_request {
 
 	spdk_nvme_cmd_cb		cb_fn;
 	void				*cb_arg;
-	STAILQ_ENTRY(nvme_request)	stailq;
 
 	/**
 	 * The following members should not be reordered with members
-	 *  above.  These members are only needed when splitting
-	 *  requests which is done rarely, and the driver is careful
-	 *  to not touch the following fields until a split operation is
-	 *  needed, to avoid touching an extra cacheline.
+	 *  above.  These members are only needed when a request must wait
+	 *  for a tracker or is split, which is done rarely, and the driver
+	 *  is careful to not touch the following fields until then, to
+	 *  avoid touching an extra cacheline.
 	 */
 
+	/**
+	 * Linked-list pointers for spdk_nvme_qpair::queued_req.
+	 */
+	STAILQ_ENTRY(nvme_request)	stailq;
+
 	/**
 	 * Points to the outstanding child requests for a parent request.
 	 *  Only valid if a request was split into multiple children
@@ -230,6 +279,278 @@ struct nvme_request {
 	 */
 	struct spdk_nvme_cpl		parent_status;
 };
+SPDK_STATIC_ASSERT(offsetof(struct nvme_request, stailq) == 128,
+		   "nvme_request fast path fields are not one cacheline after cmd");
+SPDK_STATIC_ASSERT((sizeof(struct nvme_request) & 63) == 0,
+		   "nvme_request is not a multiple of the cacheline size");
+
+/*
+ * Per-qpair cache of preallocated requests.  Like the rest of an I/O qpair, it is
+ *  only used by the thread that owns the qpair, so no locking is needed.
+ */
+struct nvme_request_cache {
+	/* Backing array of num_reqs requests. */
+	struct nvme_request		*reqs;
+	uint32_t			num_reqs;
+	uint32_t			num_free;
+
+	/* Stack of free requests; the next one to use is free_reqs[num_free - 1]. */
+	struct nvme_request		*free_reqs[];
+};
+
+/*
+ * Token bucket for rate limiting.  Tokens may go negative when a command
+ *  larger than the remaining budget is admitted; the debt is paid back
+ *  before the next command.
+ */
+struct nvme_token_bucket {
+	/* Tokens added per second, or 0 if this bucket does not limit anything. */
+	uint64_t			rate;
+	int64_t				tokens;
+	int64_t				max_tokens;
+	uint64_t			last_tick;
+};
+
+enum nvme_qos_bucket {
+	NVME_QOS_READ_IOPS		= 0,
+	NVME_QOS_WRITE_IOPS		= 1,
+	NVME_QOS_READ_BPS		= 2,
+	NVME_QOS_WRITE_BPS		= 3,
+	NVME_QOS_NUM_BUCKETS		= 4,
+};
+
+/*
+ * Buckets hold 1/NVME_QOS_BURST_DIVISOR of a second worth of tokens, which
+ *  bounds the burst size.
+ */
+#define NVME_QOS_BURST_DIVISOR		100
+
+struct nvme_qos {
+	struct nvme_token_bucket	bucket[NVME_QOS_NUM_BUCKETS];
+
+	/* Only used for namespace limits, which are shared by all qpairs. */
+	nvme_mutex_t			lock;
+};
+
+/*
+ * Commands gathered on a qpair into one batch that is sent as a single
+ *  command, and the callbacks to call when it completes.  Shared by deallocate
+ *  coalescing and write merging, whose batches embed struct nvme_batch as
+ *  their first member.
+ */
+struct nvme_batch_cb {
+	spdk_nvme_cmd_cb	cb_fn;
+	void			*cb_arg;
+};
+
+struct nvme_batch {
+	struct nvme_batcher		*batcher;
+	struct spdk_nvme_ns		*ns;
+
+	/* Callbacks of the commands in the batch, room for max_cbs. */
+	struct nvme_batch_cb		*cbs;
+	uint16_t			num_cbs;
+	uint16_t			max_cbs;
+
+	/* Set while the batch's command is outstanding. */
+	bool				in_flight;
+
+	/* Time the batch was opened, in nvme_get_tsc() ticks. */
+	uint64_t			first_tick;
+
+	STAILQ_ENTRY(nvme_batch)	stailq;
+};
+
+struct nvme_batcher {
+	struct spdk_nvme_qpair		*qpair;
+
+	/* Longest time a command may wait in the open batch, in nvme_get_tsc() ticks. */
+	uint64_t			window_ticks;
+
+	/* Batch that new commands are added to, or NULL. */
+	struct nvme_batch		*open;
+
+	uint32_t			num_in_flight;
+	STAILQ_HEAD(, nvme_batch)	free_batches;
+
+	/*
+	 * Allocate the command that sends batch, with cb_fn and batch as its
+	 *  callback.  Returns NULL if no request is available.
+	 */
+	struct nvme_request		*(*build_request)(struct nvme_batch *batch, spdk_nvme_cmd_cb cb_fn);
+};
+
+#define NVME_DSM_COALESCE_MAX_CBS	SPDK_NVME_DATASET_MANAGEMENT_MAX_RANGES
+#define NVME_DSM_COALESCE_BATCHES	4
+
+struct nvme_dsm_batch {
+	struct nvme_batch		batch;
+
+	/* One DMA-able page holding up to SPDK_NVME_DATASET_MANAGEMENT_MAX_RANGES ranges. */
+	struct spdk_nvme_dsm_range	*ranges;
+	uint16_t			num_ranges;
+
+	struct nvme_batch_cb		cbs[NVME_DSM_COALESCE_MAX_CBS];
+};
+
+struct nvme_dsm_coalesce {
+	struct nvme_batcher		batcher;
+
+	/* Ranges that make a batch full, or 0 once coalescing has been disabled. */
+	uint16_t			max_ranges;
+
+	struct nvme_dsm_batch		batches[NVME_DSM_COALESCE_BATCHES];
+};
+
+#define NVME_WRITE_MERGE_BATCHES	4
+
+struct nvme_write_merge_batch {
+	struct nvme_batch		batch;
+	uint64_t			lba;
+	uint32_t			lba_count;
+	uint32_t			io_flags;
+
+	/* Buffers of the writes, with virtually contiguous ones combined. */
+	uint16_t			iovcnt;
+	struct iovec			iov[SPDK_NVME_QPAIR_MAX_MERGED_WRITES];
+
+	struct nvme_batch_cb		cbs[SPDK_NVME_QPAIR_MAX_MERGED_WRITES];
+};
+
+struct nvme_write_merge {
+	struct nvme_batcher		batcher;
+
+	/* Writes that make a batch full, or 0 once merging has been disabled. */
+	uint16_t			max_writes;
+
+	struct nvme_write_merge_batch	batches[NVME_WRITE_MERGE_BATCHES];
+};
+
+/*
+ * Per-qpair cache of 4 KiB blocks read with spdk_nvme_ns_cmd_read(), keyed by
+ *  namespace and starting LBA.
+ */
+#define NVME_READ_CACHE_BLOCK_SIZE	4096
+#define NVME_READ_CACHE_NO_ENTRY	UINT32_MAX
+
+struct nvme_read_cache_entry {
+	struct nvme_read_cache		*cache;
+
+	/* Namespace of the cached block, or NULL if the entry is unused. */
+	struct spdk_nvme_ns		*ns;
+	uint64_t			lba;
+
+	/* Set while the block is being read from the namespace. */
+	bool				filling;
+
+	/* Set if the block was written while it was being read. */
+	bool				stale;
+
+	/* Namespace write epoch of the block when its fill was submitted. */
+	uint32_t			write_epoch;
+
+	/* CLOCK reference bit, set on every hit. */
+	bool				referenced;
+
+	/* The read that caused the fill, completed when the fill does. */
+	void				*buffer;
+	spdk_nvme_cmd_cb		cb_fn;
+	void				*cb_arg;
+};
+
+struct nvme_read_cache {
+	struct spdk_nvme_qpair		*qpair;
+	uint32_t			num_entries;
+	uint32_t			clock_hand;
+	uint32_t			num_filling;
+
+	/* Open-addressing hash index of entry numbers, linearly probed. */
+	uint32_t			*index;
+	uint32_t			index_mask;
+
+	struct nvme_read_cache_entry	*entries;
+
+	/* One DMA-able block of NVME_READ_CACHE_BLOCK_SIZE bytes per entry. */
+	uint8_t				*blocks;
+
+	struct spdk_nvme_read_cache_stats	stats;
+};
+
+/*
+ * Per-qpair sequential readahead for spdk_nvme_ns_cmd_read().  Streams are
+ *  recognized by the LBA where they will continue, and data is read ahead of
+ *  them into a pool of buffers of SPDK_NVME_READAHEAD_BUFFER_SIZE bytes.
+ */
+#define NVME_READAHEAD_MIN_SEQ_READS		2
+#define NVME_READAHEAD_INITIAL_WINDOW_READS	4
+#define NVME_READAHEAD_MAX_STREAMS		256
+#define NVME_READAHEAD_MAX_WINDOW_SIZE		(16 * 1024 * 1024)
+
+struct nvme_readahead_stream {
+	/* Namespace of the stream, or NULL if the slot is unused. */
+	struct spdk_nvme_ns		*ns;
+
+	/* LBA the next read of the stream is expected at. */
+	uint64_t			next_lba;
+
+	/* First LBA not read ahead yet. */
+	uint64_t			ra_lba;
+
+	/* Sectors to keep read ahead of next_lba, or 0 before the stream is sequential. */
+	uint32_t			window;
+
+	/* Reads of the stream so far, each starting where the previous one ended. */
+	uint32_t			seq_reads;
+
+	uint64_t			last_use;
+};
+
+struct nvme_readahead_buffer {
+	struct nvme_readahead		*ra;
+
+	/* Namespace of the data, or NULL if the buffer is unused. */
+	struct spdk_nvme_ns		*ns;
+	uint64_t			lba;
+	uint32_t			lba_count;
+
+	/* Set while the data is being read from the namespace. */
+	bool				filling;
+
+	/* Set if the range was written while it was being read. */
+	bool				stale;
+
+	/* nvme_ns_get_write_epoch() of the range when the fill was issued. */
+	uint32_t			write_epoch;
+
+	/* Least recently used buffers are reused first; 0 once fully consumed. */
+	uint64_t			last_use;
+
+	uint8_t				*data;
+
+	/*
+	 * Reads waiting for the fill.  Each null request keeps the caller's buffer in
+	 *  payload.u.contig, the length in payload_size and the offset into data in
+	 *  payload_offset.
+	 */
+	STAILQ_HEAD(, nvme_request)	waiters;
+};
+
+struct nvme_readahead {
+	struct spdk_nvme_qpair		*qpair;
+	uint32_t			num_streams;
+	uint32_t			num_buffers;
+	uint32_t			max_window_size;
+	uint32_t			num_filling;
+	uint64_t			clock;
+
+	struct nvme_readahead_stream	*streams;
+	struct nvme_readahead_buffer	*buffers;
+
+	/* One DMA-able allocation split into the buffers. */
+	uint8_t				*data;
+
+	struct spdk_nvme_readahead_stats	stats;
+};
 
 struct nvme_completion_poll_status {
 	struct spdk_nvme_cpl	cpl;
@@ -243,32 +564,64 @@ struct nvme_async_event_request {
 };
 
 struct nvme_tracker {
-	LIST_ENTRY(nvme_tracker)	list;
-
 	struct nvme_request		*req;
+
+	/* nvme_get_tsc() value when the command was submitted, if timeouts or latency tracking are enabled */
+	uint64_t			submit_tick;
+
 	uint16_t			cid;
 
-	uint16_t			rsvd1: 15;
+	/* Index into spdk_nvme_qpair::prp_list, or NVME_NO_PRP_LIST */
+	uint16_t			prp_list;
+
+	uint16_t			rsvd1: 14;
+	uint16_t			timed_out: 1;
 	uint16_t			active: 1;
 
-	uint32_t			rsvd2;
+	uint16_t			rsvd2;
 
-	uint64_t			prp_sgl_bus_addr;
+	/* submit_tick plus the predicted service time, if hybrid polling is enabled */
+	uint64_t			expected_tick;
+};
+/*
+ * struct nvme_tracker is padded to a power of 2 so that trackers in tr[] never
+ *  straddle a cacheline.
+ */
+SPDK_STATIC_ASSERT(sizeof(struct nvme_tracker) == 32, "nvme_tracker is not 32 bytes");
 
+/*
+ * A PRP list or SGL segment for one command.  Each one is exactly one 4K page,
+ *  so a PRP list never crosses a page boundary.
+ */
+struct nvme_prp_list {
 	union {
 		uint64_t			prp[NVME_MAX_PRP_LIST_ENTRIES];
 		struct spdk_nvme_sgl_descriptor	sgl[NVME_MAX_SGL_DESCRIPTORS];
 	} u;
-
-	uint64_t			rsvd3;
 };
+SPDK_STATIC_ASSERT(sizeof(struct nvme_prp_list) == 4096, "nvme_prp_list is not 4K");
+
 /*
- * struct nvme_tracker must be exactly 4K so that the prp[] array does not cross a page boundary
- * and so that there is no padding required to meet alignment requirements.
+ * Hybrid polling keeps a separate service time estimate for each power-of-two
+ *  multiple of 4 KB, up to NVME_HYBRID_POLL_SIZE_CLASSES - 1.
  */
-SPDK_STATIC_ASSERT(sizeof(struct nvme_tracker) == 4096, "nvme_tracker is not 4K");
-SPDK_STATIC_ASSERT((offsetof(struct nvme_tracker, u.sgl) & 7) == 0, "SGL must be Qword aligned");
+#define NVME_HYBRID_POLL_SIZE_CLASSES	(8)
 
+struct nvme_hybrid_poll {
+	/* EWMA of submission-to-completion ticks per size class (0 = no samples yet). */
+	uint64_t			ewma_ticks[NVME_HYBRID_POLL_SIZE_CLASSES];
+
+	/* Earliest expected_tick of any outstanding command, or UINT64_MAX if none. */
+	uint64_t			earliest_tick;
+
+	/* Set when the command that defined earliest_tick completes. */
+	bool				earliest_stale;
+
+	/* Minimum sleep, and how early to wake before the expected completion. */
+	uint64_t			min_sleep_ticks;
+
+	uint64_t			num_sleeps;
+};
 
 struct spdk_nvme_qpair {
 	volatile uint32_t		*sq_tdbl;
@@ -284,14 +637,23 @@ struct spdk_nvme_qpair {
 	 */
 	struct spdk_nvme_cpl		*cpl;
 
-	LIST_HEAD(, nvme_tracker)	free_tr;
-	LIST_HEAD(, nvme_tracker)	outstanding_tr;
-
 	/**
 	 * Array of trackers indexed by command ID.
 	 */
 	struct nvme_tracker		*tr;
 
+	/**
+	 * Stack of free tracker indices; the next tracker to use is
+	 *  free_tr[num_free_tr - 1].
+	 */
+	uint16_t			*free_tr;
+
+	/**
+	 * Pool of PRP/SGL list pages and the stack of free indices into it.
+	 */
+	struct nvme_prp_list		*prp_list;
+	uint16_t			*free_prp_list;
+
 	STAILQ_HEAD(, nvme_request)	queued_req;
 
 	uint16_t			id;
@@ -300,18 +662,124 @@ struct spdk_nvme_qpair {
 	uint16_t			sq_tail;
 	uint16_t			cq_head;
 
+	uint16_t			num_free_tr;
+	uint16_t			num_free_prp_list;
+
 	uint8_t				phase;
 
 	bool				is_enabled;
-	bool				sq_in_cmb;
+
+	/*
+	 * When delay_sq_doorbell is set, submissions only advance sq_tail and the
+	 *  SQ tail doorbell is written once per batch by nvme_qpair_ring_sq_doorbell().
+	 */
+	bool				delay_sq_doorbell;
+	bool				sq_doorbell_pending;
+
+	/* Set if timeout_ticks is non-zero. */
+	bool				timeouts_enabled;
+
+	/* Set if hybrid_poll is in use. */
+	bool				hybrid_polling;
+
+	/* Reject new submissions with -EAGAIN instead of queueing them when full. */
+	bool				fail_when_full;
+
+	/* Set when a submission found no free tracker; cleared when slots_cb_fn runs. */
+	bool				slots_cb_pending;
+
+	/* Set if this qpair or any namespace of its controller has QoS limits. */
+	bool				qos_enabled;
+
+	/* Set while deallocate commands are coalesced by dsm. */
+	bool				dsm_coalescing;
+
+	/* Set while LBA-adjacent writes are merged by wm. */
+	bool				write_merging;
+
+	/* Set while reads are cached by read_cache. */
+	bool				read_caching;
+
+	/* Set while sequential reads are read ahead by readahead. */
+	bool				reading_ahead;
+
+	/* Requests for I/O on this qpair, or NULL to always use the global pool. */
+	struct nvme_request_cache	*req_cache;
+
+	/* Per-class command latency buckets, or NULL if latency tracking is disabled. */
+	struct spdk_nvme_latency_histogram	*latency_histogram;
 
 	/*
 	 * Fields below this point should not be touched on the normal I/O happy path.
 	 */
 
+	struct spdk_nvme_ctrlr		*ctrlr;
+
+	/*
+	 * Number of SQ tail doorbell writes.  Kept next to ctrlr rather than in the hot
+	 *  fields above; it is only touched alongside an uncached MMIO write.
+	 */
+	uint64_t			num_sq_doorbell_writes;
+
 	uint8_t				qprio;
 
-	struct spdk_nvme_ctrlr		*ctrlr;
+	/* Set if the submission queue is in the controller memory buffer. */
+	bool				sq_in_cmb;
+
+	/* Set when the head of queued_req was put back for lack of a PRP/SGL list page. */
+	bool				queued_req_wait_prp_list;
+
+	uint16_t			num_trackers;
+	uint16_t			num_prp_lists;
+
+	/* NUMA socket the queues, trackers, list pages and request cache are allocated on. */
+	int				socket_id;
+
+	/* Bus address of prp_list[0]; only needed by requests that use a list page. */
+	uint64_t			prp_list_bus_addr;
+
+	/*
+	 * Next list page chained after each prp_list entry by a multi-segment SGL,
+	 *  or NVME_NO_PRP_LIST.
+	 */
+	uint16_t			*prp_list_next;
+
+	/* I/O timeout in nvme_get_tsc() ticks (0 = disabled). */
+	uint64_t			timeout_ticks;
+
+	/* Next time outstanding trackers should be checked against timeout_ticks. */
+	uint64_t			next_timeout_check_tick;
+
+	/* Service time estimates for hybrid polling, or NULL if it is disabled. */
+	struct nvme_hybrid_poll		*hybrid_poll;
+
+	/* Called when submission slots free up after the queue pair was full. */
+	spdk_nvme_qpair_slots_available_cb	slots_cb_fn;
+	void				*slots_cb_arg;
+
+	/* Rate limits of this qpair, or NULL if it has none. */
+	struct nvme_qos			*qos;
+
+	/* Read and write requests held back by QoS limits, in submission order. */
+	STAILQ_HEAD(, nvme_request)	qos_deferred_req;
+
+	/* Deallocate coalescing state, or NULL if it was never enabled. */
+	struct nvme_dsm_coalesce	*dsm;
+
+	/* Write merging state, or NULL if it was never enabled. */
+	struct nvme_write_merge		*wm;
+
+	/* Read cache, or NULL if it is not enabled. */
+	struct nvme_read_cache		*read_cache;
+
+	/* Readahead state, or NULL if it is not enabled. */
+	struct nvme_readahead		*readahead;
+
+	/*
+	 * Null requests of read cache and readahead hits, whose data was copied at
+	 *  submission, completed from process_completions.
+	 */
+	STAILQ_HEAD(, nvme_request)	hits;
 
 	/* List entry for spdk_nvme_ctrlr::free_io_qpairs and active_io_qpairs */
 	TAILQ_ENTRY(spdk_nvme_qpair)	tailq;
@@ -320,8 +788,13 @@ struct spdk_nvme_qpair {
 	uint64_t			cpl_bus_addr;
 };
 
+#define NVME_NS_WRITE_EPOCHS		256
+#define NVME_NS_WRITE_EPOCH_SHIFT	17	/* 128 KiB regions */
+
 struct spdk_nvme_ns {
 	struct spdk_nvme_ctrlr		*ctrlr;
+	/* Rate limits shared by all qpairs, or NULL if none were ever set. */
+	struct nvme_qos			*qos;
 	uint32_t			stripe_size;
 	uint32_t			sector_size;
 	uint32_t			md_size;
@@ -330,6 +803,20 @@ struct spdk_nvme_ns {
 	uint32_t			sectors_per_stripe;
 	uint16_t			id;
 	uint16_t			flags;
+
+	/* Protection information is in the first 8 bytes of the metadata (DPS.md_start). */
+	bool				pi_md_start;
+
+	/* Generate and verify protection information in software; see spdk_nvme_ns_set_sw_pi(). */
+	bool				sw_pi;
+
+	/*
+	 * Write epochs of LBA regions, hashed by region.  While any qpair of the
+	 *  controller caches reads, every write on any qpair bumps the epochs of
+	 *  the regions it covers when it is submitted and when it completes, so
+	 *  that cached data can be checked against writes through other qpairs.
+	 */
+	uint32_t			write_epoch[NVME_NS_WRITE_EPOCHS];
 };
 
 /**
@@ -356,6 +843,66 @@ enum nvme_ctrlr_state {
 	 */
 	NVME_CTRLR_STATE_ENABLE_WAIT_FOR_READY_1,
 
+	/**
+	 * Send the Identify Controller command.
+	 */
+	NVME_CTRLR_STATE_IDENTIFY,
+
+	/**
+	 * Waiting for the Identify Controller command to complete.
+	 */
+	NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY,
+
+	/**
+	 * Send the Set Features (Number of Queues) command.
+	 */
+	NVME_CTRLR_STATE_SET_NUM_QUEUES,
+
+	/**
+	 * Waiting for the Set Features (Number of Queues) command to complete.
+	 */
+	NVME_CTRLR_STATE_WAIT_FOR_SET_NUM_QUEUES,
+
+	/**
+	 * Construct the I/O queue pairs and namespaces.
+	 */
+	NVME_CTRLR_STATE_CONSTRUCT_NS,
+
+	/**
+	 * Send an Identify Namespace command for every namespace.
+	 */
+	NVME_CTRLR_STATE_IDENTIFY_NS,
+
+	/**
+	 * Waiting for all of the Identify Namespace commands to complete.
+	 */
+	NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS,
+
+	/**
+	 * Send the Set Features (Asynchronous Event Configuration) command.
+	 */
+	NVME_CTRLR_STATE_CONFIGURE_AER,
+
+	/**
+	 * Waiting for the Set Features (Asynchronous Event Configuration) command to complete.
+	 */
+	NVME_CTRLR_STATE_WAIT_FOR_CONFIGURE_AER,
+
+	/**
+	 * Determine the supported log pages, reading vendor log page directories if needed.
+	 */
+	NVME_CTRLR_STATE_SET_SUPPORTED_LOG_PAGES,
+
+	/**
+	 * Waiting for the vendor log page directory to be read.
+	 */
+	NVME_CTRLR_STATE_WAIT_FOR_SUPPORTED_LOG_PAGES,
+
+	/**
+	 * Determine the supported features.
+	 */
+	NVME_CTRLR_STATE_SET_SUPPORTED_FEATURES,
+
 	/**
 	 * Controller initialization has completed and the controller is ready.
 	 */
@@ -385,6 +932,9 @@ struct spdk_nvme_ctrlr {
 
 	bool				is_failed;
 
+	/** I/O qpairs with a read cache or readahead; writes bump namespace write epochs while nonzero */
+	uint32_t			num_caching_qpairs;
+
 	/** Controller support flags */
 	uint64_t			flags;
 
@@ -393,6 +943,15 @@ struct spdk_nvme_ctrlr {
 	enum nvme_ctrlr_state		state;
 	uint64_t			state_timeout_tsc;
 
+	/** Admin commands of the current initialization step that have not completed */
+	uint32_t			num_init_cmds;
+
+	/** Completion of the current initialization step; the first error if any failed */
+	struct spdk_nvme_cpl		init_cpl;
+
+	/** Intel log page directory, while it is being read during initialization */
+	struct spdk_nvme_intel_log_page_directory	*log_page_directory;
+
 	TAILQ_ENTRY(spdk_nvme_ctrlr)	tailq;
 
 	/** All the log pages supported */
@@ -404,6 +963,9 @@ struct spdk_nvme_ctrlr {
 	/* Opaque handle to associated PCI device. */
 	struct spdk_pci_device		*devhandle;
 
+	/** Software controller backing this controller, or NULL for a PCI device */
+	struct spdk_nvme_sw_ctrlr		*sw_dev;
+
 	/** maximum i/o size in bytes */
 	uint32_t			max_xfer_size;
 
@@ -439,6 +1001,9 @@ struct spdk_nvme_ctrlr {
 	TAILQ_HEAD(, spdk_nvme_qpair)	free_io_qpairs;
 	TAILQ_HEAD(, spdk_nvme_qpair)	active_io_qpairs;
 
+	/** Set once any namespace has had QoS limits; new I/O qpairs then check them. */
+	bool				ns_qos_enabled;
+
 	struct spdk_nvme_ctrlr_opts	opts;
 
 	/** BAR mapping address which contains controller memory buffer */
@@ -467,6 +1032,7 @@ struct pci_id {
 extern struct nvme_driver g_nvme_driver;
 
 #define nvme_min(a,b) (((a)<(b))?(a):(b))
+#define nvme_max(a,b) (((a)>(b))?(a):(b))
 
 #define INTEL_DC_P3X00_DEVID	0x09538086
 
@@ -500,6 +1066,21 @@ nvme_align32pow2(uint32_t x)
 	return 1u << (1 + nvme_u32log2(x - 1));
 }
 
+/*
+ * Number of sectors from lba up to the next multiple of boundary.  Stripe
+ *  sizes are usually powers of two, but the optimal I/O boundary reported
+ *  by the namespace does not have to be.
+ */
+static inline uint32_t
+nvme_ns_sectors_to_boundary(uint64_t lba, uint32_t boundary)
+{
+	if ((boundary & (boundary - 1)) == 0) {
+		return boundary - (lba & (boundary - 1));
+	}
+
+	return boundary - (lba % boundary);
+}
+
 /* Admin functions */
 int	nvme_ctrlr_cmd_identify_controller(struct spdk_nvme_ctrlr *ctrlr,
 		void *payload,
@@ -555,25 +1136,141 @@ int	nvme_ctrlr_alloc_cmb(struct spdk_nvme_ctrlr *ctrlr, uint64_t length, uint64_
 int	nvme_qpair_construct(struct spdk_nvme_qpair *qpair, uint16_t id,
 			     uint16_t num_entries,
 			     uint16_t num_trackers,
-			     struct spdk_nvme_ctrlr *ctrlr);
+			     struct spdk_nvme_ctrlr *ctrlr,
+			     int socket_id);
 void	nvme_qpair_destroy(struct spdk_nvme_qpair *qpair);
 void	nvme_qpair_enable(struct spdk_nvme_qpair *qpair);
 void	nvme_qpair_disable(struct spdk_nvme_qpair *qpair);
 int	nvme_qpair_submit_request(struct spdk_nvme_qpair *qpair,
 				  struct nvme_request *req);
 void	nvme_qpair_reset(struct spdk_nvme_qpair *qpair);
+void	nvme_qpair_ring_sq_doorbell(struct spdk_nvme_qpair *qpair);
 void	nvme_qpair_fail(struct spdk_nvme_qpair *qpair);
+void	nvme_qpair_qos_release(struct spdk_nvme_qpair *qpair);
+
+bool	nvme_qos_admit(struct spdk_nvme_qpair *qpair, struct nvme_request *req, bool deferred);
+void	nvme_qos_destroy(struct nvme_qos *qos);
+
+void	nvme_batcher_init(struct nvme_batcher *batcher, struct spdk_nvme_qpair *qpair,
+			  struct nvme_request *(*build_request)(struct nvme_batch *batch, spdk_nvme_cmd_cb cb_fn));
+void	nvme_batcher_add_batch(struct nvme_batcher *batcher, struct nvme_batch *batch,
+			       struct nvme_batch_cb *cbs, uint16_t max_cbs);
+void	nvme_batcher_set_window(struct nvme_batcher *batcher, uint32_t window_us);
+struct nvme_batch *nvme_batcher_open_batch(struct nvme_batcher *batcher, struct spdk_nvme_ns *ns);
+void	nvme_batch_add_cb(struct nvme_batch *batch, spdk_nvme_cmd_cb cb_fn, void *cb_arg);
+int	nvme_batcher_submit_open(struct nvme_batcher *batcher);
+void	nvme_batcher_poll(struct nvme_batcher *batcher);
+void	nvme_batcher_flush(struct nvme_batcher *batcher);
+void	nvme_batcher_fail(struct nvme_batcher *batcher);
+
+int	nvme_qpair_dsm_deallocate(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+				  const struct spdk_nvme_dsm_range *ranges, uint16_t num_ranges,
+				  spdk_nvme_cmd_cb cb_fn, void *cb_arg);
+void	nvme_qpair_dsm_destroy(struct spdk_nvme_qpair *qpair);
+
+int	nvme_qpair_write_merge(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+			       void *buffer, uint64_t lba, uint32_t lba_count,
+			       spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags);
+void	nvme_qpair_write_merge_destroy(struct spdk_nvme_qpair *qpair);
+
+int	nvme_qpair_read_cache_read(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+				   void *buffer, uint64_t lba, uint32_t lba_count,
+				   spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags);
+void	nvme_qpair_read_cache_invalidate(struct spdk_nvme_qpair *qpair,
+		const struct nvme_request *req);
+void	nvme_qpair_read_cache_destroy(struct spdk_nvme_qpair *qpair);
+
+int	nvme_qpair_readahead_read(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+				  void *buffer, uint64_t lba, uint32_t lba_count,
+				  spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags);
+void	nvme_qpair_readahead_invalidate(struct spdk_nvme_qpair *qpair,
+					const struct nvme_request *req);
+void	nvme_qpair_readahead_destroy(struct spdk_nvme_qpair *qpair);
+
+typedef void (*nvme_lba_range_fn)(void *ctx, struct spdk_nvme_ns *ns, uint64_t lba,
+				  uint64_t lba_count);
+void	nvme_request_foreach_written_range(struct spdk_nvme_qpair *qpair,
+		const struct nvme_request *req,
+		nvme_lba_range_fn fn, void *ctx);
+
+static inline uint64_t
+nvme_ns_write_epoch_region(const struct spdk_nvme_ns *ns, uint64_t lba)
+{
+	return (lba * ns->sector_size) >> NVME_NS_WRITE_EPOCH_SHIFT;
+}
+
+/* An nvme_lba_range_fn that bumps the write epochs of the range. */
+static inline void
+nvme_ns_bump_write_epoch(void *ctx, struct spdk_nvme_ns *ns, uint64_t lba, uint64_t lba_count)
+{
+	uint64_t first, last, r;
+
+	if (lba_count == 0) {
+		return;
+	}
+
+	first = nvme_ns_write_epoch_region(ns, lba);
+	last = nvme_ns_write_epoch_region(ns, lba + lba_count - 1);
+	if (last - first >= NVME_NS_WRITE_EPOCHS) {
+		first = 0;
+		last = NVME_NS_WRITE_EPOCHS - 1;
+	}
+
+	/* Other threads compare the epochs with those of their cached data. */
+	for (r = first; r <= last; r++) {
+		__sync_fetch_and_add(&ns->write_epoch[r % NVME_NS_WRITE_EPOCHS], 1);
+	}
+}
+
+/*
+ * Sum of the write epochs of the regions covering the range.  The epochs only
+ *  grow, so the sum changes whenever any part of the range has been written.
+ */
+static inline uint32_t
+nvme_ns_get_write_epoch(const struct spdk_nvme_ns *ns, uint64_t lba, uint64_t lba_count)
+{
+	const volatile uint32_t	*epoch = ns->write_epoch;
+	uint64_t		first, last, r;
+	uint32_t		sum = 0;
+
+	first = nvme_ns_write_epoch_region(ns, lba);
+	last = nvme_ns_write_epoch_region(ns, lba + lba_count - 1);
+	if (last - first >= NVME_NS_WRITE_EPOCHS) {
+		first = 0;
+		last = NVME_NS_WRITE_EPOCHS - 1;
+	}
+
+	for (r = first; r <= last; r++) {
+		sum += epoch[r % NVME_NS_WRITE_EPOCHS];
+	}
+
+	return sum;
+}
 
 int	nvme_ns_construct(struct spdk_nvme_ns *ns, uint16_t id,
 			  struct spdk_nvme_ctrlr *ctrlr);
+void	nvme_ns_set_identify_data(struct spdk_nvme_ns *ns);
 void	nvme_ns_destruct(struct spdk_nvme_ns *ns);
 
-struct nvme_request *nvme_allocate_request(const struct nvme_payload *payload,
+struct spdk_nvme_sw_ctrlr;
+int	nvme_sw_enumerate(int (*enum_cb)(void *enum_ctx, struct spdk_nvme_sw_ctrlr *sw_dev),
+			  void *enum_ctx);
+volatile struct spdk_nvme_registers *nvme_sw_dev_attach(struct spdk_nvme_sw_ctrlr *sw_dev);
+void	nvme_sw_dev_detach(struct spdk_nvme_sw_ctrlr *sw_dev);
+
+int	nvme_request_cache_construct(struct spdk_nvme_qpair *qpair, uint32_t num_reqs);
+void	nvme_request_cache_destroy(struct spdk_nvme_qpair *qpair);
+struct nvme_request *nvme_allocate_request(struct spdk_nvme_qpair *qpair,
+		const struct nvme_payload *payload,
 		uint32_t payload_size, spdk_nvme_cmd_cb cb_fn, void *cb_arg);
-struct nvme_request *nvme_allocate_request_null(spdk_nvme_cmd_cb cb_fn, void *cb_arg);
-struct nvme_request *nvme_allocate_request_contig(void *buffer, uint32_t payload_size,
+int	nvme_allocate_request_bulk(struct spdk_nvme_qpair *qpair, struct nvme_request **reqs,
+				   uint32_t num);
+struct nvme_request *nvme_allocate_request_null(struct spdk_nvme_qpair *qpair,
+		spdk_nvme_cmd_cb cb_fn, void *cb_arg);
+struct nvme_request *nvme_allocate_request_contig(struct spdk_nvme_qpair *qpair,
+		void *buffer, uint32_t payload_size,
 		spdk_nvme_cmd_cb cb_fn, void *cb_arg);
-void	nvme_free_request(struct nvme_request *req);
+void	nvme_free_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req);
 void	nvme_request_remove_child(struct nvme_request *parent, struct nvme_request *child);
 bool	nvme_intel_has_quirk(struct pci_id *id, uint64_t quirk);
 
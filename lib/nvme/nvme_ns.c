@@ -64,10 +64,27 @@ int nvme_ns_identify_update(struct spdk_nvme_ns *ns)
 		return -ENXIO;
 	}
 
+	nvme_ns_set_identify_data(ns);
+	return 0;
+}
+
+/*
+ * Update the namespace from its Identify Namespace data, once that has been
+ *  read into ctrlr->nsdata.
+ */
+void
+nvme_ns_set_identify_data(struct spdk_nvme_ns *ns)
+{
+	struct spdk_nvme_ns_data *nsdata = _nvme_ns_get_data(ns);
+
 	ns->sector_size = 1 << nsdata->lbaf[nsdata->flbas.format].lbads;
 
 	ns->sectors_per_max_io = spdk_nvme_ns_get_max_io_xfer_size(ns) / ns->sector_size;
 	ns->sectors_per_stripe = ns->stripe_size / ns->sector_size;
+	if (ns->sectors_per_stripe == 0) {
+		/* Split I/O at the namespace's optimal I/O boundary, if it reports one. */
+		ns->sectors_per_stripe = nsdata->noiob;
+	}
 
 	ns->flags = 0x0000;
 
@@ -89,13 +106,14 @@ int nvme_ns_identify_update(struct spdk_nvme_ns *ns)
 
 	ns->md_size = nsdata->lbaf[nsdata->flbas.format].ms;
 	ns->pi_type = SPDK_NVME_FMT_NVM_PROTECTION_DISABLE;
+	ns->pi_md_start = false;
 	if (nsdata->lbaf[nsdata->flbas.format].ms && nsdata->dps.pit) {
 		ns->flags |= SPDK_NVME_NS_DPS_PI_SUPPORTED;
 		ns->pi_type = nsdata->dps.pit;
+		ns->pi_md_start = nsdata->dps.md_start;
 		if (nsdata->flbas.extended)
 			ns->flags |= SPDK_NVME_NS_EXTENDED_LBA_SUPPORTED;
 	}
-	return rc;
 }
 
 uint32_t
@@ -171,6 +189,10 @@ spdk_nvme_ns_get_data(struct spdk_nvme_ns *ns)
 	return _nvme_ns_get_data(ns);
 }
 
+/*
+ * The Identify Namespace data is read separately by the controller's
+ *  initialization state machine, which then calls nvme_ns_set_identify_data().
+ */
 int nvme_ns_construct(struct spdk_nvme_ns *ns, uint16_t id,
 		      struct spdk_nvme_ctrlr *ctrlr)
 {
@@ -182,15 +204,21 @@ int nvme_ns_construct(struct spdk_nvme_ns *ns, uint16_t id,
 	ns->id = id;
 	ns->stripe_size = 0;
 
+	if (ctrlr->devhandle == NULL) {
+		/* Software controller - no PCI config space. */
+		return 0;
+	}
+
 	nvme_pcicfg_read32(ctrlr->devhandle, &pci_devid, 0);
 	if (pci_devid == INTEL_DC_P3X00_DEVID && ctrlr->cdata.vs[3] != 0) {
 		ns->stripe_size = (1 << ctrlr->cdata.vs[3]) * ctrlr->min_page_size;
 	}
 
-	return nvme_ns_identify_update(ns);
+	return 0;
 }
 
 void nvme_ns_destruct(struct spdk_nvme_ns *ns)
 {
-
+	nvme_qos_destroy(ns->qos);
+	ns->qos = NULL;
 }
@@ -33,11 +33,7 @@
 
 #include "nvme_internal.h"
 
-static struct nvme_request *_nvme_ns_cmd_rw(struct spdk_nvme_ns *ns,
-		const struct nvme_payload *payload, uint64_t lba,
-		uint32_t lba_count, spdk_nvme_cmd_cb cb_fn,
-		void *cb_arg, uint32_t opc, uint32_t io_flags,
-		uint16_t apptag_mask, uint16_t apptag);
+#include "spdk/dif.h"
 
 static void
 nvme_cb_complete_child(void *child_arg, const struct spdk_nvme_cpl *cpl)
@@ -55,7 +51,8 @@ nvme_cb_complete_child(void *child_arg, const struct spdk_nvme_cpl *cpl)
 		if (parent->cb_fn) {
 			parent->cb_fn(parent->cb_arg, &parent->parent_status);
 		}
-		nvme_free_request(parent);
+		/* Split parents always come from the global pool; see _nvme_ns_cmd_rw(). */
+		nvme_free_request(NULL, parent);
 	}
 }
 
@@ -93,76 +90,337 @@ nvme_request_remove_child(struct nvme_request *parent, struct nvme_request *chil
 	TAILQ_REMOVE(&parent->children, child, child_tailq);
 }
 
+/*
+ * Length of the child command starting at lba: as much of the remaining
+ *  sectors as fits below both the maximum transfer size and the next
+ *  stripe boundary.
+ */
+static inline uint32_t
+_nvme_ns_child_lba_count(uint64_t lba, uint32_t remaining_lba_count,
+			 uint32_t sectors_per_max_io, uint32_t sectors_per_stripe)
+{
+	uint32_t lba_count = nvme_min(remaining_lba_count, sectors_per_max_io);
+
+	if (sectors_per_stripe > 0) {
+		lba_count = nvme_min(lba_count, nvme_ns_sectors_to_boundary(lba, sectors_per_stripe));
+	}
+
+	return lba_count;
+}
+
+static void
+_nvme_ns_cmd_setup_request(struct spdk_nvme_ns *ns, struct nvme_request *req,
+			   uint32_t opc, uint64_t lba, uint32_t lba_count,
+			   uint32_t io_flags, uint16_t apptag_mask, uint16_t apptag)
+{
+	struct spdk_nvme_cmd	*cmd = &req->cmd;
+	uint64_t		*tmp_lba;
+
+	cmd->opc = opc;
+	cmd->nsid = ns->id;
+
+	tmp_lba = (uint64_t *)&cmd->cdw10;
+	*tmp_lba = lba;
+
+	if (ns->flags & SPDK_NVME_NS_DPS_PI_SUPPORTED) {
+		switch (ns->pi_type) {
+		case SPDK_NVME_FMT_NVM_PROTECTION_TYPE1:
+		case SPDK_NVME_FMT_NVM_PROTECTION_TYPE2:
+			cmd->cdw14 = (uint32_t)lba;
+			break;
+		}
+	}
+
+	cmd->cdw12 = lba_count - 1;
+	cmd->cdw12 |= io_flags;
+
+	cmd->cdw15 = apptag_mask;
+	cmd->cdw15 = (cmd->cdw15 << 16 | apptag);
+}
+
+/*
+ * Children are reserved this many at a time, so a typical split (a few
+ *  children) takes a single trip to the request cache or mempool.
+ */
+#define NVME_SPLIT_ALLOC_BATCH	16
+
 static struct nvme_request *
-_nvme_ns_cmd_split_request(struct spdk_nvme_ns *ns,
+_nvme_ns_cmd_split_request(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
 			   const struct nvme_payload *payload,
 			   uint64_t lba, uint32_t lba_count,
-			   spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t opc,
-			   uint32_t io_flags, struct nvme_request *req,
-			   uint32_t sectors_per_max_io, uint32_t sector_mask,
+			   uint32_t opc, uint32_t io_flags, struct nvme_request *req,
+			   uint32_t sector_size, uint32_t sectors_per_max_io,
+			   uint32_t sectors_per_stripe,
 			   uint16_t apptag_mask, uint16_t apptag)
 {
-	uint32_t		sector_size = ns->sector_size;
+	struct nvme_request	*reqs[NVME_SPLIT_ALLOC_BATCH];
 	uint32_t		md_size = ns->md_size;
 	uint32_t		remaining_lba_count = lba_count;
+	uint32_t		num_children = 0;
 	uint32_t		offset = 0;
 	uint32_t		md_offset = 0;
+	uint32_t		num, i;
+	uint64_t		child_lba = lba;
 	struct nvme_request	*child, *tmp;
 
-	if (ns->flags & SPDK_NVME_NS_DPS_PI_SUPPORTED) {
-		/* for extended LBA only */
-		if ((ns->flags & SPDK_NVME_NS_EXTENDED_LBA_SUPPORTED) && !(io_flags & SPDK_NVME_IO_FLAGS_PRACT))
-			sector_size += ns->md_size;
+	/* Count the children first so they can all be reserved up front. */
+	while (remaining_lba_count > 0) {
+		num = _nvme_ns_child_lba_count(child_lba, remaining_lba_count,
+					       sectors_per_max_io, sectors_per_stripe);
+		remaining_lba_count -= num;
+		child_lba += num;
+		num_children++;
 	}
 
-	while (remaining_lba_count > 0) {
-		lba_count = sectors_per_max_io - (lba & sector_mask);
-		lba_count = nvme_min(remaining_lba_count, lba_count);
-
-		child = _nvme_ns_cmd_rw(ns, payload, lba, lba_count, cb_fn,
-					cb_arg, opc, io_flags, apptag_mask, apptag);
-		if (child == NULL) {
-			if (req->num_children) {
-				/* free all child nvme_request  */
-				TAILQ_FOREACH_SAFE(child, &req->children,
-						   child_tailq, tmp) {
-					nvme_request_remove_child(req, child);
-					nvme_free_request(child);
-				}
+	remaining_lba_count = lba_count;
+	while (num_children > 0) {
+		num = nvme_min(num_children, NVME_SPLIT_ALLOC_BATCH);
+		if (nvme_allocate_request_bulk(qpair, reqs, num) != 0) {
+			/* free all child nvme_request  */
+			TAILQ_FOREACH_SAFE(child, &req->children, child_tailq, tmp) {
+				nvme_request_remove_child(req, child);
+				nvme_free_request(qpair, child);
 			}
+			nvme_free_request(NULL, req);
 			return NULL;
 		}
-		child->payload_offset = offset;
-		/* for separate metadata buffer only */
-		if (payload->md)
-			child->md_offset = md_offset;
-		nvme_request_add_child(req, child);
-		remaining_lba_count -= lba_count;
-		lba += lba_count;
-		offset += lba_count * sector_size;
-		md_offset += lba_count * md_size;
+
+		for (i = 0; i < num; i++) {
+			lba_count = _nvme_ns_child_lba_count(lba, remaining_lba_count,
+							     sectors_per_max_io, sectors_per_stripe);
+
+			child = reqs[i];
+			memset(child, 0, offsetof(struct nvme_request, stailq));
+			child->payload = *payload;
+			child->payload_size = lba_count * sector_size;
+			child->payload_offset = offset;
+			/* for separate metadata buffer only */
+			if (payload->md)
+				child->md_offset = md_offset;
+			_nvme_ns_cmd_setup_request(ns, child, opc, lba, lba_count, io_flags,
+						   apptag_mask, apptag);
+			nvme_request_add_child(req, child);
+
+			remaining_lba_count -= lba_count;
+			lba += lba_count;
+			offset += lba_count * sector_size;
+			md_offset += lba_count * md_size;
+		}
+		num_children -= num;
 	}
 
 	return req;
 }
 
+/*
+ * Software PI state of a read, kept in the command of a null request that is
+ *  never submitted.  The request itself keeps the caller's callback and payload.
+ */
+struct nvme_sw_pi_read {
+	struct spdk_dif_ctx	dif_ctx;
+	uint32_t		num_blocks;
+
+	/* Set while the read is being submitted; see _nvme_ns_cmd_submit_read(). */
+	bool			*completed;
+};
+SPDK_STATIC_ASSERT(sizeof(struct nvme_sw_pi_read) <= sizeof(struct spdk_nvme_cmd),
+		   "nvme_sw_pi_read does not fit in a command");
+
+static int
+_nvme_ns_sw_pi_ctx_init(struct spdk_nvme_ns *ns, struct spdk_dif_ctx *ctx, uint64_t lba,
+			uint32_t io_flags, uint16_t apptag_mask, uint16_t apptag)
+{
+	bool		md_interleave = ns->flags & SPDK_NVME_NS_EXTENDED_LBA_SUPPORTED;
+	uint32_t	dif_flags = 0;
+
+	if (io_flags & SPDK_NVME_IO_FLAGS_PRCHK_GUARD) {
+		dif_flags |= SPDK_DIF_FLAGS_GUARD_CHECK;
+	}
+	if (io_flags & SPDK_NVME_IO_FLAGS_PRCHK_APPTAG) {
+		dif_flags |= SPDK_DIF_FLAGS_APPTAG_CHECK;
+	}
+	if (io_flags & SPDK_NVME_IO_FLAGS_PRCHK_REFTAG) {
+		dif_flags |= SPDK_DIF_FLAGS_REFTAG_CHECK;
+	}
+
+	/* The reference tag of the first block is the ILBRT set up in cdw14. */
+	return spdk_dif_ctx_init(ctx, ns->sector_size + (md_interleave ? ns->md_size : 0),
+				 ns->md_size, md_interleave, ns->pi_md_start,
+				 (enum spdk_dif_type)ns->pi_type, dif_flags, (uint32_t)lba,
+				 apptag_mask, apptag);
+}
+
+static void
+nvme_ns_sw_pi_read_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct nvme_request	*pi_req = cb_arg;
+	struct nvme_sw_pi_read	*pi = (struct nvme_sw_pi_read *)&pi_req->cmd;
+	struct spdk_dif_error	err_blk;
+	struct spdk_nvme_cpl	pi_cpl;
+	int			rc;
+
+	if (!spdk_nvme_cpl_is_error(cpl)) {
+		if (pi->dif_ctx.md_interleave) {
+			rc = spdk_dif_verify(pi_req->payload.u.contig, pi->num_blocks, &pi->dif_ctx,
+					     &err_blk);
+		} else {
+			rc = spdk_dix_verify(pi_req->payload.u.contig, pi_req->payload.md,
+					     pi->num_blocks, &pi->dif_ctx, &err_blk);
+		}
+
+		if (rc != 0) {
+			pi_cpl = *cpl;
+			pi_cpl.status.sct = SPDK_NVME_SCT_MEDIA_ERROR;
+			switch (err_blk.err_type) {
+			case SPDK_DIF_GUARD_ERROR:
+				pi_cpl.status.sc = SPDK_NVME_SC_GUARD_CHECK_ERROR;
+				break;
+			case SPDK_DIF_APPTAG_ERROR:
+				pi_cpl.status.sc = SPDK_NVME_SC_APPLICATION_TAG_CHECK_ERROR;
+				break;
+			case SPDK_DIF_REFTAG_ERROR:
+				pi_cpl.status.sc = SPDK_NVME_SC_REFERENCE_TAG_CHECK_ERROR;
+				break;
+			}
+			cpl = &pi_cpl;
+		}
+	}
+
+	if (pi->completed != NULL) {
+		*pi->completed = true;
+	}
+	pi_req->cb_fn(pi_req->cb_arg, cpl);
+	nvme_free_request(NULL, pi_req);
+}
+
+/*
+ * A rejected submission may or may not have completed the request, so a read
+ *  with software PI frees its PI request only if the callback did not run.
+ *  -EAGAIN (queue pair full) and -ENXIO (controller failed) mean the read and
+ *  all of its children were freed before any was sent.  After any other error,
+ *  children of a split read that were already sent still complete it.
+ */
+static int
+_nvme_ns_cmd_submit_read(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
+{
+	struct nvme_request	*pi_req = NULL;
+	struct nvme_sw_pi_read	*pi = NULL;
+	bool			split = req->num_children != 0;
+	bool			completed = false;
+	int			rc;
+
+	if (req->cb_fn == nvme_ns_sw_pi_read_done) {
+		pi_req = req->cb_arg;
+		pi = (struct nvme_sw_pi_read *)&pi_req->cmd;
+		pi->completed = &completed;
+	}
+
+	rc = nvme_qpair_submit_request(qpair, req);
+
+	if (pi_req != NULL && !completed) {
+		pi->completed = NULL;
+		if (rc == -EAGAIN || rc == -ENXIO || (rc != 0 && !split)) {
+			nvme_free_request(NULL, pi_req);
+		}
+	}
+
+	return rc;
+}
+
+/*
+ * Generate the PI of a write, or set up the check of a read's PI on completion.
+ *  For a read, returns the request that takes over cb_fn and cb_arg, in *pi_req.
+ *  Payloads whose PI the driver cannot reach are rejected rather than sent with
+ *  PRCHK set and stale tags.
+ */
+static int
+_nvme_ns_cmd_sw_pi(struct spdk_nvme_ns *ns, const struct nvme_payload *payload,
+		   uint64_t lba, uint32_t lba_count, uint32_t opc, uint32_t io_flags,
+		   uint16_t apptag_mask, uint16_t apptag, spdk_nvme_cmd_cb cb_fn, void *cb_arg,
+		   struct nvme_request **pi_req)
+{
+	struct spdk_dif_ctx	ctx;
+	struct nvme_sw_pi_read	*pi;
+	int			rc;
+
+	*pi_req = NULL;
+	if (payload->type != NVME_PAYLOAD_TYPE_CONTIG) {
+		return -ENOTSUP;
+	}
+	if (!(ns->flags & SPDK_NVME_NS_EXTENDED_LBA_SUPPORTED) && payload->md == NULL) {
+		return -EINVAL;
+	}
+
+	rc = _nvme_ns_sw_pi_ctx_init(ns, &ctx, lba, io_flags, apptag_mask, apptag);
+	if (rc != 0) {
+		return rc;
+	}
+
+	if (opc == SPDK_NVME_OPC_WRITE) {
+		if (ctx.md_interleave) {
+			return spdk_dif_generate(payload->u.contig, lba_count, &ctx);
+		}
+		return spdk_dix_generate(payload->u.contig, payload->md, lba_count, &ctx);
+	}
+
+	/* From the global pool, as the qpair is not known when the read completes. */
+	*pi_req = nvme_allocate_request_null(NULL, cb_fn, cb_arg);
+	if (*pi_req == NULL) {
+		return -ENOMEM;
+	}
+	(*pi_req)->payload = *payload;
+	pi = (struct nvme_sw_pi_read *)&(*pi_req)->cmd;
+	pi->dif_ctx = ctx;
+	pi->num_blocks = lba_count;
+	pi->completed = NULL;
+
+	return 0;
+}
+
+int
+spdk_nvme_ns_set_sw_pi(struct spdk_nvme_ns *ns, bool enable)
+{
+	if (enable && (!(ns->flags & SPDK_NVME_NS_DPS_PI_SUPPORTED) ||
+		       ns->md_size < sizeof(struct spdk_nvme_protection_info))) {
+		return -ENOTSUP;
+	}
+
+	ns->sw_pi = enable;
+	return 0;
+}
+
 static struct nvme_request *
-_nvme_ns_cmd_rw(struct spdk_nvme_ns *ns, const struct nvme_payload *payload,
+_nvme_ns_cmd_rw(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
+		const struct nvme_payload *payload,
 		uint64_t lba, uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t opc,
-		uint32_t io_flags, uint16_t apptag_mask, uint16_t apptag)
+		uint32_t io_flags, uint16_t apptag_mask, uint16_t apptag, int *rc)
 {
 	struct nvme_request	*req;
-	struct spdk_nvme_cmd	*cmd;
-	uint64_t		*tmp_lba;
+	struct nvme_request	*pi_req = NULL;
 	uint32_t		sector_size;
 	uint32_t		sectors_per_max_io;
 	uint32_t		sectors_per_stripe;
+	bool			split;
 
 	if (io_flags & 0xFFFF) {
 		/* The bottom 16 bits must be empty */
+		*rc = -EINVAL;
 		return NULL;
 	}
 
+	if (ns->sw_pi && (ns->flags & SPDK_NVME_NS_DPS_PI_SUPPORTED) &&
+	    !(io_flags & SPDK_NVME_IO_FLAGS_PRACT)) {
+		*rc = _nvme_ns_cmd_sw_pi(ns, payload, lba, lba_count, opc, io_flags, apptag_mask, apptag,
+					 cb_fn, cb_arg, &pi_req);
+		if (*rc != 0) {
+			return NULL;
+		}
+		if (pi_req != NULL) {
+			cb_fn = nvme_ns_sw_pi_read_done;
+			cb_arg = pi_req;
+		}
+	}
+
 	sector_size = ns->sector_size;
 	sectors_per_max_io = ns->sectors_per_max_io;
 	sectors_per_stripe = ns->sectors_per_stripe;
@@ -173,50 +431,49 @@ _nvme_ns_cmd_rw(struct spdk_nvme_ns *ns, const struct nvme_payload *payload,
 			sector_size += ns->md_size;
 	}
 
-	req = nvme_allocate_request(payload, lba_count * sector_size, cb_fn, cb_arg);
-	if (req == NULL) {
-		return NULL;
-	}
-
 	/*
-	 * Intel DC P3*00 NVMe controllers benefit from driver-assisted striping.
-	 * If this controller defines a stripe boundary and this I/O spans a stripe
-	 *  boundary, split the request into multiple requests and submit each
-	 *  separately to hardware.
+	 * If the namespace has a stripe (Intel DC P3*00 driver-assisted striping)
+	 *  or optimal I/O boundary and this I/O spans one, or the I/O is larger
+	 *  than the maximum transfer size, split the request into child requests
+	 *  and submit each separately to hardware.
 	 */
-	if (sectors_per_stripe > 0 &&
-	    (((lba & (sectors_per_stripe - 1)) + lba_count) > sectors_per_stripe)) {
-
-		return _nvme_ns_cmd_split_request(ns, payload, lba, lba_count, cb_fn, cb_arg, opc,
-						  io_flags, req, sectors_per_stripe, sectors_per_stripe - 1, apptag_mask, apptag);
-	} else if (lba_count > sectors_per_max_io) {
-		return _nvme_ns_cmd_split_request(ns, payload, lba, lba_count, cb_fn, cb_arg, opc,
-						  io_flags, req, sectors_per_max_io, 0, apptag_mask, apptag);
-	} else {
-		cmd = &req->cmd;
-		cmd->opc = opc;
-		cmd->nsid = ns->id;
-
-		tmp_lba = (uint64_t *)&cmd->cdw10;
-		*tmp_lba = lba;
-
-		if (ns->flags & SPDK_NVME_NS_DPS_PI_SUPPORTED) {
-			switch (ns->pi_type) {
-			case SPDK_NVME_FMT_NVM_PROTECTION_TYPE1:
-			case SPDK_NVME_FMT_NVM_PROTECTION_TYPE2:
-				cmd->cdw14 = (uint32_t)lba;
-				break;
-			}
-		}
+	split = lba_count > sectors_per_max_io ||
+		(sectors_per_stripe > 0 &&
+		 lba_count > nvme_ns_sectors_to_boundary(lba, sectors_per_stripe));
 
-		cmd->cdw12 = lba_count - 1;
-		cmd->cdw12 |= io_flags;
+	/*
+	 * A split parent is freed from its last child's completion callback, where
+	 *  the qpair is not known, so parents always come from the global pool.
+	 */
+	req = nvme_allocate_request(split ? NULL : qpair,
+				    payload, lba_count * sector_size, cb_fn, cb_arg);
+	if (req == NULL) {
+		goto error;
+	}
 
-		cmd->cdw15 = apptag_mask;
-		cmd->cdw15 = (cmd->cdw15 << 16 | apptag);
+	if (split) {
+		/* The parent is never sent, but QoS classifies it by opcode and namespace. */
+		req->cmd.opc = opc;
+		req->cmd.nsid = ns->id;
+		req = _nvme_ns_cmd_split_request(ns, qpair, payload, lba, lba_count, opc, io_flags, req,
+						 sector_size, sectors_per_max_io, sectors_per_stripe,
+						 apptag_mask, apptag);
+		if (req == NULL) {
+			goto error;
+		}
+		return req;
 	}
 
+	_nvme_ns_cmd_setup_request(ns, req, opc, lba, lba_count, io_flags, apptag_mask, apptag);
+
 	return req;
+
+error:
+	if (pi_req != NULL) {
+		nvme_free_request(NULL, pi_req);
+	}
+	*rc = -ENOMEM;
+	return NULL;
 }
 
 int
@@ -227,17 +484,32 @@ spdk_nvme_ns_cmd_read(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair, vo
 {
 	struct nvme_request *req;
 	struct nvme_payload payload;
+	int rc;
+
+	if (qpair->reading_ahead) {
+		rc = nvme_qpair_readahead_read(qpair, ns, buffer, lba, lba_count, cb_fn, cb_arg, io_flags);
+		if (rc <= 0) {
+			return rc;
+		}
+	}
+
+	if (qpair->read_caching) {
+		rc = nvme_qpair_read_cache_read(qpair, ns, buffer, lba, lba_count, cb_fn, cb_arg, io_flags);
+		if (rc <= 0) {
+			return rc;
+		}
+	}
 
 	payload.type = NVME_PAYLOAD_TYPE_CONTIG;
 	payload.u.contig = buffer;
 	payload.md = NULL;
 
-	req = _nvme_ns_cmd_rw(ns, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_READ, io_flags, 0,
-			      0);
+	req = _nvme_ns_cmd_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_READ, io_flags, 0,
+			      0, &rc);
 	if (req != NULL) {
-		return nvme_qpair_submit_request(qpair, req);
+		return _nvme_ns_cmd_submit_read(qpair, req);
 	} else {
-		return -ENOMEM;
+		return rc;
 	}
 }
 
@@ -250,17 +522,18 @@ spdk_nvme_ns_cmd_read_with_md(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *q
 {
 	struct nvme_request *req;
 	struct nvme_payload payload;
+	int rc;
 
 	payload.type = NVME_PAYLOAD_TYPE_CONTIG;
 	payload.u.contig = buffer;
 	payload.md = metadata;
 
-	req = _nvme_ns_cmd_rw(ns, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_READ, io_flags,
-			      apptag_mask, apptag);
+	req = _nvme_ns_cmd_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_READ, io_flags,
+			      apptag_mask, apptag, &rc);
 	if (req != NULL) {
-		return nvme_qpair_submit_request(qpair, req);
+		return _nvme_ns_cmd_submit_read(qpair, req);
 	} else {
-		return -ENOMEM;
+		return rc;
 	}
 }
 
@@ -273,6 +546,7 @@ spdk_nvme_ns_cmd_readv(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
 {
 	struct nvme_request *req;
 	struct nvme_payload payload;
+	int rc;
 
 	if (reset_sgl_fn == NULL || next_sge_fn == NULL)
 		return -EINVAL;
@@ -283,12 +557,40 @@ spdk_nvme_ns_cmd_readv(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
 	payload.u.sgl.next_sge_fn = next_sge_fn;
 	payload.u.sgl.cb_arg = cb_arg;
 
-	req = _nvme_ns_cmd_rw(ns, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_READ, io_flags, 0,
-			      0);
+	req = _nvme_ns_cmd_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_READ, io_flags, 0,
+			      0, &rc);
 	if (req != NULL) {
 		return nvme_qpair_submit_request(qpair, req);
 	} else {
-		return -ENOMEM;
+		return rc;
+	}
+}
+
+int
+spdk_nvme_ns_cmd_readv_iov(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
+			   uint64_t lba, uint32_t lba_count,
+			   spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags,
+			   const struct iovec *iov, const uint64_t *phys_addrs, int iovcnt)
+{
+	struct nvme_request *req;
+	struct nvme_payload payload;
+	int rc;
+
+	if (iov == NULL || iovcnt <= 0)
+		return -EINVAL;
+
+	payload.type = NVME_PAYLOAD_TYPE_IOV;
+	payload.md = NULL;
+	payload.u.iov.iov = iov;
+	payload.u.iov.phys = phys_addrs;
+	payload.u.iov.iovcnt = iovcnt;
+
+	req = _nvme_ns_cmd_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_READ, io_flags, 0,
+			      0, &rc);
+	if (req != NULL) {
+		return nvme_qpair_submit_request(qpair, req);
+	} else {
+		return rc;
 	}
 }
 
@@ -300,17 +602,25 @@ spdk_nvme_ns_cmd_write(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
 {
 	struct nvme_request *req;
 	struct nvme_payload payload;
+	int rc;
+
+	if (qpair->write_merging) {
+		rc = nvme_qpair_write_merge(qpair, ns, buffer, lba, lba_count, cb_fn, cb_arg, io_flags);
+		if (rc <= 0) {
+			return rc;
+		}
+	}
 
 	payload.type = NVME_PAYLOAD_TYPE_CONTIG;
 	payload.u.contig = buffer;
 	payload.md = NULL;
 
-	req = _nvme_ns_cmd_rw(ns, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_WRITE, io_flags, 0,
-			      0);
+	req = _nvme_ns_cmd_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_WRITE, io_flags, 0,
+			      0, &rc);
 	if (req != NULL) {
 		return nvme_qpair_submit_request(qpair, req);
 	} else {
-		return -ENOMEM;
+		return rc;
 	}
 }
 
@@ -322,17 +632,18 @@ spdk_nvme_ns_cmd_write_with_md(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *
 {
 	struct nvme_request *req;
 	struct nvme_payload payload;
+	int rc;
 
 	payload.type = NVME_PAYLOAD_TYPE_CONTIG;
 	payload.u.contig = buffer;
 	payload.md = metadata;
 
-	req = _nvme_ns_cmd_rw(ns, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_WRITE, io_flags,
-			      apptag_mask, apptag);
+	req = _nvme_ns_cmd_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_WRITE, io_flags,
+			      apptag_mask, apptag, &rc);
 	if (req != NULL) {
 		return nvme_qpair_submit_request(qpair, req);
 	} else {
-		return -ENOMEM;
+		return rc;
 	}
 }
 
@@ -345,6 +656,7 @@ spdk_nvme_ns_cmd_writev(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
 {
 	struct nvme_request *req;
 	struct nvme_payload payload;
+	int rc;
 
 	if (reset_sgl_fn == NULL || next_sge_fn == NULL)
 		return -EINVAL;
@@ -355,12 +667,40 @@ spdk_nvme_ns_cmd_writev(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
 	payload.u.sgl.next_sge_fn = next_sge_fn;
 	payload.u.sgl.cb_arg = cb_arg;
 
-	req = _nvme_ns_cmd_rw(ns, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_WRITE, io_flags, 0,
-			      0);
+	req = _nvme_ns_cmd_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_WRITE, io_flags, 0,
+			      0, &rc);
 	if (req != NULL) {
 		return nvme_qpair_submit_request(qpair, req);
 	} else {
-		return -ENOMEM;
+		return rc;
+	}
+}
+
+int
+spdk_nvme_ns_cmd_writev_iov(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
+			     uint64_t lba, uint32_t lba_count,
+			     spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags,
+			     const struct iovec *iov, const uint64_t *phys_addrs, int iovcnt)
+{
+	struct nvme_request *req;
+	struct nvme_payload payload;
+	int rc;
+
+	if (iov == NULL || iovcnt <= 0)
+		return -EINVAL;
+
+	payload.type = NVME_PAYLOAD_TYPE_IOV;
+	payload.md = NULL;
+	payload.u.iov.iov = iov;
+	payload.u.iov.phys = phys_addrs;
+	payload.u.iov.iovcnt = iovcnt;
+
+	req = _nvme_ns_cmd_rw(ns, qpair, &payload, lba, lba_count, cb_fn, cb_arg, SPDK_NVME_OPC_WRITE, io_flags, 0,
+			      0, &rc);
+	if (req != NULL) {
+		return nvme_qpair_submit_request(qpair, req);
+	} else {
+		return rc;
 	}
 }
 
@@ -378,7 +718,7 @@ spdk_nvme_ns_cmd_write_zeroes(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *q
 		return -EINVAL;
 	}
 
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(qpair, cb_fn, cb_arg);
 	if (req == NULL) {
 		return -ENOMEM;
 	}
@@ -401,12 +741,21 @@ spdk_nvme_ns_cmd_deallocate(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpa
 {
 	struct nvme_request	*req;
 	struct spdk_nvme_cmd	*cmd;
+	int			rc;
 
 	if (num_ranges == 0 || num_ranges > SPDK_NVME_DATASET_MANAGEMENT_MAX_RANGES) {
 		return -EINVAL;
 	}
 
-	req = nvme_allocate_request_contig(payload,
+	if (qpair->dsm_coalescing) {
+		rc = nvme_qpair_dsm_deallocate(qpair, ns, payload, num_ranges, cb_fn, cb_arg);
+		if (rc <= 0) {
+			return rc;
+		}
+		/* No batch available; send this one on its own. */
+	}
+
+	req = nvme_allocate_request_contig(qpair, payload,
 					   num_ranges * sizeof(struct spdk_nvme_dsm_range),
 					   cb_fn, cb_arg);
 	if (req == NULL) {
@@ -431,7 +780,7 @@ spdk_nvme_ns_cmd_flush(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
 	struct nvme_request	*req;
 	struct spdk_nvme_cmd	*cmd;
 
-	req = nvme_allocate_request_null(cb_fn, cb_arg);
+	req = nvme_allocate_request_null(qpair, cb_fn, cb_arg);
 	if (req == NULL) {
 		return -ENOMEM;
 	}
@@ -455,7 +804,7 @@ spdk_nvme_ns_cmd_reservation_register(struct spdk_nvme_ns *ns,
 	struct nvme_request	*req;
 	struct spdk_nvme_cmd	*cmd;
 
-	req = nvme_allocate_request_contig(payload,
+	req = nvme_allocate_request_contig(qpair, payload,
 					   sizeof(struct spdk_nvme_reservation_register_data),
 					   cb_fn, cb_arg);
 	if (req == NULL) {
@@ -488,7 +837,7 @@ spdk_nvme_ns_cmd_reservation_release(struct spdk_nvme_ns *ns,
 	struct nvme_request	*req;
 	struct spdk_nvme_cmd	*cmd;
 
-	req = nvme_allocate_request_contig(payload, sizeof(struct spdk_nvme_reservation_key_data), cb_fn,
+	req = nvme_allocate_request_contig(qpair, payload, sizeof(struct spdk_nvme_reservation_key_data), cb_fn,
 					   cb_arg);
 	if (req == NULL) {
 		return -ENOMEM;
@@ -520,7 +869,7 @@ spdk_nvme_ns_cmd_reservation_acquire(struct spdk_nvme_ns *ns,
 	struct nvme_request	*req;
 	struct spdk_nvme_cmd	*cmd;
 
-	req = nvme_allocate_request_contig(payload,
+	req = nvme_allocate_request_contig(qpair, payload,
 					   sizeof(struct spdk_nvme_reservation_acquire_data),
 					   cb_fn, cb_arg);
 	if (req == NULL) {
@@ -555,7 +904,7 @@ spdk_nvme_ns_cmd_reservation_report(struct spdk_nvme_ns *ns,
 		return -EINVAL;
 	num_dwords = len / 4;
 
-	req = nvme_allocate_request_contig(payload, len, cb_fn, cb_arg);
+	req = nvme_allocate_request_contig(qpair, payload, len, cb_fn, cb_arg);
 	if (req == NULL) {
 		return -ENOMEM;
 	}
@@ -0,0 +1,292 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "nvme_internal.h"
+
+/*
+ * Token bucket rate limiting of read and write commands per qpair and per
+ *  namespace.  Requests over a limit are held on the qpair's
+ *  qos_deferred_req list by nvme_qpair_submit_request() and released by
+ *  nvme_qpair_qos_release() when the buckets have refilled.
+ */
+
+static void
+nvme_token_bucket_set_rate(struct nvme_token_bucket *bucket, uint64_t rate, uint64_t now)
+{
+	bucket->max_tokens = nvme_max(rate / NVME_QOS_BURST_DIVISOR, 1);
+	if (bucket->rate == 0) {
+		/* Newly limited buckets start full. */
+		bucket->tokens = bucket->max_tokens;
+		bucket->last_tick = now;
+	} else if (bucket->tokens > bucket->max_tokens) {
+		bucket->tokens = bucket->max_tokens;
+	}
+	bucket->rate = rate;
+}
+
+/*
+ * Token and tick counts fit in 64 bits, but their products with a byte rate or
+ *  tsc_hz do not for multi-GB/s limits, so the conversions are done in 128 bits.
+ */
+static inline uint64_t
+nvme_qos_muldiv(uint64_t a, uint64_t b, uint64_t c)
+{
+	return (uint64_t)((unsigned __int128)a * b / c);
+}
+
+static void
+nvme_token_bucket_refill(struct nvme_token_bucket *bucket, uint64_t now, uint64_t tsc_hz)
+{
+	/* Ticks it takes to fill the bucket from empty. */
+	uint64_t max_ticks = nvme_qos_muldiv(bucket->max_tokens, tsc_hz, bucket->rate);
+	uint64_t ticks = now - bucket->last_tick;
+	uint64_t add;
+
+	if (ticks >= max_ticks) {
+		bucket->last_tick = now;
+		add = bucket->max_tokens;
+	} else {
+		add = nvme_qos_muldiv(ticks, bucket->rate, tsc_hz);
+		if (add == 0) {
+			return;
+		}
+		/* Only consume the ticks that were turned into tokens, to keep the remainder. */
+		bucket->last_tick += nvme_qos_muldiv(add, tsc_hz, bucket->rate);
+	}
+
+	bucket->tokens = nvme_min(bucket->tokens + (int64_t)add, bucket->max_tokens);
+}
+
+static inline bool
+nvme_token_bucket_has_tokens(struct nvme_token_bucket *bucket, uint64_t now, uint64_t tsc_hz)
+{
+	if (bucket->rate == 0) {
+		return true;
+	}
+
+	nvme_token_bucket_refill(bucket, now, tsc_hz);
+	return bucket->tokens > 0;
+}
+
+static inline void
+nvme_token_bucket_take(struct nvme_token_bucket *bucket, uint64_t tokens)
+{
+	if (bucket->rate != 0) {
+		bucket->tokens -= tokens;
+	}
+}
+
+/*
+ * Refill the IOPS and bandwidth buckets of the I/O direction and report
+ *  whether both have tokens left.  Nothing is taken from them yet.
+ */
+static bool
+nvme_qos_has_tokens(struct nvme_qos *qos, uint32_t io_dir, uint64_t now, uint64_t tsc_hz)
+{
+	return nvme_token_bucket_has_tokens(&qos->bucket[NVME_QOS_READ_IOPS + io_dir], now, tsc_hz) &&
+	       nvme_token_bucket_has_tokens(&qos->bucket[NVME_QOS_READ_BPS + io_dir], now, tsc_hz);
+}
+
+static inline bool
+nvme_qos_limits_dir(const struct nvme_qos *qos, uint32_t io_dir)
+{
+	return qos != NULL && (qos->bucket[NVME_QOS_READ_IOPS + io_dir].rate != 0 ||
+			       qos->bucket[NVME_QOS_READ_BPS + io_dir].rate != 0);
+}
+
+static void
+nvme_qos_take(struct nvme_qos *qos, uint32_t io_dir, uint32_t bytes)
+{
+	nvme_token_bucket_take(&qos->bucket[NVME_QOS_READ_IOPS + io_dir], 1);
+	nvme_token_bucket_take(&qos->bucket[NVME_QOS_READ_BPS + io_dir], bytes);
+}
+
+/*
+ * Check whether a read or write command may be submitted under the limits of
+ *  its qpair and namespace, and charge it to both if so.  Commands held back
+ *  by one set of limits are not charged to the other.  If others are already
+ *  held back (deferred), limited commands must wait their turn behind them.
+ */
+bool
+nvme_qos_admit(struct spdk_nvme_qpair *qpair, struct nvme_request *req, bool deferred)
+{
+	struct spdk_nvme_ctrlr	*ctrlr = qpair->ctrlr;
+	struct nvme_qos		*ns_qos = NULL;
+	uint32_t		io_dir;
+	uint32_t		nsid = req->cmd.nsid;
+	uint64_t		now, tsc_hz;
+	bool			admit = true;
+
+	if (req->cmd.opc == SPDK_NVME_OPC_READ) {
+		io_dir = 0;
+	} else if (req->cmd.opc == SPDK_NVME_OPC_WRITE) {
+		io_dir = 1;
+	} else {
+		return true;
+	}
+
+	if (nsid != 0 && nsid <= ctrlr->num_ns) {
+		ns_qos = ctrlr->ns[nsid - 1].qos;
+	}
+
+	if (!nvme_qos_limits_dir(qpair->qos, io_dir) && !nvme_qos_limits_dir(ns_qos, io_dir)) {
+		return true;
+	}
+
+	if (deferred) {
+		return false;
+	}
+
+	now = nvme_get_tsc();
+	tsc_hz = nvme_get_tsc_hz();
+
+	if (qpair->qos != NULL && !nvme_qos_has_tokens(qpair->qos, io_dir, now, tsc_hz)) {
+		return false;
+	}
+
+	if (ns_qos != NULL) {
+		nvme_mutex_lock(&ns_qos->lock);
+		admit = nvme_qos_has_tokens(ns_qos, io_dir, now, tsc_hz);
+		if (admit) {
+			nvme_qos_take(ns_qos, io_dir, req->payload_size);
+		}
+		nvme_mutex_unlock(&ns_qos->lock);
+	}
+
+	if (admit && qpair->qos != NULL) {
+		nvme_qos_take(qpair->qos, io_dir, req->payload_size);
+	}
+
+	return admit;
+}
+
+static void
+nvme_qos_set_limits(struct nvme_qos *qos, const struct spdk_nvme_qos_limits *limits)
+{
+	uint64_t now = nvme_get_tsc();
+
+	nvme_token_bucket_set_rate(&qos->bucket[NVME_QOS_READ_IOPS], limits->read_iops, now);
+	nvme_token_bucket_set_rate(&qos->bucket[NVME_QOS_WRITE_IOPS], limits->write_iops, now);
+	nvme_token_bucket_set_rate(&qos->bucket[NVME_QOS_READ_BPS], limits->read_bytes_per_sec, now);
+	nvme_token_bucket_set_rate(&qos->bucket[NVME_QOS_WRITE_BPS], limits->write_bytes_per_sec, now);
+}
+
+static bool
+nvme_qos_limits_empty(const struct spdk_nvme_qos_limits *limits)
+{
+	return limits == NULL ||
+	       (limits->read_iops == 0 && limits->write_iops == 0 &&
+		limits->read_bytes_per_sec == 0 && limits->write_bytes_per_sec == 0);
+}
+
+int
+spdk_nvme_qpair_set_qos_limits(struct spdk_nvme_qpair *qpair,
+			       const struct spdk_nvme_qos_limits *limits)
+{
+	if (nvme_qos_limits_empty(limits)) {
+		free(qpair->qos);
+		qpair->qos = NULL;
+		qpair->qos_enabled = qpair->ctrlr->ns_qos_enabled;
+		nvme_qpair_qos_release(qpair);
+		return 0;
+	}
+
+	if (qpair->qos == NULL) {
+		qpair->qos = calloc(1, sizeof(*qpair->qos));
+		if (qpair->qos == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	nvme_qos_set_limits(qpair->qos, limits);
+	qpair->qos_enabled = true;
+	return 0;
+}
+
+int
+spdk_nvme_ns_set_qos_limits(struct spdk_nvme_ns *ns, const struct spdk_nvme_qos_limits *limits)
+{
+	struct spdk_nvme_ctrlr		*ctrlr = ns->ctrlr;
+	struct spdk_nvme_qos_limits	no_limits = {};
+	struct spdk_nvme_qpair		*qpair;
+
+	if (limits == NULL) {
+		limits = &no_limits;
+	}
+
+	nvme_mutex_lock(&ctrlr->ctrlr_lock);
+
+	if (ns->qos == NULL) {
+		if (nvme_qos_limits_empty(limits)) {
+			nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+			return 0;
+		}
+
+		ns->qos = calloc(1, sizeof(*ns->qos));
+		if (ns->qos == NULL) {
+			nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+			return -ENOMEM;
+		}
+		nvme_mutex_init(&ns->qos->lock);
+		nvme_qos_set_limits(ns->qos, limits);
+
+		/*
+		 * The namespace state is kept until the namespace is destroyed, even if
+		 *  its limits are removed again, because other threads may be using it.
+		 */
+		ctrlr->ns_qos_enabled = true;
+		TAILQ_FOREACH(qpair, &ctrlr->free_io_qpairs, tailq) {
+			qpair->qos_enabled = true;
+		}
+		TAILQ_FOREACH(qpair, &ctrlr->active_io_qpairs, tailq) {
+			qpair->qos_enabled = true;
+		}
+	} else {
+		nvme_mutex_lock(&ns->qos->lock);
+		nvme_qos_set_limits(ns->qos, limits);
+		nvme_mutex_unlock(&ns->qos->lock);
+	}
+
+	nvme_mutex_unlock(&ctrlr->ctrlr_lock);
+	return 0;
+}
+
+void
+nvme_qos_destroy(struct nvme_qos *qos)
+{
+	if (qos != NULL) {
+		nvme_mutex_destroy(&qos->lock);
+		free(qos);
+	}
+}
@@ -43,6 +43,9 @@ static inline bool nvme_qpair_is_io_queue(struct spdk_nvme_qpair *qpair)
 	return qpair->id != 0;
 }
 
+static int _nvme_qpair_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req);
+static int nvme_qpair_try_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req);
+
 struct nvme_string {
 	uint16_t	value;
 	const char 	*str;
@@ -283,13 +286,81 @@ nvme_completion_is_retry(const struct spdk_nvme_cpl *cpl)
 }
 
 static void
-nvme_qpair_construct_tracker(struct nvme_tracker *tr, uint16_t cid, uint64_t phys_addr)
+nvme_qpair_construct_tracker(struct nvme_tracker *tr, uint16_t cid)
 {
-	tr->prp_sgl_bus_addr = phys_addr + offsetof(struct nvme_tracker, u.prp);
 	tr->cid = cid;
+	tr->prp_list = NVME_NO_PRP_LIST;
 	tr->active = false;
 }
 
+static inline struct nvme_tracker *
+nvme_qpair_get_tracker(struct spdk_nvme_qpair *qpair)
+{
+	if (qpair->num_free_tr == 0) {
+		return NULL;
+	}
+
+	return &qpair->tr[qpair->free_tr[--qpair->num_free_tr]];
+}
+
+static inline void
+nvme_qpair_put_tracker(struct spdk_nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	uint16_t idx, next;
+
+	for (idx = tr->prp_list; idx != NVME_NO_PRP_LIST; idx = next) {
+		next = qpair->prp_list_next[idx];
+		qpair->prp_list_next[idx] = NVME_NO_PRP_LIST;
+		qpair->free_prp_list[qpair->num_free_prp_list++] = idx;
+	}
+	tr->prp_list = NVME_NO_PRP_LIST;
+
+	qpair->free_tr[qpair->num_free_tr++] = tr->cid;
+}
+
+/*
+ * Attach a PRP/SGL list page to the tracker.  Returns NULL if the qpair's pool
+ *  is exhausted; the caller must then queue the request and retry it later.
+ */
+static inline struct nvme_prp_list *
+nvme_qpair_get_prp_list(struct spdk_nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	if (tr->prp_list == NVME_NO_PRP_LIST) {
+		if (qpair->num_free_prp_list == 0) {
+			return NULL;
+		}
+		tr->prp_list = qpair->free_prp_list[--qpair->num_free_prp_list];
+	}
+
+	return &qpair->prp_list[tr->prp_list];
+}
+
+/*
+ * Chain another list page after page idx, which must already belong to a
+ *  tracker.  The new page is released along with the rest of the chain by
+ *  nvme_qpair_put_tracker().  Returns NVME_NO_PRP_LIST if the pool is exhausted.
+ */
+static inline uint16_t
+nvme_qpair_chain_prp_list(struct spdk_nvme_qpair *qpair, uint16_t idx)
+{
+	uint16_t next;
+
+	if (qpair->num_free_prp_list == 0) {
+		return NVME_NO_PRP_LIST;
+	}
+
+	next = qpair->free_prp_list[--qpair->num_free_prp_list];
+	qpair->prp_list_next[idx] = next;
+
+	return next;
+}
+
+static inline uint64_t
+nvme_qpair_prp_list_bus_addr(struct spdk_nvme_qpair *qpair, uint16_t idx)
+{
+	return qpair->prp_list_bus_addr + (uint64_t)idx * sizeof(struct nvme_prp_list);
+}
+
 static inline void
 nvme_copy_command(struct spdk_nvme_cmd *dst, const struct spdk_nvme_cmd *src)
 {
@@ -313,6 +384,44 @@ nvme_copy_command(struct spdk_nvme_cmd *dst, const struct spdk_nvme_cmd *src)
 #endif
 }
 
+static inline uint32_t
+nvme_hybrid_poll_size_class(struct nvme_request *req)
+{
+	return nvme_min(nvme_u32log2((req->payload_size >> 12) | 1), NVME_HYBRID_POLL_SIZE_CLASSES - 1);
+}
+
+static inline void
+nvme_hybrid_poll_submit(struct nvme_hybrid_poll *hp, struct nvme_tracker *tr)
+{
+	tr->expected_tick = tr->submit_tick + hp->ewma_ticks[nvme_hybrid_poll_size_class(tr->req)];
+	if (tr->expected_tick < hp->earliest_tick) {
+		hp->earliest_tick = tr->expected_tick;
+	}
+}
+
+static inline void
+nvme_hybrid_poll_complete(struct nvme_hybrid_poll *hp, struct nvme_tracker *tr, bool error)
+{
+	uint64_t	*ewma, ticks;
+
+	/* Failed (including manually aborted) commands say nothing about service time. */
+	if (!error) {
+		ewma = &hp->ewma_ticks[nvme_hybrid_poll_size_class(tr->req)];
+		ticks = nvme_get_tsc() - tr->submit_tick;
+
+		/* Weight each new sample 1/8 so a single outlier does not swing the estimate. */
+		if (*ewma == 0) {
+			*ewma = ticks;
+		} else {
+			*ewma = *ewma - (*ewma >> 3) + (ticks >> 3);
+		}
+	}
+
+	if (tr->expected_tick <= hp->earliest_tick) {
+		hp->earliest_stale = true;
+	}
+}
+
 static void
 nvme_qpair_submit_tracker(struct spdk_nvme_qpair *qpair, struct nvme_tracker *tr)
 {
@@ -321,6 +430,14 @@ nvme_qpair_submit_tracker(struct spdk_nvme_qpair *qpair, struct nvme_tracker *tr
 	req = tr->req;
 	qpair->tr[tr->cid].active = true;
 
+	if (qpair->timeouts_enabled || qpair->latency_histogram != NULL || qpair->hybrid_polling) {
+		tr->submit_tick = nvme_get_tsc();
+		tr->timed_out = 0;
+		if (qpair->hybrid_polling) {
+			nvme_hybrid_poll_submit(qpair->hybrid_poll, tr);
+		}
+	}
+
 	/* Copy the command from the tracker to the submission queue. */
 	nvme_copy_command(&qpair->cmd[qpair->sq_tail], &req->cmd);
 
@@ -328,8 +445,257 @@ nvme_qpair_submit_tracker(struct spdk_nvme_qpair *qpair, struct nvme_tracker *tr
 		qpair->sq_tail = 0;
 	}
 
+	if (qpair->delay_sq_doorbell) {
+		qpair->sq_doorbell_pending = true;
+		return;
+	}
+
 	spdk_wmb();
 	spdk_mmio_write_4(qpair->sq_tdbl, qpair->sq_tail);
+	qpair->num_sq_doorbell_writes++;
+}
+
+void
+nvme_qpair_ring_sq_doorbell(struct spdk_nvme_qpair *qpair)
+{
+	if (!qpair->sq_doorbell_pending) {
+		return;
+	}
+
+	qpair->sq_doorbell_pending = false;
+	spdk_wmb();
+	spdk_mmio_write_4(qpair->sq_tdbl, qpair->sq_tail);
+	qpair->num_sq_doorbell_writes++;
+}
+
+void
+spdk_nvme_qpair_set_delay_doorbell(struct spdk_nvme_qpair *qpair, bool enable)
+{
+	if (!enable) {
+		nvme_qpair_ring_sq_doorbell(qpair);
+	}
+	qpair->delay_sq_doorbell = enable;
+}
+
+void
+spdk_nvme_qpair_flush_submissions(struct spdk_nvme_qpair *qpair)
+{
+	if (qpair->dsm_coalescing) {
+		nvme_batcher_flush(&qpair->dsm->batcher);
+	}
+	if (qpair->write_merging) {
+		nvme_batcher_flush(&qpair->wm->batcher);
+	}
+	nvme_qpair_ring_sq_doorbell(qpair);
+}
+
+uint64_t
+spdk_nvme_qpair_get_num_sq_doorbell_writes(struct spdk_nvme_qpair *qpair)
+{
+	return qpair->num_sq_doorbell_writes;
+}
+
+uint16_t
+spdk_nvme_qpair_get_num_free_slots(struct spdk_nvme_qpair *qpair)
+{
+	if (!STAILQ_EMPTY(&qpair->queued_req)) {
+		return 0;
+	}
+
+	/* Any command may need a list page, so do not promise more slots than free pages. */
+	return nvme_min(qpair->num_free_tr, qpair->num_free_prp_list);
+}
+
+void
+spdk_nvme_qpair_set_fail_when_full(struct spdk_nvme_qpair *qpair, bool fail_when_full)
+{
+	qpair->fail_when_full = fail_when_full;
+}
+
+void
+spdk_nvme_qpair_register_slots_available_cb(struct spdk_nvme_qpair *qpair,
+		spdk_nvme_qpair_slots_available_cb cb_fn, void *cb_arg)
+{
+	qpair->slots_cb_fn = cb_fn;
+	qpair->slots_cb_arg = cb_arg;
+}
+
+/*
+ * Tell the owner of a queue pair that had run out of free slots that it can
+ *  submit again.  Only called once the requests queued behind the full
+ *  queue pair have all been submitted.
+ */
+static void
+nvme_qpair_check_slots_available(struct spdk_nvme_qpair *qpair)
+{
+	if (spdk_nvme_qpair_get_num_free_slots(qpair) == 0) {
+		return;
+	}
+
+	qpair->slots_cb_pending = false;
+	if (qpair->slots_cb_fn != NULL) {
+		qpair->slots_cb_fn(qpair->slots_cb_arg, qpair);
+	}
+}
+
+static inline uint32_t
+nvme_latency_histogram_bucket(uint64_t ticks)
+{
+	uint32_t msb, shift;
+
+	if (ticks < (1ULL << SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS)) {
+		return (uint32_t)ticks;
+	}
+
+	/*
+	 * Bucket range r (r >= 1) covers [2^(r + SUB_BITS - 1), 2^(r + SUB_BITS)), split into
+	 *  2^SUB_BITS linear buckets indexed by the bits just below the most significant bit.
+	 */
+	msb = 63 - __builtin_clzll(ticks);
+	shift = msb - SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS) +
+	       (uint32_t)((ticks >> shift) & ((1ULL << SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS) - 1));
+}
+
+static uint64_t
+nvme_latency_histogram_bucket_max(uint32_t bucket)
+{
+	uint32_t range, sub, shift;
+
+	range = bucket >> SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS;
+	sub = bucket & ((1U << SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS) - 1);
+
+	if (range == 0) {
+		return sub;
+	}
+
+	shift = range - 1;
+	return ((((uint64_t)1 << SPDK_NVME_LATENCY_HISTOGRAM_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static inline void
+nvme_qpair_record_latency(struct spdk_nvme_qpair *qpair, struct nvme_tracker *tr)
+{
+	enum spdk_nvme_io_class io_class;
+
+	switch (tr->req->cmd.opc) {
+	case SPDK_NVME_OPC_READ:
+		io_class = SPDK_NVME_IO_CLASS_READ;
+		break;
+	case SPDK_NVME_OPC_WRITE:
+		io_class = SPDK_NVME_IO_CLASS_WRITE;
+		break;
+	default:
+		io_class = SPDK_NVME_IO_CLASS_OTHER;
+		break;
+	}
+
+	qpair->latency_histogram->bucket[io_class]
+	[nvme_latency_histogram_bucket(nvme_get_tsc() - tr->submit_tick)]++;
+}
+
+int
+spdk_nvme_qpair_enable_latency_histogram(struct spdk_nvme_qpair *qpair, bool enable)
+{
+	if (!enable) {
+		free(qpair->latency_histogram);
+		qpair->latency_histogram = NULL;
+		return 0;
+	}
+
+	if (qpair->latency_histogram == NULL) {
+		/* Outstanding commands may have no submit_tick to measure from. */
+		if (qpair->num_free_tr != qpair->num_trackers) {
+			return -EBUSY;
+		}
+
+		qpair->latency_histogram = calloc(1, sizeof(*qpair->latency_histogram));
+		if (qpair->latency_histogram == NULL) {
+			return -ENOMEM;
+		}
+		qpair->latency_histogram->tick_rate = nvme_get_tsc_hz();
+	}
+
+	return 0;
+}
+
+int
+spdk_nvme_qpair_get_latency_histogram(struct spdk_nvme_qpair *qpair,
+				      struct spdk_nvme_latency_histogram *histogram)
+{
+	if (qpair->latency_histogram == NULL) {
+		return -EINVAL;
+	}
+
+	memcpy(histogram, qpair->latency_histogram, sizeof(*histogram));
+	return 0;
+}
+
+void
+spdk_nvme_qpair_reset_latency_histogram(struct spdk_nvme_qpair *qpair)
+{
+	if (qpair->latency_histogram != NULL) {
+		memset(qpair->latency_histogram->bucket, 0, sizeof(qpair->latency_histogram->bucket));
+	}
+}
+
+uint64_t
+spdk_nvme_latency_histogram_get_percentile(const struct spdk_nvme_latency_histogram *histogram,
+		enum spdk_nvme_io_class io_class, double percentile)
+{
+	const uint64_t	*bucket = histogram->bucket[io_class];
+	uint64_t	total = 0, target, count = 0;
+	uint32_t	i;
+
+	for (i = 0; i < SPDK_NVME_LATENCY_HISTOGRAM_NUM_BUCKETS; i++) {
+		total += bucket[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	target = (uint64_t)(total * percentile / 100.0);
+	if (target == 0) {
+		target = 1;
+	} else if (target > total) {
+		target = total;
+	}
+
+	for (i = 0; i < SPDK_NVME_LATENCY_HISTOGRAM_NUM_BUCKETS; i++) {
+		count += bucket[i];
+		if (count >= target) {
+			break;
+		}
+	}
+
+	return nvme_latency_histogram_bucket_max(i);
+}
+
+/*
+ * Submit the request at the head of queued_req after a tracker was freed.  A
+ *  request that still cannot get its list pages stays at the head, so queued
+ *  requests keep their order, and queued_req is left alone until a list page
+ *  is freed.
+ */
+static void
+nvme_qpair_submit_queued_request(struct spdk_nvme_qpair *qpair)
+{
+	struct nvme_request *req = STAILQ_FIRST(&qpair->queued_req);
+
+	if (qpair->ctrlr->is_failed ||
+	    (qpair->queued_req_wait_prp_list && qpair->num_free_prp_list == 0)) {
+		/* A failed controller's queued requests are failed by nvme_qpair_fail(). */
+		return;
+	}
+
+	STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
+	if (nvme_qpair_try_submit_request(qpair, req) == -EAGAIN) {
+		STAILQ_INSERT_HEAD(&qpair->queued_req, req, stailq);
+		/* A tracker was free, so the request is waiting for a list page. */
+		qpair->queued_req_wait_prp_list = qpair->is_enabled && qpair->num_free_tr != 0;
+		return;
+	}
+	qpair->queued_req_wait_prp_list = false;
 }
 
 static void
@@ -360,15 +726,34 @@ nvme_qpair_complete_tracker(struct spdk_nvme_qpair *qpair, struct nvme_tracker *
 		req->retries++;
 		nvme_qpair_submit_tracker(qpair, tr);
 	} else {
+		if (qpair->latency_histogram != NULL) {
+			nvme_qpair_record_latency(qpair, tr);
+		}
+
+		if (qpair->hybrid_polling) {
+			nvme_hybrid_poll_complete(qpair->hybrid_poll, tr, error);
+		}
+
+		if (qpair->ctrlr->num_caching_qpairs != 0) {
+			nvme_request_foreach_written_range(qpair, req, nvme_ns_bump_write_epoch, NULL);
+		}
+
+		if (qpair->read_caching) {
+			nvme_qpair_read_cache_invalidate(qpair, req);
+		}
+
+		if (qpair->reading_ahead) {
+			nvme_qpair_readahead_invalidate(qpair, req);
+		}
+
 		if (req->cb_fn) {
 			req->cb_fn(req->cb_arg, cpl);
 		}
 
-		nvme_free_request(req);
+		nvme_free_request(qpair, req);
 		tr->req = NULL;
 
-		LIST_REMOVE(tr, list);
-		LIST_INSERT_HEAD(&qpair->free_tr, tr, list);
+		nvme_qpair_put_tracker(qpair, tr);
 
 		/*
 		 * If the controller is in the middle of resetting, don't
@@ -377,9 +762,7 @@ nvme_qpair_complete_tracker(struct spdk_nvme_qpair *qpair, struct nvme_tracker *
 		 */
 		if (!STAILQ_EMPTY(&qpair->queued_req) &&
 		    !qpair->ctrlr->is_resetting) {
-			req = STAILQ_FIRST(&qpair->queued_req);
-			STAILQ_REMOVE_HEAD(&qpair->queued_req, stailq);
-			nvme_qpair_submit_request(qpair, req);
+			nvme_qpair_submit_queued_request(qpair);
 		}
 	}
 }
@@ -424,7 +807,120 @@ nvme_qpair_manual_complete_request(struct spdk_nvme_qpair *qpair,
 		req->cb_fn(req->cb_arg, &cpl);
 	}
 
-	nvme_free_request(req);
+	nvme_free_request(qpair, req);
+}
+
+static void
+nvme_qpair_abort_timed_out_cpl(void *arg, const struct spdk_nvme_cpl *cpl)
+{
+	/* Bit 0 of cdw0 is cleared if the command was actually aborted. */
+	if (spdk_nvme_cpl_is_error(cpl) || (cpl->cdw0 & 0x1)) {
+		nvme_printf((struct spdk_nvme_ctrlr *)arg, "abort of timed out command failed\n");
+	}
+}
+
+static void
+nvme_qpair_check_timeouts(struct spdk_nvme_qpair *qpair)
+{
+	struct spdk_nvme_ctrlr	*ctrlr = qpair->ctrlr;
+	struct nvme_tracker	*tr;
+	uint64_t		now;
+	uint16_t		i;
+
+	now = nvme_get_tsc();
+	if (now < qpair->next_timeout_check_tick) {
+		return;
+	}
+
+	/*
+	 * Walking the trackers on every poll would cost far more than the
+	 *  timeout precision is worth, so only scan them about once per second.
+	 */
+	qpair->next_timeout_check_tick = now + nvme_get_tsc_hz();
+
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (!tr->active || tr->timed_out || now - tr->submit_tick < qpair->timeout_ticks) {
+			continue;
+		}
+
+		/* Only report each submission of a command once. */
+		tr->timed_out = 1;
+
+		nvme_printf(ctrlr, "command timed out\n");
+		nvme_qpair_print_command(qpair, &tr->req->cmd);
+
+		if (ctrlr->opts.timeout_cb_fn) {
+			ctrlr->opts.timeout_cb_fn(ctrlr->opts.timeout_cb_arg, ctrlr, qpair, tr->cid);
+		} else if (nvme_ctrlr_cmd_abort(ctrlr, tr->cid, qpair->id,
+						nvme_qpair_abort_timed_out_cpl, ctrlr) != 0) {
+			nvme_printf(ctrlr, "unable to abort timed out command\n");
+		}
+	}
+}
+
+int
+spdk_nvme_qpair_set_hybrid_polling(struct spdk_nvme_qpair *qpair, uint32_t min_sleep_us)
+{
+	if (min_sleep_us == 0) {
+		qpair->hybrid_polling = false;
+		free(qpair->hybrid_poll);
+		qpair->hybrid_poll = NULL;
+		return 0;
+	}
+
+	if (qpair->hybrid_poll == NULL) {
+		/* Outstanding commands have no submit_tick to learn from or predict with. */
+		if (qpair->num_free_tr != qpair->num_trackers) {
+			return -EBUSY;
+		}
+
+		qpair->hybrid_poll = calloc(1, sizeof(*qpair->hybrid_poll));
+		if (qpair->hybrid_poll == NULL) {
+			return -ENOMEM;
+		}
+		qpair->hybrid_poll->earliest_tick = UINT64_MAX;
+	}
+
+	qpair->hybrid_poll->min_sleep_ticks = (uint64_t)min_sleep_us * nvme_get_tsc_hz() / 1000000;
+	qpair->hybrid_polling = true;
+	return 0;
+}
+
+/*
+ * Called when a poll finds no new completions.  If every outstanding command is
+ *  predicted to complete well in the future, sleep until shortly before the first one.
+ */
+static void
+nvme_qpair_hybrid_poll_sleep(struct spdk_nvme_qpair *qpair)
+{
+	struct nvme_hybrid_poll	*hp = qpair->hybrid_poll;
+	uint64_t		now, sleep_ticks;
+	uint16_t		i;
+
+	if (hp->earliest_stale) {
+		hp->earliest_tick = UINT64_MAX;
+		for (i = 0; i < qpair->num_trackers; i++) {
+			if (qpair->tr[i].active && qpair->tr[i].expected_tick < hp->earliest_tick) {
+				hp->earliest_tick = qpair->tr[i].expected_tick;
+			}
+		}
+		hp->earliest_stale = false;
+	}
+
+	if (hp->earliest_tick == UINT64_MAX) {
+		return;
+	}
+
+	now = nvme_get_tsc();
+	if (hp->earliest_tick < now + 2 * hp->min_sleep_ticks) {
+		/* Due soon (or overdue) - keep busy polling. */
+		return;
+	}
+
+	sleep_ticks = hp->earliest_tick - now - hp->min_sleep_ticks;
+	nvme_delay(sleep_ticks * 1000000 / nvme_get_tsc_hz());
+	hp->num_sleeps++;
 }
 
 static inline bool
@@ -437,12 +933,87 @@ nvme_qpair_check_enabled(struct spdk_nvme_qpair *qpair)
 	return qpair->is_enabled;
 }
 
+/*
+ * Complete the read cache and readahead hits queued since the last call, whose
+ *  data was already copied at submission.  Returns how many were completed.
+ */
+static uint32_t
+nvme_qpair_complete_hits(struct spdk_nvme_qpair *qpair)
+{
+	STAILQ_HEAD(, nvme_request)	hits;
+	struct nvme_request		*req;
+	struct spdk_nvme_cpl		cpl = {};
+	uint32_t			num_hits = 0;
+
+	/* Hits queued by the callbacks below are left for the next call. */
+	STAILQ_INIT(&hits);
+	STAILQ_CONCAT(&hits, &qpair->hits);
+
+	cpl.sqid = qpair->id;
+	while ((req = STAILQ_FIRST(&hits)) != NULL) {
+		STAILQ_REMOVE_HEAD(&hits, stailq);
+		req->cb_fn(req->cb_arg, &cpl);
+		nvme_free_request(qpair, req);
+		num_hits++;
+	}
+
+	return num_hits;
+}
+
+/*
+ * Count the run of new completion entries starting at cq_head, up to
+ *  max_entries, and prefetch the tracker and request each one refers to.
+ *  Trackers are prefetched while the phase bits are scanned; requests (the
+ *  command cacheline and the one holding the callback) are prefetched in a
+ *  second pass so the tracker loads have had time to land before their req
+ *  pointers are followed.  The cache misses for the whole batch then overlap
+ *  instead of being taken one completion at a time.
+ */
+static uint32_t
+nvme_qpair_scan_completions(struct spdk_nvme_qpair *qpair, uint32_t max_entries)
+{
+	struct spdk_nvme_cpl	*cpl;
+	struct nvme_request	*req;
+	uint32_t		head = qpair->cq_head;
+	uint32_t		count, i;
+	bool			phase = qpair->phase;
+
+	for (count = 0; count < max_entries; count++) {
+		cpl = &qpair->cpl[head];
+		if (cpl->status.p != phase) {
+			break;
+		}
+
+		nvme_prefetch(&qpair->tr[cpl->cid]);
+
+		if (++head == qpair->num_entries) {
+			head = 0;
+			phase = !phase;
+		}
+	}
+
+	head = qpair->cq_head;
+	for (i = 0; i < count; i++) {
+		req = qpair->tr[qpair->cpl[head].cid].req;
+		nvme_prefetch(req);
+		nvme_prefetch(&req->cb_fn);
+
+		if (++head == qpair->num_entries) {
+			head = 0;
+		}
+	}
+
+	return count;
+}
+
 int32_t
 spdk_nvme_qpair_process_completions(struct spdk_nvme_qpair *qpair, uint32_t max_completions)
 {
 	struct nvme_tracker	*tr;
 	struct spdk_nvme_cpl	*cpl;
 	uint32_t num_completions = 0;
+	uint32_t num_hits = 0;
+	uint32_t batch_size, i;
 
 	if (!nvme_qpair_check_enabled(qpair)) {
 		/*
@@ -454,6 +1025,28 @@ spdk_nvme_qpair_process_completions(struct spdk_nvme_qpair *qpair, uint32_t max_
 		return 0;
 	}
 
+	if (qpair->qos_enabled && !STAILQ_EMPTY(&qpair->qos_deferred_req)) {
+		nvme_qpair_qos_release(qpair);
+	}
+
+	if (qpair->dsm_coalescing) {
+		nvme_batcher_poll(&qpair->dsm->batcher);
+	}
+
+	if (qpair->write_merging) {
+		nvme_batcher_poll(&qpair->wm->batcher);
+	}
+
+	if (qpair->read_caching || qpair->reading_ahead) {
+		num_hits = nvme_qpair_complete_hits(qpair);
+	}
+
+	/*
+	 * Make sure any submissions batched up since the last poll are visible
+	 *  to the controller before looking for their completions.
+	 */
+	nvme_qpair_ring_sq_doorbell(qpair);
+
 	if (max_completions == 0 || (max_completions > (qpair->num_entries - 1U))) {
 
 		/*
@@ -464,29 +1057,48 @@ spdk_nvme_qpair_process_completions(struct spdk_nvme_qpair *qpair, uint32_t max_
 		max_completions = qpair->num_entries - 1;
 	}
 
-	while (1) {
-		cpl = &qpair->cpl[qpair->cq_head];
+	if (qpair->hybrid_polling && qpair->cpl[qpair->cq_head].status.p != qpair->phase) {
+		nvme_qpair_hybrid_poll_sleep(qpair);
+	}
 
-		if (cpl->status.p != qpair->phase)
+	while (num_completions < max_completions) {
+		batch_size = nvme_qpair_scan_completions(qpair,
+				nvme_min(max_completions - num_completions,
+					 NVME_COMPLETION_BATCH_SIZE));
+		if (batch_size == 0) {
 			break;
+		}
 
-		tr = &qpair->tr[cpl->cid];
+		for (i = 0; i < batch_size; i++) {
+			cpl = &qpair->cpl[qpair->cq_head];
 
-		if (tr->active) {
-			nvme_qpair_complete_tracker(qpair, tr, cpl, true);
-		} else {
-			nvme_printf(qpair->ctrlr,
-				    "cpl does not map to outstanding cmd\n");
-			nvme_qpair_print_completion(qpair, cpl);
-			nvme_assert(0, ("received completion for unknown cmd\n"));
-		}
+			/*
+			 * A callback earlier in this batch may have reset the
+			 *  controller, which clears the completion queue.
+			 */
+			if (cpl->status.p != qpair->phase) {
+				break;
+			}
 
-		if (++qpair->cq_head == qpair->num_entries) {
-			qpair->cq_head = 0;
-			qpair->phase = !qpair->phase;
+			tr = &qpair->tr[cpl->cid];
+
+			if (tr->active) {
+				nvme_qpair_complete_tracker(qpair, tr, cpl, true);
+			} else {
+				nvme_printf(qpair->ctrlr,
+					    "cpl does not map to outstanding cmd\n");
+				nvme_qpair_print_completion(qpair, cpl);
+				nvme_assert(0, ("received completion for unknown cmd\n"));
+			}
+
+			if (++qpair->cq_head == qpair->num_entries) {
+				qpair->cq_head = 0;
+				qpair->phase = !qpair->phase;
+			}
 		}
 
-		if (++num_completions == max_completions) {
+		num_completions += i;
+		if (i < batch_size) {
 			break;
 		}
 	}
@@ -495,16 +1107,26 @@ spdk_nvme_qpair_process_completions(struct spdk_nvme_qpair *qpair, uint32_t max_
 		spdk_mmio_write_4(qpair->cq_hdbl, qpair->cq_head);
 	}
 
-	return num_completions;
+	if (qpair->slots_cb_pending) {
+		nvme_qpair_check_slots_available(qpair);
+	}
+
+	/* Ring once for any I/O submitted from the completion callbacks above. */
+	nvme_qpair_ring_sq_doorbell(qpair);
+
+	if (qpair->timeouts_enabled) {
+		nvme_qpair_check_timeouts(qpair);
+	}
+
+	return num_completions + num_hits;
 }
 
 int
 nvme_qpair_construct(struct spdk_nvme_qpair *qpair, uint16_t id,
 		     uint16_t num_entries, uint16_t num_trackers,
-		     struct spdk_nvme_ctrlr *ctrlr)
+		     struct spdk_nvme_ctrlr *ctrlr, int socket_id)
 {
-	struct nvme_tracker	*tr;
-	uint16_t		i;
+	uint16_t		i, num_prp_lists;
 	volatile uint32_t	*doorbell_base;
 	uint64_t		phys_addr = 0;
 	uint64_t		offset;
@@ -512,15 +1134,62 @@ nvme_qpair_construct(struct spdk_nvme_qpair *qpair, uint16_t id,
 	nvme_assert(num_entries != 0, ("invalid num_entries\n"));
 	nvme_assert(num_trackers != 0, ("invalid num_trackers\n"));
 
+	if (id == 0) {
+		num_prp_lists = nvme_min(NVME_ADMIN_PRP_LISTS, num_trackers);
+	} else if (ctrlr->opts.io_queue_prp_lists != 0) {
+		num_prp_lists = nvme_min(ctrlr->opts.io_queue_prp_lists, num_trackers);
+	} else {
+		num_prp_lists = num_trackers;
+	}
+
 	qpair->id = id;
 	qpair->num_entries = num_entries;
+	qpair->num_trackers = num_trackers;
+	qpair->num_prp_lists = num_prp_lists;
+	qpair->socket_id = socket_id;
 	qpair->qprio = 0;
-	qpair->sq_in_cmb = false;
+	qpair->delay_sq_doorbell = false;
+	qpair->num_sq_doorbell_writes = 0;
+	qpair->latency_histogram = NULL;
+	qpair->hybrid_polling = false;
+	qpair->hybrid_poll = NULL;
+	qpair->req_cache = NULL;
+	qpair->fail_when_full = false;
+	qpair->slots_cb_pending = false;
+	qpair->slots_cb_fn = NULL;
+	qpair->slots_cb_arg = NULL;
+	qpair->qos = NULL;
+	qpair->qos_enabled = nvme_qpair_is_io_queue(qpair) && ctrlr->ns_qos_enabled;
+	STAILQ_INIT(&qpair->qos_deferred_req);
+	qpair->dsm = NULL;
+	qpair->dsm_coalescing = false;
+	qpair->wm = NULL;
+	qpair->write_merging = false;
+	qpair->read_cache = NULL;
+	qpair->read_caching = false;
+	qpair->readahead = NULL;
+	qpair->reading_ahead = false;
+	STAILQ_INIT(&qpair->hits);
 
 	qpair->ctrlr = ctrlr;
 
-	/* cmd and cpl rings must be aligned on 4KB boundaries. */
-	if (ctrlr->opts.use_cmb_sqs) {
+	/* Timeouts are only tracked for I/O queues. */
+	qpair->timeout_ticks = 0;
+	if (nvme_qpair_is_io_queue(qpair)) {
+		qpair->timeout_ticks = (uint64_t)ctrlr->opts.timeout_sec * nvme_get_tsc_hz();
+	}
+	qpair->timeouts_enabled = qpair->timeout_ticks != 0;
+	qpair->next_timeout_check_tick = 0;
+
+	/*
+	 * cmd and cpl rings must be aligned on 4KB boundaries.
+	 *  CMB space is never given back, so an I/O qpair that is constructed
+	 *  again after nvme_qpair_destroy() reuses its CMB submission queue.
+	 */
+	if (nvme_qpair_is_admin_queue(qpair) || !ctrlr->opts.use_cmb_sqs) {
+		qpair->sq_in_cmb = false;
+	}
+	if (ctrlr->opts.use_cmb_sqs && !qpair->sq_in_cmb) {
 		if (nvme_ctrlr_alloc_cmb(ctrlr, qpair->num_entries * sizeof(struct spdk_nvme_cmd),
 					 0x1000, &offset) == 0) {
 			qpair->cmd = ctrlr->cmb_bar_virt_addr + offset;
@@ -529,20 +1198,20 @@ nvme_qpair_construct(struct spdk_nvme_qpair *qpair, uint16_t id,
 		}
 	}
 	if (qpair->sq_in_cmb == false) {
-		qpair->cmd = nvme_malloc("qpair_cmd",
-					 qpair->num_entries * sizeof(struct spdk_nvme_cmd),
-					 0x1000,
-					 &qpair->cmd_bus_addr);
+		qpair->cmd = nvme_malloc_socket("qpair_cmd",
+						qpair->num_entries * sizeof(struct spdk_nvme_cmd),
+						0x1000,
+						&qpair->cmd_bus_addr, socket_id);
 		if (qpair->cmd == NULL) {
 			nvme_printf(ctrlr, "alloc qpair_cmd failed\n");
 			goto fail;
 		}
 	}
 
-	qpair->cpl = nvme_malloc("qpair_cpl",
-				 qpair->num_entries * sizeof(struct spdk_nvme_cpl),
-				 0x1000,
-				 &qpair->cpl_bus_addr);
+	qpair->cpl = nvme_malloc_socket("qpair_cpl",
+					qpair->num_entries * sizeof(struct spdk_nvme_cpl),
+					0x1000,
+					&qpair->cpl_bus_addr, socket_id);
 	if (qpair->cpl == NULL) {
 		nvme_printf(ctrlr, "alloc qpair_cpl failed\n");
 		goto fail;
@@ -552,27 +1221,58 @@ nvme_qpair_construct(struct spdk_nvme_qpair *qpair, uint16_t id,
 	qpair->sq_tdbl = doorbell_base + (2 * id + 0) * ctrlr->doorbell_stride_u32;
 	qpair->cq_hdbl = doorbell_base + (2 * id + 1) * ctrlr->doorbell_stride_u32;
 
-	LIST_INIT(&qpair->free_tr);
-	LIST_INIT(&qpair->outstanding_tr);
 	STAILQ_INIT(&qpair->queued_req);
+	qpair->queued_req_wait_prp_list = false;
 
 	/*
 	 * Reserve space for all of the trackers in a single allocation.
-	 *   struct nvme_tracker must be padded so that its size is already a power of 2.
-	 *   This ensures the PRP list embedded in the nvme_tracker object will not span a
-	 *   4KB boundary, while allowing access to trackers in tr[] via normal array indexing.
+	 *   struct nvme_tracker is padded so that its size is a power of 2, so
+	 *   aligning the array to its size keeps every tracker within one cacheline.
 	 */
-	qpair->tr = nvme_malloc("nvme_tr", num_trackers * sizeof(*tr), sizeof(*tr), &phys_addr);
-	if (qpair->tr == NULL) {
+	qpair->tr = nvme_malloc_socket("nvme_tr", num_trackers * sizeof(struct nvme_tracker),
+				       sizeof(struct nvme_tracker), &phys_addr, socket_id);
+	qpair->free_tr = nvme_malloc_socket("nvme_free_tr", num_trackers * sizeof(uint16_t), 64,
+					    &phys_addr, socket_id);
+	if (qpair->tr == NULL || qpair->free_tr == NULL) {
 		nvme_printf(ctrlr, "nvme_tr failed\n");
 		goto fail;
 	}
 
+	/*
+	 * PRP lists must not span a 4KB boundary, so each list is one 4KB-aligned page.
+	 */
+	qpair->prp_list = nvme_malloc_socket("nvme_prp_list",
+					     num_prp_lists * sizeof(struct nvme_prp_list),
+					     0x1000, &qpair->prp_list_bus_addr, socket_id);
+	qpair->free_prp_list = nvme_malloc_socket("nvme_free_prp_list",
+			       num_prp_lists * sizeof(uint16_t), 64, &phys_addr, socket_id);
+	qpair->prp_list_next = nvme_malloc_socket("nvme_prp_list_next",
+			       num_prp_lists * sizeof(uint16_t), 64, &phys_addr, socket_id);
+	if (qpair->prp_list == NULL || qpair->free_prp_list == NULL || qpair->prp_list_next == NULL) {
+		nvme_printf(ctrlr, "nvme_prp_list failed\n");
+		goto fail;
+	}
+
+	/* Fill the free stacks so that the lowest indices are handed out first. */
 	for (i = 0; i < num_trackers; i++) {
-		tr = &qpair->tr[i];
-		nvme_qpair_construct_tracker(tr, i, phys_addr);
-		LIST_INSERT_HEAD(&qpair->free_tr, tr, list);
-		phys_addr += sizeof(struct nvme_tracker);
+		nvme_qpair_construct_tracker(&qpair->tr[i], i);
+		qpair->free_tr[i] = num_trackers - 1 - i;
+	}
+	qpair->num_free_tr = num_trackers;
+
+	for (i = 0; i < num_prp_lists; i++) {
+		qpair->free_prp_list[i] = num_prp_lists - 1 - i;
+		qpair->prp_list_next[i] = NVME_NO_PRP_LIST;
+	}
+	qpair->num_free_prp_list = num_prp_lists;
+
+	/*
+	 * Admin commands are allocated from any thread before ctrlr_lock is taken,
+	 *  so only I/O qpairs get a request cache.
+	 */
+	if (nvme_qpair_is_io_queue(qpair) && nvme_request_cache_construct(qpair, num_trackers) != 0) {
+		nvme_printf(ctrlr, "nvme_req_cache failed\n");
+		goto fail;
 	}
 
 	nvme_qpair_reset(qpair);
@@ -586,17 +1286,22 @@ static void
 nvme_admin_qpair_abort_aers(struct spdk_nvme_qpair *qpair)
 {
 	struct nvme_tracker	*tr;
+	uint16_t		i;
 
-	tr = LIST_FIRST(&qpair->outstanding_tr);
-	while (tr != NULL) {
+	if (qpair->tr == NULL) {
+		return;
+	}
+
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (!tr->active) {
+			continue;
+		}
 		nvme_assert(tr->req != NULL, ("tr->req == NULL in abort_aers\n"));
 		if (tr->req->cmd.opc == SPDK_NVME_OPC_ASYNC_EVENT_REQUEST) {
 			nvme_qpair_manual_complete_tracker(qpair, tr,
 							   SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_ABORTED_SQ_DELETION, 0,
 							   false);
-			tr = LIST_FIRST(&qpair->outstanding_tr);
-		} else {
-			tr = LIST_NEXT(tr, list);
 		}
 	}
 }
@@ -611,6 +1316,8 @@ _nvme_admin_qpair_destroy(struct spdk_nvme_qpair *qpair)
 void
 nvme_qpair_destroy(struct spdk_nvme_qpair *qpair)
 {
+	struct nvme_request	*req;
+
 	if (nvme_qpair_is_admin_queue(qpair)) {
 		_nvme_admin_qpair_destroy(qpair);
 	}
@@ -626,6 +1333,39 @@ nvme_qpair_destroy(struct spdk_nvme_qpair *qpair)
 		nvme_free(qpair->tr);
 		qpair->tr = NULL;
 	}
+	if (qpair->free_tr) {
+		nvme_free(qpair->free_tr);
+		qpair->free_tr = NULL;
+	}
+	if (qpair->prp_list) {
+		nvme_free(qpair->prp_list);
+		qpair->prp_list = NULL;
+	}
+	if (qpair->free_prp_list) {
+		nvme_free(qpair->free_prp_list);
+		qpair->free_prp_list = NULL;
+	}
+	if (qpair->prp_list_next) {
+		nvme_free(qpair->prp_list_next);
+		qpair->prp_list_next = NULL;
+	}
+	nvme_qpair_read_cache_destroy(qpair);
+	nvme_qpair_readahead_destroy(qpair);
+	while ((req = STAILQ_FIRST(&qpair->hits)) != NULL) {
+		STAILQ_REMOVE_HEAD(&qpair->hits, stailq);
+		nvme_free_request(qpair, req);
+	}
+	nvme_request_cache_destroy(qpair);
+	free(qpair->latency_histogram);
+	qpair->latency_histogram = NULL;
+	qpair->hybrid_polling = false;
+	free(qpair->hybrid_poll);
+	qpair->hybrid_poll = NULL;
+	free(qpair->qos);
+	qpair->qos = NULL;
+	qpair->qos_enabled = false;
+	nvme_qpair_dsm_destroy(qpair);
+	nvme_qpair_write_merge_destroy(qpair);
 }
 
 static void
@@ -655,12 +1395,21 @@ _nvme_qpair_build_contig_request(struct spdk_nvme_qpair *qpair, struct nvme_requ
 				 struct nvme_tracker *tr)
 {
 	uint64_t phys_addr;
-	void *seg_addr;
+	uint64_t extent_phys, extent_len, offset;
+	void *seg_addr, *extent_addr;
 	uint32_t nseg, cur_nseg, modulo, unaligned;
 	void *md_payload;
 	void *payload = req->payload.u.contig + req->payload_offset;
+	struct nvme_prp_list *prp_list;
 
-	phys_addr = nvme_vtophys(payload);
+	/*
+	 * Translate the payload one physically contiguous extent at a time (usually
+	 *  a single hugepage covers the whole transfer), and compute the PRP entries
+	 *  within an extent from its base address.
+	 */
+	extent_addr = payload;
+	extent_len = req->payload_size;
+	phys_addr = extent_phys = nvme_vtophys_range(payload, &extent_len);
 	if (phys_addr == NVME_VTOPHYS_ERROR) {
 		_nvme_fail_request_bad_vtophys(qpair, tr);
 		return -1;
@@ -683,27 +1432,115 @@ _nvme_qpair_build_contig_request(struct spdk_nvme_qpair *qpair, struct nvme_requ
 
 	tr->req->cmd.psdt = SPDK_NVME_PSDT_PRP;
 	tr->req->cmd.dptr.prp.prp1 = phys_addr;
-	if (nseg == 2) {
-		seg_addr = payload + PAGE_SIZE - unaligned;
-		tr->req->cmd.dptr.prp.prp2 = nvme_vtophys(seg_addr);
-	} else if (nseg > 2) {
-		cur_nseg = 1;
-		tr->req->cmd.dptr.prp.prp2 = (uint64_t)tr->prp_sgl_bus_addr;
-		while (cur_nseg < nseg) {
+	if (nseg >= 2) {
+		if (nseg > 2) {
+			prp_list = nvme_qpair_get_prp_list(qpair, tr);
+			if (prp_list == NULL) {
+				return -EAGAIN;
+			}
+			tr->req->cmd.dptr.prp.prp2 = nvme_qpair_prp_list_bus_addr(qpair, tr->prp_list);
+		} else {
+			prp_list = NULL;
+		}
+
+		for (cur_nseg = 1; cur_nseg < nseg; cur_nseg++) {
 			seg_addr = payload + cur_nseg * PAGE_SIZE - unaligned;
-			phys_addr = nvme_vtophys(seg_addr);
-			if (phys_addr == NVME_VTOPHYS_ERROR) {
-				_nvme_fail_request_bad_vtophys(qpair, tr);
-				return -1;
+			offset = (uint64_t)(seg_addr - extent_addr);
+			if (offset >= extent_len) {
+				extent_addr = seg_addr;
+				extent_len = req->payload_size - (uint64_t)(seg_addr - payload);
+				extent_phys = nvme_vtophys_range(seg_addr, &extent_len);
+				if (extent_phys == NVME_VTOPHYS_ERROR) {
+					_nvme_fail_request_bad_vtophys(qpair, tr);
+					return -1;
+				}
+				offset = 0;
+			}
+
+			if (prp_list == NULL) {
+				tr->req->cmd.dptr.prp.prp2 = extent_phys + offset;
+			} else {
+				prp_list->u.prp[cur_nseg - 1] = extent_phys + offset;
 			}
-			tr->u.prp[cur_nseg - 1] = phys_addr;
-			cur_nseg++;
 		}
 	}
 
 	return 0;
 }
 
+/*
+ * Position within a scattered (SGL or IOV) payload while its PRPs or SGL
+ *  descriptors are being built.  Only used for IOV payloads; SGL payloads keep
+ *  their position in the caller's cb_arg.
+ */
+struct nvme_sge_iter {
+	uint32_t	idx;
+	uint32_t	offset;
+};
+
+static inline void
+nvme_payload_reset_sge(struct nvme_request *req, struct nvme_sge_iter *iter)
+{
+	const struct iovec	*iov = req->payload.u.iov.iov;
+	uint32_t		offset = req->payload_offset;
+
+	iter->idx = 0;
+	iter->offset = 0;
+
+	if (req->payload.type == NVME_PAYLOAD_TYPE_SGL) {
+		nvme_assert(req->payload.u.sgl.reset_sgl_fn != NULL, ("sgl reset callback required\n"));
+		req->payload.u.sgl.reset_sgl_fn(req->payload.u.sgl.cb_arg, offset);
+		return;
+	}
+
+	while (iter->idx < req->payload.u.iov.iovcnt && offset >= iov[iter->idx].iov_len) {
+		offset -= iov[iter->idx].iov_len;
+		iter->idx++;
+	}
+	iter->offset = offset;
+}
+
+/*
+ * Return the physical address and length of the next physically contiguous
+ *  element of the payload.  IOV payloads are walked inline so that building a
+ *  command costs no indirect call per element.
+ */
+static inline int
+nvme_payload_next_sge(struct nvme_request *req, struct nvme_sge_iter *iter,
+		      uint64_t *phys_addr, uint32_t *length)
+{
+	const struct iovec	*iov;
+
+	if (req->payload.type == NVME_PAYLOAD_TYPE_SGL) {
+		nvme_assert(req->payload.u.sgl.next_sge_fn != NULL, ("sgl callback required\n"));
+		return req->payload.u.sgl.next_sge_fn(req->payload.u.sgl.cb_arg, phys_addr, length);
+	}
+
+	/* Skip empty elements. */
+	while (iter->idx < req->payload.u.iov.iovcnt &&
+	       req->payload.u.iov.iov[iter->idx].iov_len == 0) {
+		iter->idx++;
+	}
+	if (iter->idx >= req->payload.u.iov.iovcnt) {
+		return -1;
+	}
+
+	iov = &req->payload.u.iov.iov[iter->idx];
+	if (req->payload.u.iov.phys != NULL) {
+		*phys_addr = req->payload.u.iov.phys[iter->idx] + iter->offset;
+	} else {
+		*phys_addr = nvme_vtophys((uint8_t *)iov->iov_base + iter->offset);
+		if (*phys_addr == NVME_VTOPHYS_ERROR) {
+			return -1;
+		}
+	}
+	*length = iov->iov_len - iter->offset;
+
+	iter->idx++;
+	iter->offset = 0;
+	return 0;
+}
+
 /**
  * Build SGL list describing scattered payload buffer.
  */
@@ -714,31 +1551,42 @@ _nvme_qpair_build_hw_sgl_request(struct spdk_nvme_qpair *qpair, struct nvme_requ
 	int rc;
 	uint64_t phys_addr;
 	uint32_t remaining_transfer_len, length;
-	struct spdk_nvme_sgl_descriptor *sgl;
-	uint32_t nseg = 0;
+	struct spdk_nvme_sgl_descriptor *sgl, *link, first;
+	struct nvme_prp_list *prp_list = NULL;
+	uint32_t nseg = 0, num_segments = 0, max_segments;
+	uint16_t list_idx = NVME_NO_PRP_LIST, next_idx;
+	struct nvme_sge_iter iter;
 
 	/*
 	 * Build scattered payloads.
 	 */
 	nvme_assert(req->payload_size != 0, ("cannot build SGL for zero-length transfer\n"));
-	nvme_assert(req->payload.type == NVME_PAYLOAD_TYPE_SGL, ("sgl payload type required\n"));
-	nvme_assert(req->payload.u.sgl.reset_sgl_fn != NULL, ("sgl reset callback required\n"));
-	nvme_assert(req->payload.u.sgl.next_sge_fn != NULL, ("sgl callback required\n"));
-	req->payload.u.sgl.reset_sgl_fn(req->payload.u.sgl.cb_arg, req->payload_offset);
+	nvme_assert(req->payload.type == NVME_PAYLOAD_TYPE_SGL ||
+		    req->payload.type == NVME_PAYLOAD_TYPE_IOV, ("scattered payload type required\n"));
+	nvme_payload_reset_sge(req, &iter);
 
-	sgl = tr->u.sgl;
+	/*
+	 * A request may not chain more list pages than the pool holds, or it could
+	 *  never be submitted.
+	 */
+	max_segments = nvme_min(NVME_MAX_SGL_SEGMENTS, qpair->num_prp_lists);
+
+	/*
+	 * The first descriptor is built on the stack, since it goes directly into SGL1
+	 *  when it covers the whole transfer.  A list page is only taken once a second
+	 *  descriptor is needed.  link is the descriptor that points at the segment
+	 *  currently being filled: SGL1 for the first segment, and the last entry of
+	 *  the previous page for each chained one.
+	 */
+	sgl = &first;
+	link = &req->cmd.dptr.sgl1;
 	req->cmd.psdt = SPDK_NVME_PSDT_SGL_MPTR_SGL;
 	req->cmd.dptr.sgl1.unkeyed.subtype = 0;
 
 	remaining_transfer_len = req->payload_size;
 
 	while (remaining_transfer_len > 0) {
-		if (nseg >= NVME_MAX_SGL_DESCRIPTORS) {
-			_nvme_fail_request_bad_vtophys(qpair, tr);
-			return -1;
-		}
-
-		rc = req->payload.u.sgl.next_sge_fn(req->payload.u.sgl.cb_arg, &phys_addr, &length);
+		rc = nvme_payload_next_sge(req, &iter, &phys_addr, &length);
 		if (rc) {
 			_nvme_fail_request_bad_vtophys(qpair, tr);
 			return -1;
@@ -747,6 +1595,44 @@ _nvme_qpair_build_hw_sgl_request(struct spdk_nvme_qpair *qpair, struct nvme_requ
 		length = nvme_min(remaining_transfer_len, length);
 		remaining_transfer_len -= length;
 
+		if (num_segments == 0 && nseg == 1) {
+			prp_list = nvme_qpair_get_prp_list(qpair, tr);
+			if (prp_list == NULL) {
+				return -EAGAIN;
+			}
+			list_idx = tr->prp_list;
+			num_segments = 1;
+			prp_list->u.sgl[0] = first;
+			sgl = &prp_list->u.sgl[1];
+		} else if (nseg == NVME_MAX_SGL_DESCRIPTORS) {
+			/*
+			 * This page is full.  Move its last descriptor to the start of a
+			 *  new page and replace it with a Segment descriptor pointing there.
+			 */
+			if (num_segments >= max_segments) {
+				_nvme_fail_request_bad_vtophys(qpair, tr);
+				return -1;
+			}
+
+			next_idx = nvme_qpair_chain_prp_list(qpair, list_idx);
+			if (next_idx == NVME_NO_PRP_LIST) {
+				return -EAGAIN;
+			}
+
+			link->unkeyed.type = SPDK_NVME_SGL_TYPE_SEGMENT;
+			link->unkeyed.subtype = 0;
+			link->unkeyed.length = NVME_MAX_SGL_DESCRIPTORS * sizeof(struct spdk_nvme_sgl_descriptor);
+			link->address = nvme_qpair_prp_list_bus_addr(qpair, list_idx);
+
+			link = &prp_list->u.sgl[NVME_MAX_SGL_DESCRIPTORS - 1];
+			prp_list = &qpair->prp_list[next_idx];
+			prp_list->u.sgl[0] = *link;
+			sgl = &prp_list->u.sgl[1];
+			list_idx = next_idx;
+			num_segments++;
+			nseg = 1;
+		}
+
 		sgl->unkeyed.type = SPDK_NVME_SGL_TYPE_DATA_BLOCK;
 		sgl->unkeyed.length = length;
 		sgl->address = phys_addr;
@@ -756,21 +1642,21 @@ _nvme_qpair_build_hw_sgl_request(struct spdk_nvme_qpair *qpair, struct nvme_requ
 		nseg++;
 	}
 
-	if (nseg == 1) {
+	if (num_segments == 0) {
 		/*
 		 * The whole transfer can be described by a single SGL descriptor.
 		 *  Use the special case described by the spec where SGL1's type is Data Block.
-		 *  This means the SGL in the tracker is not used at all, so copy the first (and only)
+		 *  This means no SGL list page is used at all, so copy the first (and only)
 		 *  SGL element into SGL1.
 		 */
 		req->cmd.dptr.sgl1.unkeyed.type = SPDK_NVME_SGL_TYPE_DATA_BLOCK;
-		req->cmd.dptr.sgl1.address = tr->u.sgl[0].address;
-		req->cmd.dptr.sgl1.unkeyed.length = tr->u.sgl[0].unkeyed.length;
+		req->cmd.dptr.sgl1.address = first.address;
+		req->cmd.dptr.sgl1.unkeyed.length = first.unkeyed.length;
 	} else {
-		/* For now we can only support 1 SGL segment in NVMe controller */
-		req->cmd.dptr.sgl1.unkeyed.type = SPDK_NVME_SGL_TYPE_LAST_SEGMENT;
-		req->cmd.dptr.sgl1.address = tr->prp_sgl_bus_addr;
-		req->cmd.dptr.sgl1.unkeyed.length = nseg * sizeof(struct spdk_nvme_sgl_descriptor);
+		link->unkeyed.type = SPDK_NVME_SGL_TYPE_LAST_SEGMENT;
+		link->unkeyed.subtype = 0;
+		link->unkeyed.length = nseg * sizeof(struct spdk_nvme_sgl_descriptor);
+		link->address = nvme_qpair_prp_list_bus_addr(qpair, list_idx);
 	}
 
 	return 0;
@@ -789,21 +1675,22 @@ _nvme_qpair_build_prps_sgl_request(struct spdk_nvme_qpair *qpair, struct nvme_re
 	uint32_t nseg, cur_nseg, total_nseg, last_nseg, modulo, unaligned;
 	uint32_t sge_count = 0;
 	uint64_t prp2 = 0;
+	struct nvme_prp_list *prp_list;
+	struct nvme_sge_iter iter;
 
 	/*
 	 * Build scattered payloads.
 	 */
-	nvme_assert(req->payload.type == NVME_PAYLOAD_TYPE_SGL, ("sgl payload type required\n"));
-	nvme_assert(req->payload.u.sgl.reset_sgl_fn != NULL, ("sgl reset callback required\n"));
-	req->payload.u.sgl.reset_sgl_fn(req->payload.u.sgl.cb_arg, req->payload_offset);
+	nvme_assert(req->payload.type == NVME_PAYLOAD_TYPE_SGL ||
+		    req->payload.type == NVME_PAYLOAD_TYPE_IOV, ("scattered payload type required\n"));
+	nvme_payload_reset_sge(req, &iter);
 
 	remaining_transfer_len = req->payload_size;
 	total_nseg = 0;
 	last_nseg = 0;
 
 	while (remaining_transfer_len > 0) {
-		nvme_assert(req->payload.u.sgl.next_sge_fn != NULL, ("sgl callback required\n"));
-		rc = req->payload.u.sgl.next_sge_fn(req->payload.u.sgl.cb_arg, &phys_addr, &length);
+		rc = nvme_payload_next_sge(req, &iter, &phys_addr, &length);
 		if (rc) {
 			_nvme_fail_request_bad_vtophys(qpair, tr);
 			return -1;
@@ -840,13 +1727,18 @@ _nvme_qpair_build_prps_sgl_request(struct spdk_nvme_qpair *qpair, struct nvme_re
 			else
 				cur_nseg = 0;
 
-			tr->req->cmd.dptr.prp.prp2 = (uint64_t)tr->prp_sgl_bus_addr;
+			prp_list = nvme_qpair_get_prp_list(qpair, tr);
+			if (prp_list == NULL) {
+				return -EAGAIN;
+			}
+
+			tr->req->cmd.dptr.prp.prp2 = nvme_qpair_prp_list_bus_addr(qpair, tr->prp_list);
 			while (cur_nseg < nseg) {
 				if (prp2) {
-					tr->u.prp[0] = prp2;
-					tr->u.prp[last_nseg + 1] = phys_addr + cur_nseg * PAGE_SIZE - unaligned;
+					prp_list->u.prp[0] = prp2;
+					prp_list->u.prp[last_nseg + 1] = phys_addr + cur_nseg * PAGE_SIZE - unaligned;
 				} else
-					tr->u.prp[last_nseg] = phys_addr + cur_nseg * PAGE_SIZE - unaligned;
+					prp_list->u.prp[last_nseg] = phys_addr + cur_nseg * PAGE_SIZE - unaligned;
 
 				last_nseg++;
 				cur_nseg++;
@@ -865,17 +1757,143 @@ _nvme_qpair_build_prps_sgl_request(struct spdk_nvme_qpair *qpair, struct nvme_re
 	return 0;
 }
 
+static void
+nvme_qpair_free_children(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
+{
+	struct nvme_request	*child_req, *tmp;
+
+	if (req->num_children) {
+		TAILQ_FOREACH_SAFE(child_req, &req->children, child_tailq, tmp) {
+			nvme_request_remove_child(req, child_req);
+			nvme_free_request(qpair, child_req);
+		}
+	}
+}
+
+static void
+nvme_qpair_free_unsubmitted_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
+{
+	nvme_qpair_free_children(qpair, req);
+	nvme_free_request(qpair, req);
+}
+
+/*
+ * Submit the requests held back by QoS limits, in order, for as long as
+ *  the limits allow.  Once the controller has failed they are all completed
+ *  with an error instead.
+ */
+void
+nvme_qpair_qos_release(struct spdk_nvme_qpair *qpair)
+{
+	struct nvme_request	*req;
+
+	while ((req = STAILQ_FIRST(&qpair->qos_deferred_req)) != NULL) {
+		if (qpair->ctrlr->is_failed) {
+			/* _nvme_qpair_submit_request() would free it without calling back. */
+			STAILQ_REMOVE_HEAD(&qpair->qos_deferred_req, stailq);
+			nvme_qpair_free_children(qpair, req);
+			nvme_qpair_manual_complete_request(qpair, req, SPDK_NVME_SCT_GENERIC,
+							   SPDK_NVME_SC_ABORTED_BY_REQUEST, true);
+			continue;
+		}
+		if (!nvme_qos_admit(qpair, req, false)) {
+			break;
+		}
+		STAILQ_REMOVE_HEAD(&qpair->qos_deferred_req, stailq);
+		/*
+		 * Other errors complete the request (or its children) with an
+		 *  error status, and a lack of trackers queues it, so nothing
+		 *  is lost here.
+		 */
+		_nvme_qpair_submit_request(qpair, req);
+	}
+}
+
+/*
+ * Call fn for each LBA range whose data req changes: writes, write zeroes,
+ *  write uncorrectable, and the ranges of a Dataset Management deallocate.
+ */
+void
+nvme_request_foreach_written_range(struct spdk_nvme_qpair *qpair, const struct nvme_request *req,
+				   nvme_lba_range_fn fn, void *ctx)
+{
+	struct spdk_nvme_ctrlr			*ctrlr = qpair->ctrlr;
+	const struct spdk_nvme_cmd		*cmd = &req->cmd;
+	const struct spdk_nvme_dsm_range	*ranges;
+	struct spdk_nvme_ns			*ns;
+	uint32_t				i;
+
+	if (cmd->opc != SPDK_NVME_OPC_WRITE && cmd->opc != SPDK_NVME_OPC_WRITE_ZEROES &&
+	    cmd->opc != SPDK_NVME_OPC_WRITE_UNCORRECTABLE &&
+	    cmd->opc != SPDK_NVME_OPC_DATASET_MANAGEMENT) {
+		return;
+	}
+
+	if (cmd->nsid == 0 || cmd->nsid > ctrlr->num_ns) {
+		return;
+	}
+	ns = &ctrlr->ns[cmd->nsid - 1];
+
+	if (cmd->opc != SPDK_NVME_OPC_DATASET_MANAGEMENT) {
+		fn(ctx, ns, *(const uint64_t *)&cmd->cdw10, (cmd->cdw12 & 0xFFFF) + 1);
+		return;
+	}
+
+	if (!(cmd->cdw11 & SPDK_NVME_DSM_ATTR_DEALLOCATE) ||
+	    req->payload.type != NVME_PAYLOAD_TYPE_CONTIG) {
+		return;
+	}
+	ranges = (const struct spdk_nvme_dsm_range *)((const uint8_t *)req->payload.u.contig +
+			req->payload_offset);
+	for (i = 0; i <= (cmd->cdw10 & 0xFF); i++) {
+		fn(ctx, ns, ranges[i].starting_lba, ranges[i].length);
+	}
+}
+
+/*
+ * Submit a request that the caller has not handed to the driver before.
+ *  Requests that were queued (and so already accepted) are resubmitted
+ *  through _nvme_qpair_submit_request() and are never rejected for lack
+ *  of free slots.
+ */
 int
 nvme_qpair_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
+{
+	uint32_t		num_trackers = req->num_children ? req->num_children : 1;
+
+	/*
+	 * A disabled qpair (controller reset in progress) queues everything;
+	 *  that is not the queue pair being full.
+	 */
+	if (!qpair->ctrlr->is_failed && nvme_qpair_check_enabled(qpair) &&
+	    spdk_nvme_qpair_get_num_free_slots(qpair) < num_trackers) {
+		qpair->slots_cb_pending = true;
+		if (qpair->fail_when_full) {
+			nvme_qpair_free_unsubmitted_request(qpair, req);
+			return -EAGAIN;
+		}
+	}
+
+	if (qpair->qos_enabled &&
+	    !nvme_qos_admit(qpair, req, !STAILQ_EMPTY(&qpair->qos_deferred_req))) {
+		/* Over a rate limit; submitted later by nvme_qpair_qos_release(). */
+		STAILQ_INSERT_TAIL(&qpair->qos_deferred_req, req, stailq);
+		return 0;
+	}
+
+	return _nvme_qpair_submit_request(qpair, req);
+}
+
+static int
+_nvme_qpair_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
 {
 	int			rc = 0;
-	struct nvme_tracker	*tr;
 	struct nvme_request	*child_req, *tmp;
 	struct spdk_nvme_ctrlr	*ctrlr = qpair->ctrlr;
 	bool			child_req_failed = false;
 
 	if (ctrlr->is_failed) {
-		nvme_free_request(req);
+		nvme_qpair_free_unsubmitted_request(qpair, req);
 		return -ENXIO;
 	}
 
@@ -888,24 +1906,23 @@ nvme_qpair_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *re
 		 */
 		TAILQ_FOREACH_SAFE(child_req, &req->children, child_tailq, tmp) {
 			if (!child_req_failed) {
-				rc = nvme_qpair_submit_request(qpair, child_req);
+				rc = _nvme_qpair_submit_request(qpair, child_req);
 				if (rc != 0)
 					child_req_failed = true;
 			} else { /* free remaining child_reqs since one child_req fails */
 				nvme_request_remove_child(req, child_req);
-				nvme_free_request(child_req);
+				nvme_free_request(qpair, child_req);
 			}
 		}
 
 		return rc;
 	}
 
-	tr = LIST_FIRST(&qpair->free_tr);
-
-	if (tr == NULL || !qpair->is_enabled) {
+	rc = nvme_qpair_try_submit_request(qpair, req);
+	if (rc == -EAGAIN) {
 		/*
-		 * No tracker is available, or the qpair is disabled due to
-		 *  an in-progress controller-level reset.
+		 * No tracker or list page is available, or the qpair is disabled
+		 *  due to an in-progress controller-level reset.
 		 *
 		 * Put the request on the qpair's request queue to be
 		 *  processed when a tracker frees up via a command
@@ -916,8 +1933,36 @@ nvme_qpair_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *re
 		return 0;
 	}
 
-	LIST_REMOVE(tr, list); /* remove tr from free_tr */
-	LIST_INSERT_HEAD(&qpair->outstanding_tr, tr, list);
+	return rc;
+}
+
+/*
+ * Submit a request that is not split.  Returns -EAGAIN, without queueing the
+ *  request, if it cannot get a tracker or the PRP/SGL list pages it needs.
+ */
+static int
+nvme_qpair_try_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
+{
+	int			rc = 0;
+	struct nvme_tracker	*tr;
+	struct spdk_nvme_ctrlr	*ctrlr = qpair->ctrlr;
+
+	if (ctrlr->num_caching_qpairs != 0) {
+		nvme_request_foreach_written_range(qpair, req, nvme_ns_bump_write_epoch, NULL);
+	}
+
+	if (qpair->read_caching) {
+		nvme_qpair_read_cache_invalidate(qpair, req);
+	}
+
+	if (qpair->reading_ahead) {
+		nvme_qpair_readahead_invalidate(qpair, req);
+	}
+
+	if (!qpair->is_enabled || (tr = nvme_qpair_get_tracker(qpair)) == NULL) {
+		return -EAGAIN;
+	}
+
 	tr->req = req;
 	req->cmd.cid = tr->cid;
 
@@ -925,23 +1970,27 @@ nvme_qpair_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *re
 		/* Null payload - leave PRP fields zeroed */
 	} else if (req->payload.type == NVME_PAYLOAD_TYPE_CONTIG) {
 		rc = _nvme_qpair_build_contig_request(qpair, req, tr);
-		if (rc < 0) {
-			return rc;
-		}
-	} else if (req->payload.type == NVME_PAYLOAD_TYPE_SGL) {
+	} else if (req->payload.type == NVME_PAYLOAD_TYPE_SGL ||
+		   req->payload.type == NVME_PAYLOAD_TYPE_IOV) {
 		if (ctrlr->flags & SPDK_NVME_CTRLR_SGL_SUPPORTED)
 			rc = _nvme_qpair_build_hw_sgl_request(qpair, req, tr);
 		else
 			rc = _nvme_qpair_build_prps_sgl_request(qpair, req, tr);
-		if (rc < 0) {
-			return rc;
-		}
 	} else {
 		nvme_assert(0, ("invalid NVMe payload type %d\n", req->payload.type));
 		_nvme_fail_request_bad_vtophys(qpair, tr);
 		return -EINVAL;
 	}
 
+	if (rc == -EAGAIN) {
+		/* No PRP/SGL list page is available.  Give the tracker back. */
+		tr->req = NULL;
+		nvme_qpair_put_tracker(qpair, tr);
+		return -EAGAIN;
+	} else if (rc < 0) {
+		return rc;
+	}
+
 	nvme_qpair_submit_tracker(qpair, tr);
 	return 0;
 }
@@ -950,6 +1999,7 @@ void
 nvme_qpair_reset(struct spdk_nvme_qpair *qpair)
 {
 	qpair->sq_tail = qpair->cq_head = 0;
+	qpair->sq_doorbell_pending = false;
 
 	/*
 	 * First time through the completion queue, HW will set phase
@@ -970,7 +2020,7 @@ static void
 _nvme_admin_qpair_enable(struct spdk_nvme_qpair *qpair)
 {
 	struct nvme_tracker		*tr;
-	struct nvme_tracker		*tr_temp;
+	uint16_t			i;
 
 	/*
 	 * Manually abort each outstanding admin command.  Do not retry
@@ -978,7 +2028,11 @@ _nvme_admin_qpair_enable(struct spdk_nvme_qpair *qpair)
 	 *  a controller reset and its likely the context in which the
 	 *  command was issued no longer applies.
 	 */
-	LIST_FOREACH_SAFE(tr, &qpair->outstanding_tr, list, tr_temp) {
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (!tr->active) {
+			continue;
+		}
 		nvme_printf(qpair->ctrlr,
 			    "aborting outstanding admin command\n");
 		nvme_qpair_manual_complete_tracker(qpair, tr, SPDK_NVME_SCT_GENERIC,
@@ -993,8 +2047,8 @@ _nvme_io_qpair_enable(struct spdk_nvme_qpair *qpair)
 {
 	STAILQ_HEAD(, nvme_request)	temp;
 	struct nvme_tracker		*tr;
-	struct nvme_tracker		*tr_temp;
 	struct nvme_request		*req;
+	uint16_t			i;
 
 	qpair->is_enabled = true;
 	/*
@@ -1002,7 +2056,11 @@ _nvme_io_qpair_enable(struct spdk_nvme_qpair *qpair)
 	 *  retry, unless the retry count on the associated request has
 	 *  reached its limit.
 	 */
-	LIST_FOREACH_SAFE(tr, &qpair->outstanding_tr, list, tr_temp) {
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (!tr->active) {
+			continue;
+		}
 		nvme_printf(qpair->ctrlr, "aborting outstanding i/o\n");
 		nvme_qpair_manual_complete_tracker(qpair, tr, SPDK_NVME_SCT_GENERIC,
 						   SPDK_NVME_SC_ABORTED_BY_REQUEST, 0, true);
@@ -1018,7 +2076,7 @@ _nvme_io_qpair_enable(struct spdk_nvme_qpair *qpair)
 
 		nvme_printf(qpair->ctrlr, "resubmitting queued i/o\n");
 		nvme_qpair_print_command(qpair, &req->cmd);
-		if (nvme_qpair_submit_request(qpair, req) != 0) {
+		if (_nvme_qpair_submit_request(qpair, req) != 0) {
 			_nvme_fail_request_ctrlr_failed(qpair, req);
 		}
 	}
@@ -1062,6 +2120,18 @@ nvme_qpair_fail(struct spdk_nvme_qpair *qpair)
 {
 	struct nvme_tracker		*tr;
 	struct nvme_request		*req;
+	uint16_t			i;
+
+	/* Deallocates and writes still waiting to be coalesced. */
+	if (qpair->dsm != NULL) {
+		nvme_batcher_fail(&qpair->dsm->batcher);
+	}
+	if (qpair->wm != NULL) {
+		nvme_batcher_fail(&qpair->wm->batcher);
+	}
+
+	/* Read cache and readahead hits already have their data. */
+	nvme_qpair_complete_hits(qpair);
 
 	while (!STAILQ_EMPTY(&qpair->queued_req)) {
 		req = STAILQ_FIRST(&qpair->queued_req);
@@ -1071,11 +2141,24 @@ nvme_qpair_fail(struct spdk_nvme_qpair *qpair)
 						   SPDK_NVME_SC_ABORTED_BY_REQUEST, true);
 	}
 
+	while (!STAILQ_EMPTY(&qpair->qos_deferred_req)) {
+		req = STAILQ_FIRST(&qpair->qos_deferred_req);
+		STAILQ_REMOVE_HEAD(&qpair->qos_deferred_req, stailq);
+		nvme_printf(qpair->ctrlr, "failing rate limited i/o\n");
+		/* Split parents are held back whole; their children were never submitted. */
+		nvme_qpair_free_children(qpair, req);
+		nvme_qpair_manual_complete_request(qpair, req, SPDK_NVME_SCT_GENERIC,
+						   SPDK_NVME_SC_ABORTED_BY_REQUEST, true);
+	}
+
 	/* Manually abort each outstanding I/O. */
-	while (!LIST_EMPTY(&qpair->outstanding_tr)) {
-		tr = LIST_FIRST(&qpair->outstanding_tr);
+	for (i = 0; i < qpair->num_trackers; i++) {
+		tr = &qpair->tr[i];
+		if (!tr->active) {
+			continue;
+		}
 		/*
-		 * Do not remove the tracker.  The abort_tracker path will
+		 * Do not release the tracker.  The abort_tracker path will
 		 *  do that for us.
 		 */
 		nvme_printf(qpair->ctrlr, "failing outstanding i/o\n");
@@ -0,0 +1,417 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "nvme_internal.h"
+
+/*
+ * Per-qpair read cache.  Single 4 KiB block reads through
+ *  spdk_nvme_ns_cmd_read() are looked up by (namespace, LBA) in an
+ *  open-addressing index with linear probing.  Misses are read into a
+ *  DMA-able cache block and copied out when they complete, and victims are
+ *  chosen with the CLOCK algorithm.  Writes, write zeroes, write
+ *  uncorrectable and deallocate commands on the qpair drop the blocks they
+ *  cover, both when they are submitted and when they complete, so that a
+ *  block read while a write to it is outstanding is never kept.  Writes
+ *  through other qpairs are caught by the namespace write epochs, which are
+ *  recorded when a block is read and checked on every hit.
+ */
+
+static inline uint32_t
+nvme_read_cache_hash(const struct nvme_read_cache *cache, const struct spdk_nvme_ns *ns,
+		     uint64_t lba)
+{
+	uint64_t h = (lba ^ ((uint64_t)(uintptr_t)ns << 16)) * 0x9E3779B97F4A7C15ULL;
+
+	return (uint32_t)(h >> 32) & cache->index_mask;
+}
+
+static inline uint8_t *
+nvme_read_cache_block(const struct nvme_read_cache *cache, const struct nvme_read_cache_entry *entry)
+{
+	return cache->blocks + (size_t)(entry - cache->entries) * NVME_READ_CACHE_BLOCK_SIZE;
+}
+
+/* Returns the index slot of the block, or NVME_READ_CACHE_NO_ENTRY. */
+static uint32_t
+nvme_read_cache_find(const struct nvme_read_cache *cache, const struct spdk_nvme_ns *ns,
+		     uint64_t lba)
+{
+	const struct nvme_read_cache_entry	*entry;
+	uint32_t				slot = nvme_read_cache_hash(cache, ns, lba);
+
+	/* The index has at least twice as many slots as entries, so an empty slot ends the probe. */
+	while (cache->index[slot] != NVME_READ_CACHE_NO_ENTRY) {
+		entry = &cache->entries[cache->index[slot]];
+		if (entry->ns == ns && entry->lba == lba) {
+			return slot;
+		}
+		slot = (slot + 1) & cache->index_mask;
+	}
+
+	return NVME_READ_CACHE_NO_ENTRY;
+}
+
+static void
+nvme_read_cache_insert(struct nvme_read_cache *cache, struct nvme_read_cache_entry *entry)
+{
+	uint32_t slot = nvme_read_cache_hash(cache, entry->ns, entry->lba);
+
+	while (cache->index[slot] != NVME_READ_CACHE_NO_ENTRY) {
+		slot = (slot + 1) & cache->index_mask;
+	}
+	cache->index[slot] = entry - cache->entries;
+}
+
+/*
+ * Free the entry at an index slot.  Later entries of the probe sequence are
+ *  shifted back into the hole, so lookups never need tombstones.
+ */
+static void
+nvme_read_cache_remove(struct nvme_read_cache *cache, uint32_t slot)
+{
+	struct nvme_read_cache_entry	*entry;
+	uint32_t			next, home;
+
+	cache->entries[cache->index[slot]].ns = NULL;
+
+	next = slot;
+	for (;;) {
+		cache->index[slot] = NVME_READ_CACHE_NO_ENTRY;
+		for (;;) {
+			next = (next + 1) & cache->index_mask;
+			if (cache->index[next] == NVME_READ_CACHE_NO_ENTRY) {
+				return;
+			}
+			entry = &cache->entries[cache->index[next]];
+			home = nvme_read_cache_hash(cache, entry->ns, entry->lba);
+			/* Stop at the first entry whose home is not cyclically within (slot, next]. */
+			if (slot <= next ? (home <= slot || home > next) : (home <= slot && home > next)) {
+				break;
+			}
+		}
+		cache->index[slot] = cache->index[next];
+		slot = next;
+	}
+}
+
+/* Returns an unused entry, evicting a block if needed, or NULL if every entry is filling. */
+static struct nvme_read_cache_entry *
+nvme_read_cache_get_victim(struct nvme_read_cache *cache)
+{
+	struct nvme_read_cache_entry	*entry;
+	uint32_t			i;
+
+	for (i = 0; i < 2 * cache->num_entries; i++) {
+		entry = &cache->entries[cache->clock_hand];
+		if (++cache->clock_hand == cache->num_entries) {
+			cache->clock_hand = 0;
+		}
+
+		if (entry->ns == NULL) {
+			return entry;
+		}
+		if (entry->filling) {
+			continue;
+		}
+		if (entry->referenced) {
+			entry->referenced = false;
+			continue;
+		}
+
+		nvme_read_cache_remove(cache, nvme_read_cache_find(cache, entry->ns, entry->lba));
+		cache->stats.evictions++;
+		return entry;
+	}
+
+	return NULL;
+}
+
+static void
+nvme_read_cache_fill_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct nvme_read_cache_entry	*entry = cb_arg;
+	struct nvme_read_cache		*cache = entry->cache;
+	bool				error = spdk_nvme_cpl_is_error(cpl);
+
+	entry->filling = false;
+	cache->num_filling--;
+
+	if (!error) {
+		memcpy(entry->buffer, nvme_read_cache_block(cache, entry), NVME_READ_CACHE_BLOCK_SIZE);
+	}
+	if (!entry->stale && entry->write_epoch != nvme_ns_get_write_epoch(entry->ns, entry->lba,
+			NVME_READ_CACHE_BLOCK_SIZE / entry->ns->sector_size)) {
+		entry->stale = true;
+		cache->stats.invalidations++;
+	}
+	if (error || entry->stale) {
+		nvme_read_cache_remove(cache, nvme_read_cache_find(cache, entry->ns, entry->lba));
+	}
+
+	entry->cb_fn(entry->cb_arg, cpl);
+}
+
+/*
+ * Returns 0 if the read was served from or through the cache, 1 if it must be
+ *  submitted on its own, or a negative errno.
+ */
+int
+nvme_qpair_read_cache_read(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+			   void *buffer, uint64_t lba, uint32_t lba_count,
+			   spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	struct nvme_read_cache		*cache = qpair->read_cache;
+	struct nvme_read_cache_entry	*entry;
+	struct nvme_request		*req;
+	struct spdk_nvme_cmd		*cmd;
+	uint32_t			slot;
+	int				rc;
+
+	if (io_flags != 0 || ns->md_size != 0 || ns->sector_size > NVME_READ_CACHE_BLOCK_SIZE ||
+	    lba_count != NVME_READ_CACHE_BLOCK_SIZE / ns->sector_size || lba % lba_count != 0) {
+		cache->stats.bypasses++;
+		return 1;
+	}
+
+	slot = nvme_read_cache_find(cache, ns, lba);
+	if (slot != NVME_READ_CACHE_NO_ENTRY) {
+		entry = &cache->entries[cache->index[slot]];
+		if (entry->filling) {
+			cache->stats.bypasses++;
+			return 1;
+		}
+
+		if (entry->write_epoch == nvme_ns_get_write_epoch(ns, lba, lba_count)) {
+			req = nvme_allocate_request_null(qpair, cb_fn, cb_arg);
+			if (req == NULL) {
+				return -ENOMEM;
+			}
+			memcpy(buffer, nvme_read_cache_block(cache, entry), NVME_READ_CACHE_BLOCK_SIZE);
+			entry->referenced = true;
+			STAILQ_INSERT_TAIL(&qpair->hits, req, stailq);
+			cache->stats.hits++;
+			return 0;
+		}
+
+		/* Written through another qpair since it was read; read it again. */
+		nvme_read_cache_remove(cache, slot);
+		cache->stats.invalidations++;
+	}
+
+	entry = nvme_read_cache_get_victim(cache);
+	if (entry == NULL) {
+		cache->stats.bypasses++;
+		return 1;
+	}
+
+	req = nvme_allocate_request_contig(qpair, nvme_read_cache_block(cache, entry),
+					   NVME_READ_CACHE_BLOCK_SIZE, nvme_read_cache_fill_done, entry);
+	if (req == NULL) {
+		return -ENOMEM;
+	}
+
+	cmd = &req->cmd;
+	cmd->opc = SPDK_NVME_OPC_READ;
+	cmd->nsid = ns->id;
+	*(uint64_t *)&cmd->cdw10 = lba;
+	cmd->cdw12 = lba_count - 1;
+
+	entry->ns = ns;
+	entry->lba = lba;
+	entry->filling = true;
+	entry->stale = false;
+	entry->write_epoch = nvme_ns_get_write_epoch(ns, lba, lba_count);
+	entry->referenced = false;
+	entry->buffer = buffer;
+	entry->cb_fn = cb_fn;
+	entry->cb_arg = cb_arg;
+	nvme_read_cache_insert(cache, entry);
+	cache->num_filling++;
+	cache->stats.misses++;
+
+	rc = nvme_qpair_submit_request(qpair, req);
+	if (rc != 0 && entry->filling) {
+		/* No fill_done() call will come; undo the miss here. */
+		entry->filling = false;
+		cache->num_filling--;
+		cache->stats.misses--;
+		nvme_read_cache_remove(cache, nvme_read_cache_find(cache, ns, lba));
+		return rc;
+	}
+
+	return 0;
+}
+
+static void
+nvme_read_cache_drop(struct nvme_read_cache *cache, uint32_t slot)
+{
+	struct nvme_read_cache_entry *entry = &cache->entries[cache->index[slot]];
+
+	if (!entry->filling) {
+		nvme_read_cache_remove(cache, slot);
+	} else if (!entry->stale) {
+		/* Keep it indexed so no other read refills it; it is dropped when the fill completes. */
+		entry->stale = true;
+	} else {
+		return;
+	}
+	cache->stats.invalidations++;
+}
+
+static void
+nvme_read_cache_invalidate_range(void *ctx, struct spdk_nvme_ns *ns, uint64_t lba,
+				 uint64_t lba_count)
+{
+	struct nvme_read_cache		*cache = ctx;
+	struct nvme_read_cache_entry	*entry;
+	uint32_t			sectors_per_block, slot, i;
+	uint64_t			block_lba, end = lba + lba_count;
+
+	if (ns->sector_size > NVME_READ_CACHE_BLOCK_SIZE) {
+		return;
+	}
+	sectors_per_block = NVME_READ_CACHE_BLOCK_SIZE / ns->sector_size;
+	block_lba = lba - lba % sectors_per_block;
+
+	if ((end - block_lba) / sectors_per_block < cache->num_entries) {
+		for (; block_lba < end; block_lba += sectors_per_block) {
+			slot = nvme_read_cache_find(cache, ns, block_lba);
+			if (slot != NVME_READ_CACHE_NO_ENTRY) {
+				nvme_read_cache_drop(cache, slot);
+			}
+		}
+		return;
+	}
+
+	/* The range covers more blocks than the cache holds, so check every entry instead. */
+	for (i = 0; i < cache->num_entries; i++) {
+		entry = &cache->entries[i];
+		if (entry->ns == ns && entry->lba < end && entry->lba + sectors_per_block > lba) {
+			nvme_read_cache_drop(cache, nvme_read_cache_find(cache, ns, entry->lba));
+		}
+	}
+}
+
+/* Called for every command when it is submitted and when it completes. */
+void
+nvme_qpair_read_cache_invalidate(struct spdk_nvme_qpair *qpair, const struct nvme_request *req)
+{
+	nvme_request_foreach_written_range(qpair, req, nvme_read_cache_invalidate_range,
+					   qpair->read_cache);
+}
+
+void
+nvme_qpair_read_cache_destroy(struct spdk_nvme_qpair *qpair)
+{
+	struct nvme_read_cache	*cache = qpair->read_cache;
+
+	if (cache == NULL) {
+		return;
+	}
+
+	if (cache->blocks != NULL) {
+		nvme_free(cache->blocks);
+	}
+	free(cache->entries);
+	free(cache->index);
+	free(cache);
+	qpair->read_cache = NULL;
+	if (qpair->read_caching) {
+		__sync_fetch_and_sub(&qpair->ctrlr->num_caching_qpairs, 1);
+		qpair->read_caching = false;
+	}
+}
+
+int
+spdk_nvme_qpair_set_read_cache(struct spdk_nvme_qpair *qpair, uint32_t num_blocks)
+{
+	struct nvme_read_cache	*cache = qpair->read_cache;
+	uint64_t		phys_addr = 0;
+	uint32_t		i;
+
+	if (num_blocks > UINT32_MAX / 4) {
+		return -EINVAL;
+	}
+
+	if (cache != NULL) {
+		if (cache->num_filling != 0 || !STAILQ_EMPTY(&qpair->hits)) {
+			return -EBUSY;
+		}
+		nvme_qpair_read_cache_destroy(qpair);
+	}
+
+	if (num_blocks == 0) {
+		return 0;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		return -ENOMEM;
+	}
+	cache->qpair = qpair;
+	cache->num_entries = num_blocks;
+	cache->index_mask = nvme_align32pow2(2 * num_blocks) - 1;
+	qpair->read_cache = cache;
+
+	cache->index = malloc((cache->index_mask + 1) * sizeof(*cache->index));
+	cache->entries = calloc(num_blocks, sizeof(*cache->entries));
+	cache->blocks = nvme_malloc_socket("nvme_read_cache",
+					   (size_t)num_blocks * NVME_READ_CACHE_BLOCK_SIZE,
+					   NVME_READ_CACHE_BLOCK_SIZE, &phys_addr, qpair->socket_id);
+	if (cache->index == NULL || cache->entries == NULL || cache->blocks == NULL) {
+		nvme_qpair_read_cache_destroy(qpair);
+		return -ENOMEM;
+	}
+
+	memset(cache->index, 0xFF, (cache->index_mask + 1) * sizeof(*cache->index));
+	for (i = 0; i < num_blocks; i++) {
+		cache->entries[i].cache = cache;
+	}
+	qpair->read_caching = true;
+	__sync_fetch_and_add(&qpair->ctrlr->num_caching_qpairs, 1);
+
+	return 0;
+}
+
+int
+spdk_nvme_qpair_get_read_cache_stats(struct spdk_nvme_qpair *qpair,
+				     struct spdk_nvme_read_cache_stats *stats)
+{
+	if (qpair->read_cache == NULL) {
+		return -EINVAL;
+	}
+
+	*stats = qpair->read_cache->stats;
+	return 0;
+}
@@ -0,0 +1,432 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "nvme_internal.h"
+
+/*
+ * Per-qpair sequential readahead.  Each spdk_nvme_ns_cmd_read() continues the
+ *  stream that expects its LBA, or takes over the least recently used stream.
+ *  Once a stream is sequential, reads of up to one buffer are issued ahead of
+ *  it into the buffer pool, and later reads of the stream are copied out of
+ *  the buffers.  The window kept ahead of the stream starts at a few reads and
+ *  doubles each time half of it has been consumed, up to the configured
+ *  maximum; taking the stream over for a non-sequential read collapses it.
+ */
+
+/*
+ * Returns the buffer that holds all of [lba, lba + lba_count), or NULL.  A buffer
+ *  whose range was written through another qpair since its fill was issued is
+ *  dropped instead.
+ */
+static struct nvme_readahead_buffer *
+nvme_readahead_find_buffer(struct nvme_readahead *ra, const struct spdk_nvme_ns *ns,
+			   uint64_t lba, uint32_t lba_count)
+{
+	struct nvme_readahead_buffer	*buf;
+	uint32_t			i;
+
+	for (i = 0; i < ra->num_buffers; i++) {
+		buf = &ra->buffers[i];
+		if (buf->ns != ns || buf->stale || lba < buf->lba ||
+		    lba + lba_count > buf->lba + buf->lba_count) {
+			continue;
+		}
+
+		if (buf->write_epoch == nvme_ns_get_write_epoch(ns, buf->lba, buf->lba_count)) {
+			return buf;
+		}
+
+		if (buf->filling) {
+			buf->stale = true;
+		} else {
+			buf->ns = NULL;
+		}
+		ra->stats.invalidations++;
+	}
+
+	return NULL;
+}
+
+/* Returns the stream that expects a read at lba, or takes over the least recently used one. */
+static struct nvme_readahead_stream *
+nvme_readahead_get_stream(struct nvme_readahead *ra, struct spdk_nvme_ns *ns, uint64_t lba)
+{
+	struct nvme_readahead_stream	*stream, *lru = &ra->streams[0];
+	uint32_t			i;
+
+	for (i = 0; i < ra->num_streams; i++) {
+		stream = &ra->streams[i];
+		if (stream->ns == ns && stream->next_lba == lba) {
+			return stream;
+		}
+		if (stream->last_use < lru->last_use) {
+			lru = stream;
+		}
+	}
+
+	if (lru->window != 0) {
+		ra->stats.collapses++;
+	}
+	lru->ns = ns;
+	lru->ra_lba = 0;
+	lru->window = 0;
+	lru->seq_reads = 0;
+	return lru;
+}
+
+/* Returns an unused buffer, or the least recently used one that is not filling, or NULL. */
+static struct nvme_readahead_buffer *
+nvme_readahead_get_buffer(struct nvme_readahead *ra)
+{
+	struct nvme_readahead_buffer	*buf, *victim = NULL;
+	uint32_t			i;
+
+	for (i = 0; i < ra->num_buffers; i++) {
+		buf = &ra->buffers[i];
+		if (buf->ns == NULL) {
+			return buf;
+		}
+		if (!buf->filling && (victim == NULL || buf->last_use < victim->last_use)) {
+			victim = buf;
+		}
+	}
+
+	return victim;
+}
+
+static void
+nvme_readahead_fill_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct nvme_readahead_buffer	*buf = cb_arg;
+	struct nvme_readahead		*ra = buf->ra;
+	STAILQ_HEAD(, nvme_request)	waiters;
+	struct nvme_request		*req;
+	bool				error = spdk_nvme_cpl_is_error(cpl);
+
+	buf->filling = false;
+	ra->num_filling--;
+
+	/* Copy out before any callback can submit a read that reuses the buffer. */
+	STAILQ_INIT(&waiters);
+	STAILQ_CONCAT(&waiters, &buf->waiters);
+	if (!error) {
+		STAILQ_FOREACH(req, &waiters, stailq) {
+			memcpy(req->payload.u.contig, buf->data + req->payload_offset, req->payload_size);
+		}
+	}
+	if (!buf->stale && buf->write_epoch != nvme_ns_get_write_epoch(buf->ns, buf->lba,
+			buf->lba_count)) {
+		buf->stale = true;
+		ra->stats.invalidations++;
+	}
+	if (error || buf->stale) {
+		buf->ns = NULL;
+	}
+
+	while ((req = STAILQ_FIRST(&waiters)) != NULL) {
+		STAILQ_REMOVE_HEAD(&waiters, stailq);
+		req->cb_fn(req->cb_arg, cpl);
+		nvme_free_request(ra->qpair, req);
+	}
+}
+
+/*
+ * Read ahead of the stream until the window past next_lba is covered, one
+ *  buffer per command, or until no buffer or request is available.
+ */
+static void
+nvme_readahead_issue(struct nvme_readahead *ra, struct nvme_readahead_stream *stream,
+		     uint32_t read_sectors)
+{
+	struct spdk_nvme_ns		*ns = stream->ns;
+	struct spdk_nvme_qpair		*qpair = ra->qpair;
+	struct nvme_readahead_buffer	*buf;
+	struct nvme_request		*req;
+	struct spdk_nvme_cmd		*cmd;
+	uint64_t			end;
+	uint32_t			count;
+	int				rc;
+
+	end = nvme_min(stream->next_lba + stream->window, spdk_nvme_ns_get_num_sectors(ns));
+
+	while (stream->ra_lba < end) {
+		count = nvme_min(end - stream->ra_lba, SPDK_NVME_READAHEAD_BUFFER_SIZE / ns->sector_size);
+		count = nvme_min(count, ns->sectors_per_max_io);
+		if (ns->sectors_per_stripe > 0) {
+			count = nvme_min(count, nvme_ns_sectors_to_boundary(stream->ra_lba, ns->sectors_per_stripe));
+		}
+		/* Keep reads of the stream's size from straddling two buffers. */
+		if (count > read_sectors) {
+			count -= count % read_sectors;
+		}
+
+		buf = nvme_readahead_get_buffer(ra);
+		if (buf == NULL) {
+			return;
+		}
+
+		req = nvme_allocate_request_contig(qpair, buf->data, count * ns->sector_size,
+						   nvme_readahead_fill_done, buf);
+		if (req == NULL) {
+			return;
+		}
+
+		cmd = &req->cmd;
+		cmd->opc = SPDK_NVME_OPC_READ;
+		cmd->nsid = ns->id;
+		*(uint64_t *)&cmd->cdw10 = stream->ra_lba;
+		cmd->cdw12 = count - 1;
+
+		buf->ns = ns;
+		buf->lba = stream->ra_lba;
+		buf->lba_count = count;
+		buf->filling = true;
+		buf->stale = false;
+		buf->write_epoch = nvme_ns_get_write_epoch(ns, buf->lba, count);
+		buf->last_use = stream->last_use;
+		ra->num_filling++;
+
+		rc = nvme_qpair_submit_request(qpair, req);
+		if (rc != 0) {
+			if (buf->filling) {
+				/* Never reached the drive; free the buffer and stop. */
+				buf->filling = false;
+				buf->ns = NULL;
+				ra->num_filling--;
+			}
+			return;
+		}
+
+		stream->ra_lba += count;
+		ra->stats.readaheads++;
+	}
+}
+
+/*
+ * Returns 0 if the read was served from a readahead buffer, 1 if it must be
+ *  submitted on its own, or a negative errno.
+ */
+int
+nvme_qpair_readahead_read(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+			  void *buffer, uint64_t lba, uint32_t lba_count,
+			  spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	struct nvme_readahead		*ra = qpair->readahead;
+	struct nvme_readahead_stream	*stream;
+	struct nvme_readahead_buffer	*buf;
+	struct nvme_request		*req;
+	uint32_t			max_window, offset;
+
+	if (io_flags != 0 || ns->md_size != 0 || lba_count == 0 ||
+	    (uint64_t)lba_count * ns->sector_size > SPDK_NVME_READAHEAD_BUFFER_SIZE) {
+		return 1;
+	}
+
+	stream = nvme_readahead_get_stream(ra, ns, lba);
+	stream->next_lba = lba + lba_count;
+	stream->seq_reads++;
+	stream->last_use = ++ra->clock;
+
+	if (stream->seq_reads >= NVME_READAHEAD_MIN_SEQ_READS) {
+		max_window = ra->max_window_size / ns->sector_size;
+		if (stream->window == 0) {
+			/* The stream just turned sequential; read ahead from this read on. */
+			stream->window = nvme_min(NVME_READAHEAD_INITIAL_WINDOW_READS * lba_count, max_window);
+			stream->ra_lba = lba;
+			nvme_readahead_issue(ra, stream, lba_count);
+		} else if (stream->ra_lba < stream->next_lba + stream->window / 2) {
+			/* Half of the window has been consumed: grow it and refill. */
+			stream->window = nvme_min(stream->window * 2, max_window);
+			stream->ra_lba = nvme_max(stream->ra_lba, lba);
+			nvme_readahead_issue(ra, stream, lba_count);
+		}
+	}
+
+	buf = nvme_readahead_find_buffer(ra, ns, lba, lba_count);
+	if (buf == NULL) {
+		ra->stats.misses++;
+		return 1;
+	}
+
+	req = nvme_allocate_request_null(qpair, cb_fn, cb_arg);
+	if (req == NULL) {
+		return -ENOMEM;
+	}
+
+	/* A buffer read to its end is reused first. */
+	buf->last_use = (lba + lba_count == buf->lba + buf->lba_count) ? 0 : stream->last_use;
+	offset = (lba - buf->lba) * ns->sector_size;
+
+	if (buf->filling) {
+		req->payload.u.contig = buffer;
+		req->payload_offset = offset;
+		req->payload_size = lba_count * ns->sector_size;
+		STAILQ_INSERT_TAIL(&buf->waiters, req, stailq);
+		ra->stats.waits++;
+		return 0;
+	}
+
+	memcpy(buffer, buf->data + offset, lba_count * ns->sector_size);
+	STAILQ_INSERT_TAIL(&qpair->hits, req, stailq);
+	ra->stats.hits++;
+	return 0;
+}
+
+static void
+nvme_readahead_invalidate_range(void *ctx, struct spdk_nvme_ns *ns, uint64_t lba,
+				uint64_t lba_count)
+{
+	struct nvme_readahead		*ra = ctx;
+	struct nvme_readahead_buffer	*buf;
+	uint32_t			i;
+
+	for (i = 0; i < ra->num_buffers; i++) {
+		buf = &ra->buffers[i];
+		if (buf->ns != ns || buf->stale || buf->lba >= lba + lba_count ||
+		    buf->lba + buf->lba_count <= lba) {
+			continue;
+		}
+
+		if (buf->filling) {
+			/* Waiting reads still get the data; the buffer is dropped when the fill completes. */
+			buf->stale = true;
+		} else {
+			buf->ns = NULL;
+		}
+		ra->stats.invalidations++;
+	}
+}
+
+/* Called for every command when it is submitted and when it completes. */
+void
+nvme_qpair_readahead_invalidate(struct spdk_nvme_qpair *qpair, const struct nvme_request *req)
+{
+	nvme_request_foreach_written_range(qpair, req, nvme_readahead_invalidate_range,
+					   qpair->readahead);
+}
+
+void
+nvme_qpair_readahead_destroy(struct spdk_nvme_qpair *qpair)
+{
+	struct nvme_readahead	*ra = qpair->readahead;
+
+	if (ra == NULL) {
+		return;
+	}
+
+	if (ra->data != NULL) {
+		nvme_free(ra->data);
+	}
+	free(ra->streams);
+	free(ra->buffers);
+	free(ra);
+	qpair->readahead = NULL;
+	if (qpair->reading_ahead) {
+		__sync_fetch_and_sub(&qpair->ctrlr->num_caching_qpairs, 1);
+		qpair->reading_ahead = false;
+	}
+}
+
+int
+spdk_nvme_qpair_set_readahead(struct spdk_nvme_qpair *qpair, uint32_t num_streams,
+			      uint32_t max_window_size)
+{
+	struct nvme_readahead	*ra = qpair->readahead;
+	uint64_t		phys_addr = 0;
+	uint32_t		num_buffers, i;
+
+	if (num_streams > NVME_READAHEAD_MAX_STREAMS ||
+	    max_window_size > NVME_READAHEAD_MAX_WINDOW_SIZE) {
+		return -EINVAL;
+	}
+
+	if (ra != NULL) {
+		if (ra->num_filling != 0 || !STAILQ_EMPTY(&qpair->hits)) {
+			return -EBUSY;
+		}
+		nvme_qpair_readahead_destroy(qpair);
+	}
+
+	if (num_streams == 0) {
+		return 0;
+	}
+
+	max_window_size = nvme_max(max_window_size, 1);
+	max_window_size = (max_window_size + SPDK_NVME_READAHEAD_BUFFER_SIZE - 1) /
+			  SPDK_NVME_READAHEAD_BUFFER_SIZE * SPDK_NVME_READAHEAD_BUFFER_SIZE;
+
+	/* Each stream needs its window plus the buffer it is currently reading from. */
+	num_buffers = num_streams * (max_window_size / SPDK_NVME_READAHEAD_BUFFER_SIZE + 1);
+
+	ra = calloc(1, sizeof(*ra));
+	if (ra == NULL) {
+		return -ENOMEM;
+	}
+	ra->qpair = qpair;
+	ra->num_streams = num_streams;
+	ra->num_buffers = num_buffers;
+	ra->max_window_size = max_window_size;
+	qpair->readahead = ra;
+
+	ra->streams = calloc(num_streams, sizeof(*ra->streams));
+	ra->buffers = calloc(num_buffers, sizeof(*ra->buffers));
+	ra->data = nvme_malloc_socket("nvme_readahead",
+				      (size_t)num_buffers * SPDK_NVME_READAHEAD_BUFFER_SIZE,
+				      0x1000, &phys_addr, qpair->socket_id);
+	if (ra->streams == NULL || ra->buffers == NULL || ra->data == NULL) {
+		nvme_qpair_readahead_destroy(qpair);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < num_buffers; i++) {
+		ra->buffers[i].ra = ra;
+		ra->buffers[i].data = ra->data + (size_t)i * SPDK_NVME_READAHEAD_BUFFER_SIZE;
+		STAILQ_INIT(&ra->buffers[i].waiters);
+	}
+	qpair->reading_ahead = true;
+	__sync_fetch_and_add(&qpair->ctrlr->num_caching_qpairs, 1);
+
+	return 0;
+}
+
+int
+spdk_nvme_qpair_get_readahead_stats(struct spdk_nvme_qpair *qpair,
+				    struct spdk_nvme_readahead_stats *stats)
+{
+	if (qpair->readahead == NULL) {
+		return -EINVAL;
+	}
+
+	*stats = qpair->readahead->stats;
+	return 0;
+}
@@ -0,0 +1,711 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "nvme_internal.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+/*
+ * Memory-backed software NVMe controller.
+ *
+ * The controller exposes a struct spdk_nvme_registers block in ordinary memory
+ *  and services the admin and I/O queues the driver creates from a background
+ *  thread, backed by a single RAM namespace.  It lets the whole driver submission
+ *  and completion path run (and be measured) without NVMe hardware.
+ *
+ * Queues and data buffers are described by physical address just like for a
+ *  real device, so they must come from memory nvme_phys_to_virt() can translate.
+ */
+
+#define NVME_SW_MAX_IO_QUEUES	(16)
+#define NVME_SW_MAX_QUEUE_ENTRIES	(1024)
+#define NVME_SW_AERL		(3)
+
+struct nvme_sw_queue {
+	/** host memory for the ring - struct spdk_nvme_cmd or struct spdk_nvme_cpl entries */
+	void		*base;
+	uint16_t	size;
+
+	/** SQ: next entry to fetch.  CQ: next entry to post. */
+	uint16_t	idx;
+
+	/** CQ only: current phase tag */
+	uint8_t		phase;
+
+	/** SQ only: completion queue this submission queue posts to */
+	uint16_t	cqid;
+
+	bool		valid;
+};
+
+struct spdk_nvme_sw_ctrlr {
+	volatile struct spdk_nvme_registers	*regs;
+
+	uint8_t			*ns_buf;
+	uint64_t		num_blocks;
+	uint32_t		block_size;
+
+	/** host memory page size selected by CC.MPS */
+	uint32_t		page_size;
+
+	bool			enabled;
+	uint32_t		num_aers;
+
+	struct nvme_sw_queue	sq[NVME_SW_MAX_IO_QUEUES + 1];
+	struct nvme_sw_queue	cq[NVME_SW_MAX_IO_QUEUES + 1];
+
+	bool			attached;
+	volatile bool		stop;
+	pthread_t		thread;
+
+	TAILQ_ENTRY(spdk_nvme_sw_ctrlr)	tailq;
+};
+
+/* Protected by g_nvme_driver.lock */
+static TAILQ_HEAD(, spdk_nvme_sw_ctrlr) g_nvme_sw_devs = TAILQ_HEAD_INITIALIZER(g_nvme_sw_devs);
+
+/* Returned by the command handlers when no completion should be posted. */
+#define NVME_SW_NO_COMPLETION	(-1)
+
+static void
+nvme_sw_set_status(struct spdk_nvme_cpl *cpl, int sct, int sc)
+{
+	cpl->status.sct = sct;
+	cpl->status.sc = sc;
+}
+
+/*
+ * Copy len bytes between buf and the host memory described by the command's PRPs.
+ *  The driver never chains PRP lists (a list is at most one page), so the list
+ *  is treated as a single contiguous array.
+ */
+static int
+nvme_sw_dev_prp_copy(struct spdk_nvme_sw_ctrlr *dev, const struct spdk_nvme_cmd *cmd,
+		     void *buf, uint32_t len, bool to_host)
+{
+	uint64_t	prp = cmd->dptr.prp.prp1;
+	uint64_t	*prp_list = NULL;
+	uint32_t	page_size = dev->page_size;
+	uint32_t	first_len, chunk, i = 0;
+	uint8_t		*p = buf;
+	void		*host;
+
+	first_len = page_size - (prp & (page_size - 1));
+
+	while (len > 0) {
+		chunk = nvme_min(len, page_size - (uint32_t)(prp & (page_size - 1)));
+		host = nvme_phys_to_virt(prp);
+		if (host == NULL) {
+			return -EFAULT;
+		}
+
+		if (to_host) {
+			memcpy(host, p, chunk);
+		} else {
+			memcpy(p, host, chunk);
+		}
+		p += chunk;
+		len -= chunk;
+
+		if (len == 0) {
+			break;
+		}
+
+		if (p == (uint8_t *)buf + first_len) {
+			/* Second page: PRP2 is either the data pointer or the list pointer. */
+			if (len <= page_size) {
+				prp = cmd->dptr.prp.prp2;
+				continue;
+			}
+			prp_list = nvme_phys_to_virt(cmd->dptr.prp.prp2);
+			if (prp_list == NULL) {
+				return -EFAULT;
+			}
+		}
+
+		if (i >= NVME_MAX_PRP_LIST_ENTRIES) {
+			return -EFAULT;
+		}
+		prp = prp_list[i++];
+	}
+
+	return 0;
+}
+
+static int
+nvme_sw_dev_identify(struct spdk_nvme_sw_ctrlr *dev, const struct spdk_nvme_cmd *cmd,
+		     struct spdk_nvme_cpl *cpl)
+{
+	union {
+		struct spdk_nvme_ctrlr_data	cdata;
+		struct spdk_nvme_ns_data	nsdata;
+	} data;
+	uint32_t	lbads = 0;
+
+	memset(&data, 0, sizeof(data));
+
+	switch (cmd->cdw10 & 0xFF) {
+	case SPDK_NVME_IDENTIFY_CTRLR:
+		memcpy(data.cdata.sn, "SW0000000000", 12);
+		memcpy(data.cdata.mn, "SPDK software controller", 24);
+		memcpy(data.cdata.fr, "1.0", 3);
+		data.cdata.aerl = NVME_SW_AERL;
+		data.cdata.acl = 3;
+		data.cdata.sqes.min = 6;
+		data.cdata.sqes.max = 6;
+		data.cdata.cqes.min = 4;
+		data.cdata.cqes.max = 4;
+		data.cdata.nn = 1;
+		data.cdata.oncs.dsm = 1;
+		data.cdata.oncs.write_zeroes = 1;
+		break;
+	case SPDK_NVME_IDENTIFY_NS:
+		if (cmd->nsid != 1) {
+			nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_INVALID_NAMESPACE_OR_FORMAT);
+			return 0;
+		}
+		while ((1u << lbads) < dev->block_size) {
+			lbads++;
+		}
+		data.nsdata.nsze = dev->num_blocks;
+		data.nsdata.ncap = dev->num_blocks;
+		data.nsdata.nuse = dev->num_blocks;
+		data.nsdata.nlbaf = 0;
+		data.nsdata.lbaf[0].lbads = lbads;
+		break;
+	default:
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_INVALID_FIELD);
+		return 0;
+	}
+
+	if (nvme_sw_dev_prp_copy(dev, cmd, &data, sizeof(data), true) != 0) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_DATA_TRANSFER_ERROR);
+	}
+	return 0;
+}
+
+static int
+nvme_sw_dev_get_log_page(struct spdk_nvme_sw_ctrlr *dev, const struct spdk_nvme_cmd *cmd,
+			 struct spdk_nvme_cpl *cpl)
+{
+	uint8_t		zeroes[4096];
+	uint32_t	len = (((cmd->cdw10 >> 16) & 0xFFF) + 1) * sizeof(uint32_t);
+
+	if (len > sizeof(zeroes)) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_INVALID_FIELD);
+		return 0;
+	}
+
+	memset(zeroes, 0, len);
+	if (nvme_sw_dev_prp_copy(dev, cmd, zeroes, len, true) != 0) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_DATA_TRANSFER_ERROR);
+	}
+	return 0;
+}
+
+static int
+nvme_sw_dev_create_queue(struct spdk_nvme_sw_ctrlr *dev, const struct spdk_nvme_cmd *cmd,
+			 struct spdk_nvme_cpl *cpl, bool is_sq)
+{
+	struct nvme_sw_queue	*q;
+	uint16_t		qid = cmd->cdw10 & 0xFFFF;
+	uint32_t		size = (cmd->cdw10 >> 16) + 1;
+	uint16_t		cqid = cmd->cdw11 >> 16;
+
+	if (qid == 0 || qid > NVME_SW_MAX_IO_QUEUES) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_COMMAND_SPECIFIC,
+				   SPDK_NVME_SC_INVALID_QUEUE_IDENTIFIER);
+		return 0;
+	}
+
+	q = is_sq ? &dev->sq[qid] : &dev->cq[qid];
+	if (q->valid) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_COMMAND_SPECIFIC,
+				   SPDK_NVME_SC_INVALID_QUEUE_IDENTIFIER);
+		return 0;
+	}
+
+	if (size < 2 || size > NVME_SW_MAX_QUEUE_ENTRIES) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_COMMAND_SPECIFIC,
+				   SPDK_NVME_SC_MAXIMUM_QUEUE_SIZE_EXCEEDED);
+		return 0;
+	}
+
+	/* Only physically contiguous queues are supported (CAP.CQR = 1). */
+	if ((cmd->cdw11 & 0x1) == 0) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_INVALID_FIELD);
+		return 0;
+	}
+
+	if (is_sq && (cqid == 0 || cqid > NVME_SW_MAX_IO_QUEUES || !dev->cq[cqid].valid)) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_COMMAND_SPECIFIC,
+				   SPDK_NVME_SC_COMPLETION_QUEUE_INVALID);
+		return 0;
+	}
+
+	q->base = nvme_phys_to_virt(cmd->dptr.prp.prp1);
+	if (q->base == NULL) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_DATA_TRANSFER_ERROR);
+		return 0;
+	}
+
+	q->size = size;
+	q->idx = 0;
+	q->phase = 1;
+	q->cqid = is_sq ? cqid : 0;
+	q->valid = true;
+	return 0;
+}
+
+static int
+nvme_sw_dev_delete_queue(struct spdk_nvme_sw_ctrlr *dev, const struct spdk_nvme_cmd *cmd,
+			 struct spdk_nvme_cpl *cpl, bool is_sq)
+{
+	uint16_t		qid = cmd->cdw10 & 0xFFFF;
+	struct nvme_sw_queue	*q;
+
+	if (qid == 0 || qid > NVME_SW_MAX_IO_QUEUES) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_COMMAND_SPECIFIC,
+				   SPDK_NVME_SC_INVALID_QUEUE_IDENTIFIER);
+		return 0;
+	}
+
+	q = is_sq ? &dev->sq[qid] : &dev->cq[qid];
+	if (!q->valid) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_COMMAND_SPECIFIC,
+				   SPDK_NVME_SC_INVALID_QUEUE_IDENTIFIER);
+		return 0;
+	}
+
+	q->valid = false;
+	return 0;
+}
+
+static int
+nvme_sw_dev_admin_cmd(struct spdk_nvme_sw_ctrlr *dev, const struct spdk_nvme_cmd *cmd,
+		      struct spdk_nvme_cpl *cpl)
+{
+	switch (cmd->opc) {
+	case SPDK_NVME_OPC_IDENTIFY:
+		return nvme_sw_dev_identify(dev, cmd, cpl);
+	case SPDK_NVME_OPC_GET_LOG_PAGE:
+		return nvme_sw_dev_get_log_page(dev, cmd, cpl);
+	case SPDK_NVME_OPC_CREATE_IO_CQ:
+		return nvme_sw_dev_create_queue(dev, cmd, cpl, false);
+	case SPDK_NVME_OPC_CREATE_IO_SQ:
+		return nvme_sw_dev_create_queue(dev, cmd, cpl, true);
+	case SPDK_NVME_OPC_DELETE_IO_CQ:
+		return nvme_sw_dev_delete_queue(dev, cmd, cpl, false);
+	case SPDK_NVME_OPC_DELETE_IO_SQ:
+		return nvme_sw_dev_delete_queue(dev, cmd, cpl, true);
+	case SPDK_NVME_OPC_SET_FEATURES:
+	case SPDK_NVME_OPC_GET_FEATURES:
+		if ((cmd->cdw10 & 0xFF) == SPDK_NVME_FEAT_NUMBER_OF_QUEUES) {
+			/* 0-based number of completion (upper) and submission (lower) queues */
+			cpl->cdw0 = ((NVME_SW_MAX_IO_QUEUES - 1) << 16) | (NVME_SW_MAX_IO_QUEUES - 1);
+		}
+		return 0;
+	case SPDK_NVME_OPC_ABORT:
+		/* Commands complete as soon as they are fetched - nothing to abort. */
+		cpl->cdw0 = 1;
+		return 0;
+	case SPDK_NVME_OPC_ASYNC_EVENT_REQUEST:
+		if (dev->num_aers > NVME_SW_AERL) {
+			nvme_sw_set_status(cpl, SPDK_NVME_SCT_COMMAND_SPECIFIC,
+					   SPDK_NVME_SC_ASYNC_EVENT_REQUEST_LIMIT_EXCEEDED);
+			return 0;
+		}
+		/* No events are ever generated, so the request stays outstanding. */
+		dev->num_aers++;
+		return NVME_SW_NO_COMPLETION;
+	default:
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_INVALID_OPCODE);
+		return 0;
+	}
+}
+
+static int
+nvme_sw_dev_io_cmd(struct spdk_nvme_sw_ctrlr *dev, const struct spdk_nvme_cmd *cmd,
+		   struct spdk_nvme_cpl *cpl)
+{
+	uint64_t	lba = ((uint64_t)cmd->cdw11 << 32) | cmd->cdw10;
+	uint32_t	lba_count = (cmd->cdw12 & 0xFFFF) + 1;
+	uint8_t		*buf;
+
+	if (cmd->nsid != 1) {
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_INVALID_NAMESPACE_OR_FORMAT);
+		return 0;
+	}
+
+	switch (cmd->opc) {
+	case SPDK_NVME_OPC_READ:
+	case SPDK_NVME_OPC_WRITE:
+	case SPDK_NVME_OPC_WRITE_ZEROES:
+		if (lba >= dev->num_blocks || lba_count > dev->num_blocks - lba) {
+			nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_LBA_OUT_OF_RANGE);
+			return 0;
+		}
+		buf = dev->ns_buf + lba * dev->block_size;
+		if (cmd->opc == SPDK_NVME_OPC_WRITE_ZEROES) {
+			memset(buf, 0, (size_t)lba_count * dev->block_size);
+		} else if (nvme_sw_dev_prp_copy(dev, cmd, buf, lba_count * dev->block_size,
+						cmd->opc == SPDK_NVME_OPC_READ) != 0) {
+			nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_DATA_TRANSFER_ERROR);
+		}
+		return 0;
+	case SPDK_NVME_OPC_FLUSH:
+	case SPDK_NVME_OPC_DATASET_MANAGEMENT:
+		return 0;
+	default:
+		nvme_sw_set_status(cpl, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_INVALID_OPCODE);
+		return 0;
+	}
+}
+
+static void
+nvme_sw_dev_post_cpl(struct nvme_sw_queue *cq, const struct spdk_nvme_cpl *cpl)
+{
+	struct spdk_nvme_cpl	*entry = &((struct spdk_nvme_cpl *)cq->base)[cq->idx];
+	struct spdk_nvme_status	status = cpl->status;
+
+	entry->cdw0 = cpl->cdw0;
+	entry->sqhd = cpl->sqhd;
+	entry->sqid = cpl->sqid;
+	entry->cid = cpl->cid;
+
+	/* The phase tag must not become visible before the rest of the entry. */
+	spdk_wmb();
+	status.p = cq->phase;
+	entry->status = status;
+
+	if (++cq->idx == cq->size) {
+		cq->idx = 0;
+		cq->phase = !cq->phase;
+	}
+}
+
+static uint32_t
+nvme_sw_dev_process_sq(struct spdk_nvme_sw_ctrlr *dev, uint16_t qid)
+{
+	struct nvme_sw_queue	*sq = &dev->sq[qid];
+	struct nvme_sw_queue	*cq = &dev->cq[sq->cqid];
+	struct spdk_nvme_cmd	cmd;
+	struct spdk_nvme_cpl	cpl;
+	uint32_t		sq_tail, cq_head;
+	uint32_t		num_processed = 0;
+	int			rc;
+
+	sq_tail = dev->regs->doorbell[qid].sq_tdbl;
+	if (sq_tail == sq->idx || sq_tail >= sq->size) {
+		return 0;
+	}
+
+	/* Read the queue entries only after the doorbell write that published them. */
+	spdk_mb();
+
+	while (sq->idx != sq_tail) {
+		cq_head = dev->regs->doorbell[sq->cqid].cq_hdbl;
+		if ((uint32_t)(cq->idx + 1) % cq->size == cq_head) {
+			/* Completion queue full - wait for the host to consume some entries. */
+			break;
+		}
+
+		memcpy(&cmd, &((struct spdk_nvme_cmd *)sq->base)[sq->idx], sizeof(cmd));
+		sq->idx = (sq->idx + 1) % sq->size;
+
+		memset(&cpl, 0, sizeof(cpl));
+		cpl.cid = cmd.cid;
+		cpl.sqid = qid;
+		cpl.sqhd = sq->idx;
+
+		if (qid == 0) {
+			rc = nvme_sw_dev_admin_cmd(dev, &cmd, &cpl);
+		} else {
+			rc = nvme_sw_dev_io_cmd(dev, &cmd, &cpl);
+		}
+
+		if (rc != NVME_SW_NO_COMPLETION) {
+			nvme_sw_dev_post_cpl(cq, &cpl);
+		}
+		num_processed++;
+	}
+
+	return num_processed;
+}
+
+static void
+nvme_sw_dev_disable(struct spdk_nvme_sw_ctrlr *dev)
+{
+	union spdk_nvme_csts_register	csts;
+
+	memset(dev->sq, 0, sizeof(dev->sq));
+	memset(dev->cq, 0, sizeof(dev->cq));
+	dev->num_aers = 0;
+	dev->enabled = false;
+
+	csts.raw = dev->regs->csts.raw;
+	csts.bits.rdy = 0;
+	dev->regs->csts.raw = csts.raw;
+}
+
+static void
+nvme_sw_dev_enable(struct spdk_nvme_sw_ctrlr *dev, union spdk_nvme_cc_register cc)
+{
+	union spdk_nvme_aqa_register	aqa;
+	union spdk_nvme_csts_register	csts;
+
+	aqa.raw = dev->regs->aqa.raw;
+	csts.raw = dev->regs->csts.raw;
+
+	dev->page_size = 1u << (12 + cc.bits.mps);
+
+	dev->sq[0].base = nvme_phys_to_virt(dev->regs->asq);
+	dev->sq[0].size = aqa.bits.asqs + 1;
+	dev->cq[0].base = nvme_phys_to_virt(dev->regs->acq);
+	dev->cq[0].size = aqa.bits.acqs + 1;
+	dev->cq[0].phase = 1;
+
+	if (dev->sq[0].base == NULL || dev->cq[0].base == NULL ||
+	    dev->sq[0].size < 2 || dev->cq[0].size < 2) {
+		csts.bits.cfs = 1;
+		dev->regs->csts.raw = csts.raw;
+		return;
+	}
+
+	dev->sq[0].valid = true;
+	dev->cq[0].valid = true;
+	dev->enabled = true;
+
+	csts.bits.rdy = 1;
+	dev->regs->csts.raw = csts.raw;
+}
+
+/*
+ * Handle register state changes and process every submission queue once.
+ *  Returns the number of commands processed.
+ */
+static uint32_t
+nvme_sw_dev_poll(struct spdk_nvme_sw_ctrlr *dev)
+{
+	union spdk_nvme_cc_register	cc;
+	union spdk_nvme_csts_register	csts;
+	uint32_t			num_processed = 0;
+	uint16_t			qid;
+
+	cc.raw = dev->regs->cc.raw;
+
+	if (cc.bits.en && !dev->enabled && !dev->regs->csts.bits.cfs) {
+		nvme_sw_dev_enable(dev, cc);
+	} else if (!cc.bits.en && (dev->enabled || dev->regs->csts.bits.cfs)) {
+		nvme_sw_dev_disable(dev);
+		csts.raw = dev->regs->csts.raw;
+		csts.bits.cfs = 0;
+		dev->regs->csts.raw = csts.raw;
+	}
+
+	csts.raw = dev->regs->csts.raw;
+	if (cc.bits.shn && csts.bits.shst != SPDK_NVME_SHST_COMPLETE) {
+		csts.bits.shst = SPDK_NVME_SHST_COMPLETE;
+		dev->regs->csts.raw = csts.raw;
+	} else if (!cc.bits.shn && csts.bits.shst != SPDK_NVME_SHST_NORMAL) {
+		csts.bits.shst = SPDK_NVME_SHST_NORMAL;
+		dev->regs->csts.raw = csts.raw;
+	}
+
+	if (!dev->enabled) {
+		return 0;
+	}
+
+	for (qid = 0; qid <= NVME_SW_MAX_IO_QUEUES; qid++) {
+		if (dev->sq[qid].valid && dev->cq[dev->sq[qid].cqid].valid) {
+			num_processed += nvme_sw_dev_process_sq(dev, qid);
+		}
+	}
+
+	return num_processed;
+}
+
+static void *
+nvme_sw_dev_thread(void *arg)
+{
+	struct spdk_nvme_sw_ctrlr *dev = arg;
+
+	while (!dev->stop) {
+		if (nvme_sw_dev_poll(dev) == 0) {
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+volatile struct spdk_nvme_registers *
+nvme_sw_dev_attach(struct spdk_nvme_sw_ctrlr *dev)
+{
+	nvme_assert(!dev->attached, ("sw controller %p already attached\n", dev));
+
+	dev->stop = false;
+	if (pthread_create(&dev->thread, NULL, nvme_sw_dev_thread, dev) != 0) {
+		nvme_printf(NULL, "could not start sw controller thread\n");
+		return NULL;
+	}
+
+	dev->attached = true;
+	return dev->regs;
+}
+
+void
+nvme_sw_dev_detach(struct spdk_nvme_sw_ctrlr *dev)
+{
+	if (!dev->attached) {
+		return;
+	}
+
+	dev->stop = true;
+	pthread_join(dev->thread, NULL);
+
+	nvme_sw_dev_disable(dev);
+	dev->regs->cc.raw = 0;
+	dev->regs->csts.raw = 0;
+	dev->attached = false;
+}
+
+/* This function must only be called while holding g_nvme_driver.lock */
+int
+nvme_sw_enumerate(int (*enum_cb)(void *enum_ctx, struct spdk_nvme_sw_ctrlr *sw_dev), void *enum_ctx)
+{
+	struct spdk_nvme_sw_ctrlr	*dev;
+	int			rc = 0;
+
+	TAILQ_FOREACH(dev, &g_nvme_sw_devs, tailq) {
+		if (dev->attached) {
+			continue;
+		}
+
+		if (enum_cb(enum_ctx, dev) != 0) {
+			rc = -1;
+		}
+	}
+
+	return rc;
+}
+
+static struct spdk_nvme_sw_ctrlr *
+nvme_sw_dev_create(uint64_t num_blocks, uint32_t block_size)
+{
+	struct spdk_nvme_sw_ctrlr		*dev;
+	union spdk_nvme_cap_register	cap;
+	union spdk_nvme_vs_register	vs;
+	size_t				regs_size;
+	void				*regs;
+
+	dev = calloc(1, sizeof(*dev));
+	if (dev == NULL) {
+		return NULL;
+	}
+
+	/* Leave room for one SQ/CQ doorbell pair per queue (CAP.DSTRD = 0). */
+	regs_size = sizeof(struct spdk_nvme_registers) +
+		    NVME_SW_MAX_IO_QUEUES * sizeof(dev->regs->doorbell[0]);
+	if (posix_memalign(&regs, PAGE_SIZE, regs_size) != 0) {
+		free(dev);
+		return NULL;
+	}
+	memset(regs, 0, regs_size);
+	dev->regs = regs;
+
+	dev->ns_buf = calloc(num_blocks, block_size);
+	if (dev->ns_buf == NULL) {
+		free(regs);
+		free(dev);
+		return NULL;
+	}
+	dev->num_blocks = num_blocks;
+	dev->block_size = block_size;
+	dev->page_size = PAGE_SIZE;
+
+	cap.raw = 0;
+	cap.bits.mqes = NVME_SW_MAX_QUEUE_ENTRIES - 1;
+	cap.bits.cqr = 1;
+	cap.bits.to = 1;
+	cap.bits.css_nvm = 1;
+	dev->regs->cap.raw = cap.raw;
+
+	vs.raw = 0;
+	vs.bits.mjr = 1;
+	vs.bits.mnr = 2;
+	dev->regs->vs.raw = vs.raw;
+
+	return dev;
+}
+
+struct spdk_nvme_sw_ctrlr *
+spdk_nvme_sw_ctrlr_create(uint64_t num_blocks, uint32_t block_size)
+{
+	struct spdk_nvme_sw_ctrlr *dev;
+
+	if (num_blocks == 0 || block_size < 512 || (block_size & (block_size - 1)) != 0 ||
+	    num_blocks > SIZE_MAX / block_size) {
+		return NULL;
+	}
+
+	dev = nvme_sw_dev_create(num_blocks, block_size);
+	if (dev == NULL) {
+		return NULL;
+	}
+
+	nvme_mutex_lock(&g_nvme_driver.lock);
+	TAILQ_INSERT_TAIL(&g_nvme_sw_devs, dev, tailq);
+	nvme_mutex_unlock(&g_nvme_driver.lock);
+
+	return dev;
+}
+
+int
+spdk_nvme_sw_ctrlr_destroy(struct spdk_nvme_sw_ctrlr *dev)
+{
+	nvme_mutex_lock(&g_nvme_driver.lock);
+	if (dev->attached) {
+		nvme_mutex_unlock(&g_nvme_driver.lock);
+		return -EBUSY;
+	}
+	TAILQ_REMOVE(&g_nvme_sw_devs, dev, tailq);
+	nvme_mutex_unlock(&g_nvme_driver.lock);
+
+	free(dev->ns_buf);
+	free((void *)dev->regs);
+	free(dev);
+
+	return 0;
+}
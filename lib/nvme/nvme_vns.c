@@ -0,0 +1,426 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "nvme_internal.h"
+
+/*
+ * Virtual namespaces stripe (RAID-0) or mirror (RAID-1) I/O across several
+ *  namespaces.  Each part of a virtual I/O is an ordinary spdk_nvme_ns_cmd_*
+ *  command on the member's own queue pair; the virtual I/O completes when
+ *  all of its parts have.
+ */
+
+#define NVME_VNS_MAX_MEMBERS	32
+
+struct spdk_nvme_vns {
+	enum spdk_nvme_vns_level	level;
+	uint32_t			num_members;
+	uint32_t			sector_size;
+	uint32_t			strip_sectors;
+	uint64_t			num_sectors;
+	uint32_t			num_qpairs;
+	struct spdk_nvme_ns		*members[NVME_VNS_MAX_MEMBERS];
+};
+
+struct nvme_vns_io {
+	struct spdk_nvme_vns_qpair	*vqpair;
+	spdk_nvme_cmd_cb		cb_fn;
+	void				*cb_arg;
+
+	/* Parts submitted and not yet completed, plus one while still submitting. */
+	uint32_t			outstanding;
+
+	/* Parts completed so far, to tell whether a failed submission called back. */
+	uint32_t			completed;
+
+	/* Status of the first failed part, or success. */
+	struct spdk_nvme_cpl		cpl;
+};
+
+struct spdk_nvme_vns_qpair {
+	struct spdk_nvme_vns		*vns;
+	struct spdk_nvme_qpair		*qpairs[NVME_VNS_MAX_MEMBERS];
+
+	/* Member to try first for the next RAID-1 read, so ties rotate. */
+	uint32_t			next_read_member;
+
+	/* Pool of virtual I/O contexts and the stack of free ones. */
+	struct nvme_vns_io		*ios;
+	struct nvme_vns_io		**free_ios;
+	uint32_t			num_ios;
+	uint32_t			num_free_ios;
+};
+
+struct spdk_nvme_vns *
+spdk_nvme_vns_create(enum spdk_nvme_vns_level level, struct spdk_nvme_ns **ns, uint32_t num_ns,
+		     uint32_t strip_sectors)
+{
+	struct spdk_nvme_vns	*vns;
+	uint64_t		min_sectors = UINT64_MAX;
+	uint32_t		i;
+
+	if (ns == NULL || num_ns == 0 || num_ns > NVME_VNS_MAX_MEMBERS) {
+		return NULL;
+	}
+
+	if (level == SPDK_NVME_VNS_RAID0) {
+		if (strip_sectors == 0) {
+			return NULL;
+		}
+	} else if (level == SPDK_NVME_VNS_RAID1) {
+		strip_sectors = 0;
+	} else {
+		return NULL;
+	}
+
+	for (i = 0; i < num_ns; i++) {
+		if (ns[i] == NULL ||
+		    spdk_nvme_ns_get_sector_size(ns[i]) != spdk_nvme_ns_get_sector_size(ns[0]) ||
+		    spdk_nvme_ns_get_md_size(ns[i]) != 0) {
+			return NULL;
+		}
+		min_sectors = nvme_min(min_sectors, spdk_nvme_ns_get_num_sectors(ns[i]));
+	}
+
+	vns = calloc(1, sizeof(*vns));
+	if (vns == NULL) {
+		return NULL;
+	}
+
+	vns->level = level;
+	vns->num_members = num_ns;
+	vns->sector_size = spdk_nvme_ns_get_sector_size(ns[0]);
+	vns->strip_sectors = strip_sectors;
+	memcpy(vns->members, ns, num_ns * sizeof(ns[0]));
+
+	if (level == SPDK_NVME_VNS_RAID0) {
+		vns->num_sectors = (min_sectors / strip_sectors) * strip_sectors * num_ns;
+	} else {
+		vns->num_sectors = min_sectors;
+	}
+
+	if (vns->num_sectors == 0) {
+		free(vns);
+		return NULL;
+	}
+
+	return vns;
+}
+
+void
+spdk_nvme_vns_destroy(struct spdk_nvme_vns *vns)
+{
+	if (vns == NULL) {
+		return;
+	}
+
+	nvme_assert(vns->num_qpairs == 0, ("vns still has qpairs\n"));
+	free(vns);
+}
+
+uint64_t
+spdk_nvme_vns_get_num_sectors(struct spdk_nvme_vns *vns)
+{
+	return vns->num_sectors;
+}
+
+uint32_t
+spdk_nvme_vns_get_sector_size(struct spdk_nvme_vns *vns)
+{
+	return vns->sector_size;
+}
+
+static void
+nvme_vns_free_member_qpairs(struct spdk_nvme_vns_qpair *vqpair)
+{
+	uint32_t i;
+
+	for (i = 0; i < vqpair->vns->num_members; i++) {
+		if (vqpair->qpairs[i] != NULL) {
+			spdk_nvme_ctrlr_free_io_qpair(vqpair->qpairs[i]);
+		}
+	}
+}
+
+struct spdk_nvme_vns_qpair *
+spdk_nvme_vns_alloc_qpair(struct spdk_nvme_vns *vns, enum spdk_nvme_qprio qprio)
+{
+	struct spdk_nvme_vns_qpair	*vqpair;
+	uint32_t			i, num_ios = 0;
+
+	vqpair = calloc(1, sizeof(*vqpair));
+	if (vqpair == NULL) {
+		return NULL;
+	}
+	vqpair->vns = vns;
+
+	for (i = 0; i < vns->num_members; i++) {
+		vqpair->qpairs[i] = spdk_nvme_ctrlr_alloc_io_qpair(vns->members[i]->ctrlr, qprio);
+		if (vqpair->qpairs[i] == NULL) {
+			goto fail;
+		}
+		num_ios += vqpair->qpairs[i]->num_trackers;
+	}
+
+	/* Every virtual I/O uses at least one tracker on some member. */
+	vqpair->ios = calloc(num_ios, sizeof(*vqpair->ios));
+	vqpair->free_ios = calloc(num_ios, sizeof(*vqpair->free_ios));
+	if (vqpair->ios == NULL || vqpair->free_ios == NULL) {
+		goto fail;
+	}
+
+	for (i = 0; i < num_ios; i++) {
+		vqpair->ios[i].vqpair = vqpair;
+		vqpair->free_ios[i] = &vqpair->ios[num_ios - 1 - i];
+	}
+	vqpair->num_ios = num_ios;
+	vqpair->num_free_ios = num_ios;
+
+	vns->num_qpairs++;
+	return vqpair;
+
+fail:
+	nvme_vns_free_member_qpairs(vqpair);
+	free(vqpair->ios);
+	free(vqpair->free_ios);
+	free(vqpair);
+	return NULL;
+}
+
+void
+spdk_nvme_vns_free_qpair(struct spdk_nvme_vns_qpair *vqpair)
+{
+	if (vqpair == NULL) {
+		return;
+	}
+
+	nvme_assert(vqpair->num_free_ios == vqpair->num_ios, ("vns qpair has I/O outstanding\n"));
+
+	nvme_vns_free_member_qpairs(vqpair);
+	vqpair->vns->num_qpairs--;
+	free(vqpair->ios);
+	free(vqpair->free_ios);
+	free(vqpair);
+}
+
+static void
+nvme_vns_io_put_ref(struct nvme_vns_io *io)
+{
+	struct spdk_nvme_vns_qpair *vqpair = io->vqpair;
+
+	if (--io->outstanding != 0) {
+		return;
+	}
+
+	if (io->cb_fn) {
+		io->cb_fn(io->cb_arg, &io->cpl);
+	}
+	vqpair->free_ios[vqpair->num_free_ios++] = io;
+}
+
+static void
+nvme_vns_part_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct nvme_vns_io *io = cb_arg;
+
+	io->completed++;
+	if (spdk_nvme_cpl_is_error(cpl) && !spdk_nvme_cpl_is_error(&io->cpl)) {
+		io->cpl = *cpl;
+	}
+	nvme_vns_io_put_ref(io);
+}
+
+typedef int (*nvme_vns_ns_cmd_fn)(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
+				  void *payload, uint64_t lba, uint32_t lba_count,
+				  spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags);
+
+/*
+ * Submit one part of a virtual I/O.  Returns the submission error, if any,
+ *  after making sure the part holds no reference on io any more.
+ */
+static int
+nvme_vns_submit_part(struct nvme_vns_io *io, nvme_vns_ns_cmd_fn ns_cmd, uint32_t member,
+		     void *payload, uint64_t lba, uint32_t lba_count, uint32_t io_flags)
+{
+	struct spdk_nvme_vns_qpair	*vqpair = io->vqpair;
+	uint32_t			completed = io->completed;
+	int				rc;
+
+	io->outstanding++;
+	rc = ns_cmd(vqpair->vns->members[member], vqpair->qpairs[member], payload, lba, lba_count,
+		    nvme_vns_part_done, io, io_flags);
+	if (rc != 0 && io->completed == completed) {
+		/* The part was rejected without its callback being called. */
+		io->outstanding--;
+		if (!spdk_nvme_cpl_is_error(&io->cpl)) {
+			io->cpl.status.sct = SPDK_NVME_SCT_GENERIC;
+			io->cpl.status.sc = SPDK_NVME_SC_INTERNAL_DEVICE_ERROR;
+		}
+	}
+
+	return rc;
+}
+
+static uint32_t
+nvme_vns_pick_read_member(struct spdk_nvme_vns_qpair *vqpair)
+{
+	struct spdk_nvme_qpair	*qpair;
+	uint32_t		num_members = vqpair->vns->num_members;
+	uint32_t		member = vqpair->next_read_member;
+	uint32_t		best = member;
+	uint32_t		depth, best_depth = UINT32_MAX;
+	uint32_t		i;
+
+	for (i = 0; i < num_members; i++) {
+		qpair = vqpair->qpairs[member];
+		depth = qpair->num_trackers - qpair->num_free_tr;
+		if (depth < best_depth) {
+			best = member;
+			best_depth = depth;
+		}
+		if (++member == num_members) {
+			member = 0;
+		}
+	}
+
+	vqpair->next_read_member = (best + 1 == num_members) ? 0 : best + 1;
+	return best;
+}
+
+static int
+nvme_vns_cmd_rw(struct spdk_nvme_vns *vns, struct spdk_nvme_vns_qpair *vqpair,
+		nvme_vns_ns_cmd_fn ns_cmd, bool is_write,
+		void *payload, uint64_t lba, uint32_t lba_count,
+		spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	struct nvme_vns_io	*io;
+	uint64_t		strip, member_lba;
+	uint32_t		member, offset, count;
+	uint32_t		submitted = 0;
+	int			rc = 0;
+
+	if (lba_count == 0 || lba >= vns->num_sectors || lba_count > vns->num_sectors - lba) {
+		return -EINVAL;
+	}
+
+	if (vqpair->num_free_ios == 0) {
+		return -ENOMEM;
+	}
+	io = vqpair->free_ios[--vqpair->num_free_ios];
+	io->cb_fn = cb_fn;
+	io->cb_arg = cb_arg;
+	io->outstanding = 1;
+	io->completed = 0;
+	memset(&io->cpl, 0, sizeof(io->cpl));
+
+	if (vns->level == SPDK_NVME_VNS_RAID1) {
+		if (is_write) {
+			for (member = 0; member < vns->num_members; member++) {
+				rc = nvme_vns_submit_part(io, ns_cmd, member, payload, lba, lba_count, io_flags);
+				if (rc != 0) {
+					break;
+				}
+				submitted++;
+			}
+		} else {
+			member = nvme_vns_pick_read_member(vqpair);
+			rc = nvme_vns_submit_part(io, ns_cmd, member, payload, lba, lba_count, io_flags);
+			submitted += (rc == 0);
+		}
+	} else {
+		while (lba_count > 0) {
+			strip = lba / vns->strip_sectors;
+			offset = lba - strip * vns->strip_sectors;
+			count = nvme_min(lba_count, vns->strip_sectors - offset);
+			member = strip % vns->num_members;
+			member_lba = (strip / vns->num_members) * vns->strip_sectors + offset;
+
+			rc = nvme_vns_submit_part(io, ns_cmd, member, payload, member_lba, count, io_flags);
+			if (rc != 0) {
+				break;
+			}
+			submitted++;
+
+			payload = (uint8_t *)payload + (uint64_t)count * vns->sector_size;
+			lba += count;
+			lba_count -= count;
+		}
+	}
+
+	if (submitted == 0 && io->completed == 0) {
+		/* Nothing was sent, so report the error to the caller instead of cb_fn. */
+		vqpair->free_ios[vqpair->num_free_ios++] = io;
+		return rc;
+	}
+
+	/* Parts that were sent complete normally; cb_fn reports any failure. */
+	nvme_vns_io_put_ref(io);
+	return 0;
+}
+
+int
+spdk_nvme_vns_cmd_read(struct spdk_nvme_vns *vns, struct spdk_nvme_vns_qpair *vqpair,
+		       void *payload, uint64_t lba, uint32_t lba_count,
+		       spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return nvme_vns_cmd_rw(vns, vqpair, spdk_nvme_ns_cmd_read, false, payload, lba, lba_count,
+			       cb_fn, cb_arg, io_flags);
+}
+
+int
+spdk_nvme_vns_cmd_write(struct spdk_nvme_vns *vns, struct spdk_nvme_vns_qpair *vqpair,
+			void *payload, uint64_t lba, uint32_t lba_count,
+			spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return nvme_vns_cmd_rw(vns, vqpair, spdk_nvme_ns_cmd_write, true, payload, lba, lba_count,
+			       cb_fn, cb_arg, io_flags);
+}
+
+int32_t
+spdk_nvme_vns_qpair_process_completions(struct spdk_nvme_vns_qpair *vqpair,
+					uint32_t max_completions)
+{
+	int32_t		num_completions = 0;
+	int32_t		rc;
+	uint32_t	i;
+
+	for (i = 0; i < vqpair->vns->num_members; i++) {
+		rc = spdk_nvme_qpair_process_completions(vqpair->qpairs[i], max_completions);
+		if (rc > 0) {
+			num_completions += rc;
+		}
+	}
+
+	return num_completions;
+}
@@ -0,0 +1,992 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "nvme_internal.h"
+#include "spdk/crc32.h"
+
+/*
+ * A write-ahead log stages writes for a data namespace on a smaller, lower latency log
+ *  namespace.  Each write is appended to a ring on the log namespace with FUA and is
+ *  acknowledged as soon as that write completes.  spdk_nvme_wal_process_completions()
+ *  later destages the logged writes to the data namespace in batches sorted by LBA.
+ *
+ *  Log namespace layout:
+ *
+ *   sector 0			superblock: ring size, epoch and oldest record not destaged
+ *   sectors 1..ring_sectors	ring of records, each a header sector followed by its data
+ *
+ *  A record that does not fit before the end of the ring starts at ring offset 0 instead.
+ *  The whole ring is mirrored in host memory, so reads see staged data and destaging never
+ *  reads the log back.  Attaching walks the ring from the superblock's tail and replays
+ *  every record whose epoch, sequence number and checksums are valid.
+ */
+
+#define NVME_WAL_SB_MAGIC			0x4c41575f454d564eULL	/* "NVME_WAL" */
+#define NVME_WAL_RECORD_MAGIC			0x44524357		/* "WCRD" */
+#define NVME_WAL_VERSION			1
+
+#define NVME_WAL_DEFAULT_LOG_SIZE		(64 * 1024 * 1024)
+#define NVME_WAL_DEFAULT_DESTAGE_BATCH_SIZE	(1024 * 1024)
+#define NVME_WAL_DEFAULT_DESTAGE_THRESHOLD	(256 * 1024)
+
+struct nvme_wal_superblock {
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	sector_size;
+	uint64_t	ring_sectors;
+
+	/* Incremented on every attach, so records written before it are never replayed again. */
+	uint64_t	epoch;
+
+	/* Ring offset and sequence number of the oldest record not yet destaged. */
+	uint64_t	tail_pos;
+	uint64_t	tail_seq;
+
+	/* CRC-32C of the fields above. */
+	uint32_t	crc;
+};
+
+struct nvme_wal_record_header {
+	uint32_t	magic;
+	uint32_t	lba_count;
+	uint64_t	epoch;
+	uint64_t	seq;
+	uint64_t	lba;
+	uint32_t	data_crc;
+
+	/* CRC-32C of the fields above. */
+	uint32_t	header_crc;
+};
+
+struct nvme_wal_record {
+	struct spdk_nvme_wal	*wal;
+	spdk_nvme_cmd_cb	cb_fn;
+	void			*cb_arg;
+	uint64_t		lba;
+	uint32_t		lba_count;
+
+	/* Ring offset of the header sector; the data follows it. */
+	uint64_t		pos;
+
+	/* Sector offset of the data in the destage buffer while the record is destaged. */
+	uint64_t		destage_offset;
+
+	/* The log write is outstanding. */
+	bool			logging;
+
+	/* The write was acknowledged with an error, so its data is never destaged or read. */
+	bool			failed;
+};
+
+struct nvme_wal_read {
+	struct spdk_nvme_wal	*wal;
+	void			*payload;
+	uint64_t		lba;
+	uint32_t		lba_count;
+	spdk_nvme_cmd_cb	cb_fn;
+	void			*cb_arg;
+	bool			done;
+};
+
+enum nvme_wal_destage_phase {
+	NVME_WAL_DESTAGE_WRITE,
+	NVME_WAL_DESTAGE_FLUSH,
+	NVME_WAL_DESTAGE_SUPERBLOCK,
+};
+
+struct spdk_nvme_wal {
+	struct spdk_nvme_ns		*log_ns;
+	struct spdk_nvme_ns		*data_ns;
+	struct spdk_nvme_qpair		*log_qpair;
+	struct spdk_nvme_qpair		*data_qpair;
+
+	uint32_t			sector_size;
+	uint32_t			max_write_sectors;
+	uint64_t			data_sectors;
+	uint64_t			ring_sectors;
+	uint64_t			epoch;
+
+	/* Host copy of the ring, which is also the buffer of every log write. */
+	uint8_t				*ring;
+	struct nvme_wal_superblock	*sb;
+
+	/*
+	 * Records are indexed by sequence number modulo num_records:
+	 *  [tail_seq, destage_seq)	being destaged, or destaged and not yet retired
+	 *  [destage_seq, ack_seq)	logged and acknowledged
+	 *  [ack_seq, head_seq)		being logged, or logged after one that still is
+	 */
+	struct nvme_wal_record		*records;
+	uint64_t			num_records;
+	uint64_t			tail_seq;
+	uint64_t			destage_seq;
+	uint64_t			ack_seq;
+	uint64_t			head_seq;
+	uint64_t			tail_pos;
+	uint64_t			head_pos;
+
+	/* LBA range written by live records, so most reads can skip the overlay. */
+	uint64_t			min_lba;
+	uint64_t			max_lba_end;
+
+	/* Sectors acknowledged and not yet in a destage batch. */
+	uint64_t			pending_sectors;
+	uint32_t			destage_threshold_sectors;
+	uint32_t			destage_batch_sectors;
+
+	/* Records of the current destage batch, and the buffer their runs are written from. */
+	struct nvme_wal_record		**batch;
+	uint8_t				*destage_buf;
+	uint64_t			batch_sectors;
+	enum nvme_wal_destage_phase	destage_phase;
+	uint32_t			destage_outstanding;
+	uint32_t			destage_completed;
+	uint32_t			destage_failures;
+	bool				destaging;
+	bool				destage_error;
+
+	/* The batch is destaged and the superblock updated; waiting for reads to retire it. */
+	bool				retire_pending;
+
+	/* A log write failed, so no further writes can be acknowledged. */
+	bool				failed;
+
+	/* Reads that overlap live records, and the stack of free ones. */
+	struct nvme_wal_read		*reads;
+	struct nvme_wal_read		**free_reads;
+	uint32_t			num_reads;
+	uint32_t			num_free_reads;
+};
+
+static inline struct nvme_wal_record *
+nvme_wal_record(struct spdk_nvme_wal *wal, uint64_t seq)
+{
+	return &wal->records[seq % wal->num_records];
+}
+
+static inline bool
+nvme_wal_is_empty(struct spdk_nvme_wal *wal)
+{
+	return wal->tail_seq == wal->head_seq;
+}
+
+/* Ring offset of the record with sequence number seq, or of the next one if seq is the head. */
+static uint64_t
+nvme_wal_seq_pos(struct spdk_nvme_wal *wal, uint64_t seq)
+{
+	return (seq == wal->head_seq) ? wal->head_pos : nvme_wal_record(wal, seq)->pos;
+}
+
+static uint64_t
+nvme_wal_ring_used(struct spdk_nvme_wal *wal)
+{
+	if (nvme_wal_is_empty(wal)) {
+		return 0;
+	}
+	if (wal->head_pos > wal->tail_pos) {
+		return wal->head_pos - wal->tail_pos;
+	}
+	return wal->ring_sectors - wal->tail_pos + wal->head_pos;
+}
+
+/* Find ring space for a record of num_sectors, or return UINT64_MAX if there is none. */
+static uint64_t
+nvme_wal_ring_alloc(struct spdk_nvme_wal *wal, uint64_t num_sectors)
+{
+	uint64_t head = wal->head_pos;
+	uint64_t tail = wal->tail_pos;
+
+	if (nvme_wal_is_empty(wal)) {
+		return (num_sectors <= wal->ring_sectors - head) ? head : 0;
+	}
+
+	if (head > tail) {
+		if (num_sectors <= wal->ring_sectors - head) {
+			return head;
+		}
+		if (num_sectors <= tail) {
+			return 0;
+		}
+	} else if (head < tail && num_sectors <= tail - head) {
+		return head;
+	}
+
+	return UINT64_MAX;
+}
+
+static void
+nvme_wal_add_range(struct spdk_nvme_wal *wal, uint64_t lba, uint32_t lba_count)
+{
+	wal->min_lba = nvme_min(wal->min_lba, lba);
+	wal->max_lba_end = nvme_max(wal->max_lba_end, lba + lba_count);
+}
+
+static void
+nvme_wal_update_range(struct spdk_nvme_wal *wal)
+{
+	struct nvme_wal_record	*rec;
+	uint64_t		seq;
+
+	wal->min_lba = UINT64_MAX;
+	wal->max_lba_end = 0;
+	for (seq = wal->tail_seq; seq != wal->head_seq; seq++) {
+		rec = nvme_wal_record(wal, seq);
+		nvme_wal_add_range(wal, rec->lba, rec->lba_count);
+	}
+}
+
+static void
+nvme_wal_fill_superblock(struct spdk_nvme_wal *wal, uint64_t tail_seq)
+{
+	struct nvme_wal_superblock *sb = wal->sb;
+
+	memset(sb, 0, wal->sector_size);
+	sb->magic = NVME_WAL_SB_MAGIC;
+	sb->version = NVME_WAL_VERSION;
+	sb->sector_size = wal->sector_size;
+	sb->ring_sectors = wal->ring_sectors;
+	sb->epoch = wal->epoch;
+	sb->tail_pos = nvme_wal_seq_pos(wal, tail_seq);
+	sb->tail_seq = tail_seq;
+	sb->crc = spdk_crc32c(0, sb, offsetof(struct nvme_wal_superblock, crc));
+}
+
+static bool
+nvme_wal_superblock_valid(struct spdk_nvme_wal *wal, uint64_t log_sectors)
+{
+	struct nvme_wal_superblock *sb = wal->sb;
+
+	return sb->magic == NVME_WAL_SB_MAGIC &&
+	       sb->version == NVME_WAL_VERSION &&
+	       sb->crc == spdk_crc32c(0, sb, offsetof(struct nvme_wal_superblock, crc)) &&
+	       sb->sector_size == wal->sector_size &&
+	       sb->ring_sectors >= 2 && sb->ring_sectors < log_sectors &&
+	       sb->tail_pos < sb->ring_sectors;
+}
+
+static bool
+nvme_wal_header_valid(struct spdk_nvme_wal *wal, const struct nvme_wal_record_header *hdr,
+		      uint64_t pos, uint64_t seq)
+{
+	return hdr->magic == NVME_WAL_RECORD_MAGIC &&
+	       hdr->header_crc == spdk_crc32c(0, hdr,
+			       offsetof(struct nvme_wal_record_header, header_crc)) &&
+	       hdr->epoch == wal->epoch &&
+	       hdr->seq == seq &&
+	       hdr->lba_count != 0 && hdr->lba_count < wal->ring_sectors - pos &&
+	       hdr->lba < wal->data_sectors && hdr->lba_count <= wal->data_sectors - hdr->lba;
+}
+
+/* Read or write the log namespace and wait for the command; only used while attaching. */
+static int
+nvme_wal_log_io_sync(struct spdk_nvme_wal *wal, bool is_write, void *buf, uint64_t lba,
+		     uint32_t lba_count)
+{
+	struct nvme_completion_poll_status	status = {};
+	int					rc;
+
+	if (is_write) {
+		rc = spdk_nvme_ns_cmd_write(wal->log_ns, wal->log_qpair, buf, lba, lba_count,
+					    nvme_completion_poll_cb, &status,
+					    SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS);
+	} else {
+		rc = spdk_nvme_ns_cmd_read(wal->log_ns, wal->log_qpair, buf, lba, lba_count,
+					   nvme_completion_poll_cb, &status, 0);
+	}
+	if (rc != 0) {
+		return rc;
+	}
+
+	while (!status.done) {
+		spdk_nvme_qpair_process_completions(wal->log_qpair, 0);
+	}
+
+	return spdk_nvme_cpl_is_error(&status.cpl) ? -EIO : 0;
+}
+
+static void
+nvme_wal_ack(struct spdk_nvme_wal *wal)
+{
+	struct nvme_wal_record	*rec;
+	struct spdk_nvme_cpl	cpl;
+
+	while (wal->ack_seq != wal->head_seq) {
+		rec = nvme_wal_record(wal, wal->ack_seq);
+		if (rec->logging) {
+			break;
+		}
+
+		memset(&cpl, 0, sizeof(cpl));
+		if (wal->failed) {
+			rec->failed = true;
+			cpl.status.sct = SPDK_NVME_SCT_GENERIC;
+			cpl.status.sc = SPDK_NVME_SC_INTERNAL_DEVICE_ERROR;
+		} else {
+			wal->pending_sectors += rec->lba_count;
+		}
+
+		wal->ack_seq++;
+		if (rec->cb_fn) {
+			rec->cb_fn(rec->cb_arg, &cpl);
+		}
+	}
+}
+
+static void
+nvme_wal_log_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct nvme_wal_record	*rec = cb_arg;
+	struct spdk_nvme_wal	*wal = rec->wal;
+
+	rec->logging = false;
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		/*
+		 * Replay stops at this record, so none of the records after it can be
+		 *  acknowledged either.
+		 */
+		wal->failed = true;
+	}
+
+	/* Writes are acknowledged in log order, so an acknowledged write is always replayed. */
+	nvme_wal_ack(wal);
+}
+
+static void
+nvme_wal_try_retire(struct spdk_nvme_wal *wal)
+{
+	/* Reads being overlaid may still copy from the records of the batch. */
+	if (!wal->retire_pending || wal->num_free_reads != wal->num_reads) {
+		return;
+	}
+
+	wal->retire_pending = false;
+	wal->tail_seq = wal->destage_seq;
+	wal->tail_pos = nvme_wal_seq_pos(wal, wal->tail_seq);
+	nvme_wal_update_range(wal);
+}
+
+static void
+nvme_wal_destage_failed(struct spdk_nvme_wal *wal)
+{
+	/* Destage the whole batch again later; writing the same data twice is harmless. */
+	wal->destaging = false;
+	wal->destage_failures++;
+	wal->pending_sectors += wal->batch_sectors;
+	wal->destage_seq = wal->tail_seq;
+}
+
+static void nvme_wal_destage_cmd_done(void *cb_arg, const struct spdk_nvme_cpl *cpl);
+
+static void
+nvme_wal_destage_put(struct spdk_nvme_wal *wal)
+{
+	uint32_t	completed;
+	int		rc;
+
+	if (--wal->destage_outstanding != 0) {
+		return;
+	}
+
+	if (wal->destage_error) {
+		nvme_wal_destage_failed(wal);
+		return;
+	}
+
+	wal->destage_outstanding = 1;
+	completed = wal->destage_completed;
+
+	switch (wal->destage_phase) {
+	case NVME_WAL_DESTAGE_WRITE:
+		/* The tail may only move once the data is durable on the data namespace. */
+		wal->destage_phase = NVME_WAL_DESTAGE_FLUSH;
+		rc = spdk_nvme_ns_cmd_flush(wal->data_ns, wal->data_qpair, nvme_wal_destage_cmd_done, wal);
+		break;
+	case NVME_WAL_DESTAGE_FLUSH:
+		wal->destage_phase = NVME_WAL_DESTAGE_SUPERBLOCK;
+		nvme_wal_fill_superblock(wal, wal->destage_seq);
+		rc = spdk_nvme_ns_cmd_write(wal->log_ns, wal->log_qpair, wal->sb, 0, 1,
+					    nvme_wal_destage_cmd_done, wal,
+					    SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS);
+		break;
+	case NVME_WAL_DESTAGE_SUPERBLOCK:
+	default:
+		wal->destage_outstanding = 0;
+		wal->destaging = false;
+		wal->retire_pending = true;
+		nvme_wal_try_retire(wal);
+		return;
+	}
+
+	if (rc != 0 && wal->destage_completed == completed) {
+		wal->destage_outstanding = 0;
+		nvme_wal_destage_failed(wal);
+	}
+}
+
+static void
+nvme_wal_destage_cmd_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct spdk_nvme_wal *wal = cb_arg;
+
+	wal->destage_completed++;
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		wal->destage_error = true;
+	}
+	nvme_wal_destage_put(wal);
+}
+
+static int
+nvme_wal_record_lba_cmp(const void *a, const void *b)
+{
+	const struct nvme_wal_record *ra = *(struct nvme_wal_record * const *)a;
+	const struct nvme_wal_record *rb = *(struct nvme_wal_record * const *)b;
+
+	if (ra->lba != rb->lba) {
+		return (ra->lba < rb->lba) ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * Start destaging the oldest acknowledged records, if no batch is in progress and either
+ *  enough has been logged or force is set.  The records are sorted by LBA and grouped
+ *  into runs of overlapping or adjacent ranges; each run is assembled in the destage
+ *  buffer, in log order so later writes win, and written with a single command.
+ */
+static void
+nvme_wal_destage(struct spdk_nvme_wal *wal, bool force)
+{
+	struct nvme_wal_record	*rec;
+	uint64_t		seq, end, offset, run_lba, run_end;
+	uint64_t		sectors = 0;
+	uint32_t		num = 0, completed, i, j;
+	int			rc;
+
+	if (wal->destaging || wal->retire_pending || wal->destage_seq == wal->ack_seq) {
+		return;
+	}
+
+	if (!force && wal->pending_sectors < wal->destage_threshold_sectors &&
+	    nvme_wal_ring_used(wal) < wal->ring_sectors / 2) {
+		return;
+	}
+
+	for (seq = wal->destage_seq; seq != wal->ack_seq; seq++) {
+		rec = nvme_wal_record(wal, seq);
+		if (rec->failed) {
+			continue;
+		}
+		if (num > 0 && sectors + rec->lba_count > wal->destage_batch_sectors) {
+			break;
+		}
+		sectors += rec->lba_count;
+		wal->batch[num++] = rec;
+	}
+	end = seq;
+
+	qsort(wal->batch, num, sizeof(wal->batch[0]), nvme_wal_record_lba_cmp);
+
+	offset = 0;
+	for (i = 0; i < num; i = j) {
+		run_lba = wal->batch[i]->lba;
+		run_end = run_lba + wal->batch[i]->lba_count;
+		for (j = i + 1; j < num && wal->batch[j]->lba <= run_end; j++) {
+			run_end = nvme_max(run_end, wal->batch[j]->lba + wal->batch[j]->lba_count);
+		}
+		for (; i < j; i++) {
+			wal->batch[i]->destage_offset = offset + (wal->batch[i]->lba - run_lba);
+		}
+		offset += run_end - run_lba;
+	}
+
+	for (seq = wal->destage_seq; seq != end; seq++) {
+		rec = nvme_wal_record(wal, seq);
+		if (!rec->failed) {
+			memcpy(wal->destage_buf + rec->destage_offset * wal->sector_size,
+			       wal->ring + (rec->pos + 1) * wal->sector_size,
+			       (uint64_t)rec->lba_count * wal->sector_size);
+		}
+	}
+
+	wal->destaging = true;
+	wal->destage_error = false;
+	wal->destage_phase = NVME_WAL_DESTAGE_WRITE;
+	wal->destage_outstanding = 1;
+	wal->batch_sectors = sectors;
+	wal->pending_sectors -= sectors;
+	wal->destage_seq = end;
+
+	offset = 0;
+	for (i = 0; i < num; i = j) {
+		run_lba = wal->batch[i]->lba;
+		run_end = run_lba + wal->batch[i]->lba_count;
+		for (j = i + 1; j < num && wal->batch[j]->lba <= run_end; j++) {
+			run_end = nvme_max(run_end, wal->batch[j]->lba + wal->batch[j]->lba_count);
+		}
+
+		wal->destage_outstanding++;
+		completed = wal->destage_completed;
+		rc = spdk_nvme_ns_cmd_write(wal->data_ns, wal->data_qpair,
+					    wal->destage_buf + offset * wal->sector_size,
+					    run_lba, run_end - run_lba, nvme_wal_destage_cmd_done, wal, 0);
+		if (rc != 0) {
+			if (wal->destage_completed == completed) {
+				wal->destage_outstanding--;
+				wal->destage_error = true;
+			}
+			break;
+		}
+		offset += run_end - run_lba;
+	}
+
+	nvme_wal_destage_put(wal);
+}
+
+/* Replay the log into the ring mirror, starting at the superblock's tail. */
+static int
+nvme_wal_recover(struct spdk_nvme_wal *wal, uint32_t *max_lba_count)
+{
+	struct nvme_wal_record_header	*hdr;
+	struct nvme_wal_record		*rec;
+	uint64_t			pos = wal->sb->tail_pos;
+	uint64_t			seq = wal->sb->tail_seq;
+	int				rc;
+
+	wal->tail_seq = wal->destage_seq = wal->ack_seq = wal->head_seq = seq;
+	wal->tail_pos = wal->head_pos = pos;
+
+	while (wal->head_seq - wal->tail_seq < wal->num_records) {
+		hdr = (struct nvme_wal_record_header *)(wal->ring + pos * wal->sector_size);
+		rc = nvme_wal_log_io_sync(wal, false, hdr, 1 + pos, 1);
+		if (rc != 0) {
+			return rc;
+		}
+
+		if (!nvme_wal_header_valid(wal, hdr, pos, seq)) {
+			/* The record may have been placed at the start of the ring instead. */
+			if (pos == 0) {
+				break;
+			}
+			pos = 0;
+			continue;
+		}
+
+		rc = nvme_wal_log_io_sync(wal, false, (uint8_t *)hdr + wal->sector_size, 2 + pos,
+					  hdr->lba_count);
+		if (rc != 0) {
+			return rc;
+		}
+		if (hdr->data_crc != spdk_crc32c(0, (uint8_t *)hdr + wal->sector_size,
+						 (uint64_t)hdr->lba_count * wal->sector_size)) {
+			/* Torn write; it was never acknowledged. */
+			break;
+		}
+
+		rec = nvme_wal_record(wal, seq);
+		rec->cb_fn = NULL;
+		rec->cb_arg = NULL;
+		rec->lba = hdr->lba;
+		rec->lba_count = hdr->lba_count;
+		rec->pos = pos;
+		rec->logging = false;
+		rec->failed = false;
+		nvme_wal_add_range(wal, rec->lba, rec->lba_count);
+		wal->pending_sectors += rec->lba_count;
+		*max_lba_count = nvme_max(*max_lba_count, rec->lba_count);
+
+		seq++;
+		pos += 1 + rec->lba_count;
+		if (pos == wal->ring_sectors) {
+			pos = 0;
+		}
+		wal->ack_seq = wal->head_seq = seq;
+		wal->head_pos = pos;
+	}
+
+	return 0;
+}
+
+/* Destage and retire every record, waiting for outstanding log writes first. */
+static int
+nvme_wal_drain(struct spdk_nvme_wal *wal)
+{
+	uint32_t failures = wal->destage_failures;
+
+	while (!nvme_wal_is_empty(wal)) {
+		nvme_wal_destage(wal, true);
+		spdk_nvme_wal_process_completions(wal);
+		if (wal->destage_failures != failures) {
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+static void
+nvme_wal_free(struct spdk_nvme_wal *wal)
+{
+	if (wal->log_qpair != NULL) {
+		spdk_nvme_ctrlr_free_io_qpair(wal->log_qpair);
+	}
+	if (wal->data_qpair != NULL) {
+		spdk_nvme_ctrlr_free_io_qpair(wal->data_qpair);
+	}
+	nvme_free(wal->ring);
+	nvme_free(wal->sb);
+	nvme_free(wal->destage_buf);
+	free(wal->records);
+	free(wal->batch);
+	free(wal->reads);
+	free(wal->free_reads);
+	free(wal);
+}
+
+void
+spdk_nvme_wal_get_default_opts(struct spdk_nvme_wal_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->log_size = NVME_WAL_DEFAULT_LOG_SIZE;
+	opts->destage_batch_size = NVME_WAL_DEFAULT_DESTAGE_BATCH_SIZE;
+	opts->destage_threshold = NVME_WAL_DEFAULT_DESTAGE_THRESHOLD;
+	opts->format = false;
+}
+
+struct spdk_nvme_wal *
+spdk_nvme_wal_create(struct spdk_nvme_ns *log_ns, struct spdk_nvme_ns *data_ns,
+		     const struct spdk_nvme_wal_opts *opts)
+{
+	struct spdk_nvme_wal_opts	default_opts;
+	struct spdk_nvme_wal		*wal;
+	uint64_t			log_sectors, phys_addr, i;
+	uint32_t			sector_size, max_lba_count = 0;
+	bool				formatted = false;
+
+	if (log_ns == NULL || data_ns == NULL || log_ns == data_ns) {
+		return NULL;
+	}
+
+	if (opts == NULL) {
+		spdk_nvme_wal_get_default_opts(&default_opts);
+		opts = &default_opts;
+	}
+
+	sector_size = spdk_nvme_ns_get_sector_size(data_ns);
+	log_sectors = spdk_nvme_ns_get_num_sectors(log_ns);
+	if (spdk_nvme_ns_get_sector_size(log_ns) != sector_size ||
+	    spdk_nvme_ns_get_md_size(log_ns) != 0 || spdk_nvme_ns_get_md_size(data_ns) != 0 ||
+	    sector_size < sizeof(struct nvme_wal_superblock) || log_sectors < 3 ||
+	    opts->destage_batch_size < sector_size) {
+		return NULL;
+	}
+
+	wal = calloc(1, sizeof(*wal));
+	if (wal == NULL) {
+		return NULL;
+	}
+
+	wal->log_ns = log_ns;
+	wal->data_ns = data_ns;
+	wal->sector_size = sector_size;
+	wal->data_sectors = spdk_nvme_ns_get_num_sectors(data_ns);
+	wal->destage_batch_sectors = opts->destage_batch_size / sector_size;
+	wal->destage_threshold_sectors = opts->destage_threshold / sector_size;
+	wal->min_lba = UINT64_MAX;
+
+	wal->log_qpair = spdk_nvme_ctrlr_alloc_io_qpair(log_ns->ctrlr, 0);
+	wal->data_qpair = spdk_nvme_ctrlr_alloc_io_qpair(data_ns->ctrlr, 0);
+	wal->sb = nvme_malloc("nvme_wal_sb", sector_size, sector_size, &phys_addr);
+	if (wal->log_qpair == NULL || wal->data_qpair == NULL || wal->sb == NULL) {
+		goto fail;
+	}
+
+	if (nvme_wal_log_io_sync(wal, false, wal->sb, 0, 1) != 0) {
+		goto fail;
+	}
+
+	if (nvme_wal_superblock_valid(wal, log_sectors)) {
+		wal->ring_sectors = wal->sb->ring_sectors;
+		wal->epoch = wal->sb->epoch;
+	} else if (opts->format) {
+		wal->ring_sectors = nvme_min(log_sectors - 1, opts->log_size / sector_size);
+		formatted = true;
+		if (wal->ring_sectors < 2) {
+			goto fail;
+		}
+	} else {
+		nvme_printf(NULL, "no valid write-ahead log superblock\n");
+		goto fail;
+	}
+
+	/* Every record takes at least two sectors. */
+	wal->num_records = wal->ring_sectors / 2;
+	wal->ring = nvme_malloc("nvme_wal_ring", wal->ring_sectors * sector_size, 0x1000, &phys_addr);
+	wal->records = calloc(wal->num_records, sizeof(*wal->records));
+	wal->batch = calloc(wal->num_records, sizeof(*wal->batch));
+	if (wal->ring == NULL || wal->records == NULL || wal->batch == NULL) {
+		goto fail;
+	}
+	for (i = 0; i < wal->num_records; i++) {
+		wal->records[i].wal = wal;
+	}
+
+	/* Only reads that overlap staged data need a context, and each holds a tracker. */
+	wal->num_reads = wal->data_qpair->num_trackers;
+	wal->reads = calloc(wal->num_reads, sizeof(*wal->reads));
+	wal->free_reads = calloc(wal->num_reads, sizeof(*wal->free_reads));
+	if (wal->reads == NULL || wal->free_reads == NULL) {
+		goto fail;
+	}
+	for (i = 0; i < wal->num_reads; i++) {
+		wal->reads[i].wal = wal;
+		wal->free_reads[i] = &wal->reads[wal->num_reads - 1 - i];
+	}
+	wal->num_free_reads = wal->num_reads;
+
+	if (!formatted && nvme_wal_recover(wal, &max_lba_count) != 0) {
+		goto fail;
+	}
+
+	wal->max_write_sectors = nvme_min(wal->destage_batch_sectors, wal->ring_sectors - 1);
+	wal->destage_buf = nvme_malloc("nvme_wal_destage",
+				       (uint64_t)nvme_max(wal->destage_batch_sectors, max_lba_count) * sector_size,
+				       0x1000, &phys_addr);
+	if (wal->destage_buf == NULL) {
+		goto fail;
+	}
+
+	/*
+	 * Replayed records are destaged before the epoch changes; until then a crash simply
+	 *  replays them again.
+	 */
+	if (nvme_wal_drain(wal) != 0) {
+		goto fail;
+	}
+
+	wal->epoch++;
+	nvme_wal_fill_superblock(wal, wal->head_seq);
+	if (nvme_wal_log_io_sync(wal, true, wal->sb, 0, 1) != 0) {
+		goto fail;
+	}
+
+	return wal;
+
+fail:
+	nvme_wal_free(wal);
+	return NULL;
+}
+
+void
+spdk_nvme_wal_destroy(struct spdk_nvme_wal *wal)
+{
+	if (wal == NULL) {
+		return;
+	}
+
+	nvme_assert(wal->num_free_reads == wal->num_reads, ("wal has reads outstanding\n"));
+
+	/* If destaging fails, the records stay in the log and are replayed at the next attach. */
+	nvme_wal_drain(wal);
+	nvme_wal_free(wal);
+}
+
+uint32_t
+spdk_nvme_wal_get_max_write_sectors(struct spdk_nvme_wal *wal)
+{
+	return wal->max_write_sectors;
+}
+
+int
+spdk_nvme_wal_cmd_write(struct spdk_nvme_wal *wal, void *payload, uint64_t lba,
+			uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	struct nvme_wal_record_header	*hdr;
+	struct nvme_wal_record		*rec;
+	uint64_t			pos, head_pos;
+	uint8_t				*data;
+	int				rc;
+
+	if (lba_count == 0 || lba_count > wal->max_write_sectors ||
+	    lba >= wal->data_sectors || lba_count > wal->data_sectors - lba) {
+		return -EINVAL;
+	}
+
+	if (wal->failed) {
+		return -EIO;
+	}
+
+	if (wal->head_seq - wal->tail_seq == wal->num_records) {
+		return -ENOMEM;
+	}
+
+	pos = nvme_wal_ring_alloc(wal, 1 + lba_count);
+	if (pos == UINT64_MAX) {
+		return -ENOMEM;
+	}
+
+	hdr = (struct nvme_wal_record_header *)(wal->ring + pos * wal->sector_size);
+	data = (uint8_t *)hdr + wal->sector_size;
+	memset(hdr, 0, wal->sector_size);
+	memcpy(data, payload, (uint64_t)lba_count * wal->sector_size);
+	hdr->magic = NVME_WAL_RECORD_MAGIC;
+	hdr->lba_count = lba_count;
+	hdr->epoch = wal->epoch;
+	hdr->seq = wal->head_seq;
+	hdr->lba = lba;
+	hdr->data_crc = spdk_crc32c(0, data, (uint64_t)lba_count * wal->sector_size);
+	hdr->header_crc = spdk_crc32c(0, hdr, offsetof(struct nvme_wal_record_header, header_crc));
+
+	rec = nvme_wal_record(wal, wal->head_seq);
+	rec->cb_fn = cb_fn;
+	rec->cb_arg = cb_arg;
+	rec->lba = lba;
+	rec->lba_count = lba_count;
+	rec->pos = pos;
+	rec->logging = true;
+	rec->failed = false;
+
+	head_pos = wal->head_pos;
+	wal->head_seq++;
+	wal->head_pos = pos + 1 + lba_count;
+	if (wal->head_pos == wal->ring_sectors) {
+		wal->head_pos = 0;
+	}
+	nvme_wal_add_range(wal, lba, lba_count);
+
+	rc = spdk_nvme_ns_cmd_write(wal->log_ns, wal->log_qpair, hdr, 1 + pos, 1 + lba_count,
+				    nvme_wal_log_done, rec, SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS);
+	if (rc != 0 && rec->logging) {
+		/* Rejected without calling back, so the record was never logged. */
+		wal->head_seq--;
+		wal->head_pos = head_pos;
+		return rc;
+	}
+
+	return 0;
+}
+
+/* Copy the staged data of live records over what was read from the data namespace. */
+static void
+nvme_wal_overlay(struct spdk_nvme_wal *wal, struct nvme_wal_read *read)
+{
+	struct nvme_wal_record	*rec;
+	uint64_t		seq, first, last;
+	uint64_t		end = read->lba + read->lba_count;
+
+	for (seq = wal->tail_seq; seq != wal->head_seq; seq++) {
+		rec = nvme_wal_record(wal, seq);
+		if (rec->failed || rec->lba >= end || rec->lba + rec->lba_count <= read->lba) {
+			continue;
+		}
+
+		first = nvme_max(rec->lba, read->lba);
+		last = nvme_min(rec->lba + rec->lba_count, end);
+		memcpy((uint8_t *)read->payload + (first - read->lba) * wal->sector_size,
+		       wal->ring + (rec->pos + 1 + first - rec->lba) * wal->sector_size,
+		       (last - first) * wal->sector_size);
+	}
+}
+
+static void
+nvme_wal_read_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct nvme_wal_read	*read = cb_arg;
+	struct spdk_nvme_wal	*wal = read->wal;
+
+	read->done = true;
+	if (!spdk_nvme_cpl_is_error(cpl)) {
+		nvme_wal_overlay(wal, read);
+	}
+
+	wal->free_reads[wal->num_free_reads++] = read;
+	read->cb_fn(read->cb_arg, cpl);
+}
+
+int
+spdk_nvme_wal_cmd_read(struct spdk_nvme_wal *wal, void *payload, uint64_t lba,
+		       uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	struct nvme_wal_read	*read;
+	int			rc;
+
+	if (lba_count == 0 || lba >= wal->data_sectors || lba_count > wal->data_sectors - lba) {
+		return -EINVAL;
+	}
+
+	if (lba >= wal->max_lba_end || lba + lba_count <= wal->min_lba) {
+		return spdk_nvme_ns_cmd_read(wal->data_ns, wal->data_qpair, payload, lba, lba_count,
+					     cb_fn, cb_arg, 0);
+	}
+
+	if (wal->num_free_reads == 0) {
+		return -ENOMEM;
+	}
+	read = wal->free_reads[--wal->num_free_reads];
+	read->payload = payload;
+	read->lba = lba;
+	read->lba_count = lba_count;
+	read->cb_fn = cb_fn;
+	read->cb_arg = cb_arg;
+	read->done = false;
+
+	rc = spdk_nvme_ns_cmd_read(wal->data_ns, wal->data_qpair, payload, lba, lba_count,
+				   nvme_wal_read_done, read, 0);
+	if (rc != 0 && !read->done) {
+		wal->free_reads[wal->num_free_reads++] = read;
+		return rc;
+	}
+
+	return 0;
+}
+
+int32_t
+spdk_nvme_wal_process_completions(struct spdk_nvme_wal *wal)
+{
+	int32_t num_completions = 0;
+	int32_t rc;
+
+	rc = spdk_nvme_qpair_process_completions(wal->log_qpair, 0);
+	if (rc > 0) {
+		num_completions += rc;
+	}
+	rc = spdk_nvme_qpair_process_completions(wal->data_qpair, 0);
+	if (rc > 0) {
+		num_completions += rc;
+	}
+
+	nvme_wal_try_retire(wal);
+	nvme_wal_destage(wal, false);
+
+	return num_completions;
+}
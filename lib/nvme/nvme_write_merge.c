@@ -0,0 +1,232 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "nvme_internal.h"
+
+/*
+ * Merging of LBA-adjacent writes.  While it is enabled on a qpair,
+ *  spdk_nvme_ns_cmd_write() adds a write that starts right after the open
+ *  batch to it, and the batch is sent as one write command whose payload is
+ *  an iovec over the separate buffers.
+ */
+
+static struct nvme_request *
+nvme_write_merge_build_request(struct nvme_batch *batch, spdk_nvme_cmd_cb cb_fn)
+{
+	struct nvme_write_merge_batch	*wm_batch = (struct nvme_write_merge_batch *)batch;
+	struct nvme_request		*req;
+	struct nvme_payload		payload;
+	struct spdk_nvme_cmd		*cmd;
+
+	if (wm_batch->iovcnt == 1) {
+		payload.type = NVME_PAYLOAD_TYPE_CONTIG;
+		payload.u.contig = wm_batch->iov[0].iov_base;
+	} else {
+		payload.type = NVME_PAYLOAD_TYPE_IOV;
+		payload.u.iov.iov = wm_batch->iov;
+		payload.u.iov.phys = NULL;
+		payload.u.iov.iovcnt = wm_batch->iovcnt;
+	}
+	payload.md = NULL;
+
+	req = nvme_allocate_request(batch->batcher->qpair, &payload,
+				    wm_batch->lba_count * batch->ns->sector_size, cb_fn, batch);
+	if (req == NULL) {
+		return NULL;
+	}
+
+	cmd = &req->cmd;
+	cmd->opc = SPDK_NVME_OPC_WRITE;
+	cmd->nsid = batch->ns->id;
+	*(uint64_t *)&cmd->cdw10 = wm_batch->lba;
+	cmd->cdw12 = (wm_batch->lba_count - 1) | wm_batch->io_flags;
+
+	return req;
+}
+
+static bool
+nvme_write_merge_buffers_contiguous(const struct iovec *last, const void *buffer)
+{
+	return (const uint8_t *)last->iov_base + last->iov_len == buffer;
+}
+
+static bool
+nvme_write_merge_can_append(struct nvme_write_merge_batch *batch, struct spdk_nvme_ns *ns,
+			    void *buffer, uint64_t lba, uint32_t lba_count, uint32_t io_flags)
+{
+	const struct iovec	*last = &batch->iov[batch->iovcnt - 1];
+	uint32_t		total = batch->lba_count + lba_count;
+
+	if (batch->batch.ns != ns || batch->io_flags != io_flags ||
+	    batch->lba + batch->lba_count != lba) {
+		return false;
+	}
+
+	/* The merged command must not need splitting. */
+	if (total > ns->sectors_per_max_io ||
+	    (ns->sectors_per_stripe > 0 &&
+	     total > nvme_ns_sectors_to_boundary(batch->lba, ns->sectors_per_stripe))) {
+		return false;
+	}
+
+	if (nvme_write_merge_buffers_contiguous(last, buffer) ||
+	    (ns->ctrlr->flags & SPDK_NVME_CTRLR_SGL_SUPPORTED)) {
+		return true;
+	}
+
+	/* A PRP list can only join buffers at page boundaries. */
+	return (((uintptr_t)last->iov_base + last->iov_len) & (PAGE_SIZE - 1)) == 0 &&
+	       ((uintptr_t)buffer & (PAGE_SIZE - 1)) == 0;
+}
+
+/*
+ * Returns 0 if the write was added to a batch, 1 if it cannot be merged and
+ *  must be submitted on its own, or a negative errno if the open batch had to
+ *  be sent to make room but could not be.
+ */
+int
+nvme_qpair_write_merge(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+		       void *buffer, uint64_t lba, uint32_t lba_count,
+		       spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	struct nvme_write_merge		*wm = qpair->wm;
+	struct nvme_write_merge_batch	*batch = (struct nvme_write_merge_batch *)wm->batcher.open;
+	uint32_t			length = lba_count * ns->sector_size;
+	int				rc;
+
+	if ((io_flags & 0xFFFF) || ns->md_size != 0 || lba_count == 0 ||
+	    lba_count > ns->sectors_per_max_io ||
+	    (ns->sectors_per_stripe > 0 &&
+	     lba_count > nvme_ns_sectors_to_boundary(lba, ns->sectors_per_stripe))) {
+		return 1;
+	}
+
+	if (batch != NULL && !nvme_write_merge_can_append(batch, ns, buffer, lba, lba_count, io_flags)) {
+		rc = nvme_batcher_submit_open(&wm->batcher);
+		if (rc != 0) {
+			return rc;
+		}
+		batch = NULL;
+	}
+
+	if (batch == NULL) {
+		batch = (struct nvme_write_merge_batch *)nvme_batcher_open_batch(&wm->batcher, ns);
+		if (batch == NULL) {
+			return 1;
+		}
+		batch->lba = lba;
+		batch->lba_count = 0;
+		batch->io_flags = io_flags;
+		batch->iovcnt = 0;
+	}
+
+	if (batch->iovcnt > 0 &&
+	    nvme_write_merge_buffers_contiguous(&batch->iov[batch->iovcnt - 1], buffer)) {
+		batch->iov[batch->iovcnt - 1].iov_len += length;
+	} else {
+		batch->iov[batch->iovcnt].iov_base = buffer;
+		batch->iov[batch->iovcnt].iov_len = length;
+		batch->iovcnt++;
+	}
+	batch->lba_count += lba_count;
+	nvme_batch_add_cb(&batch->batch, cb_fn, cb_arg);
+
+	/* Send the batch as soon as no further write could be merged into it. */
+	if (batch->batch.num_cbs >= wm->max_writes ||
+	    batch->lba_count == ns->sectors_per_max_io ||
+	    (ns->sectors_per_stripe > 0 &&
+	     nvme_ns_sectors_to_boundary(batch->lba + batch->lba_count,
+					 ns->sectors_per_stripe) == ns->sectors_per_stripe)) {
+		/* If this fails, nvme_batcher_poll() retries it. */
+		nvme_batcher_submit_open(&wm->batcher);
+	}
+
+	return 0;
+}
+
+void
+nvme_qpair_write_merge_destroy(struct spdk_nvme_qpair *qpair)
+{
+	free(qpair->wm);
+	qpair->wm = NULL;
+	qpair->write_merging = false;
+}
+
+int
+spdk_nvme_qpair_set_write_merging(struct spdk_nvme_qpair *qpair, uint16_t max_writes,
+				  uint32_t window_us)
+{
+	struct nvme_write_merge	*wm = qpair->wm;
+	uint32_t		i;
+
+	if (max_writes > SPDK_NVME_QPAIR_MAX_MERGED_WRITES) {
+		return -EINVAL;
+	}
+
+	if (max_writes == 0) {
+		if (wm == NULL) {
+			return 0;
+		}
+
+		qpair->write_merging = false;
+		wm->max_writes = 0;
+		nvme_batcher_flush(&wm->batcher);
+		nvme_batcher_fail(&wm->batcher);
+
+		/* Batches still outstanding keep the state until the qpair is destroyed. */
+		if (wm->batcher.num_in_flight == 0) {
+			nvme_qpair_write_merge_destroy(qpair);
+		}
+		return 0;
+	}
+
+	if (wm == NULL) {
+		wm = calloc(1, sizeof(*wm));
+		if (wm == NULL) {
+			return -ENOMEM;
+		}
+		nvme_batcher_init(&wm->batcher, qpair, nvme_write_merge_build_request);
+		for (i = 0; i < NVME_WRITE_MERGE_BATCHES; i++) {
+			nvme_batcher_add_batch(&wm->batcher, &wm->batches[i].batch, wm->batches[i].cbs,
+					       SPDK_NVME_QPAIR_MAX_MERGED_WRITES);
+		}
+		qpair->wm = wm;
+	}
+
+	wm->max_writes = max_writes;
+	nvme_batcher_set_window(&wm->batcher, window_us);
+	qpair->write_merging = true;
+
+	return 0;
+}
@@ -126,13 +126,21 @@ static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
 	struct spdk_nvmf_probe_ctx *ctx = cb_ctx;
-	uint16_t found_domain = spdk_pci_device_get_domain(dev);
-	uint8_t found_bus    = spdk_pci_device_get_bus(dev);
-	uint8_t found_dev    = spdk_pci_device_get_dev(dev);
-	uint8_t found_func   = spdk_pci_device_get_func(dev);
+	uint16_t found_domain;
+	uint8_t found_bus, found_dev, found_func;
 	int i;
 	bool claim_device = false;
 
+	/* Subsystems are configured by PCI address; software controllers are never claimed. */
+	if (dev == NULL) {
+		return false;
+	}
+
+	found_domain = spdk_pci_device_get_domain(dev);
+	found_bus = spdk_pci_device_get_bus(dev);
+	found_dev = spdk_pci_device_get_dev(dev);
+	found_func = spdk_pci_device_get_func(dev);
+
 	SPDK_NOTICELOG("Probing device %x:%x:%x.%x\n",
 		       found_domain, found_bus, found_dev, found_func);
 
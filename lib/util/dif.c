@@ -0,0 +1,287 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+
+#include "spdk/crc16.h"
+#include "spdk/dif.h"
+
+/*
+ * The tags are stored big-endian, so they are accessed a byte at a time rather
+ *  than through struct spdk_dif.
+ */
+static inline uint16_t
+dif_load_be16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t
+dif_load_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void
+dif_store_be16(uint8_t *p, uint16_t val)
+{
+	p[0] = val >> 8;
+	p[1] = val;
+}
+
+static inline void
+dif_store_be32(uint8_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+int
+spdk_dif_ctx_init(struct spdk_dif_ctx *ctx, uint32_t block_size, uint32_t md_size,
+		  bool md_interleave, bool dif_loc_first, enum spdk_dif_type dif_type,
+		  uint32_t dif_flags, uint32_t init_ref_tag, uint16_t apptag_mask,
+		  uint16_t app_tag)
+{
+	uint32_t data_size;
+
+	if (md_size < sizeof(struct spdk_dif) || block_size == 0 ||
+	    (md_interleave && block_size <= md_size)) {
+		return -EINVAL;
+	}
+
+	switch (dif_type) {
+	case SPDK_DIF_TYPE1:
+	case SPDK_DIF_TYPE2:
+	case SPDK_DIF_TYPE3:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	data_size = md_interleave ? block_size - md_size : block_size;
+
+	ctx->block_size = block_size;
+	ctx->md_size = md_size;
+	ctx->md_interleave = md_interleave;
+	ctx->dif_offset = dif_loc_first ? 0 : md_size - sizeof(struct spdk_dif);
+	ctx->guard_interval = data_size + ctx->dif_offset;
+	ctx->dif_type = dif_type;
+	ctx->dif_flags = dif_flags;
+	ctx->init_ref_tag = init_ref_tag;
+	ctx->apptag_mask = apptag_mask;
+	ctx->app_tag = app_tag;
+
+	return 0;
+}
+
+/*
+ * CRC-16 of the first guard_interval bytes of the block.  With separate metadata,
+ *  data holds only data_size bytes and the rest comes from the front of md.
+ */
+static inline uint16_t
+dif_guard(const uint8_t *data, uint32_t data_size, const uint8_t *md,
+	  const struct spdk_dif_ctx *ctx)
+{
+	uint16_t crc;
+
+	if (ctx->guard_interval <= data_size) {
+		return spdk_crc16_t10dif(0, data, ctx->guard_interval);
+	}
+
+	crc = spdk_crc16_t10dif(0, data, data_size);
+	return spdk_crc16_t10dif(crc, md, ctx->guard_interval - data_size);
+}
+
+static inline uint32_t
+dif_ref_tag(const struct spdk_dif_ctx *ctx, uint32_t block)
+{
+	return ctx->dif_type == SPDK_DIF_TYPE3 ? ctx->init_ref_tag : ctx->init_ref_tag + block;
+}
+
+static inline void
+dif_generate_block(const uint8_t *data, uint32_t data_size, uint8_t *md,
+		   const struct spdk_dif_ctx *ctx, uint32_t block)
+{
+	uint8_t *pi = md + ctx->dif_offset;
+
+	dif_store_be16(pi, dif_guard(data, data_size, md, ctx));
+	dif_store_be16(pi + 2, ctx->app_tag);
+	dif_store_be32(pi + 4, dif_ref_tag(ctx, block));
+}
+
+static inline int
+dif_verify_block(const uint8_t *data, uint32_t data_size, const uint8_t *md,
+		 const struct spdk_dif_ctx *ctx, uint32_t block, struct spdk_dif_error *err_blk)
+{
+	const uint8_t		*pi = md + ctx->dif_offset;
+	uint16_t		app_tag = dif_load_be16(pi + 2);
+	uint32_t		ref_tag = dif_load_be32(pi + 4);
+	uint32_t		expected, actual;
+	enum spdk_dif_err_type	err_type;
+
+	/* An application tag of all ones (and for Type 3 a reference tag of all ones) disables checking. */
+	if (app_tag == 0xFFFF &&
+	    (ctx->dif_type != SPDK_DIF_TYPE3 || ref_tag == 0xFFFFFFFF)) {
+		return 0;
+	}
+
+	if (ctx->dif_flags & SPDK_DIF_FLAGS_GUARD_CHECK) {
+		expected = dif_guard(data, data_size, md, ctx);
+		actual = dif_load_be16(pi);
+		if (expected != actual) {
+			err_type = SPDK_DIF_GUARD_ERROR;
+			goto error;
+		}
+	}
+
+	if (ctx->dif_flags & SPDK_DIF_FLAGS_APPTAG_CHECK) {
+		expected = ctx->app_tag & ctx->apptag_mask;
+		actual = app_tag & ctx->apptag_mask;
+		if (expected != actual) {
+			err_type = SPDK_DIF_APPTAG_ERROR;
+			goto error;
+		}
+	}
+
+	/* The Type 3 reference tag is owned by the application and never checked. */
+	if ((ctx->dif_flags & SPDK_DIF_FLAGS_REFTAG_CHECK) && ctx->dif_type != SPDK_DIF_TYPE3) {
+		expected = dif_ref_tag(ctx, block);
+		actual = ref_tag;
+		if (expected != actual) {
+			err_type = SPDK_DIF_REFTAG_ERROR;
+			goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	if (err_blk != NULL) {
+		err_blk->err_type = err_type;
+		err_blk->expected = expected;
+		err_blk->actual = actual;
+		err_blk->err_offset = block;
+	}
+	return -EIO;
+}
+
+int
+spdk_dif_generate(void *buf, uint32_t num_blocks, const struct spdk_dif_ctx *ctx)
+{
+	uint8_t		*block = buf;
+	uint32_t	data_size = ctx->block_size - ctx->md_size;
+	uint32_t	i;
+
+	if (!ctx->md_interleave) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < num_blocks; i++) {
+		dif_generate_block(block, data_size, block + data_size, ctx, i);
+		block += ctx->block_size;
+	}
+
+	return 0;
+}
+
+int
+spdk_dif_verify(const void *buf, uint32_t num_blocks, const struct spdk_dif_ctx *ctx,
+		struct spdk_dif_error *err_blk)
+{
+	const uint8_t	*block = buf;
+	uint32_t	data_size = ctx->block_size - ctx->md_size;
+	uint32_t	i;
+	int		rc;
+
+	if (!ctx->md_interleave) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < num_blocks; i++) {
+		rc = dif_verify_block(block, data_size, block + data_size, ctx, i, err_blk);
+		if (rc != 0) {
+			return rc;
+		}
+		block += ctx->block_size;
+	}
+
+	return 0;
+}
+
+int
+spdk_dix_generate(const void *buf, void *md_buf, uint32_t num_blocks,
+		  const struct spdk_dif_ctx *ctx)
+{
+	const uint8_t	*data = buf;
+	uint8_t		*md = md_buf;
+	uint32_t	i;
+
+	if (ctx->md_interleave) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < num_blocks; i++) {
+		dif_generate_block(data, ctx->block_size, md, ctx, i);
+		data += ctx->block_size;
+		md += ctx->md_size;
+	}
+
+	return 0;
+}
+
+int
+spdk_dix_verify(const void *buf, const void *md_buf, uint32_t num_blocks,
+		const struct spdk_dif_ctx *ctx, struct spdk_dif_error *err_blk)
+{
+	const uint8_t	*data = buf;
+	const uint8_t	*md = md_buf;
+	uint32_t	i;
+	int		rc;
+
+	if (ctx->md_interleave) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < num_blocks; i++) {
+		rc = dif_verify_block(data, ctx->block_size, md, ctx, i, err_blk);
+		if (rc != 0) {
+			return rc;
+		}
+		data += ctx->block_size;
+		md += ctx->md_size;
+	}
+
+	return 0;
+}
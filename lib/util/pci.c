@@ -162,6 +162,35 @@ spdk_pci_device_get_device_name(struct spdk_pci_device *dev)
 	return pci_device_get_device_name(dev);
 }
 
+int
+spdk_pci_device_get_socket_id(struct spdk_pci_device *dev)
+{
+#ifdef __linux__
+	char filename[SPDK_PCI_PATH_MAX];
+	FILE *fd;
+	int socket_id;
+
+	snprintf(filename, sizeof(filename),
+		 SYSFS_PCI_DEVICES "/" PCI_PRI_FMT "/numa_node",
+		 spdk_pci_device_get_domain(dev), spdk_pci_device_get_bus(dev),
+		 spdk_pci_device_get_dev(dev), spdk_pci_device_get_func(dev));
+
+	fd = fopen(filename, "r");
+	if (!fd) {
+		return -1;
+	}
+
+	if (fscanf(fd, "%d", &socket_id) != 1 || socket_id < 0) {
+		socket_id = -1;
+	}
+
+	fclose(fd);
+	return socket_id;
+#else
+	return -1;
+#endif
+}
+
 int
 spdk_pci_device_cfg_read8(struct spdk_pci_device *dev, uint8_t *value, uint32_t offset)
 {
@@ -338,6 +367,12 @@ spdk_pci_device_get_device_name(struct spdk_pci_device *dev)
 	return NULL;
 }
 
+int
+spdk_pci_device_get_socket_id(struct spdk_pci_device *dev)
+{
+	return dev->numa_node;
+}
+
 int
 spdk_pci_device_cfg_read8(struct spdk_pci_device *dev, uint8_t *value, uint32_t offset)
 {
@@ -31,9 +31,11 @@
  *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include <rte_config.h>
 #include <rte_eal.h>
@@ -120,6 +122,79 @@ vtophys_positive_test(void)
 	return rc;
 }
 
+static int
+mem_register_test(void)
+{
+	const size_t size = 4 * 1024 * 1024;
+	uint8_t *p;
+	void *seg, *seg_2mb;
+	int rc = 0;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	if (p == MAP_FAILED) {
+		printf("mem_register_test skipped: no free hugepages outside DPDK\n");
+		return 0;
+	}
+
+	if (spdk_vtophys(p) != SPDK_VTOPHYS_ERROR) {
+		rc = -1;
+		printf("Err: VA=%p is mapped before registration\n", p);
+	}
+
+	if (spdk_mem_register(p + 4096, size - 4096) != -EINVAL) {
+		rc = -1;
+		printf("Err: misaligned registration was allowed\n");
+	}
+
+	if (spdk_mem_register(p, size) != 0) {
+		rc = -1;
+		printf("Err: could not register VA=%p\n", p);
+	} else {
+		if (spdk_vtophys(p) == SPDK_VTOPHYS_ERROR ||
+		    spdk_vtophys(p + size - 1) == SPDK_VTOPHYS_ERROR) {
+			rc = -1;
+			printf("Err: registered VA=%p is not mapped\n", p);
+		}
+
+		if (spdk_mem_register(p, size) != -EEXIST) {
+			rc = -1;
+			printf("Err: duplicate registration was allowed\n");
+		}
+
+		if (spdk_mem_unregister(p, 2 * size) != -EINVAL ||
+		    spdk_vtophys(p) == SPDK_VTOPHYS_ERROR) {
+			rc = -1;
+			printf("Err: unregistration past the registered range was allowed\n");
+		}
+
+		seg = rte_malloc("vtophys_test", 512, 512);
+		if (seg != NULL) {
+			seg_2mb = (void *)((uintptr_t)seg & ~(uintptr_t)(2 * 1024 * 1024 - 1));
+			if (spdk_mem_unregister(seg_2mb, 2 * 1024 * 1024) != -EINVAL ||
+			    spdk_vtophys(seg) == SPDK_VTOPHYS_ERROR) {
+				rc = -1;
+				printf("Err: unregistration of DPDK memory was allowed\n");
+			}
+			rte_free(seg);
+		}
+
+		if (spdk_mem_unregister(p, size) != 0 || spdk_vtophys(p) != SPDK_VTOPHYS_ERROR) {
+			rc = -1;
+			printf("Err: VA=%p is still mapped after unregistration\n", p);
+		}
+	}
+
+	munmap(p, size);
+
+	if (!rc)
+		printf("mem_register_test passed\n");
+	else
+		printf("mem_register_test failed\n");
+
+	return rc;
+}
+
 
 int
 main(int argc, char **argv)
@@ -139,5 +214,9 @@ main(int argc, char **argv)
 		return rc;
 
 	rc = vtophys_positive_test();
+	if (rc < 0)
+		return rc;
+
+	rc = mem_register_test();
 	return rc;
 }
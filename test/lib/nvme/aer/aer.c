@@ -190,6 +190,11 @@ static void aer_cb(void *arg, const struct spdk_nvme_cpl *cpl)
 static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
+	if (dev == NULL) {
+		printf("Attaching to software controller\n");
+		return true;
+	}
+
 	if (spdk_pci_device_has_non_uio_driver(dev)) {
 		fprintf(stderr, "non-uio kernel driver attached to NVMe\n");
 		fprintf(stderr, " controller at PCI address %04x:%02x:%02x.%02x\n",
@@ -222,9 +227,13 @@ attach_cb(void *cb_ctx, struct spdk_pci_device *pci_dev, struct spdk_nvme_ctrlr
 	dev->ctrlr = ctrlr;
 	dev->pci_dev = pci_dev;
 
-	snprintf(dev->name, sizeof(dev->name), "%04x:%02x:%02x.%02x",
-		 spdk_pci_device_get_domain(pci_dev), spdk_pci_device_get_bus(pci_dev),
-		 spdk_pci_device_get_dev(pci_dev), spdk_pci_device_get_func(pci_dev));
+	if (pci_dev == NULL) {
+		snprintf(dev->name, sizeof(dev->name), "software controller");
+	} else {
+		snprintf(dev->name, sizeof(dev->name), "%04x:%02x:%02x.%02x",
+			 spdk_pci_device_get_domain(pci_dev), spdk_pci_device_get_bus(pci_dev),
+			 spdk_pci_device_get_dev(pci_dev), spdk_pci_device_get_func(pci_dev));
+	}
 
 	printf("Attached to %s\n", dev->name);
 
@@ -0,0 +1,393 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmark for spdk_nvme_qpair_process_completions().
+ *
+ * Each pass fills the completion queues of several queue pairs with a full
+ *  queue depth of completions in random command ID order, evicts the trackers
+ *  and requests from the CPU caches (as happens on a real system between
+ *  submission and completion), and then reaps them.  The batched, prefetching
+ *  completion loop in the driver is compared against a reference loop that
+ *  processes one entry at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nvme/nvme_qpair.c"
+
+struct nvme_driver g_nvme_driver = {
+	.lock = NVME_MUTEX_INITIALIZER,
+};
+
+int32_t spdk_nvme_retry_count = 1;
+
+uint64_t g_ut_tsc = 0;
+
+char outbuf[OUTBUF_SIZE];
+
+uint64_t
+nvme_vtophys(void *buf)
+{
+	return (uintptr_t)buf;
+}
+
+struct nvme_request *
+nvme_allocate_request(struct spdk_nvme_qpair *qpair, const struct nvme_payload *payload,
+		      uint32_t payload_size, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	return NULL;
+}
+
+struct nvme_request *
+nvme_allocate_request_contig(struct spdk_nvme_qpair *qpair, void *buffer, uint32_t payload_size,
+			     spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	return NULL;
+}
+
+struct nvme_request *
+nvme_allocate_request_null(struct spdk_nvme_qpair *qpair, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	return NULL;
+}
+
+uint64_t
+spdk_nvme_ns_get_num_sectors(struct spdk_nvme_ns *ns)
+{
+	return 0;
+}
+
+void
+nvme_free_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
+{
+	/* Requests are owned by the benchmark and reused on every pass. */
+}
+
+int
+nvme_request_cache_construct(struct spdk_nvme_qpair *qpair, uint32_t num_reqs)
+{
+	return 0;
+}
+
+void
+nvme_request_cache_destroy(struct spdk_nvme_qpair *qpair)
+{
+}
+
+void
+nvme_request_remove_child(struct nvme_request *parent, struct nvme_request *child)
+{
+}
+
+int
+nvme_ctrlr_cmd_abort(struct spdk_nvme_ctrlr *ctrlr, uint16_t cid,
+		     uint16_t sqid, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	return 0;
+}
+
+int
+nvme_ctrlr_alloc_cmb(struct spdk_nvme_ctrlr *ctrlr, uint64_t length, uint64_t aligned,
+		     uint64_t *offset)
+{
+	return -1;
+}
+
+struct bench_qpair {
+	struct spdk_nvme_ctrlr		ctrlr;
+	struct spdk_nvme_registers	regs;
+	struct spdk_nvme_qpair		qpair;
+	struct nvme_request		**reqs;
+	uint16_t			*cids;
+};
+
+typedef int32_t (*process_fn)(struct spdk_nvme_qpair *qpair, uint32_t max_completions);
+
+static uint32_t g_queue_depth = 1024;
+static uint32_t g_num_qpairs = 16;
+static uint32_t g_iterations = 50;
+static uint64_t g_cache_flush_size = 64 * 1024 * 1024;
+
+static struct bench_qpair *g_qpairs;
+static volatile uint8_t *g_flush_buf;
+static uint64_t g_completed;
+
+static inline uint64_t
+bench_get_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Reference completion loop: read one entry, complete its tracker, advance,
+ *  repeat.  This is how spdk_nvme_qpair_process_completions() reaped entries
+ *  before completions were scanned and prefetched in batches.
+ */
+static int32_t
+process_completions_serial(struct spdk_nvme_qpair *qpair, uint32_t max_completions)
+{
+	struct nvme_tracker	*tr;
+	struct spdk_nvme_cpl	*cpl;
+	uint32_t		num_completions = 0;
+
+	if (max_completions == 0 || max_completions > (qpair->num_entries - 1U)) {
+		max_completions = qpair->num_entries - 1;
+	}
+
+	while (1) {
+		cpl = &qpair->cpl[qpair->cq_head];
+
+		if (cpl->status.p != qpair->phase) {
+			break;
+		}
+
+		tr = &qpair->tr[cpl->cid];
+		nvme_qpair_complete_tracker(qpair, tr, cpl, true);
+
+		if (++qpair->cq_head == qpair->num_entries) {
+			qpair->cq_head = 0;
+			qpair->phase = !qpair->phase;
+		}
+
+		if (++num_completions == max_completions) {
+			break;
+		}
+	}
+
+	if (num_completions > 0) {
+		spdk_mmio_write_4(qpair->cq_hdbl, qpair->cq_head);
+	}
+
+	return num_completions;
+}
+
+static void
+bench_cpl_cb(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	(*(uint64_t *)cb_arg)++;
+}
+
+static int
+bench_qpair_init(struct bench_qpair *bq)
+{
+	uint32_t i;
+
+	memset(bq, 0, sizeof(*bq));
+	bq->ctrlr.regs = &bq->regs;
+	TAILQ_INIT(&bq->ctrlr.free_io_qpairs);
+	TAILQ_INIT(&bq->ctrlr.active_io_qpairs);
+
+	if (nvme_qpair_construct(&bq->qpair, 1, g_queue_depth + 1, g_queue_depth, &bq->ctrlr,
+				 NVME_SOCKET_ID_ANY) != 0) {
+		return -1;
+	}
+	bq->qpair.is_enabled = true;
+
+	bq->reqs = calloc(g_queue_depth, sizeof(*bq->reqs));
+	bq->cids = calloc(g_queue_depth, sizeof(*bq->cids));
+	if (bq->reqs == NULL || bq->cids == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < g_queue_depth; i++) {
+		nvme_alloc_request(&bq->reqs[i]);
+		if (bq->reqs[i] == NULL) {
+			return -1;
+		}
+		memset(bq->reqs[i], 0, sizeof(struct nvme_request));
+		bq->reqs[i]->cb_fn = bench_cpl_cb;
+		bq->reqs[i]->cb_arg = &g_completed;
+	}
+
+	return 0;
+}
+
+/*
+ * Post a full queue depth of successful completions, in random command ID
+ *  order, as if every outstanding command had just finished.
+ */
+static void
+bench_qpair_fill(struct bench_qpair *bq)
+{
+	struct spdk_nvme_qpair	*qpair = &bq->qpair;
+	struct nvme_tracker	*tr;
+	struct spdk_nvme_cpl	*cpl;
+	uint32_t		i, j, head = qpair->cq_head;
+	uint16_t		tmp;
+	bool			phase = qpair->phase;
+
+	for (i = 0; i < g_queue_depth; i++) {
+		tr = nvme_qpair_get_tracker(qpair);
+		tr->req = bq->reqs[i];
+		tr->req->cmd.cid = tr->cid;
+		tr->active = true;
+		bq->cids[i] = tr->cid;
+	}
+
+	for (i = g_queue_depth - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		tmp = bq->cids[i];
+		bq->cids[i] = bq->cids[j];
+		bq->cids[j] = tmp;
+	}
+
+	for (i = 0; i < g_queue_depth; i++) {
+		cpl = &qpair->cpl[head];
+		memset(cpl, 0, sizeof(*cpl));
+		cpl->sqid = qpair->id;
+		cpl->cid = bq->cids[i];
+		cpl->status.p = phase;
+
+		if (++head == qpair->num_entries) {
+			head = 0;
+			phase = !phase;
+		}
+	}
+}
+
+static void
+flush_caches(void)
+{
+	uint64_t i;
+
+	for (i = 0; i < g_cache_flush_size; i += 64) {
+		g_flush_buf[i]++;
+	}
+}
+
+static double
+run_pass(process_fn fn)
+{
+	uint64_t	ticks = 0, start, count = 0;
+	uint32_t	i;
+
+	for (i = 0; i < g_num_qpairs; i++) {
+		bench_qpair_fill(&g_qpairs[i]);
+	}
+
+	flush_caches();
+
+	for (i = 0; i < g_num_qpairs; i++) {
+		start = bench_get_ticks();
+		count += fn(&g_qpairs[i].qpair, 0);
+		ticks += bench_get_ticks() - start;
+	}
+
+	if (count != (uint64_t)g_num_qpairs * g_queue_depth) {
+		fprintf(stderr, "reaped %" PRIu64 " completions, expected %" PRIu64 "\n",
+			count, (uint64_t)g_num_qpairs * g_queue_depth);
+		exit(1);
+	}
+
+	return (double)ticks / count;
+}
+
+static void
+usage(char *program_name)
+{
+	printf("%s options\n", program_name);
+	printf("\t[-q queue depth per queue pair (default %u)]\n", g_queue_depth);
+	printf("\t[-n number of queue pairs (default %u)]\n", g_num_qpairs);
+	printf("\t[-i number of iterations (default %u)]\n", g_iterations);
+}
+
+int
+main(int argc, char **argv)
+{
+	double		serial = 0, batched = 0;
+	uint32_t	i;
+	int		op;
+
+	while ((op = getopt(argc, argv, "i:n:q:")) != -1) {
+		switch (op) {
+		case 'i':
+			g_iterations = atoi(optarg);
+			break;
+		case 'n':
+			g_num_qpairs = atoi(optarg);
+			break;
+		case 'q':
+			g_queue_depth = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (g_queue_depth < 1 || g_queue_depth > NVME_MAX_IO_TRACKERS ||
+	    g_num_qpairs < 1 || g_iterations < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	g_flush_buf = calloc(1, g_cache_flush_size);
+	g_qpairs = calloc(g_num_qpairs, sizeof(*g_qpairs));
+	if (g_flush_buf == NULL || g_qpairs == NULL) {
+		fprintf(stderr, "allocation failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < g_num_qpairs; i++) {
+		if (bench_qpair_init(&g_qpairs[i]) != 0) {
+			fprintf(stderr, "failed to initialize queue pair %u\n", i);
+			return 1;
+		}
+	}
+
+	/* Alternate the two loops so that both see the same system conditions. */
+	for (i = 0; i < g_iterations; i++) {
+		serial += run_pass(process_completions_serial);
+		batched += run_pass(spdk_nvme_qpair_process_completions);
+	}
+
+	printf("queue depth %u, %u queue pairs, %u iterations\n",
+	       g_queue_depth, g_num_qpairs, g_iterations);
+	printf("one at a time: %8.1f ticks per completion\n", serial / g_iterations);
+	printf("batched:       %8.1f ticks per completion\n", batched / g_iterations);
+
+	return 0;
+}
@@ -335,6 +335,51 @@ static uint32_t dp_without_flags_separate_meta_test(struct spdk_nvme_ns *ns, str
 	return req->lba_count;
 }
 
+/*
+ * Protection information generated and checked by the driver in software
+ *  (PRACT setting to 0, no tags filled in by the test), both extended LBA
+ *  format and separate metadata can run the test case.
+ */
+static uint32_t dp_sw_pi_test(struct spdk_nvme_ns *ns, struct io_request *req,
+			      uint32_t *io_flags)
+{
+	uint32_t md_size, sector_size;
+
+	req->lba_count = 8;
+
+	if (spdk_nvme_ns_set_sw_pi(ns, true) != 0)
+		return 0;
+
+	sector_size = spdk_nvme_ns_get_sector_size(ns);
+	md_size = spdk_nvme_ns_get_md_size(ns);
+	req->use_extended_lba = spdk_nvme_ns_supports_extended_lba(ns);
+	if (req->use_extended_lba) {
+		req->contig = rte_zmalloc(NULL, (sector_size + md_size) * req->lba_count, 0x1000);
+		if (!req->contig)
+			return 0;
+	} else {
+		req->contig = rte_zmalloc(NULL, sector_size * req->lba_count, 0x1000);
+		if (!req->contig)
+			return 0;
+
+		req->metadata = rte_zmalloc(NULL, md_size * req->lba_count, 0x1000);
+		if (!req->metadata) {
+			rte_free(req->contig);
+			return 0;
+		}
+	}
+
+	req->lba = 0x700000;
+	req->apptag_mask = 0xFFFF;
+	req->apptag = 0x5A5A;
+
+	*io_flags = SPDK_NVME_IO_FLAGS_PRCHK_GUARD | SPDK_NVME_IO_FLAGS_PRCHK_APPTAG;
+	if (spdk_nvme_ns_get_pi_type(ns) != SPDK_NVME_FMT_NVM_PROTECTION_TYPE3)
+		*io_flags |= SPDK_NVME_IO_FLAGS_PRCHK_REFTAG;
+
+	return req->lba_count;
+}
+
 typedef uint32_t (*nvme_build_io_req_fn_t)(struct spdk_nvme_ns *ns, struct io_request *req,
 		uint32_t *lba_count);
 
@@ -435,7 +480,8 @@ write_read_e2e_dp_tests(struct dev *dev, nvme_build_io_req_fn_t build_io_fn, con
 		return 0;
 	}
 
-	/* IO parameters setting */
+	/* IO parameters setting; only dp_sw_pi_test turns software PI on */
+	spdk_nvme_ns_set_sw_pi(ns, false);
 	lba_count = build_io_fn(ns, req, &io_flags);
 
 	if (!lba_count) {
@@ -451,7 +497,7 @@ write_read_e2e_dp_tests(struct dev *dev, nvme_build_io_req_fn_t build_io_fn, con
 	}
 
 	ns_data_buffer_reset(ns, req, DATA_PATTERN);
-	if (req->use_extended_lba)
+	if (req->use_extended_lba && !req->apptag_mask)
 		rc = spdk_nvme_ns_cmd_write(ns, qpair, req->contig, req->lba, lba_count,
 					    io_complete, req, io_flags);
 	else
@@ -481,7 +527,7 @@ write_read_e2e_dp_tests(struct dev *dev, nvme_build_io_req_fn_t build_io_fn, con
 	io_complete_flag = 0;
 
 	ns_data_buffer_reset(ns, req, 0);
-	if (req->use_extended_lba)
+	if (req->use_extended_lba && !req->apptag_mask)
 		rc = spdk_nvme_ns_cmd_read(ns, qpair, req->contig, req->lba, lba_count,
 					   io_complete, req, io_flags);
 	else
@@ -522,6 +568,11 @@ write_read_e2e_dp_tests(struct dev *dev, nvme_build_io_req_fn_t build_io_fn, con
 static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
+	if (dev == NULL) {
+		printf("Attaching to software controller\n");
+		return true;
+	}
+
 	if (spdk_pci_device_has_non_uio_driver(dev)) {
 		fprintf(stderr, "non-uio kernel driver attached to NVMe\n");
 		fprintf(stderr, " controller at PCI address %04x:%02x:%02x.%02x\n",
@@ -553,11 +604,15 @@ attach_cb(void *cb_ctx, struct spdk_pci_device *pci_dev, struct spdk_nvme_ctrlr
 
 	dev->ctrlr = ctrlr;
 
-	snprintf(dev->name, sizeof(dev->name), "%04X:%02X:%02X.%02X",
-		 spdk_pci_device_get_domain(pci_dev),
-		 spdk_pci_device_get_bus(pci_dev),
-		 spdk_pci_device_get_dev(pci_dev),
-		 spdk_pci_device_get_func(pci_dev));
+	if (pci_dev == NULL) {
+		snprintf(dev->name, sizeof(dev->name), "software controller");
+	} else {
+		snprintf(dev->name, sizeof(dev->name), "%04X:%02X:%02X.%02X",
+			 spdk_pci_device_get_domain(pci_dev),
+			 spdk_pci_device_get_bus(pci_dev),
+			 spdk_pci_device_get_dev(pci_dev),
+			 spdk_pci_device_get_func(pci_dev));
+	}
 
 	printf("Attached to %s\n", dev->name);
 }
@@ -607,7 +662,8 @@ int main(int argc, char **argv)
 		    || TEST(dp_without_flags_extended_lba_test)
 		    || TEST(dp_without_pract_separate_meta_test)
 		    || TEST(dp_without_pract_separate_meta_apptag_test)
-		    || TEST(dp_without_flags_separate_meta_test)) {
+		    || TEST(dp_without_flags_separate_meta_test)
+		    || TEST(dp_sw_pi_test)) {
 #undef TEST
 			rc = 1;
 			printf("%s: failed End-to-End data protection tests\n", iter->name);
@@ -369,6 +369,11 @@ writev_readv_tests(struct dev *dev, nvme_build_io_req_fn_t build_io_fn, const ch
 static bool
 probe_cb(void *cb_ctx, struct spdk_pci_device *dev, struct spdk_nvme_ctrlr_opts *opts)
 {
+	if (dev == NULL) {
+		printf("Attaching to software controller\n");
+		return true;
+	}
+
 	if (spdk_pci_device_has_non_uio_driver(dev)) {
 		fprintf(stderr, "non-uio kernel driver attached to NVMe\n");
 		fprintf(stderr, " controller at PCI address %04x:%02x:%02x.%02x\n",
@@ -400,11 +405,15 @@ attach_cb(void *cb_ctx, struct spdk_pci_device *pci_dev, struct spdk_nvme_ctrlr
 
 	dev->ctrlr = ctrlr;
 
-	snprintf(dev->name, sizeof(dev->name), "%04X:%02X:%02X.%02X",
-		 spdk_pci_device_get_domain(pci_dev),
-		 spdk_pci_device_get_bus(pci_dev),
-		 spdk_pci_device_get_dev(pci_dev),
-		 spdk_pci_device_get_func(pci_dev));
+	if (pci_dev == NULL) {
+		snprintf(dev->name, sizeof(dev->name), "software controller");
+	} else {
+		snprintf(dev->name, sizeof(dev->name), "%04X:%02X:%02X.%02X",
+			 spdk_pci_device_get_domain(pci_dev),
+			 spdk_pci_device_get_bus(pci_dev),
+			 spdk_pci_device_get_dev(pci_dev),
+			 spdk_pci_device_get_func(pci_dev));
+	}
 
 	printf("Attached to %s\n", dev->name);
 }
@@ -71,6 +71,17 @@ spdk_nvme_ctrlr_opts_set_defaults(struct spdk_nvme_ctrlr_opts *opts)
 	memset(opts, 0, sizeof(*opts));
 }
 
+int
+nvme_sw_enumerate(int (*enum_cb)(void *enum_ctx, struct spdk_nvme_sw_ctrlr *sw_dev), void *enum_ctx)
+{
+	return 0;
+}
+
+void
+nvme_sw_dev_detach(struct spdk_nvme_sw_ctrlr *sw_dev)
+{
+}
+
 static void
 test_opc_data_transfer(void)
 {
@@ -89,6 +100,67 @@ test_opc_data_transfer(void)
 	CU_ASSERT(xfer == SPDK_NVME_DATA_CONTROLLER_TO_HOST);
 }
 
+static void
+test_request_cache(void)
+{
+	struct spdk_nvme_qpair	qpair = {};
+	struct nvme_request	*req[5];
+	struct nvme_payload	payload = {};
+	struct nvme_request_cache *cache;
+	int			i;
+
+	CU_ASSERT(nvme_request_cache_construct(&qpair, 4) == 0);
+	cache = qpair.req_cache;
+	SPDK_CU_ASSERT_FATAL(cache != NULL);
+	CU_ASSERT(cache->num_free == 4);
+
+	/* The first 4 requests come from the cache, the 5th from the global pool. */
+	for (i = 0; i < 5; i++) {
+		req[i] = nvme_allocate_request(&qpair, &payload, 0, NULL, NULL);
+		SPDK_CU_ASSERT_FATAL(req[i] != NULL);
+	}
+	for (i = 0; i < 4; i++) {
+		CU_ASSERT(req[i] >= cache->reqs && req[i] < cache->reqs + cache->num_reqs);
+	}
+	CU_ASSERT(req[4] < cache->reqs || req[4] >= cache->reqs + cache->num_reqs);
+	CU_ASSERT(cache->num_free == 0);
+
+	/* Freeing returns cached requests to the cache and the rest to the global pool. */
+	for (i = 0; i < 5; i++) {
+		nvme_free_request(&qpair, req[i]);
+	}
+	CU_ASSERT(cache->num_free == 4);
+
+	/* The most recently freed request is reused first. */
+	req[0] = nvme_allocate_request(&qpair, &payload, 0, NULL, NULL);
+	CU_ASSERT(req[0] == req[3]);
+	nvme_free_request(&qpair, req[0]);
+
+	/* A NULL qpair always uses the global pool. */
+	req[0] = nvme_allocate_request_null(NULL, NULL, NULL);
+	SPDK_CU_ASSERT_FATAL(req[0] != NULL);
+	CU_ASSERT(cache->num_free == 4);
+	nvme_free_request(NULL, req[0]);
+
+	/* Bulk allocations are all-or-nothing from the cache, else all from the global pool. */
+	CU_ASSERT(nvme_allocate_request_bulk(&qpair, req, 3) == 0);
+	for (i = 0; i < 3; i++) {
+		CU_ASSERT(req[i] >= cache->reqs && req[i] < cache->reqs + cache->num_reqs);
+	}
+	CU_ASSERT(cache->num_free == 1);
+	CU_ASSERT(nvme_allocate_request_bulk(&qpair, req + 3, 2) == 0);
+	CU_ASSERT(req[3] < cache->reqs || req[3] >= cache->reqs + cache->num_reqs);
+	CU_ASSERT(req[4] < cache->reqs || req[4] >= cache->reqs + cache->num_reqs);
+	CU_ASSERT(cache->num_free == 1);
+	for (i = 0; i < 5; i++) {
+		nvme_free_request(&qpair, req[i]);
+	}
+	CU_ASSERT(cache->num_free == 4);
+
+	nvme_request_cache_destroy(&qpair);
+	CU_ASSERT(qpair.req_cache == NULL);
+}
+
 int main(int argc, char **argv)
 {
 	CU_pSuite	suite = NULL;
@@ -106,6 +178,7 @@ int main(int argc, char **argv)
 
 	if (
 		CU_add_test(suite, "test_opc_data_transfer", test_opc_data_transfer) == NULL
+		|| CU_add_test(suite, "test_request_cache", test_request_cache) == NULL
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -51,6 +51,11 @@ struct spdk_nvme_registers g_ut_nvme_regs = {};
 
 __thread int    nvme_thread_ioq_index = -1;
 
+/* I/O qpairs whose queues are currently constructed. */
+#define UT_MAX_IO_QPAIRS	8
+static struct spdk_nvme_qpair	*g_io_qpairs_constructed[UT_MAX_IO_QPAIRS];
+static int			g_num_io_qpairs_constructed;
+
 uint16_t
 spdk_pci_device_get_vendor_id(struct spdk_pci_device *dev)
 {
@@ -77,21 +82,60 @@ spdk_pci_device_get_subdevice_id(struct spdk_pci_device *dev)
 
 int nvme_qpair_construct(struct spdk_nvme_qpair *qpair, uint16_t id,
 			 uint16_t num_entries, uint16_t num_trackers,
-			 struct spdk_nvme_ctrlr *ctrlr)
+			 struct spdk_nvme_ctrlr *ctrlr, int socket_id)
 {
 	qpair->id = id;
 	qpair->num_entries = num_entries;
+	qpair->socket_id = socket_id;
 	qpair->qprio = 0;
 	qpair->ctrlr = ctrlr;
 
+	if (id != 0) {
+		SPDK_CU_ASSERT_FATAL(g_num_io_qpairs_constructed < UT_MAX_IO_QPAIRS);
+		g_io_qpairs_constructed[g_num_io_qpairs_constructed++] = qpair;
+	}
+
 	return 0;
 }
 
+volatile struct spdk_nvme_registers *
+nvme_sw_dev_attach(struct spdk_nvme_sw_ctrlr *sw_dev)
+{
+	return NULL;
+}
+
+void
+nvme_sw_dev_detach(struct spdk_nvme_sw_ctrlr *sw_dev)
+{
+}
+
+/*
+ * When g_defer_admin_cpl is set, admin commands are not completed during
+ *  submission.  Instead, spdk_nvme_qpair_process_completions() completes up to
+ *  g_num_admin_cpl_posted of them with status g_admin_cpl_sc.
+ */
+#define UT_MAX_DEFERRED_CPL	8
+
+static bool		g_defer_admin_cpl;
+static uint16_t		g_admin_cpl_sc = SPDK_NVME_SC_SUCCESS;
+static spdk_nvme_cmd_cb	g_deferred_cb_fn[UT_MAX_DEFERRED_CPL];
+static void		*g_deferred_cb_arg[UT_MAX_DEFERRED_CPL];
+static uint32_t		g_num_deferred_cpl;
+static uint32_t		g_num_admin_cpl_posted;
+
 static void
 fake_cpl_success(spdk_nvme_cmd_cb cb_fn, void *cb_arg)
 {
 	struct spdk_nvme_cpl cpl = {};
 
+	if (g_defer_admin_cpl) {
+		SPDK_CU_ASSERT_FATAL(g_num_deferred_cpl < UT_MAX_DEFERRED_CPL);
+		g_deferred_cb_fn[g_num_deferred_cpl] = cb_fn;
+		g_deferred_cb_arg[g_num_deferred_cpl] = cb_arg;
+		g_num_deferred_cpl++;
+		return;
+	}
+
 	cpl.status.sc = SPDK_NVME_SC_SUCCESS;
 	cb_fn(cb_arg, &cpl);
 }
@@ -127,7 +171,24 @@ nvme_qpair_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *re
 int32_t
 spdk_nvme_qpair_process_completions(struct spdk_nvme_qpair *qpair, uint32_t max_completions)
 {
-	return 0;
+	struct spdk_nvme_cpl	cpl = {};
+	uint32_t		num_cpl = 0;
+	spdk_nvme_cmd_cb	cb_fn;
+	void			*cb_arg;
+
+	cpl.status.sc = g_admin_cpl_sc;
+	while (g_num_deferred_cpl > 0 && g_num_admin_cpl_posted > 0) {
+		cb_fn = g_deferred_cb_fn[0];
+		cb_arg = g_deferred_cb_arg[0];
+		g_num_deferred_cpl--;
+		g_num_admin_cpl_posted--;
+		memmove(&g_deferred_cb_fn[0], &g_deferred_cb_fn[1], g_num_deferred_cpl * sizeof(cb_fn));
+		memmove(&g_deferred_cb_arg[0], &g_deferred_cb_arg[1], g_num_deferred_cpl * sizeof(cb_arg));
+		cb_fn(cb_arg, &cpl);
+		num_cpl++;
+	}
+
+	return num_cpl;
 }
 
 void
@@ -138,6 +199,14 @@ nvme_qpair_disable(struct spdk_nvme_qpair *qpair)
 void
 nvme_qpair_destroy(struct spdk_nvme_qpair *qpair)
 {
+	int i;
+
+	for (i = 0; i < g_num_io_qpairs_constructed; i++) {
+		if (g_io_qpairs_constructed[i] == qpair) {
+			g_io_qpairs_constructed[i] = g_io_qpairs_constructed[--g_num_io_qpairs_constructed];
+			break;
+		}
+	}
 }
 
 void
@@ -176,6 +245,14 @@ nvme_ctrlr_cmd_identify_controller(struct spdk_nvme_ctrlr *ctrlr, void *payload,
 	return 0;
 }
 
+int
+nvme_ctrlr_cmd_identify_namespace(struct spdk_nvme_ctrlr *ctrlr, uint16_t nsid, void *payload,
+				  spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	fake_cpl_success(cb_fn, cb_arg);
+	return 0;
+}
+
 int
 nvme_ctrlr_cmd_set_num_queues(struct spdk_nvme_ctrlr *ctrlr,
 			      uint32_t num_queues, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
@@ -280,8 +357,14 @@ nvme_ns_construct(struct spdk_nvme_ns *ns, uint16_t id,
 	return 0;
 }
 
+void
+nvme_ns_set_identify_data(struct spdk_nvme_ns *ns)
+{
+}
+
 struct nvme_request *
-nvme_allocate_request(const struct nvme_payload *payload, uint32_t payload_size,
+nvme_allocate_request(struct spdk_nvme_qpair *qpair, const struct nvme_payload *payload,
+		      uint32_t payload_size,
 		      spdk_nvme_cmd_cb cb_fn,
 		      void *cb_arg)
 {
@@ -289,7 +372,7 @@ nvme_allocate_request(const struct nvme_payload *payload, uint32_t payload_size,
 	nvme_alloc_request(&req);
 
 	if (req != NULL) {
-		memset(req, 0, offsetof(struct nvme_request, children));
+		memset(req, 0, offsetof(struct nvme_request, stailq));
 
 		req->payload = *payload;
 		req->payload_size = payload_size;
@@ -302,21 +385,21 @@ nvme_allocate_request(const struct nvme_payload *payload, uint32_t payload_size,
 }
 
 struct nvme_request *
-nvme_allocate_request_contig(void *buffer, uint32_t payload_size, spdk_nvme_cmd_cb cb_fn,
-			     void *cb_arg)
+nvme_allocate_request_contig(struct spdk_nvme_qpair *qpair, void *buffer, uint32_t payload_size,
+			     spdk_nvme_cmd_cb cb_fn, void *cb_arg)
 {
 	struct nvme_payload payload;
 
 	payload.type = NVME_PAYLOAD_TYPE_CONTIG;
 	payload.u.contig = buffer;
 
-	return nvme_allocate_request(&payload, payload_size, cb_fn, cb_arg);
+	return nvme_allocate_request(qpair, &payload, payload_size, cb_fn, cb_arg);
 }
 
 struct nvme_request *
-nvme_allocate_request_null(spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+nvme_allocate_request_null(struct spdk_nvme_qpair *qpair, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
 {
-	return nvme_allocate_request_contig(NULL, 0, cb_fn, cb_arg);
+	return nvme_allocate_request_contig(qpair, NULL, 0, cb_fn, cb_arg);
 }
 
 static void
@@ -836,6 +919,86 @@ test_nvme_ctrlr_init_en_0_rdy_1(void)
 	nvme_ctrlr_destruct(&ctrlr);
 }
 
+static void
+test_nvme_ctrlr_init_async_admin(void)
+{
+	struct spdk_nvme_ctrlr	ctrlr = {};
+
+	memset(&g_ut_nvme_regs, 0, sizeof(g_ut_nvme_regs));
+	g_defer_admin_cpl = true;
+
+	/*
+	 * Initial state: CC.EN = 0, CSTS.RDY = 0
+	 */
+	SPDK_CU_ASSERT_FATAL(nvme_ctrlr_construct(&ctrlr, NULL) == 0);
+	ctrlr.cdata.nn = 2;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_ENABLE_WAIT_FOR_READY_1);
+
+	/*
+	 * Once CSTS.RDY = 1, each admin step is submitted and init() returns
+	 *  without waiting for it.
+	 */
+	g_ut_nvme_regs.csts.bits.rdy = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY);
+	CU_ASSERT(ctrlr.num_init_cmds == 1);
+
+	/* Nothing completed yet. */
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY);
+
+	g_num_admin_cpl_posted = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_WAIT_FOR_SET_NUM_QUEUES);
+	CU_ASSERT(ctrlr.num_init_cmds == 1);
+
+	/* Both namespaces are identified at the same time. */
+	g_num_admin_cpl_posted = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS);
+	CU_ASSERT(ctrlr.num_init_cmds == 2);
+	CU_ASSERT(ctrlr.num_ns == 2);
+
+	g_num_admin_cpl_posted = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY_NS);
+	CU_ASSERT(ctrlr.num_init_cmds == 1);
+
+	g_num_admin_cpl_posted = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_WAIT_FOR_CONFIGURE_AER);
+	CU_ASSERT(ctrlr.num_init_cmds == 1);
+
+	g_num_admin_cpl_posted = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_READY);
+	CU_ASSERT(ctrlr.num_init_cmds == 0);
+
+	g_ut_nvme_regs.csts.bits.shst = SPDK_NVME_SHST_COMPLETE;
+	nvme_ctrlr_destruct(&ctrlr);
+
+	/*
+	 * A failed admin command fails initialization when it completes.
+	 */
+	memset(&ctrlr, 0, sizeof(ctrlr));
+	memset(&g_ut_nvme_regs, 0, sizeof(g_ut_nvme_regs));
+	SPDK_CU_ASSERT_FATAL(nvme_ctrlr_construct(&ctrlr, NULL) == 0);
+	ctrlr.cdata.nn = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	g_ut_nvme_regs.csts.bits.rdy = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) == 0);
+	CU_ASSERT(ctrlr.state == NVME_CTRLR_STATE_WAIT_FOR_IDENTIFY);
+	g_admin_cpl_sc = SPDK_NVME_SC_INTERNAL_DEVICE_ERROR;
+	g_num_admin_cpl_posted = 1;
+	CU_ASSERT(nvme_ctrlr_process_init(&ctrlr) != 0);
+
+	g_admin_cpl_sc = SPDK_NVME_SC_SUCCESS;
+	g_defer_admin_cpl = false;
+	g_ut_nvme_regs.csts.bits.shst = SPDK_NVME_SHST_COMPLETE;
+	nvme_ctrlr_destruct(&ctrlr);
+}
+
 static void
 setup_qpairs(struct spdk_nvme_ctrlr *ctrlr, uint32_t num_io_queues)
 {
@@ -860,6 +1023,9 @@ test_alloc_io_qpair_rr_1(void)
 
 	setup_qpairs(&ctrlr, 1);
 
+	/* Queues are only constructed when a qpair is allocated. */
+	CU_ASSERT(g_num_io_qpairs_constructed == 0);
+
 	/*
 	 * Fake to simulate the controller with default round robin
 	 * arbitration mechanism.
@@ -869,9 +1035,11 @@ test_alloc_io_qpair_rr_1(void)
 	q0 = spdk_nvme_ctrlr_alloc_io_qpair(&ctrlr, 0);
 	SPDK_CU_ASSERT_FATAL(q0 != NULL);
 	SPDK_CU_ASSERT_FATAL(q0->qprio == 0);
+	CU_ASSERT(g_num_io_qpairs_constructed == 1);
 	/* Only 1 I/O qpair was allocated, so this should fail */
 	SPDK_CU_ASSERT_FATAL(spdk_nvme_ctrlr_alloc_io_qpair(&ctrlr, 0) == NULL);
 	SPDK_CU_ASSERT_FATAL(spdk_nvme_ctrlr_free_io_qpair(q0) == 0);
+	CU_ASSERT(g_num_io_qpairs_constructed == 0);
 
 	/*
 	 * Now that the qpair has been returned to the free list,
@@ -896,6 +1064,35 @@ test_alloc_io_qpair_rr_1(void)
 	cleanup_qpairs(&ctrlr);
 }
 
+static void
+test_alloc_io_qpair_socket(void)
+{
+	struct spdk_nvme_ctrlr ctrlr = {};
+	struct spdk_nvme_qpair *q0, *q1;
+
+	setup_qpairs(&ctrlr, 2);
+	g_ut_nvme_regs.cc.bits.ams = SPDK_NVME_CC_AMS_RR;
+
+	/* Without a socket hint, memory goes on the socket of the calling lcore. */
+	q0 = spdk_nvme_ctrlr_alloc_io_qpair(&ctrlr, 0);
+	SPDK_CU_ASSERT_FATAL(q0 != NULL);
+	CU_ASSERT(q0->socket_id == nvme_get_socket_id());
+
+	q1 = spdk_nvme_ctrlr_alloc_io_qpair_on_socket(&ctrlr, 0, 1);
+	SPDK_CU_ASSERT_FATAL(q1 != NULL);
+	CU_ASSERT(q1->socket_id == 1);
+	SPDK_CU_ASSERT_FATAL(spdk_nvme_ctrlr_free_io_qpair(q1) == 0);
+
+	q1 = spdk_nvme_ctrlr_alloc_io_qpair_on_socket(&ctrlr, 0, SPDK_NVME_SOCKET_ID_LOCAL);
+	SPDK_CU_ASSERT_FATAL(q1 != NULL);
+	CU_ASSERT(q1->socket_id == nvme_get_socket_id());
+
+	SPDK_CU_ASSERT_FATAL(spdk_nvme_ctrlr_free_io_qpair(q0) == 0);
+	SPDK_CU_ASSERT_FATAL(spdk_nvme_ctrlr_free_io_qpair(q1) == 0);
+
+	cleanup_qpairs(&ctrlr);
+}
+
 static void
 test_alloc_io_qpair_wrr_1(void)
 {
@@ -1143,7 +1340,10 @@ int main(int argc, char **argv)
 			       test_nvme_ctrlr_init_en_0_rdy_0_ams_wrr) == NULL
 		|| CU_add_test(suite, "test nvme_ctrlr init CC.EN = 0 CSTS.RDY = 0 AMS = VS",
 			       test_nvme_ctrlr_init_en_0_rdy_0_ams_vs) == NULL
+		|| CU_add_test(suite, "test nvme_ctrlr init asynchronous admin commands",
+			       test_nvme_ctrlr_init_async_admin) == NULL
 		|| CU_add_test(suite, "alloc_io_qpair_rr 1", test_alloc_io_qpair_rr_1) == NULL
+		|| CU_add_test(suite, "alloc_io_qpair_socket", test_alloc_io_qpair_socket) == NULL
 		|| CU_add_test(suite, "alloc_io_qpair_wrr 1", test_alloc_io_qpair_wrr_1) == NULL
 		|| CU_add_test(suite, "alloc_io_qpair_wrr 2", test_alloc_io_qpair_wrr_2) == NULL
 		|| CU_add_test(suite, "test nvme_ctrlr function nvme_ctrlr_fail", test_nvme_ctrlr_fail) == NULL
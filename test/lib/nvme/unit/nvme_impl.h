@@ -35,6 +35,7 @@
 #define __NVME_IMPL_H__
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -55,6 +56,11 @@ nvme_malloc(const char *tag, size_t size, unsigned align, uint64_t *phys_addr)
 	return buf;
 }
 
+#define NVME_SOCKET_ID_ANY		(-1)
+#define nvme_malloc_socket(tag, size, align, phys_addr, socket_id)	\
+	nvme_malloc(tag, size, align, phys_addr)
+#define nvme_get_socket_id()		0
+
 #define nvme_free(buf)			free(buf)
 #define OUTBUF_SIZE 1024
 extern char outbuf[OUTBUF_SIZE];
@@ -74,20 +80,70 @@ do							\
 uint64_t nvme_vtophys(void *buf);
 #define NVME_VTOPHYS_ERROR	(0xFFFFFFFFFFFFFFFFULL)
 
+/* Pretend memory is made of 2MB pages that are contiguous only within themselves. */
+static inline uint64_t
+nvme_vtophys_range(void *buf, uint64_t *size)
+{
+	uint64_t contig = 0x200000 - ((uintptr_t)buf & 0x1FFFFF);
+
+	if (contig < *size) {
+		*size = contig;
+	}
+	return nvme_vtophys(buf);
+}
+#define nvme_phys_to_virt(phys_addr)	((void *)(uintptr_t)(phys_addr))
+
+#ifdef NVME_UT_COUNT_REQUESTS
+/* Requests from the global pool not yet freed, for tests that check for leaks. */
+extern int g_ut_num_requests;
+#define nvme_ut_count_request(n)	(g_ut_num_requests += (n))
+#else
+#define nvme_ut_count_request(n)	((void)0)
+#endif
+
 #define nvme_alloc_request(bufp)	\
 do					\
 	{				\
 		if (posix_memalign((void **)(bufp), 64, sizeof(struct nvme_request))) {	\
 			*(bufp) = NULL;	\
+		} else {		\
+			nvme_ut_count_request(1);	\
 		}			\
 	}				\
 	while (0)
 
-#define nvme_dealloc_request(buf)	free(buf)
+#define nvme_dealloc_request(buf)	\
+do					\
+	{				\
+		nvme_ut_count_request(-1);	\
+		free(buf);		\
+	}				\
+	while (0)
+
+static inline int
+nvme_ut_alloc_bulk(void **bufs, uint32_t n, size_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (posix_memalign(&bufs[i], 64, size)) {
+			while (i > 0) {
+				free(bufs[--i]);
+			}
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+#define nvme_alloc_request_bulk(bufs, n)	\
+	(nvme_ut_alloc_bulk((void **)(bufs), n, sizeof(struct nvme_request)) != 0 ? -ENOMEM :	\
+	 (nvme_ut_count_request(n), 0))
 
 extern uint64_t g_ut_tsc;
 #define nvme_get_tsc()			(g_ut_tsc)
 #define nvme_get_tsc_hz()		(1000000)
+#define nvme_prefetch(addr)		__builtin_prefetch(addr)
 
 static inline int
 nvme_pci_enumerate(int (*enum_cb)(void *enum_ctx, struct spdk_pci_device *pci_dev), void *enum_ctx)
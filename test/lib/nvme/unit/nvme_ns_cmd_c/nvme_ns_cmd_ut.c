@@ -34,10 +34,13 @@
 #include "spdk_cunit.h"
 
 #include "nvme/nvme_ns_cmd.c"
+#include "util/crc16.c"
+#include "util/dif.c"
 
 char outbuf[OUTBUF_SIZE];
 
 struct nvme_request *g_request = NULL;
+int g_ut_num_requests = 0;
 
 
 static void nvme_request_reset_sgl(void *cb_arg, uint32_t sgl_offset)
@@ -77,6 +80,17 @@ nvme_ctrlr_start(struct spdk_nvme_ctrlr *ctrlr)
 	return 0;
 }
 
+int
+nvme_sw_enumerate(int (*enum_cb)(void *enum_ctx, struct spdk_nvme_sw_ctrlr *sw_dev), void *enum_ctx)
+{
+	return 0;
+}
+
+void
+nvme_sw_dev_detach(struct spdk_nvme_sw_ctrlr *sw_dev)
+{
+}
+
 void
 spdk_nvme_ctrlr_opts_set_defaults(struct spdk_nvme_ctrlr_opts *opts)
 {
@@ -98,11 +112,57 @@ spdk_nvme_ns_get_max_io_xfer_size(struct spdk_nvme_ns *ns)
 int
 nvme_qpair_submit_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
 {
+	struct nvme_request *child, *tmp;
+
+	/* A full queue pair with fail_when_full frees the request and its children. */
+	if (qpair->fail_when_full) {
+		TAILQ_FOREACH_SAFE(child, &req->children, child_tailq, tmp) {
+			nvme_request_remove_child(req, child);
+			nvme_free_request(qpair, child);
+		}
+		nvme_free_request(qpair, req);
+		return -EAGAIN;
+	}
+
 	g_request = req;
 
 	return 0;
 }
 
+static int g_dsm_deallocate_rc = 0;
+
+int
+nvme_qpair_dsm_deallocate(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+			  const struct spdk_nvme_dsm_range *ranges, uint16_t num_ranges,
+			  spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	return g_dsm_deallocate_rc;
+}
+
+int
+nvme_qpair_read_cache_read(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+			   void *buffer, uint64_t lba, uint32_t lba_count,
+			   spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return 1;
+}
+
+int
+nvme_qpair_readahead_read(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+			  void *buffer, uint64_t lba, uint32_t lba_count,
+			  spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return 1;
+}
+
+int
+nvme_qpair_write_merge(struct spdk_nvme_qpair *qpair, struct spdk_nvme_ns *ns,
+		       void *buffer, uint64_t lba, uint32_t lba_count,
+		       spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	return 1;
+}
+
 static void
 prepare_for_test(struct spdk_nvme_ns *ns, struct spdk_nvme_ctrlr *ctrlr,
 		 struct spdk_nvme_qpair *qpair,
@@ -157,7 +217,7 @@ split_test(void)
 	CU_ASSERT(cmd_lba_count == lba_count);
 
 	free(payload);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 }
 
 static void
@@ -197,7 +257,7 @@ split_test2(void)
 	CU_ASSERT(child->payload_size == 128 * 1024);
 	CU_ASSERT(cmd_lba == 0);
 	CU_ASSERT(cmd_lba_count == 256); /* 256 * 512 byte blocks = 128 KB */
-	nvme_free_request(child);
+	nvme_free_request(&qpair, child);
 
 	child = TAILQ_FIRST(&g_request->children);
 	nvme_request_remove_child(g_request, child);
@@ -206,12 +266,12 @@ split_test2(void)
 	CU_ASSERT(child->payload_size == 128 * 1024);
 	CU_ASSERT(cmd_lba == 256);
 	CU_ASSERT(cmd_lba_count == 256);
-	nvme_free_request(child);
+	nvme_free_request(&qpair, child);
 
 	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
 
 	free(payload);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 }
 
 static void
@@ -253,7 +313,7 @@ split_test3(void)
 	CU_ASSERT(child->payload_size == 128 * 1024);
 	CU_ASSERT(cmd_lba == 10);
 	CU_ASSERT(cmd_lba_count == 256);
-	nvme_free_request(child);
+	nvme_free_request(&qpair, child);
 
 	child = TAILQ_FIRST(&g_request->children);
 	nvme_request_remove_child(g_request, child);
@@ -262,12 +322,12 @@ split_test3(void)
 	CU_ASSERT(child->payload_size == 128 * 1024);
 	CU_ASSERT(cmd_lba == 266);
 	CU_ASSERT(cmd_lba_count == 256);
-	nvme_free_request(child);
+	nvme_free_request(&qpair, child);
 
 	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
 
 	free(payload);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 }
 
 static void
@@ -315,7 +375,7 @@ split_test4(void)
 	CU_ASSERT(cmd_lba_count == 256 - 10);
 	CU_ASSERT((child->cmd.cdw12 & SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) != 0);
 	CU_ASSERT((child->cmd.cdw12 & SPDK_NVME_IO_FLAGS_LIMITED_RETRY) == 0);
-	nvme_free_request(child);
+	nvme_free_request(&qpair, child);
 
 	child = TAILQ_FIRST(&g_request->children);
 	nvme_request_remove_child(g_request, child);
@@ -327,7 +387,7 @@ split_test4(void)
 	CU_ASSERT(cmd_lba_count == 256);
 	CU_ASSERT((child->cmd.cdw12 & SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) != 0);
 	CU_ASSERT((child->cmd.cdw12 & SPDK_NVME_IO_FLAGS_LIMITED_RETRY) == 0);
-	nvme_free_request(child);
+	nvme_free_request(&qpair, child);
 
 	child = TAILQ_FIRST(&g_request->children);
 	nvme_request_remove_child(g_request, child);
@@ -339,12 +399,111 @@ split_test4(void)
 	CU_ASSERT(cmd_lba_count == 10);
 	CU_ASSERT((child->cmd.cdw12 & SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) != 0);
 	CU_ASSERT((child->cmd.cdw12 & SPDK_NVME_IO_FLAGS_LIMITED_RETRY) == 0);
-	nvme_free_request(child);
+	nvme_free_request(&qpair, child);
 
 	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
 
 	free(payload);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
+}
+
+static void
+split_test5(void)
+{
+	struct spdk_nvme_ns	ns;
+	struct spdk_nvme_ctrlr	ctrlr;
+	struct spdk_nvme_qpair	qpair;
+	struct nvme_request	*child;
+	void			*payload;
+	uint64_t		lba, cmd_lba;
+	uint32_t		lba_count, cmd_lba_count;
+	uint32_t		expected_lba_count[] = { 6, 64, 30 };
+	uint32_t		i, offset;
+	int			rc;
+
+	/*
+	 * Controller has max xfer of 32 KB (64 blocks) and the namespace reports an
+	 * optimal I/O boundary of 96 blocks, which is not a power of two.
+	 * Submit an I/O of 100 blocks starting at LBA 90, which should be split
+	 * at LBA 96 (boundary), 160 (max xfer) and end at LBA 190.
+	 */
+	prepare_for_test(&ns, &ctrlr, &qpair, 512, 32 * 1024, 0);
+	ns.sectors_per_stripe = 96;
+	payload = malloc(100 * 512);
+	lba = 90;
+	lba_count = 100;
+
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, payload, lba, lba_count, NULL, NULL, 0);
+
+	CU_ASSERT(rc == 0);
+	SPDK_CU_ASSERT_FATAL(g_request != NULL);
+	SPDK_CU_ASSERT_FATAL(g_request->num_children == 3);
+
+	offset = 0;
+	for (i = 0; i < 3; i++) {
+		child = TAILQ_FIRST(&g_request->children);
+		nvme_request_remove_child(g_request, child);
+		nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
+		CU_ASSERT(cmd_lba == lba);
+		CU_ASSERT(cmd_lba_count == expected_lba_count[i]);
+		CU_ASSERT(child->payload_offset == offset);
+		CU_ASSERT(child->payload_size == expected_lba_count[i] * 512);
+		CU_ASSERT(child->parent == g_request);
+		lba += cmd_lba_count;
+		offset += cmd_lba_count * 512;
+		nvme_free_request(&qpair, child);
+	}
+	CU_ASSERT(TAILQ_EMPTY(&g_request->children));
+	nvme_free_request(NULL, g_request);
+
+	/* More children than are reserved in one batch. */
+	ns.sectors_per_stripe = 8;
+	lba = 4;
+	lba_count = 100;
+	g_request = NULL;
+
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, payload, lba, lba_count, NULL, NULL, 0);
+
+	CU_ASSERT(rc == 0);
+	SPDK_CU_ASSERT_FATAL(g_request != NULL);
+	SPDK_CU_ASSERT_FATAL(g_request->num_children == 13);
+
+	offset = 0;
+	for (i = 0; i < 13; i++) {
+		child = TAILQ_FIRST(&g_request->children);
+		nvme_request_remove_child(g_request, child);
+		nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
+		CU_ASSERT(cmd_lba == lba);
+		CU_ASSERT(cmd_lba_count == (i == 0 ? 4 : 8));
+		CU_ASSERT(child->payload_offset == offset);
+		lba += cmd_lba_count;
+		offset += cmd_lba_count * 512;
+		nvme_free_request(&qpair, child);
+	}
+	CU_ASSERT(lba == 104);
+	nvme_free_request(NULL, g_request);
+
+	ns.sectors_per_stripe = 2;
+	lba = 0;
+	lba_count = 64;
+	g_request = NULL;
+
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, payload, lba, lba_count, NULL, NULL, 0);
+
+	CU_ASSERT(rc == 0);
+	SPDK_CU_ASSERT_FATAL(g_request != NULL);
+	SPDK_CU_ASSERT_FATAL(g_request->num_children == 32);
+	for (i = 0; i < 32; i++) {
+		child = TAILQ_FIRST(&g_request->children);
+		nvme_request_remove_child(g_request, child);
+		nvme_cmd_interpret_rw(&child->cmd, &cmd_lba, &cmd_lba_count);
+		CU_ASSERT(cmd_lba == i * 2);
+		CU_ASSERT(cmd_lba_count == 2);
+		nvme_free_request(&qpair, child);
+	}
+	nvme_free_request(NULL, g_request);
+
+	free(payload);
 }
 
 static void
@@ -371,13 +530,13 @@ test_cmd_child_request(void)
 	CU_ASSERT(rc == 0);
 	CU_ASSERT(g_request->payload_offset == 0);
 	CU_ASSERT(g_request->num_children == 0);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 
 	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, payload, lba, sectors_per_max_io - 1, NULL, NULL, 0);
 	CU_ASSERT(rc == 0);
 	CU_ASSERT(g_request->payload_offset == 0);
 	CU_ASSERT(g_request->num_children == 0);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 
 	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, payload, lba, sectors_per_max_io * 4, NULL, NULL, 0);
 	CU_ASSERT(rc == 0);
@@ -391,12 +550,12 @@ test_cmd_child_request(void)
 		CU_ASSERT(child->cmd.cdw10 == (lba + sectors_per_max_io * i));
 		CU_ASSERT(child->cmd.cdw12 == ((sectors_per_max_io - 1) | 0));
 		offset += max_io_size;
-		nvme_free_request(child);
+		nvme_free_request(&qpair, child);
 		i++;
 	}
 
 	free(payload);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 }
 
 static void
@@ -414,7 +573,7 @@ test_nvme_ns_cmd_flush(void)
 	CU_ASSERT(g_request->cmd.opc == SPDK_NVME_OPC_FLUSH);
 	CU_ASSERT(g_request->cmd.nsid == ns.id);
 
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 }
 
 static void
@@ -437,7 +596,7 @@ test_nvme_ns_cmd_write_zeroes(void)
 	CU_ASSERT_EQUAL(cmd_lba, 0);
 	CU_ASSERT_EQUAL(cmd_lba_count, 2);
 
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 }
 
 static void
@@ -461,7 +620,7 @@ test_nvme_ns_cmd_deallocate(void)
 	CU_ASSERT(g_request->cmd.cdw10 == num_ranges - 1u);
 	CU_ASSERT(g_request->cmd.cdw11 == SPDK_NVME_DSM_ATTR_DEALLOCATE);
 	free(payload);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 
 	num_ranges = 256;
 	payload = malloc(num_ranges * sizeof(struct spdk_nvme_dsm_range));
@@ -471,12 +630,30 @@ test_nvme_ns_cmd_deallocate(void)
 	CU_ASSERT(g_request->cmd.cdw10 == num_ranges - 1u);
 	CU_ASSERT(g_request->cmd.cdw11 == SPDK_NVME_DSM_ATTR_DEALLOCATE);
 	free(payload);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 
 	payload = NULL;
 	num_ranges = 0;
 	rc = spdk_nvme_ns_cmd_deallocate(&ns, &qpair, payload, num_ranges, cb_fn, cb_arg);
 	CU_ASSERT(rc != 0);
+
+	/* Coalesced deallocates are not sent unless no batch is available. */
+	qpair.dsm_coalescing = true;
+	num_ranges = 1;
+	payload = malloc(num_ranges * sizeof(struct spdk_nvme_dsm_range));
+	g_request = NULL;
+	g_dsm_deallocate_rc = 0;
+	rc = spdk_nvme_ns_cmd_deallocate(&ns, &qpair, payload, num_ranges, cb_fn, cb_arg);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(g_request == NULL);
+	g_dsm_deallocate_rc = 1;
+	rc = spdk_nvme_ns_cmd_deallocate(&ns, &qpair, payload, num_ranges, cb_fn, cb_arg);
+	CU_ASSERT(rc == 0);
+	SPDK_CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->cmd.opc == SPDK_NVME_OPC_DATASET_MANAGEMENT);
+	g_dsm_deallocate_rc = 0;
+	free(payload);
+	nvme_free_request(NULL, g_request);
 }
 
 static void
@@ -506,7 +683,7 @@ test_nvme_ns_cmd_readv(void)
 	CU_ASSERT(rc != 0);
 
 	free(cb_arg);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 }
 
 static void
@@ -537,7 +714,51 @@ test_nvme_ns_cmd_writev(void)
 	CU_ASSERT(rc != 0);
 
 	free(cb_arg);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
+}
+
+static void
+test_nvme_ns_cmd_iov(void)
+{
+	struct spdk_nvme_ns		ns;
+	struct spdk_nvme_ctrlr		ctrlr;
+	struct spdk_nvme_qpair		qpair;
+	struct iovec			iov[2];
+	uint64_t			phys[2] = { 0x10000, 0x20000 };
+	int				rc = 0;
+
+	iov[0].iov_base = (void *)0x10000;
+	iov[0].iov_len = 64 * 1024;
+	iov[1].iov_base = (void *)0x20000;
+	iov[1].iov_len = 64 * 1024;
+
+	prepare_for_test(&ns, &ctrlr, &qpair, 512, 128 * 1024, 0);
+	rc = spdk_nvme_ns_cmd_readv_iov(&ns, &qpair, 0x1000, 256, NULL, NULL, 0, iov, phys, 2);
+
+	CU_ASSERT(rc == 0);
+	SPDK_CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->cmd.opc == SPDK_NVME_OPC_READ);
+	CU_ASSERT(g_request->payload.type == NVME_PAYLOAD_TYPE_IOV);
+	CU_ASSERT(g_request->payload.u.iov.iov == iov);
+	CU_ASSERT(g_request->payload.u.iov.phys == phys);
+	CU_ASSERT(g_request->payload.u.iov.iovcnt == 2);
+	CU_ASSERT(g_request->cmd.nsid == ns.id);
+	nvme_free_request(NULL, g_request);
+
+	g_request = NULL;
+	rc = spdk_nvme_ns_cmd_writev_iov(&ns, &qpair, 0x1000, 256, NULL, NULL, 0, iov, NULL, 2);
+
+	CU_ASSERT(rc == 0);
+	SPDK_CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->cmd.opc == SPDK_NVME_OPC_WRITE);
+	CU_ASSERT(g_request->payload.type == NVME_PAYLOAD_TYPE_IOV);
+	CU_ASSERT(g_request->payload.u.iov.phys == NULL);
+	nvme_free_request(NULL, g_request);
+
+	rc = spdk_nvme_ns_cmd_readv_iov(&ns, &qpair, 0x1000, 256, NULL, NULL, 0, NULL, NULL, 2);
+	CU_ASSERT(rc == -EINVAL);
+	rc = spdk_nvme_ns_cmd_writev_iov(&ns, &qpair, 0x1000, 256, NULL, NULL, 0, iov, NULL, 0);
+	CU_ASSERT(rc == -EINVAL);
 }
 
 static void
@@ -562,7 +783,7 @@ test_io_flags(void)
 	SPDK_CU_ASSERT_FATAL(g_request != NULL);
 	CU_ASSERT((g_request->cmd.cdw12 & SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) != 0);
 	CU_ASSERT((g_request->cmd.cdw12 & SPDK_NVME_IO_FLAGS_LIMITED_RETRY) == 0);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 
 	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, payload, lba, lba_count, NULL, NULL,
 				   SPDK_NVME_IO_FLAGS_LIMITED_RETRY);
@@ -570,7 +791,7 @@ test_io_flags(void)
 	SPDK_CU_ASSERT_FATAL(g_request != NULL);
 	CU_ASSERT((g_request->cmd.cdw12 & SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) == 0);
 	CU_ASSERT((g_request->cmd.cdw12 & SPDK_NVME_IO_FLAGS_LIMITED_RETRY) != 0);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 
 	free(payload);
 
@@ -607,7 +828,7 @@ test_nvme_ns_cmd_reservation_register(void)
 
 	CU_ASSERT(g_request->cmd.cdw10 == tmp_cdw10);
 
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 	free(payload);
 }
 
@@ -642,7 +863,7 @@ test_nvme_ns_cmd_reservation_release(void)
 
 	CU_ASSERT(g_request->cmd.cdw10 == tmp_cdw10);
 
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 	free(payload);
 }
 
@@ -677,7 +898,7 @@ test_nvme_ns_cmd_reservation_acquire(void)
 
 	CU_ASSERT(g_request->cmd.cdw10 == tmp_cdw10);
 
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 	free(payload);
 }
 
@@ -704,7 +925,7 @@ test_nvme_ns_cmd_reservation_report(void)
 
 	CU_ASSERT(g_request->cmd.cdw10 == (0x1000 / 4));
 
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 	free(payload);
 }
 
@@ -735,9 +956,159 @@ test_nvme_ns_cmd_write_with_md(void)
 
 	free(buffer);
 	free(metadata);
-	nvme_free_request(g_request);
+	nvme_free_request(NULL, g_request);
 }
 
+static struct spdk_nvme_cpl g_sw_pi_cpl;
+static int g_sw_pi_cb_count;
+
+static void
+sw_pi_read_cb(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	g_sw_pi_cpl = *cpl;
+	g_sw_pi_cb_count++;
+}
+
+static void
+ut_sw_pi_complete_read(void)
+{
+	struct spdk_nvme_cpl cpl = {};
+
+	SPDK_CU_ASSERT_FATAL(g_request != NULL);
+	CU_ASSERT(g_request->cb_fn == nvme_ns_sw_pi_read_done);
+	g_request->cb_fn(g_request->cb_arg, &cpl);
+	nvme_free_request(NULL, g_request);
+	g_request = NULL;
+}
+
+static void
+test_nvme_ns_cmd_sw_pi(void)
+{
+	struct spdk_nvme_ns		ns;
+	struct spdk_nvme_ctrlr		ctrlr;
+	struct spdk_nvme_qpair		qpair;
+	uint32_t			prchk = SPDK_NVME_IO_FLAGS_PRCHK_GUARD |
+					SPDK_NVME_IO_FLAGS_PRCHK_APPTAG | SPDK_NVME_IO_FLAGS_PRCHK_REFTAG;
+	uint8_t				*buffer, *metadata, *pi;
+	int				num_requests;
+	int				rc;
+
+	prepare_for_test(&ns, &ctrlr, &qpair, 512, 128 * 1024, 0);
+	ns.md_size = 8;
+	buffer = calloc(2, 520);
+	metadata = calloc(2, 8);
+	SPDK_CU_ASSERT_FATAL(buffer != NULL && metadata != NULL);
+	memset(buffer, 0xA5, 512);
+
+	/* Only namespaces formatted with PI can enable it. */
+	CU_ASSERT(spdk_nvme_ns_set_sw_pi(&ns, true) == -ENOTSUP);
+	ns.flags = SPDK_NVME_NS_DPS_PI_SUPPORTED | SPDK_NVME_NS_EXTENDED_LBA_SUPPORTED;
+	ns.pi_type = SPDK_NVME_FMT_NVM_PROTECTION_TYPE1;
+	CU_ASSERT(spdk_nvme_ns_set_sw_pi(&ns, true) == 0);
+
+	/* A write gets its PI generated into the interleaved metadata. */
+	rc = spdk_nvme_ns_cmd_write_with_md(&ns, &qpair, buffer, NULL, 0x1000, 2, NULL, NULL, prchk,
+					    0xFFFF, 0x1234);
+	CU_ASSERT(rc == 0);
+	pi = buffer + 512;
+	CU_ASSERT(dif_load_be16(pi) == spdk_crc16_t10dif(0, buffer, 512));
+	CU_ASSERT(dif_load_be16(pi + 2) == 0x1234);
+	CU_ASSERT(dif_load_be32(pi + 4) == 0x1000);
+	CU_ASSERT(dif_load_be32(buffer + 520 + 516) == 0x1001);
+	CU_ASSERT(g_request->cb_fn == NULL);
+	nvme_free_request(NULL, g_request);
+
+	/* A read is checked when it completes. */
+	g_sw_pi_cb_count = 0;
+	rc = spdk_nvme_ns_cmd_read_with_md(&ns, &qpair, buffer, NULL, 0x1000, 2, sw_pi_read_cb, NULL,
+					   prchk, 0xFFFF, 0x1234);
+	CU_ASSERT(rc == 0);
+	ut_sw_pi_complete_read();
+	CU_ASSERT(g_sw_pi_cb_count == 1);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(&g_sw_pi_cpl));
+
+	/* Only the tags selected by the read's flags are checked. */
+	buffer[100] ^= 1;
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, buffer, 0x1000, 2, sw_pi_read_cb, NULL,
+				   SPDK_NVME_IO_FLAGS_PRCHK_REFTAG);
+	CU_ASSERT(rc == 0);
+	ut_sw_pi_complete_read();
+	CU_ASSERT(!spdk_nvme_cpl_is_error(&g_sw_pi_cpl));
+
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, buffer, 0x1000, 2, sw_pi_read_cb, NULL, prchk);
+	CU_ASSERT(rc == 0);
+	ut_sw_pi_complete_read();
+	CU_ASSERT(g_sw_pi_cpl.status.sct == SPDK_NVME_SCT_MEDIA_ERROR);
+	CU_ASSERT(g_sw_pi_cpl.status.sc == SPDK_NVME_SC_GUARD_CHECK_ERROR);
+	buffer[100] ^= 1;
+
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, buffer, 0x1001, 2, sw_pi_read_cb, NULL, prchk);
+	CU_ASSERT(rc == 0);
+	ut_sw_pi_complete_read();
+	CU_ASSERT(g_sw_pi_cpl.status.sc == SPDK_NVME_SC_REFERENCE_TAG_CHECK_ERROR);
+	CU_ASSERT(g_sw_pi_cb_count == 4);
+
+	/* With PRACT the controller inserts and strips the PI itself. */
+	memset(buffer, 0, 2 * 520);
+	rc = spdk_nvme_ns_cmd_write(&ns, &qpair, buffer, 0x1000, 2, NULL, NULL,
+				    SPDK_NVME_IO_FLAGS_PRACT);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(dif_load_be32(buffer + 516) == 0);
+	nvme_free_request(NULL, g_request);
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, buffer, 0x1000, 2, sw_pi_read_cb, NULL,
+				   SPDK_NVME_IO_FLAGS_PRACT | prchk);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(g_request->cb_fn == sw_pi_read_cb);
+	nvme_free_request(NULL, g_request);
+
+	/* A read rejected by a full queue pair frees its PI request, split or not. */
+	num_requests = g_ut_num_requests;
+	qpair.fail_when_full = true;
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, buffer, 0x1000, 2, sw_pi_read_cb, NULL, prchk);
+	CU_ASSERT(rc == -EAGAIN);
+	ns.sectors_per_max_io = 1;
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, buffer, 0x1000, 2, sw_pi_read_cb, NULL, prchk);
+	CU_ASSERT(rc == -EAGAIN);
+	CU_ASSERT(g_sw_pi_cb_count == 4);
+	CU_ASSERT(g_ut_num_requests == num_requests);
+	ns.sectors_per_max_io = 256;
+	qpair.fail_when_full = false;
+
+	/* With separate metadata, the PI goes into the metadata buffer. */
+	ns.flags = SPDK_NVME_NS_DPS_PI_SUPPORTED;
+	ns.pi_type = SPDK_NVME_FMT_NVM_PROTECTION_TYPE3;
+	rc = spdk_nvme_ns_cmd_write_with_md(&ns, &qpair, buffer, metadata, 0x2000, 2, NULL, NULL,
+					    prchk, 0xFFFF, 0x4321);
+	CU_ASSERT(rc == 0);
+	CU_ASSERT(dif_load_be16(metadata) == spdk_crc16_t10dif(0, buffer, 512));
+	CU_ASSERT(dif_load_be16(metadata + 10) == 0x4321);
+	CU_ASSERT(dif_load_be32(metadata + 12) == 0x2000);
+	nvme_free_request(NULL, g_request);
+
+	rc = spdk_nvme_ns_cmd_read_with_md(&ns, &qpair, buffer, metadata, 0x2000, 2, sw_pi_read_cb,
+					   NULL, prchk, 0xFFFF, 0x4322);
+	CU_ASSERT(rc == 0);
+	ut_sw_pi_complete_read();
+	CU_ASSERT(g_sw_pi_cpl.status.sc == SPDK_NVME_SC_APPLICATION_TAG_CHECK_ERROR);
+
+	/* Without a metadata buffer there is nowhere to put the PI, so the command is rejected. */
+	g_request = NULL;
+	rc = spdk_nvme_ns_cmd_read(&ns, &qpair, buffer, 0x2000, 2, sw_pi_read_cb, NULL, prchk);
+	CU_ASSERT(rc == -EINVAL);
+	rc = spdk_nvme_ns_cmd_write(&ns, &qpair, buffer, 0x2000, 2, NULL, NULL, prchk);
+	CU_ASSERT(rc == -EINVAL);
+	CU_ASSERT(g_request == NULL);
+
+	/* Nor are scattered payloads, which the driver does not generate or check PI for. */
+	rc = spdk_nvme_ns_cmd_readv(&ns, &qpair, 0x2000, 2, sw_pi_read_cb, NULL, prchk,
+				    nvme_request_reset_sgl, nvme_request_next_sge);
+	CU_ASSERT(rc == -ENOTSUP);
+	CU_ASSERT(g_request == NULL);
+
+	CU_ASSERT(spdk_nvme_ns_set_sw_pi(&ns, false) == 0);
+	free(buffer);
+	free(metadata);
+}
 
 int main(int argc, char **argv)
 {
@@ -759,6 +1130,7 @@ int main(int argc, char **argv)
 		|| CU_add_test(suite, "split_test2", split_test2) == NULL
 		|| CU_add_test(suite, "split_test3", split_test3) == NULL
 		|| CU_add_test(suite, "split_test4", split_test4) == NULL
+		|| CU_add_test(suite, "split_test5", split_test5) == NULL
 		|| CU_add_test(suite, "nvme_ns_cmd_flush", test_nvme_ns_cmd_flush) == NULL
 		|| CU_add_test(suite, "nvme_ns_cmd_deallocate", test_nvme_ns_cmd_deallocate) == NULL
 		|| CU_add_test(suite, "io_flags", test_io_flags) == NULL
@@ -773,7 +1145,9 @@ int main(int argc, char **argv)
 		|| CU_add_test(suite, "test_cmd_child_request", test_cmd_child_request) == NULL
 		|| CU_add_test(suite, "nvme_ns_cmd_readv", test_nvme_ns_cmd_readv) == NULL
 		|| CU_add_test(suite, "nvme_ns_cmd_writev", test_nvme_ns_cmd_writev) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_iov", test_nvme_ns_cmd_iov) == NULL
 		|| CU_add_test(suite, "nvme_ns_cmd_write_with_md", test_nvme_ns_cmd_write_with_md) == NULL
+		|| CU_add_test(suite, "nvme_ns_cmd_sw_pi", test_nvme_ns_cmd_sw_pi) == NULL
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
@@ -44,6 +44,8 @@ struct nvme_driver g_nvme_driver = {
 
 int32_t spdk_nvme_retry_count = 1;
 
+uint64_t g_ut_tsc = 0;
+
 char outbuf[OUTBUF_SIZE];
 
 struct nvme_request *g_request = NULL;
@@ -52,8 +54,17 @@ bool fail_vtophys = false;
 
 bool fail_next_sge = false;
 
+static uint32_t g_vtophys_calls = 0;
+
+uint64_t
+spdk_nvme_ns_get_num_sectors(struct spdk_nvme_ns *ns)
+{
+	return 1024 * 1024;
+}
+
 uint64_t nvme_vtophys(void *buf)
 {
+	g_vtophys_calls++;
 	if (fail_vtophys) {
 		return (uint64_t) - 1;
 	} else {
@@ -123,7 +134,8 @@ static int nvme_request_next_sge(void *cb_arg, uint64_t *address, uint32_t *leng
 }
 
 struct nvme_request *
-nvme_allocate_request(const struct nvme_payload *payload, uint32_t payload_size,
+nvme_allocate_request(struct spdk_nvme_qpair *qpair, const struct nvme_payload *payload,
+		      uint32_t payload_size,
 		      spdk_nvme_cmd_cb cb_fn,
 		      void *cb_arg)
 {
@@ -136,14 +148,12 @@ nvme_allocate_request(const struct nvme_payload *payload, uint32_t payload_size,
 	}
 
 	/*
-	 * Only memset up to (but not including) the children
-	 *  TAILQ_ENTRY.  children, and following members, are
-	 *  only used as part of I/O splitting so we avoid
+	 * Only memset up to (but not including) the stailq
+	 *  STAILQ_ENTRY.  stailq, and following members, are
+	 *  only used when queueing or splitting requests so we avoid
 	 *  memsetting them until it is actually needed.
-	 *  They will be initialized in nvme_request_add_child()
-	 *  if the request is split.
 	 */
-	memset(req, 0, offsetof(struct nvme_request, children));
+	memset(req, 0, offsetof(struct nvme_request, stailq));
 	req->cb_fn = cb_fn;
 	req->cb_arg = cb_arg;
 	req->payload = *payload;
@@ -153,29 +163,41 @@ nvme_allocate_request(const struct nvme_payload *payload, uint32_t payload_size,
 }
 
 struct nvme_request *
-nvme_allocate_request_contig(void *buffer, uint32_t payload_size, spdk_nvme_cmd_cb cb_fn,
-			     void *cb_arg)
+nvme_allocate_request_contig(struct spdk_nvme_qpair *qpair, void *buffer, uint32_t payload_size,
+			     spdk_nvme_cmd_cb cb_fn, void *cb_arg)
 {
 	struct nvme_payload payload;
 
 	payload.type = NVME_PAYLOAD_TYPE_CONTIG;
 	payload.u.contig = buffer;
+	payload.md = NULL;
 
-	return nvme_allocate_request(&payload, payload_size, cb_fn, cb_arg);
+	return nvme_allocate_request(qpair, &payload, payload_size, cb_fn, cb_arg);
 }
 
 struct nvme_request *
-nvme_allocate_request_null(spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+nvme_allocate_request_null(struct spdk_nvme_qpair *qpair, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
 {
-	return nvme_allocate_request_contig(NULL, 0, cb_fn, cb_arg);
+	return nvme_allocate_request_contig(qpair, NULL, 0, cb_fn, cb_arg);
 }
 
 void
-nvme_free_request(struct nvme_request *req)
+nvme_free_request(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
 {
 	nvme_dealloc_request(req);
 }
 
+int
+nvme_request_cache_construct(struct spdk_nvme_qpair *qpair, uint32_t num_reqs)
+{
+	return 0;
+}
+
+void
+nvme_request_cache_destroy(struct spdk_nvme_qpair *qpair)
+{
+}
+
 void
 nvme_request_remove_child(struct nvme_request *parent,
 			  struct nvme_request *child)
@@ -184,6 +206,18 @@ nvme_request_remove_child(struct nvme_request *parent,
 	TAILQ_REMOVE(&parent->children, child, child_tailq);
 }
 
+static int g_abort_count = 0;
+static uint16_t g_abort_cid;
+
+int
+nvme_ctrlr_cmd_abort(struct spdk_nvme_ctrlr *ctrlr, uint16_t cid,
+		     uint16_t sqid, spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	g_abort_count++;
+	g_abort_cid = cid;
+	return 0;
+}
+
 int
 nvme_ctrlr_alloc_cmb(struct spdk_nvme_ctrlr *ctrlr, uint64_t length, uint64_t aligned,
 		     uint64_t *offset)
@@ -242,7 +276,7 @@ prepare_submit_request_test(struct spdk_nvme_qpair *qpair,
 	ctrlr->regs = regs;
 	TAILQ_INIT(&ctrlr->free_io_qpairs);
 	TAILQ_INIT(&ctrlr->active_io_qpairs);
-	nvme_qpair_construct(qpair, 1, 128, 32, ctrlr);
+	nvme_qpair_construct(qpair, 1, 128, 32, ctrlr, NVME_SOCKET_ID_ANY);
 
 	CU_ASSERT(qpair->sq_tail == 0);
 	CU_ASSERT(qpair->cq_head == 0);
@@ -267,9 +301,8 @@ ut_insert_cq_entry(struct spdk_nvme_qpair *qpair, uint32_t slot)
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 	memset(req, 0, sizeof(*req));
 
-	tr = LIST_FIRST(&qpair->free_tr);
-	LIST_REMOVE(tr, list); /* remove tr from free_tr */
-	LIST_INSERT_HEAD(&qpair->outstanding_tr, tr, list);
+	tr = nvme_qpair_get_tracker(qpair);
+	SPDK_CU_ASSERT_FATAL(tr != NULL);
 	req->cmd.cid = tr->cid;
 	tr->req = req;
 	qpair->tr[tr->cid].active = true;
@@ -303,7 +336,7 @@ test3(void)
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
 
-	req = nvme_allocate_request_null(expected_success_callback, NULL);
+	req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 
 	CU_ASSERT(qpair.sq_tail == 0);
@@ -330,6 +363,333 @@ test3(void)
 	cleanup_submit_request_test(&qpair);
 }
 
+static void
+test_delay_doorbell(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct nvme_request		*req;
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	int				i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	spdk_nvme_qpair_set_delay_doorbell(&qpair, true);
+
+	/* Submissions only advance sq_tail while the doorbell is delayed. */
+	for (i = 0; i < 3; i++) {
+		req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+		SPDK_CU_ASSERT_FATAL(req != NULL);
+		CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	}
+	CU_ASSERT(qpair.sq_tail == 3);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 0);
+	CU_ASSERT(qpair.sq_doorbell_pending == true);
+	CU_ASSERT(spdk_nvme_qpair_get_num_sq_doorbell_writes(&qpair) == 0);
+
+	/* One doorbell write covers the whole batch. */
+	spdk_nvme_qpair_flush_submissions(&qpair);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 3);
+	CU_ASSERT(qpair.sq_doorbell_pending == false);
+	CU_ASSERT(spdk_nvme_qpair_get_num_sq_doorbell_writes(&qpair) == 1);
+
+	/* Polling for completions rings the doorbell for pending submissions. */
+	req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 3);
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 4);
+	CU_ASSERT(spdk_nvme_qpair_get_num_sq_doorbell_writes(&qpair) == 2);
+
+	/* Disabling the mode flushes anything still pending and rings per command again. */
+	req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	spdk_nvme_qpair_set_delay_doorbell(&qpair, false);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 5);
+
+	req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	CU_ASSERT(regs.doorbell[0].sq_tdbl == 6);
+	CU_ASSERT(spdk_nvme_qpair_get_num_sq_doorbell_writes(&qpair) == 4);
+
+	for (i = 0; i < 6; i++) {
+		nvme_qpair_manual_complete_tracker(&qpair, &qpair.tr[qpair.cmd[i].cid], SPDK_NVME_SCT_GENERIC,
+						   SPDK_NVME_SC_SUCCESS, 0, false);
+	}
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static int g_timeout_cb_count = 0;
+
+static void
+ut_timeout_cb(void *cb_arg, struct spdk_nvme_ctrlr *ctrlr, struct spdk_nvme_qpair *qpair,
+	      uint16_t cid)
+{
+	g_timeout_cb_count++;
+	CU_ASSERT(cb_arg == &g_timeout_cb_count);
+	CU_ASSERT(qpair->tr[cid].active);
+}
+
+static void
+test_io_timeout(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct nvme_request		*req;
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	uint16_t			cid;
+
+	g_ut_tsc = 0;
+	g_abort_count = 0;
+
+	memset(&ctrlr, 0, sizeof(ctrlr));
+	ctrlr.regs = &regs;
+	ctrlr.opts.timeout_sec = 5;
+	nvme_qpair_construct(&qpair, 1, 128, 32, &ctrlr, NVME_SOCKET_ID_ANY);
+	qpair.is_enabled = true;
+	CU_ASSERT(qpair.timeout_ticks == 5 * nvme_get_tsc_hz());
+
+	req = nvme_allocate_request_null(&qpair, expected_failure_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	cid = qpair.cmd[0].cid;
+
+	/* Not expired yet. */
+	g_ut_tsc = 49 * nvme_get_tsc_hz() / 10;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(g_abort_count == 0);
+
+	/* Expired, but the outstanding list is only scanned once per second. */
+	g_ut_tsc = 55 * nvme_get_tsc_hz() / 10;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(g_abort_count == 0);
+
+	/* Without a timeout callback, the driver aborts the command itself, once. */
+	g_ut_tsc = 6 * nvme_get_tsc_hz();
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(g_abort_count == 1);
+	CU_ASSERT(g_abort_cid == cid);
+	CU_ASSERT(qpair.tr[cid].timed_out);
+
+	g_ut_tsc = 8 * nvme_get_tsc_hz();
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(g_abort_count == 1);
+
+	/* A retried submission is timed again and reported to the user callback. */
+	ctrlr.opts.timeout_cb_fn = ut_timeout_cb;
+	ctrlr.opts.timeout_cb_arg = &g_timeout_cb_count;
+	nvme_qpair_submit_tracker(&qpair, &qpair.tr[cid]);
+	CU_ASSERT(!qpair.tr[cid].timed_out);
+	g_ut_tsc = 14 * nvme_get_tsc_hz();
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(g_timeout_cb_count == 1);
+	CU_ASSERT(g_abort_count == 1);
+
+	nvme_qpair_manual_complete_tracker(&qpair, &qpair.tr[cid], SPDK_NVME_SCT_GENERIC,
+					   SPDK_NVME_SC_ABORTED_BY_REQUEST, 1, false);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+
+	cleanup_submit_request_test(&qpair);
+	g_ut_tsc = 0;
+}
+
+static void
+test_latency_histogram_buckets(void)
+{
+	uint64_t	ticks;
+	uint32_t	bucket, prev_bucket = 0;
+
+	/* Every bucket's upper bound must map back to that bucket, and buckets must be monotonic. */
+	for (bucket = 0; bucket < SPDK_NVME_LATENCY_HISTOGRAM_NUM_BUCKETS; bucket++) {
+		CU_ASSERT(nvme_latency_histogram_bucket(nvme_latency_histogram_bucket_max(bucket)) == bucket);
+	}
+
+	for (ticks = 1; ticks < (1ULL << 20); ticks = ticks * 9 / 8 + 1) {
+		bucket = nvme_latency_histogram_bucket(ticks);
+		CU_ASSERT(bucket >= prev_bucket);
+		CU_ASSERT(nvme_latency_histogram_bucket_max(bucket) >= ticks);
+		prev_bucket = bucket;
+	}
+
+	CU_ASSERT(nvme_latency_histogram_bucket(UINT64_MAX) == SPDK_NVME_LATENCY_HISTOGRAM_NUM_BUCKETS - 1);
+}
+
+static void
+test_latency_histogram(void)
+{
+	struct spdk_nvme_qpair			qpair = {};
+	struct nvme_request			*req;
+	struct spdk_nvme_ctrlr			ctrlr = {};
+	struct spdk_nvme_registers		regs = {};
+	struct spdk_nvme_latency_histogram	*hist;
+	uint64_t				p50, p99;
+	int					i;
+
+	hist = calloc(1, sizeof(*hist));
+	SPDK_CU_ASSERT_FATAL(hist != NULL);
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	g_ut_tsc = 0;
+
+	CU_ASSERT(spdk_nvme_qpair_get_latency_histogram(&qpair, hist) == -EINVAL);
+
+	/* A command submitted before the histogram was enabled has no submit_tick. */
+	req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	CU_ASSERT(spdk_nvme_qpair_enable_latency_histogram(&qpair, true) == -EBUSY);
+	CU_ASSERT(qpair.latency_histogram == NULL);
+	nvme_qpair_manual_complete_tracker(&qpair, &qpair.tr[req->cmd.cid], SPDK_NVME_SCT_GENERIC,
+					   SPDK_NVME_SC_SUCCESS, 0, false);
+
+	CU_ASSERT(spdk_nvme_qpair_enable_latency_histogram(&qpair, true) == 0);
+	SPDK_CU_ASSERT_FATAL(qpair.latency_histogram != NULL);
+
+	/* 99 reads that take 100 ticks and one that takes 10000 ticks. */
+	for (i = 0; i < 100; i++) {
+		req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+		SPDK_CU_ASSERT_FATAL(req != NULL);
+		req->cmd.opc = SPDK_NVME_OPC_READ;
+		g_ut_tsc = 1000;
+		CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+		g_ut_tsc += (i == 99) ? 10000 : 100;
+		nvme_qpair_manual_complete_tracker(&qpair, &qpair.tr[req->cmd.cid], SPDK_NVME_SCT_GENERIC,
+						   SPDK_NVME_SC_SUCCESS, 0, false);
+	}
+
+	CU_ASSERT(spdk_nvme_qpair_get_latency_histogram(&qpair, hist) == 0);
+	CU_ASSERT(hist->tick_rate == nvme_get_tsc_hz());
+
+	p50 = spdk_nvme_latency_histogram_get_percentile(hist, SPDK_NVME_IO_CLASS_READ, 50);
+	CU_ASSERT(p50 >= 100 && p50 < 110);
+	p99 = spdk_nvme_latency_histogram_get_percentile(hist, SPDK_NVME_IO_CLASS_READ, 99);
+	CU_ASSERT(p99 >= 100 && p99 < 110);
+	CU_ASSERT(spdk_nvme_latency_histogram_get_percentile(hist, SPDK_NVME_IO_CLASS_READ, 100) >= 10000);
+	CU_ASSERT(spdk_nvme_latency_histogram_get_percentile(hist, SPDK_NVME_IO_CLASS_WRITE, 50) == 0);
+
+	spdk_nvme_qpair_reset_latency_histogram(&qpair);
+	CU_ASSERT(spdk_nvme_qpair_get_latency_histogram(&qpair, hist) == 0);
+	CU_ASSERT(spdk_nvme_latency_histogram_get_percentile(hist, SPDK_NVME_IO_CLASS_READ, 50) == 0);
+
+	CU_ASSERT(spdk_nvme_qpair_enable_latency_histogram(&qpair, false) == 0);
+	CU_ASSERT(qpair.latency_histogram == NULL);
+
+	cleanup_submit_request_test(&qpair);
+	g_ut_tsc = 0;
+	free(hist);
+}
+
+static struct nvme_request *
+ut_submit_hybrid_poll_read(struct spdk_nvme_qpair *qpair, uint32_t payload_size)
+{
+	struct nvme_request *req;
+
+	req = nvme_allocate_request_null(qpair, expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_READ;
+	req->payload_size = payload_size;
+	CU_ASSERT(nvme_qpair_submit_request(qpair, req) == 0);
+	return req;
+}
+
+static void
+ut_complete_hybrid_poll_read(struct spdk_nvme_qpair *qpair, struct nvme_request *req)
+{
+	nvme_qpair_manual_complete_tracker(qpair, &qpair->tr[req->cmd.cid], SPDK_NVME_SCT_GENERIC,
+					   SPDK_NVME_SC_SUCCESS, 0, false);
+}
+
+static void
+test_hybrid_polling(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct nvme_request		*req, *req2;
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	struct nvme_hybrid_poll		*hp;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	g_ut_tsc = 1000;
+
+	/* Can't learn from commands submitted before hybrid polling was enabled. */
+	req = ut_submit_hybrid_poll_read(&qpair, 4096);
+	CU_ASSERT(spdk_nvme_qpair_set_hybrid_polling(&qpair, 10) == -EBUSY);
+	CU_ASSERT(qpair.hybrid_poll == NULL);
+	ut_complete_hybrid_poll_read(&qpair, req);
+
+	CU_ASSERT(spdk_nvme_qpair_set_hybrid_polling(&qpair, 10) == 0);
+	hp = qpair.hybrid_poll;
+	SPDK_CU_ASSERT_FATAL(hp != NULL);
+	CU_ASSERT(qpair.hybrid_polling);
+	CU_ASSERT(hp->min_sleep_ticks == 10);
+
+	/* 4 KB and smaller share a class; each doubling gets its own. */
+	req = ut_submit_hybrid_poll_read(&qpair, 512);
+	CU_ASSERT(nvme_hybrid_poll_size_class(req) == 0);
+	req->payload_size = 8192;
+	CU_ASSERT(nvme_hybrid_poll_size_class(req) == 1);
+	req->payload_size = 16384 + 4096;
+	CU_ASSERT(nvme_hybrid_poll_size_class(req) == 2);
+	req->payload_size = 64 * 1024 * 1024;
+	CU_ASSERT(nvme_hybrid_poll_size_class(req) == NVME_HYBRID_POLL_SIZE_CLASSES - 1);
+	req->payload_size = 512;
+
+	/* No estimate yet - the command is due immediately, so keep busy polling. */
+	CU_ASSERT(hp->earliest_tick == 1000);
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 0);
+	CU_ASSERT(hp->num_sleeps == 0);
+
+	g_ut_tsc += 500;
+	ut_complete_hybrid_poll_read(&qpair, req);
+	CU_ASSERT(hp->ewma_ticks[0] == 500);
+	CU_ASSERT(hp->earliest_stale);
+
+	g_ut_tsc = 2000;
+	req = ut_submit_hybrid_poll_read(&qpair, 4096);
+	g_ut_tsc += 900;
+	ut_complete_hybrid_poll_read(&qpair, req);
+	CU_ASSERT(hp->ewma_ticks[0] == 500 - 62 + 112);
+
+	/* Only the queue pair's own size class estimate is used for the prediction. */
+	g_ut_tsc = 3000;
+	req = ut_submit_hybrid_poll_read(&qpair, 4096);
+	req2 = ut_submit_hybrid_poll_read(&qpair, 8192);
+	CU_ASSERT(qpair.tr[req->cmd.cid].expected_tick == 3000 + 550);
+	CU_ASSERT(qpair.tr[req2->cmd.cid].expected_tick == 3000);
+	ut_complete_hybrid_poll_read(&qpair, req2);
+	CU_ASSERT(hp->ewma_ticks[1] == 0);
+
+	/* The 4 KB read is expected well in the future - sleep instead of spinning. */
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 0);
+	CU_ASSERT(!hp->earliest_stale);
+	CU_ASSERT(hp->earliest_tick == 3550);
+	CU_ASSERT(hp->num_sleeps == 1);
+
+	/* Within 2 * min_sleep of the expected completion - busy poll. */
+	g_ut_tsc = 3535;
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 0);
+	CU_ASSERT(hp->num_sleeps == 1);
+
+	ut_complete_hybrid_poll_read(&qpair, req);
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 0);
+	CU_ASSERT(hp->earliest_tick == UINT64_MAX);
+	CU_ASSERT(hp->num_sleeps == 1);
+
+	CU_ASSERT(spdk_nvme_qpair_set_hybrid_polling(&qpair, 0) == 0);
+	CU_ASSERT(qpair.hybrid_poll == NULL);
+	CU_ASSERT(!qpair.hybrid_polling);
+
+	cleanup_submit_request_test(&qpair);
+	g_ut_tsc = 0;
+}
+
 static void
 test4(void)
 {
@@ -341,7 +701,7 @@ test4(void)
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
 
-	req = nvme_allocate_request_contig(payload, sizeof(payload), expected_failure_callback, NULL);
+	req = nvme_allocate_request_contig(&qpair, payload, sizeof(payload), expected_failure_callback, NULL);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 
 	/* Force vtophys to return a failure.  This should
@@ -373,6 +733,7 @@ test_sgl_req(void)
 	struct spdk_nvme_registers	regs = {};
 	struct nvme_payload	payload = {};
 	struct nvme_tracker 	*sgl_tr = NULL;
+	struct nvme_prp_list	*prp_list;
 	uint64_t 		i;
 	struct io_request	io_req = {};
 
@@ -382,7 +743,7 @@ test_sgl_req(void)
 	payload.u.sgl.cb_arg = &io_req;
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
-	req = nvme_allocate_request(&payload, PAGE_SIZE, NULL, &io_req);
+	req = nvme_allocate_request(&qpair, &payload, PAGE_SIZE, NULL, &io_req);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 	req->cmd.opc = SPDK_NVME_OPC_WRITE;
 	req->cmd.cdw10 = 10000;
@@ -393,14 +754,13 @@ test_sgl_req(void)
 	CU_ASSERT(req->cmd.psdt == SPDK_NVME_PSDT_PRP);
 	CU_ASSERT(req->cmd.dptr.prp.prp1 == 7);
 	CU_ASSERT(req->cmd.dptr.prp.prp2 == 4096);
+	CU_ASSERT(qpair.tr[req->cmd.cid].prp_list == NVME_NO_PRP_LIST);
 
-	sgl_tr = LIST_FIRST(&qpair.outstanding_tr);
-	LIST_REMOVE(sgl_tr, list);
 	cleanup_submit_request_test(&qpair);
-	nvme_free_request(req);
+	nvme_free_request(&qpair, req);
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
-	req = nvme_allocate_request(&payload, PAGE_SIZE, NULL, &io_req);
+	req = nvme_allocate_request(&qpair, &payload, PAGE_SIZE, NULL, &io_req);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 	req->cmd.opc = SPDK_NVME_OPC_WRITE;
 	req->cmd.cdw10 = 10000;
@@ -415,7 +775,7 @@ test_sgl_req(void)
 	fail_next_sge = false;
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
-	req = nvme_allocate_request(&payload, 2 * PAGE_SIZE, NULL, &io_req);
+	req = nvme_allocate_request(&qpair, &payload, 2 * PAGE_SIZE, NULL, &io_req);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 	req->cmd.opc = SPDK_NVME_OPC_WRITE;
 	req->cmd.cdw10 = 10000;
@@ -427,7 +787,7 @@ test_sgl_req(void)
 	cleanup_submit_request_test(&qpair);
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
-	req = nvme_allocate_request(&payload, (NVME_MAX_PRP_LIST_ENTRIES + 1) * PAGE_SIZE, NULL, &io_req);
+	req = nvme_allocate_request(&qpair, &payload, (NVME_MAX_PRP_LIST_ENTRIES + 1) * PAGE_SIZE, NULL, &io_req);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 	req->cmd.opc = SPDK_NVME_OPC_WRITE;
 	req->cmd.cdw10 = 10000;
@@ -437,16 +797,17 @@ test_sgl_req(void)
 
 	CU_ASSERT(req->cmd.dptr.prp.prp1 == 0);
 	CU_ASSERT(qpair.sq_tail == 1);
-	sgl_tr = LIST_FIRST(&qpair.outstanding_tr);
-	if (sgl_tr != NULL) {
-		for (i = 0; i < NVME_MAX_PRP_LIST_ENTRIES; i++) {
-			CU_ASSERT(sgl_tr->u.prp[i] == (PAGE_SIZE * (i + 1)));
-		}
-
-		LIST_REMOVE(sgl_tr, list);
+	sgl_tr = &qpair.tr[req->cmd.cid];
+	SPDK_CU_ASSERT_FATAL(sgl_tr->prp_list != NVME_NO_PRP_LIST);
+	prp_list = &qpair.prp_list[sgl_tr->prp_list];
+	CU_ASSERT(req->cmd.dptr.prp.prp2 == qpair.prp_list_bus_addr +
+		  sgl_tr->prp_list * sizeof(struct nvme_prp_list));
+	for (i = 0; i < NVME_MAX_PRP_LIST_ENTRIES; i++) {
+		CU_ASSERT(prp_list->u.prp[i] == (PAGE_SIZE * (i + 1)));
 	}
+
 	cleanup_submit_request_test(&qpair);
-	nvme_free_request(req);
+	nvme_free_request(&qpair, req);
 }
 
 static void
@@ -458,6 +819,7 @@ test_hw_sgl_req(void)
 	struct spdk_nvme_registers	regs = {};
 	struct nvme_payload	payload = {};
 	struct nvme_tracker 	*sgl_tr = NULL;
+	struct nvme_prp_list	*prp_list;
 	uint64_t 		i;
 	struct io_request	io_req = {};
 
@@ -467,7 +829,7 @@ test_hw_sgl_req(void)
 	payload.u.sgl.cb_arg = &io_req;
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
-	req = nvme_allocate_request(&payload, PAGE_SIZE, NULL, &io_req);
+	req = nvme_allocate_request(&qpair, &payload, PAGE_SIZE, NULL, &io_req);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 	req->cmd.opc = SPDK_NVME_OPC_WRITE;
 	req->cmd.cdw10 = 10000;
@@ -477,19 +839,18 @@ test_hw_sgl_req(void)
 
 	nvme_qpair_submit_request(&qpair, req);
 
-	sgl_tr = LIST_FIRST(&qpair.outstanding_tr);
-	CU_ASSERT(sgl_tr != NULL);
-	CU_ASSERT(sgl_tr->u.sgl[0].generic.type == SPDK_NVME_SGL_TYPE_DATA_BLOCK);
-	CU_ASSERT(sgl_tr->u.sgl[0].generic.subtype == 0);
-	CU_ASSERT(sgl_tr->u.sgl[0].unkeyed.length == 4096);
-	CU_ASSERT(sgl_tr->u.sgl[0].address == 0);
+	/* A single descriptor goes directly into SGL1 without using a list page. */
+	sgl_tr = &qpair.tr[req->cmd.cid];
+	CU_ASSERT(sgl_tr->prp_list == NVME_NO_PRP_LIST);
 	CU_ASSERT(req->cmd.dptr.sgl1.generic.type == SPDK_NVME_SGL_TYPE_DATA_BLOCK);
-	LIST_REMOVE(sgl_tr, list);
+	CU_ASSERT(req->cmd.dptr.sgl1.generic.subtype == 0);
+	CU_ASSERT(req->cmd.dptr.sgl1.unkeyed.length == 4096);
+	CU_ASSERT(req->cmd.dptr.sgl1.address == 0);
 	cleanup_submit_request_test(&qpair);
-	nvme_free_request(req);
+	nvme_free_request(&qpair, req);
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
-	req = nvme_allocate_request(&payload, NVME_MAX_SGL_DESCRIPTORS * PAGE_SIZE, NULL, &io_req);
+	req = nvme_allocate_request(&qpair, &payload, NVME_MAX_SGL_DESCRIPTORS * PAGE_SIZE, NULL, &io_req);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 	req->cmd.opc = SPDK_NVME_OPC_WRITE;
 	req->cmd.cdw10 = 10000;
@@ -499,20 +860,1178 @@ test_hw_sgl_req(void)
 
 	nvme_qpair_submit_request(&qpair, req);
 
-	sgl_tr = LIST_FIRST(&qpair.outstanding_tr);
-	CU_ASSERT(sgl_tr != NULL);
+	sgl_tr = &qpair.tr[req->cmd.cid];
+	SPDK_CU_ASSERT_FATAL(sgl_tr->prp_list != NVME_NO_PRP_LIST);
+	prp_list = &qpair.prp_list[sgl_tr->prp_list];
 	for (i = 0; i < NVME_MAX_SGL_DESCRIPTORS; i++) {
-		CU_ASSERT(sgl_tr->u.sgl[i].generic.type == SPDK_NVME_SGL_TYPE_DATA_BLOCK);
-		CU_ASSERT(sgl_tr->u.sgl[i].generic.subtype == 0);
-		CU_ASSERT(sgl_tr->u.sgl[i].unkeyed.length == 4096);
-		CU_ASSERT(sgl_tr->u.sgl[i].address == i * 4096);
+		CU_ASSERT(prp_list->u.sgl[i].generic.type == SPDK_NVME_SGL_TYPE_DATA_BLOCK);
+		CU_ASSERT(prp_list->u.sgl[i].generic.subtype == 0);
+		CU_ASSERT(prp_list->u.sgl[i].unkeyed.length == 4096);
+		CU_ASSERT(prp_list->u.sgl[i].address == i * 4096);
 	}
 	CU_ASSERT(req->cmd.dptr.sgl1.generic.type == SPDK_NVME_SGL_TYPE_LAST_SEGMENT);
-	LIST_REMOVE(sgl_tr, list);
+	CU_ASSERT(req->cmd.dptr.sgl1.address == qpair.prp_list_bus_addr +
+		  sgl_tr->prp_list * sizeof(struct nvme_prp_list));
+	cleanup_submit_request_test(&qpair);
+	nvme_free_request(&qpair, req);
+}
+
+static void
+test_hw_sgl_chained(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct nvme_request		*req;
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	struct nvme_payload		payload = {};
+	struct nvme_tracker		*tr;
+	struct nvme_prp_list		*seg[3];
+	struct io_request		io_req = {};
+	const uint32_t			per_seg = NVME_MAX_SGL_DESCRIPTORS - 1;
+	uint16_t			idx;
+	uint32_t			i, num_sge;
+
+	payload.type = NVME_PAYLOAD_TYPE_SGL;
+	payload.u.sgl.reset_sgl_fn = nvme_request_reset_sgl;
+	payload.u.sgl.next_sge_fn = nvme_request_next_sge;
+	payload.u.sgl.cb_arg = &io_req;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	ctrlr.flags |= SPDK_NVME_CTRLR_SGL_SUPPORTED;
+
+	/* Two full segments chained to a partial last segment. */
+	num_sge = 2 * per_seg + 90;
+	req = nvme_allocate_request(&qpair, &payload, num_sge * PAGE_SIZE, NULL, &io_req);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_WRITE;
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+
+	tr = &qpair.tr[req->cmd.cid];
+	SPDK_CU_ASSERT_FATAL(tr->prp_list != NVME_NO_PRP_LIST);
+	idx = tr->prp_list;
+	for (i = 0; i < 3; i++) {
+		SPDK_CU_ASSERT_FATAL(idx != NVME_NO_PRP_LIST);
+		seg[i] = &qpair.prp_list[idx];
+		idx = qpair.prp_list_next[idx];
+	}
+	CU_ASSERT(idx == NVME_NO_PRP_LIST);
+	CU_ASSERT(qpair.num_free_prp_list == qpair.num_prp_lists - 3);
+
+	CU_ASSERT(req->cmd.dptr.sgl1.unkeyed.type == SPDK_NVME_SGL_TYPE_SEGMENT);
+	CU_ASSERT(req->cmd.dptr.sgl1.unkeyed.length == 4096);
+	CU_ASSERT(req->cmd.dptr.sgl1.address == (uint64_t)(uintptr_t)seg[0]);
+
+	for (i = 0; i < num_sge; i++) {
+		struct spdk_nvme_sgl_descriptor *sgl = &seg[i / per_seg]->u.sgl[i % per_seg];
+
+		CU_ASSERT(sgl->unkeyed.type == SPDK_NVME_SGL_TYPE_DATA_BLOCK);
+		CU_ASSERT(sgl->unkeyed.length == 4096);
+		CU_ASSERT(sgl->address == i * 4096);
+	}
+
+	CU_ASSERT(seg[0]->u.sgl[per_seg].unkeyed.type == SPDK_NVME_SGL_TYPE_SEGMENT);
+	CU_ASSERT(seg[0]->u.sgl[per_seg].unkeyed.length == 4096);
+	CU_ASSERT(seg[0]->u.sgl[per_seg].address == (uint64_t)(uintptr_t)seg[1]);
+	CU_ASSERT(seg[1]->u.sgl[per_seg].unkeyed.type == SPDK_NVME_SGL_TYPE_LAST_SEGMENT);
+	CU_ASSERT(seg[1]->u.sgl[per_seg].unkeyed.length == 90 * sizeof(struct spdk_nvme_sgl_descriptor));
+	CU_ASSERT(seg[1]->u.sgl[per_seg].address == (uint64_t)(uintptr_t)seg[2]);
+
+	/* Completing the command returns every page in the chain. */
+	nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+					   false);
+	CU_ASSERT(qpair.num_free_prp_list == qpair.num_prp_lists);
+	for (i = 0; i < qpair.num_prp_lists; i++) {
+		CU_ASSERT(qpair.prp_list_next[i] == NVME_NO_PRP_LIST);
+	}
+
+	/* If the pool runs dry partway through the chain, the request is queued. */
+	qpair.num_free_prp_list = 2;
+	req = nvme_allocate_request(&qpair, &payload, num_sge * PAGE_SIZE, NULL, &io_req);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_WRITE;
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	CU_ASSERT(STAILQ_FIRST(&qpair.queued_req) == req);
+	CU_ASSERT(qpair.num_free_prp_list == 2);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+	STAILQ_REMOVE_HEAD(&qpair.queued_req, stailq);
+	nvme_free_request(&qpair, req);
+	qpair.num_free_prp_list = qpair.num_prp_lists;
+
+	/* More descriptors than NVME_MAX_SGL_SEGMENTS pages can hold fails the request. */
+	num_sge = NVME_MAX_SGL_SEGMENTS * per_seg + 2;
+	req = nvme_allocate_request(&qpair, &payload, num_sge * PAGE_SIZE, expected_failure_callback,
+				    &io_req);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_WRITE;
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT(qpair.num_free_prp_list == qpair.num_prp_lists);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_iov_req(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct nvme_request		*req;
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	struct nvme_payload		payload = {};
+	struct nvme_tracker		*tr;
+	struct nvme_prp_list		*prp_list;
+	struct iovec			iov[4];
+	uint64_t			phys[4] = { 0xA0000, 0, 0xB0000, 0xC0000 };
+
+	iov[0].iov_base = (void *)0x100000;
+	iov[0].iov_len = 4096;
+	iov[1].iov_base = (void *)0x180000;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = (void *)0x200000;
+	iov[2].iov_len = 8192;
+	iov[3].iov_base = (void *)0x300000;
+	iov[3].iov_len = 4096;
+
+	payload.type = NVME_PAYLOAD_TYPE_IOV;
+	payload.u.iov.iov = iov;
+	payload.u.iov.phys = NULL;
+	payload.u.iov.iovcnt = 4;
+
+	/* PRPs are built from translated iov_base addresses, skipping empty elements. */
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+	req = nvme_allocate_request(&qpair, &payload, 16384, NULL, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_READ;
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+
+	tr = &qpair.tr[req->cmd.cid];
+	SPDK_CU_ASSERT_FATAL(tr->prp_list != NVME_NO_PRP_LIST);
+	prp_list = &qpair.prp_list[tr->prp_list];
+	CU_ASSERT(req->cmd.psdt == SPDK_NVME_PSDT_PRP);
+	CU_ASSERT(req->cmd.dptr.prp.prp1 == 0x100000);
+	CU_ASSERT(req->cmd.dptr.prp.prp2 == (uint64_t)(uintptr_t)prp_list);
+	CU_ASSERT(prp_list->u.prp[0] == 0x200000);
+	CU_ASSERT(prp_list->u.prp[1] == 0x201000);
+	CU_ASSERT(prp_list->u.prp[2] == 0x300000);
+	nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+					   false);
+
+	/* Hardware SGLs use the caller's physical addresses and honor payload_offset. */
+	ctrlr.flags |= SPDK_NVME_CTRLR_SGL_SUPPORTED;
+	payload.u.iov.phys = phys;
+	req = nvme_allocate_request(&qpair, &payload, 10240, NULL, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_READ;
+	req->payload_offset = 4096 + 2048;
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+
+	tr = &qpair.tr[req->cmd.cid];
+	SPDK_CU_ASSERT_FATAL(tr->prp_list != NVME_NO_PRP_LIST);
+	prp_list = &qpair.prp_list[tr->prp_list];
+	CU_ASSERT(req->cmd.dptr.sgl1.unkeyed.type == SPDK_NVME_SGL_TYPE_LAST_SEGMENT);
+	CU_ASSERT(req->cmd.dptr.sgl1.unkeyed.length == 2 * sizeof(struct spdk_nvme_sgl_descriptor));
+	CU_ASSERT(prp_list->u.sgl[0].address == 0xB0000 + 2048);
+	CU_ASSERT(prp_list->u.sgl[0].unkeyed.length == 6144);
+	CU_ASSERT(prp_list->u.sgl[1].address == 0xC0000);
+	CU_ASSERT(prp_list->u.sgl[1].unkeyed.length == 4096);
+	nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+					   false);
+
+	/* A payload longer than the iovecs, or an untranslatable one, fails the request. */
+	req = nvme_allocate_request(&qpair, &payload, 20480, expected_failure_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_READ;
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+
+	payload.u.iov.phys = NULL;
+	fail_vtophys = true;
+	req = nvme_allocate_request(&qpair, &payload, 4096, expected_failure_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_READ;
+	nvme_qpair_submit_request(&qpair, req);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+	fail_vtophys = false;
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_contig_req_extents(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct nvme_request		*req;
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	struct nvme_tracker		*tr;
+	struct nvme_prp_list		*prp_list;
+	uint32_t			i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/* A 128 KB transfer inside one 2 MB page needs a single translation. */
+	g_vtophys_calls = 0;
+	req = nvme_allocate_request_contig(&qpair, (void *)0x400000, 128 * 1024, NULL, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	CU_ASSERT(g_vtophys_calls == 1);
+
+	tr = &qpair.tr[req->cmd.cid];
+	SPDK_CU_ASSERT_FATAL(tr->prp_list != NVME_NO_PRP_LIST);
+	prp_list = &qpair.prp_list[tr->prp_list];
+	CU_ASSERT(req->cmd.dptr.prp.prp1 == 0x400000);
+	for (i = 0; i < 31; i++) {
+		CU_ASSERT(prp_list->u.prp[i] == 0x400000 + (i + 1) * 4096);
+	}
+	nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+					   false);
+
+	/* Crossing a 2 MB boundary translates the second extent separately. */
+	g_vtophys_calls = 0;
+	req = nvme_allocate_request_contig(&qpair, (void *)(0x600000 - 8192), 16384, NULL, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	CU_ASSERT(g_vtophys_calls == 2);
+
+	tr = &qpair.tr[req->cmd.cid];
+	SPDK_CU_ASSERT_FATAL(tr->prp_list != NVME_NO_PRP_LIST);
+	prp_list = &qpair.prp_list[tr->prp_list];
+	CU_ASSERT(req->cmd.dptr.prp.prp1 == 0x600000 - 8192);
+	CU_ASSERT(prp_list->u.prp[0] == 0x600000 - 4096);
+	CU_ASSERT(prp_list->u.prp[1] == 0x600000);
+	CU_ASSERT(prp_list->u.prp[2] == 0x601000);
+	nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+					   false);
+
+	/* Two pages: PRP2 comes from the second extent without a list page. */
+	req = nvme_allocate_request_contig(&qpair, (void *)(0x600000 - 4096), 8192, NULL, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	tr = &qpair.tr[req->cmd.cid];
+	CU_ASSERT(tr->prp_list == NVME_NO_PRP_LIST);
+	CU_ASSERT(req->cmd.dptr.prp.prp1 == 0x600000 - 4096);
+	CU_ASSERT(req->cmd.dptr.prp.prp2 == 0x600000);
+	nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+					   false);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_prp_list_pool(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct nvme_request		*req, *queued[2];
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	struct nvme_tracker		*tr;
+	static char			payload[3 * 4096] __attribute__((aligned(4096)));
+	uint16_t			i, num_lists;
+
+	/* By default every tracker can get a list page. */
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	CU_ASSERT(qpair.num_prp_lists == qpair.num_trackers);
+
+	/* Construct the qpair again with a smaller pool. */
+	nvme_qpair_destroy(&qpair);
+	ctrlr.opts.io_queue_prp_lists = 8;
+	nvme_qpair_construct(&qpair, 1, 128, 32, &ctrlr, NVME_SOCKET_ID_ANY);
+	qpair.is_enabled = true;
+
+	num_lists = qpair.num_prp_lists;
+	CU_ASSERT(num_lists == 8);
+	/* Free slots are limited by the list pages, not the trackers. */
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == num_lists);
+
+	/* Each 3-page transfer needs a PRP list. */
+	for (i = 0; i < num_lists; i++) {
+		req = nvme_allocate_request_contig(&qpair, payload, sizeof(payload), expected_success_callback, NULL);
+		SPDK_CU_ASSERT_FATAL(req != NULL);
+		CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+		CU_ASSERT(qpair.tr[req->cmd.cid].prp_list != NVME_NO_PRP_LIST);
+	}
+	CU_ASSERT(qpair.num_free_prp_list == 0);
+	CU_ASSERT(qpair.sq_tail == num_lists);
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == 0);
+
+	/* With the pool empty, the next one is queued and its tracker is not used. */
+	queued[0] = nvme_allocate_request_contig(&qpair, payload, sizeof(payload),
+			expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(queued[0] != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, queued[0]) == 0);
+	CU_ASSERT(qpair.sq_tail == num_lists);
+	CU_ASSERT(STAILQ_FIRST(&qpair.queued_req) == queued[0]);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers - num_lists);
+
+	/* Requests that fit in the command itself still go straight through. */
+	req = nvme_allocate_request_contig(&qpair, payload, 2 * 4096, expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	CU_ASSERT(qpair.sq_tail == num_lists + 1);
+	CU_ASSERT(qpair.tr[req->cmd.cid].prp_list == NVME_NO_PRP_LIST);
+
+	queued[1] = nvme_allocate_request_contig(&qpair, payload, sizeof(payload),
+			expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(queued[1] != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, queued[1]) == 0);
+	CU_ASSERT(STAILQ_NEXT(queued[0], stailq) == queued[1]);
+
+	/*
+	 * Completing a command without a list page frees only a tracker.  The head of
+	 *  the queue is retried, and stays at the head.
+	 */
+	tr = &qpair.tr[qpair.cmd[num_lists].cid];
+	nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+					   false);
+	CU_ASSERT(qpair.sq_tail == num_lists + 1);
+	CU_ASSERT(STAILQ_FIRST(&qpair.queued_req) == queued[0]);
+	CU_ASSERT(STAILQ_NEXT(queued[0], stailq) == queued[1]);
+	CU_ASSERT(qpair.queued_req_wait_prp_list == true);
+
+	/* Completing a command returns its list page and resubmits the queued requests in order. */
+	tr = &qpair.tr[qpair.cmd[0].cid];
+	nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+					   false);
+	CU_ASSERT(STAILQ_FIRST(&qpair.queued_req) == queued[1]);
+	CU_ASSERT(qpair.sq_tail == num_lists + 2);
+	CU_ASSERT(qpair.tr[qpair.cmd[num_lists + 1].cid].req == queued[0]);
+	CU_ASSERT(qpair.num_free_prp_list == 0);
+
+	tr = &qpair.tr[qpair.cmd[1].cid];
+	nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+					   false);
+	CU_ASSERT(STAILQ_EMPTY(&qpair.queued_req));
+	CU_ASSERT(qpair.sq_tail == num_lists + 3);
+	CU_ASSERT(qpair.tr[qpair.cmd[num_lists + 2].cid].req == queued[1]);
+
+	for (i = 2; i < num_lists + 3; i++) {
+		if (i == num_lists) {
+			continue;
+		}
+		tr = &qpair.tr[qpair.cmd[i].cid];
+		nvme_qpair_manual_complete_tracker(&qpair, tr, SPDK_NVME_SCT_GENERIC, SPDK_NVME_SC_SUCCESS, 0,
+						   false);
+	}
+	CU_ASSERT(qpair.num_free_prp_list == num_lists);
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == num_lists);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static int g_slots_available_count = 0;
+
+static void
+slots_available_cb(void *cb_arg, struct spdk_nvme_qpair *qpair)
+{
+	g_slots_available_count++;
+	CU_ASSERT(cb_arg == &g_slots_available_count);
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(qpair) != 0);
+}
+
+static void
+ut_complete_sq_entry(struct spdk_nvme_qpair *qpair, uint16_t sq_idx)
+{
+	struct spdk_nvme_cpl *cpl = &qpair->cpl[qpair->cq_head];
+
+	memset(cpl, 0, sizeof(*cpl));
+	cpl->cid = qpair->cmd[sq_idx].cid;
+	cpl->status.p = qpair->phase;
+	CU_ASSERT(spdk_nvme_qpair_process_completions(qpair, 1) == 1);
+}
+
+static void
+test_qpair_full(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct nvme_request		*req, *child;
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	uint16_t			i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	spdk_nvme_qpair_register_slots_available_cb(&qpair, slots_available_cb,
+			&g_slots_available_count);
+	g_slots_available_count = 0;
+
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == qpair.num_trackers);
+
+	for (i = 0; i < qpair.num_trackers; i++) {
+		req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+		SPDK_CU_ASSERT_FATAL(req != NULL);
+		CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	}
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == 0);
+	CU_ASSERT(!qpair.slots_cb_pending);
+
+	/* By default, a submission to the full qpair is queued. */
+	req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	CU_ASSERT(STAILQ_FIRST(&qpair.queued_req) == req);
+	CU_ASSERT(qpair.slots_cb_pending);
+
+	/* With fail_when_full, it is rejected instead. */
+	spdk_nvme_qpair_set_fail_when_full(&qpair, true);
+	req = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == -EAGAIN);
+	CU_ASSERT(STAILQ_NEXT(STAILQ_FIRST(&qpair.queued_req), stailq) == NULL);
+
+	/* The first completion's tracker goes to the queued request; no slot frees up. */
+	ut_complete_sq_entry(&qpair, 0);
+	CU_ASSERT(STAILQ_EMPTY(&qpair.queued_req));
+	CU_ASSERT(qpair.sq_tail == qpair.num_trackers + 1);
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == 0);
+	CU_ASSERT(g_slots_available_count == 0);
+
+	/* The next one frees a slot, which is reported exactly once. */
+	ut_complete_sq_entry(&qpair, 1);
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == 1);
+	CU_ASSERT(g_slots_available_count == 1);
+	CU_ASSERT(!qpair.slots_cb_pending);
+
+	ut_complete_sq_entry(&qpair, 2);
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == 2);
+	CU_ASSERT(g_slots_available_count == 1);
+
+	/* A split request that does not fit as a whole is rejected without submitting any child. */
+	nvme_alloc_request(&req);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	memset(req, 0, sizeof(*req));
+	TAILQ_INIT(&req->children);
+	for (i = 0; i < 3; i++) {
+		child = nvme_allocate_request_null(&qpair, expected_success_callback, NULL);
+		SPDK_CU_ASSERT_FATAL(child != NULL);
+		child->parent = req;
+		TAILQ_INSERT_TAIL(&req->children, child, child_tailq);
+		req->num_children++;
+	}
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == -EAGAIN);
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == 2);
+	CU_ASSERT(qpair.sq_tail == qpair.num_trackers + 1);
+
+	ut_complete_sq_entry(&qpair, 3);
+	CU_ASSERT(g_slots_available_count == 2);
+
+	for (i = 4; i <= qpair.num_trackers; i++) {
+		ut_complete_sq_entry(&qpair, i);
+	}
+	CU_ASSERT(spdk_nvme_qpair_get_num_free_slots(&qpair) == qpair.num_trackers);
+
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+ut_submit_rw(struct spdk_nvme_qpair *qpair, uint8_t opc, uint32_t size,
+	     spdk_nvme_cmd_cb cb_fn)
+{
+	struct nvme_request *req;
+
+	req = nvme_allocate_request_null(qpair, cb_fn, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = opc;
+	req->cmd.nsid = 1;
+	req->payload_size = size;
+	CU_ASSERT(nvme_qpair_submit_request(qpair, req) == 0);
+}
+
+static int g_qos_failed_count = 0;
+
+static void
+qos_failed_callback(void *arg, const struct spdk_nvme_cpl *cpl)
+{
+	CU_ASSERT(spdk_nvme_cpl_is_error(cpl));
+	g_qos_failed_count++;
+}
+
+static void
+test_qos(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	struct spdk_nvme_ns		ns = {};
+	struct spdk_nvme_qos_limits	limits = {};
+	uint16_t			i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	nvme_mutex_init_recursive(&ctrlr.ctrlr_lock);
+	ns.ctrlr = &ctrlr;
+	ns.id = 1;
+	ctrlr.ns = &ns;
+	ctrlr.num_ns = 1;
+	TAILQ_INSERT_TAIL(&ctrlr.active_io_qpairs, &qpair, tailq);
+	g_ut_tsc = 1000000;
+
+	/* 1000 reads/s allows a burst of 10 reads. */
+	limits.read_iops = 1000;
+	CU_ASSERT(spdk_nvme_qpair_set_qos_limits(&qpair, &limits) == 0);
+	CU_ASSERT(qpair.qos_enabled);
+	for (i = 0; i < 15; i++) {
+		ut_submit_rw(&qpair, SPDK_NVME_OPC_READ, 4096, NULL);
+	}
+	CU_ASSERT(qpair.sq_tail == 10);
+
+	/* Writes are not limited and are not held up by the deferred reads. */
+	ut_submit_rw(&qpair, SPDK_NVME_OPC_WRITE, 4096, NULL);
+	CU_ASSERT(qpair.sq_tail == 11);
+
+	/* 2 ms later, 2 more reads may go. */
+	g_ut_tsc += 2000;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.sq_tail == 13);
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.sq_tail == 13);
+
+	/* A long idle period refills the bucket, but only up to the burst size. */
+	g_ut_tsc += 1000000;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.sq_tail == 16);
+	CU_ASSERT(STAILQ_EMPTY(&qpair.qos_deferred_req));
+	CU_ASSERT(qpair.qos->bucket[NVME_QOS_READ_IOPS].tokens == 7);
+
+	/* Namespace limits: 409600 bytes/s is a 4 KB burst; larger writes go into debt. */
+	memset(&limits, 0, sizeof(limits));
+	limits.write_bytes_per_sec = 409600;
+	CU_ASSERT(spdk_nvme_ns_set_qos_limits(&ns, &limits) == 0);
+	SPDK_CU_ASSERT_FATAL(ns.qos != NULL);
+	CU_ASSERT(ctrlr.ns_qos_enabled);
+	ut_submit_rw(&qpair, SPDK_NVME_OPC_WRITE, 8192, NULL);
+	ut_submit_rw(&qpair, SPDK_NVME_OPC_WRITE, 8192, NULL);
+	CU_ASSERT(qpair.sq_tail == 17);
+	g_ut_tsc += 10000;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.sq_tail == 17);
+	g_ut_tsc += 10000;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.sq_tail == 18);
+	CU_ASSERT(ns.qos->bucket[NVME_QOS_WRITE_BPS].tokens == 4096 - 8192);
+
+	/* Reads are charged to both the qpair and the namespace. */
+	CU_ASSERT(ns.qos->bucket[NVME_QOS_READ_IOPS].rate == 0);
+	ut_submit_rw(&qpair, SPDK_NVME_OPC_READ, 4096, NULL);
+	CU_ASSERT(qpair.sq_tail == 19);
+	CU_ASSERT(qpair.qos->bucket[NVME_QOS_READ_IOPS].tokens == 9);
+
+	/* Removing the qpair limits releases its deferred reads right away. */
+	memset(&limits, 0, sizeof(limits));
+	limits.read_iops = 100;
+	CU_ASSERT(spdk_nvme_qpair_set_qos_limits(&qpair, &limits) == 0);
+	CU_ASSERT(qpair.qos->bucket[NVME_QOS_READ_IOPS].tokens == 1);
+	for (i = 0; i < 3; i++) {
+		ut_submit_rw(&qpair, SPDK_NVME_OPC_READ, 4096, NULL);
+	}
+	CU_ASSERT(qpair.sq_tail == 20);
+	CU_ASSERT(spdk_nvme_qpair_set_qos_limits(&qpair, NULL) == 0);
+	CU_ASSERT(qpair.qos == NULL);
+	CU_ASSERT(qpair.sq_tail == 22);
+	/* The namespace still has limits, so the qpair keeps checking them. */
+	CU_ASSERT(qpair.qos_enabled);
+
+	/* Deferred requests are failed with the qpair. */
+	CU_ASSERT(spdk_nvme_qpair_set_qos_limits(&qpair, &limits) == 0);
+	ut_submit_rw(&qpair, SPDK_NVME_OPC_READ, 4096, NULL);
+	ut_submit_rw(&qpair, SPDK_NVME_OPC_READ, 4096, qos_failed_callback);
+	CU_ASSERT(qpair.sq_tail == 23);
+	g_qos_failed_count = 0;
+	nvme_qpair_fail(&qpair);
+	CU_ASSERT(g_qos_failed_count == 1);
+	CU_ASSERT(STAILQ_EMPTY(&qpair.qos_deferred_req));
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
+
+	/* Requests deferred after the controller failed are failed when released, not dropped. */
+	ctrlr.is_failed = true;
+	ut_submit_rw(&qpair, SPDK_NVME_OPC_READ, 4096, qos_failed_callback);
+	CU_ASSERT(!STAILQ_EMPTY(&qpair.qos_deferred_req));
+	g_qos_failed_count = 0;
+	g_ut_tsc += 1000000;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(g_qos_failed_count == 1);
+	CU_ASSERT(STAILQ_EMPTY(&qpair.qos_deferred_req));
+	ctrlr.is_failed = false;
+
+	CU_ASSERT(spdk_nvme_ns_set_qos_limits(&ns, NULL) == 0);
+	CU_ASSERT(ns.qos != NULL);
+	CU_ASSERT(ns.qos->bucket[NVME_QOS_WRITE_BPS].rate == 0);
+
+	TAILQ_REMOVE(&ctrlr.active_io_qpairs, &qpair, tailq);
+	nvme_qos_destroy(ns.qos);
+	cleanup_submit_request_test(&qpair);
+	nvme_mutex_destroy(&ctrlr.ctrlr_lock);
+	g_ut_tsc = 0;
+}
+
+static void
+test_qos_high_rate(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	struct spdk_nvme_qos_limits	limits = {};
+	struct nvme_token_bucket	*bucket;
+	const uint64_t			rate = 1ULL << 56;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	g_ut_tsc = 1000000;
+
+	/* Both max_tokens * tsc_hz and ticks * rate overflow 64 bits at this rate. */
+	limits.read_bytes_per_sec = rate;
+	CU_ASSERT(spdk_nvme_qpair_set_qos_limits(&qpair, &limits) == 0);
+	bucket = &qpair.qos->bucket[NVME_QOS_READ_BPS];
+	CU_ASSERT(bucket->tokens == (int64_t)(rate / NVME_QOS_BURST_DIVISOR));
+
+	/* 1 ms refills a thousandth of the rate and keeps the leftover fraction of a tick. */
+	bucket->tokens = 0;
+	g_ut_tsc += 1000;
+	ut_submit_rw(&qpair, SPDK_NVME_OPC_READ, 4096, NULL);
+	CU_ASSERT(qpair.sq_tail == 1);
+	CU_ASSERT(bucket->tokens == (int64_t)(rate / 1000 - 4096));
+	CU_ASSERT(bucket->last_tick == 1000000 + 999);
+
+	/* A long idle period fills the bucket up to its burst size. */
+	g_ut_tsc += 1000000;
+	ut_submit_rw(&qpair, SPDK_NVME_OPC_READ, 4096, NULL);
+	CU_ASSERT(qpair.sq_tail == 2);
+	CU_ASSERT(bucket->tokens == (int64_t)(rate / NVME_QOS_BURST_DIVISOR - 4096));
+
+	CU_ASSERT(spdk_nvme_qpair_set_qos_limits(&qpair, NULL) == 0);
+	cleanup_submit_request_test(&qpair);
+	g_ut_tsc = 0;
+}
+
+static int g_merged_cb_count = 0;
+
+static void
+merged_callback(void *arg, const struct spdk_nvme_cpl *cpl)
+{
+	g_merged_cb_count++;
+}
+
+static void
+test_dsm_coalesce(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	struct spdk_nvme_ns		ns1 = {}, ns2 = {};
+	struct spdk_nvme_dsm_range	ranges[2] = {};
+	struct spdk_nvme_dsm_range	*sent;
+	struct nvme_dsm_batch		*batch;
+	uint16_t			i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	ns1.id = 1;
+	ns2.id = 2;
+	g_ut_tsc = 1000000;
+	g_merged_cb_count = 0;
+
+	CU_ASSERT(spdk_nvme_qpair_set_dsm_coalescing(&qpair, 257, 100) == -EINVAL);
+	CU_ASSERT(spdk_nvme_qpair_set_dsm_coalescing(&qpair, 4, 100) == 0);
+	CU_ASSERT(qpair.dsm_coalescing);
+
+	/* Adjacent ranges are merged in either direction; the rest are appended. */
+	ranges[0].starting_lba = 100;
+	ranges[0].length = 8;
+	CU_ASSERT(nvme_qpair_dsm_deallocate(&qpair, &ns1, ranges, 1, merged_callback, NULL) == 0);
+	ranges[0].starting_lba = 108;
+	ranges[1].starting_lba = 92;
+	ranges[1].length = 8;
+	CU_ASSERT(nvme_qpair_dsm_deallocate(&qpair, &ns1, ranges, 2, merged_callback, NULL) == 0);
+	ranges[0].starting_lba = 500;
+	CU_ASSERT(nvme_qpair_dsm_deallocate(&qpair, &ns1, ranges, 1, merged_callback, NULL) == 0);
+	CU_ASSERT(qpair.sq_tail == 0);
+	batch = (struct nvme_dsm_batch *)qpair.dsm->batcher.open;
+	SPDK_CU_ASSERT_FATAL(batch != NULL);
+	CU_ASSERT(batch->num_ranges == 2);
+	CU_ASSERT(batch->ranges[0].starting_lba == 92);
+	CU_ASSERT(batch->ranges[0].length == 24);
+
+	/* Nothing is sent before the window has passed. */
+	g_ut_tsc += 99;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.sq_tail == 0);
+	g_ut_tsc += 1;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.sq_tail == 1);
+	CU_ASSERT(qpair.cmd[0].opc == SPDK_NVME_OPC_DATASET_MANAGEMENT);
+	CU_ASSERT(qpair.cmd[0].nsid == 1);
+	CU_ASSERT(qpair.cmd[0].cdw10 == 1);
+	CU_ASSERT(qpair.cmd[0].cdw11 == SPDK_NVME_DSM_ATTR_DEALLOCATE);
+	sent = (struct spdk_nvme_dsm_range *)qpair.cmd[0].dptr.prp.prp1;
+	CU_ASSERT(sent[1].starting_lba == 500);
+
+	/* All callbacks of a batch are called with its completion. */
+	CU_ASSERT(qpair.dsm->batcher.num_in_flight == 1);
+	ut_complete_sq_entry(&qpair, 0);
+	CU_ASSERT(g_merged_cb_count == 3);
+	CU_ASSERT(qpair.dsm->batcher.num_in_flight == 0);
+
+	/* A batch is sent once it holds max_ranges ranges. */
+	for (i = 0; i < 4; i++) {
+		ranges[0].starting_lba = i * 100;
+		CU_ASSERT(nvme_qpair_dsm_deallocate(&qpair, &ns1, ranges, 1, merged_callback, NULL) == 0);
+	}
+	CU_ASSERT(qpair.sq_tail == 2);
+	CU_ASSERT(qpair.dsm->batcher.open == NULL);
+
+	/* A deallocate for another namespace sends the open batch first. */
+	CU_ASSERT(nvme_qpair_dsm_deallocate(&qpair, &ns1, ranges, 1, merged_callback, NULL) == 0);
+	CU_ASSERT(nvme_qpair_dsm_deallocate(&qpair, &ns2, ranges, 1, merged_callback, NULL) == 0);
+	CU_ASSERT(qpair.sq_tail == 3);
+	CU_ASSERT(qpair.cmd[2].nsid == 1);
+	spdk_nvme_qpair_flush_submissions(&qpair);
+	CU_ASSERT(qpair.sq_tail == 4);
+	CU_ASSERT(qpair.cmd[3].nsid == 2);
+
+	/* With every batch in flight, deallocates must be sent on their own. */
+	CU_ASSERT(qpair.dsm->batcher.num_in_flight == NVME_DSM_COALESCE_BATCHES - 1);
+	CU_ASSERT(nvme_qpair_dsm_deallocate(&qpair, &ns1, ranges, 1, merged_callback, NULL) == 0);
+	spdk_nvme_qpair_flush_submissions(&qpair);
+	CU_ASSERT(nvme_qpair_dsm_deallocate(&qpair, &ns1, ranges, 1, merged_callback, NULL) == 1);
+
+	/* Pending and outstanding deallocates are failed with the qpair. */
+	ut_complete_sq_entry(&qpair, 1);
+	g_merged_cb_count = 0;
+	CU_ASSERT(nvme_qpair_dsm_deallocate(&qpair, &ns1, ranges, 1, qos_failed_callback, NULL) == 0);
+	g_qos_failed_count = 0;
+	nvme_qpair_fail(&qpair);
+	CU_ASSERT(g_qos_failed_count == 1);
+	CU_ASSERT(g_merged_cb_count == 3);
+	CU_ASSERT(qpair.dsm->batcher.num_in_flight == 0);
+
+	/* Disabling frees the state once nothing is in flight. */
+	CU_ASSERT(spdk_nvme_qpair_set_dsm_coalescing(&qpair, 0, 0) == 0);
+	CU_ASSERT(qpair.dsm == NULL);
+	CU_ASSERT(!qpair.dsm_coalescing);
+
+	cleanup_submit_request_test(&qpair);
+	g_ut_tsc = 0;
+}
+
+static void
+test_write_merge(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	struct spdk_nvme_ns		ns = {};
+	struct nvme_write_merge_batch	*batch;
+	uint8_t				*buf;
+	uint64_t			phys_addr = 0;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	ns.ctrlr = &ctrlr;
+	ns.id = 1;
+	ns.sector_size = 512;
+	ns.sectors_per_max_io = 64;
+	buf = nvme_malloc("write_merge_buf", 16 * PAGE_SIZE, PAGE_SIZE, &phys_addr);
+	SPDK_CU_ASSERT_FATAL(buf != NULL);
+	g_ut_tsc = 1000000;
+	g_merged_cb_count = 0;
+
+	CU_ASSERT(spdk_nvme_qpair_set_write_merging(&qpair, SPDK_NVME_QPAIR_MAX_MERGED_WRITES + 1,
+			100) == -EINVAL);
+	CU_ASSERT(spdk_nvme_qpair_set_write_merging(&qpair, 4, 100) == 0);
+	CU_ASSERT(qpair.write_merging);
+
+	/* Writes whose buffers follow each other go out as one contiguous write. */
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf, 100, 1, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 512, 101, 2, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 1536, 103, 1, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 0);
+	batch = (struct nvme_write_merge_batch *)qpair.wm->batcher.open;
+	SPDK_CU_ASSERT_FATAL(batch != NULL);
+	CU_ASSERT(batch->iovcnt == 1);
+	g_ut_tsc += 99;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.sq_tail == 0);
+	g_ut_tsc += 1;
+	spdk_nvme_qpair_process_completions(&qpair, 0);
+	CU_ASSERT(qpair.sq_tail == 1);
+	CU_ASSERT(qpair.cmd[0].opc == SPDK_NVME_OPC_WRITE);
+	CU_ASSERT(qpair.cmd[0].cdw10 == 100);
+	CU_ASSERT(qpair.cmd[0].cdw12 == 3);
+	CU_ASSERT(qpair.cmd[0].dptr.prp.prp1 == (uint64_t)buf);
+	ut_complete_sq_entry(&qpair, 0);
+	CU_ASSERT(g_merged_cb_count == 3);
+
+	/* Page-aligned separate buffers are joined with a PRP list. */
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 4 * PAGE_SIZE, 200, 8,
+					 merged_callback, NULL, 0) == 0);
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 2 * PAGE_SIZE, 208, 8,
+					 merged_callback, NULL, 0) == 0);
+	batch = (struct nvme_write_merge_batch *)qpair.wm->batcher.open;
+	SPDK_CU_ASSERT_FATAL(batch != NULL);
+	CU_ASSERT(batch->iovcnt == 2);
+
+	/* An unaligned buffer cannot be joined without SGLs, so the open batch is sent. */
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 8 * PAGE_SIZE + 512, 216, 1,
+					 merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 2);
+	CU_ASSERT(qpair.cmd[1].cdw10 == 200);
+	CU_ASSERT(qpair.cmd[1].cdw12 == 15);
+	CU_ASSERT(qpair.cmd[1].dptr.prp.prp1 == (uint64_t)(buf + 4 * PAGE_SIZE));
+	CU_ASSERT(qpair.cmd[1].dptr.prp.prp2 == (uint64_t)(buf + 2 * PAGE_SIZE));
+
+	/* With SGLs, it is merged. */
+	ctrlr.flags |= SPDK_NVME_CTRLR_SGL_SUPPORTED;
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 12 * PAGE_SIZE, 217, 1,
+					 merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 2);
+	batch = (struct nvme_write_merge_batch *)qpair.wm->batcher.open;
+	SPDK_CU_ASSERT_FATAL(batch != NULL);
+	CU_ASSERT(batch->iovcnt == 2);
+	ctrlr.flags = 0;
+
+	/* Different io_flags or a gap in the LBAs start a new batch. */
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf, 218, 1, merged_callback, NULL,
+					 SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) == 0);
+	CU_ASSERT(qpair.sq_tail == 3);
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 512, 220, 1, merged_callback, NULL,
+					 SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) == 0);
+	CU_ASSERT(qpair.sq_tail == 4);
+	CU_ASSERT(qpair.cmd[3].cdw12 == SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS);
+
+	/* Writes that would be split are never merged. */
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf, 221, 65, merged_callback, NULL, 0) == 1);
+
+	/* A batch is sent once it is full or reaches a stripe boundary. */
+	spdk_nvme_qpair_flush_submissions(&qpair);
+	CU_ASSERT(qpair.sq_tail == 5);
+	ut_complete_sq_entry(&qpair, 1);
+	ut_complete_sq_entry(&qpair, 2);
+	ut_complete_sq_entry(&qpair, 3);
+	ut_complete_sq_entry(&qpair, 4);
+	CU_ASSERT(qpair.wm->batcher.num_in_flight == 0);
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf, 0, 48, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 48 * 512, 48, 16, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 6);
+	CU_ASSERT(qpair.cmd[5].cdw12 == 63);
+	ns.sectors_per_stripe = 16;
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf, 100, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf, 108, 8, merged_callback, NULL, 0) == 1);
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 4096, 108, 2, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 6);
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf + 5120, 110, 2, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 7);
+	CU_ASSERT(qpair.cmd[6].cdw12 == 11);
+
+	/* Pending and outstanding writes are failed with the qpair. */
+	CU_ASSERT(nvme_qpair_write_merge(&qpair, &ns, buf, 0, 1, qos_failed_callback, NULL, 0) == 0);
+	g_qos_failed_count = 0;
+	g_merged_cb_count = 0;
+	nvme_qpair_fail(&qpair);
+	CU_ASSERT(g_qos_failed_count == 1);
+	CU_ASSERT(g_merged_cb_count == 5);
+	CU_ASSERT(qpair.wm->batcher.num_in_flight == 0);
+
+	CU_ASSERT(spdk_nvme_qpair_set_write_merging(&qpair, 0, 0) == 0);
+	CU_ASSERT(qpair.wm == NULL);
+	CU_ASSERT(!qpair.write_merging);
+
+	nvme_free(buf);
 	cleanup_submit_request_test(&qpair);
-	nvme_free_request(req);
+	g_ut_tsc = 0;
 }
 
+static void
+ut_submit_write_lba(struct spdk_nvme_qpair *qpair, uint64_t lba, uint32_t lba_count)
+{
+	struct nvme_request *req;
+
+	req = nvme_allocate_request_null(qpair, NULL, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_WRITE;
+	req->cmd.nsid = 1;
+	*(uint64_t *)&req->cmd.cdw10 = lba;
+	req->cmd.cdw12 = lba_count - 1;
+	CU_ASSERT(nvme_qpair_submit_request(qpair, req) == 0);
+}
+
+static void
+test_read_cache(void)
+{
+	struct spdk_nvme_qpair			qpair = {}, qpair2 = {};
+	struct spdk_nvme_ctrlr			ctrlr = {};
+	struct spdk_nvme_registers		regs = {};
+	struct spdk_nvme_ns			ns = {};
+	struct spdk_nvme_read_cache_stats	stats;
+	struct spdk_nvme_dsm_range		range = {};
+	struct nvme_request			*req;
+	uint8_t					buf[4096];
+	uint8_t					*block;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	ns.ctrlr = &ctrlr;
+	ns.id = 1;
+	ns.sector_size = 512;
+	ns.sectors_per_max_io = 256;
+	ctrlr.ns = &ns;
+	ctrlr.num_ns = 1;
+	g_merged_cb_count = 0;
+
+	CU_ASSERT(spdk_nvme_qpair_get_read_cache_stats(&qpair, &stats) == -EINVAL);
+	CU_ASSERT(spdk_nvme_qpair_set_read_cache(&qpair, 2) == 0);
+	CU_ASSERT(qpair.read_caching);
+
+	/* A miss is read into a cache block and copied out when it completes. */
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 1);
+	CU_ASSERT(qpair.cmd[0].opc == SPDK_NVME_OPC_READ);
+	CU_ASSERT(qpair.cmd[0].cdw10 == 8);
+	CU_ASSERT(qpair.cmd[0].cdw12 == 7);
+	block = (uint8_t *)qpair.cmd[0].dptr.prp.prp1;
+	memset(block, 0x5A, 4096);
+	memset(buf, 0, sizeof(buf));
+	ut_complete_sq_entry(&qpair, 0);
+	CU_ASSERT(g_merged_cb_count == 1);
+	CU_ASSERT(buf[0] == 0x5A && buf[4095] == 0x5A);
+
+	/* A hit copies the data right away and completes from process_completions. */
+	memset(buf, 0, sizeof(buf));
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 1);
+	CU_ASSERT(buf[0] == 0x5A && buf[4095] == 0x5A);
+	CU_ASSERT(g_merged_cb_count == 1);
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(g_merged_cb_count == 2);
+
+	/* Unaligned, partial, or flagged reads bypass the cache. */
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 9, 8, merged_callback, NULL, 0) == 1);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 1, merged_callback, NULL, 0) == 1);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL,
+					     SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) == 1);
+
+	/* A write that overlaps the block drops it when it is submitted. */
+	ut_submit_write_lba(&qpair, 12, 1);
+	CU_ASSERT(qpair.sq_tail == 2);
+	ut_complete_sq_entry(&qpair, 1);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 3);
+
+	/* A block written while it is being filled is not kept. */
+	ut_submit_write_lba(&qpair, 8, 8);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 1);
+	ut_complete_sq_entry(&qpair, 2);
+	ut_complete_sq_entry(&qpair, 3);
+	CU_ASSERT(g_merged_cb_count == 3);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 5);
+	ut_complete_sq_entry(&qpair, 4);
+
+	/* CLOCK gives the referenced block a second chance. */
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 16, 8, merged_callback, NULL, 0) == 0);
+	ut_complete_sq_entry(&qpair, 5);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 24, 8, merged_callback, NULL, 0) == 0);
+	ut_complete_sq_entry(&qpair, 6);
+	CU_ASSERT(qpair.sq_tail == 7);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 7);
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 16, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 8);
+
+	/* A reconfiguration must wait for outstanding fills. */
+	CU_ASSERT(spdk_nvme_qpair_set_read_cache(&qpair, 4) == -EBUSY);
+	ut_complete_sq_entry(&qpair, 7);
+
+	/* Deallocated blocks are dropped. */
+	range.starting_lba = 0;
+	range.length = 1000;
+	req = nvme_allocate_request_contig(&qpair, &range, sizeof(range), NULL, NULL);
+	SPDK_CU_ASSERT_FATAL(req != NULL);
+	req->cmd.opc = SPDK_NVME_OPC_DATASET_MANAGEMENT;
+	req->cmd.nsid = 1;
+	req->cmd.cdw11 = SPDK_NVME_DSM_ATTR_DEALLOCATE;
+	CU_ASSERT(nvme_qpair_submit_request(&qpair, req) == 0);
+	ut_complete_sq_entry(&qpair, 8);
+
+	CU_ASSERT(spdk_nvme_qpair_get_read_cache_stats(&qpair, &stats) == 0);
+	CU_ASSERT(stats.hits == 3);
+	CU_ASSERT(stats.misses == 6);
+	CU_ASSERT(stats.bypasses == 4);
+	CU_ASSERT(stats.evictions == 2);
+	CU_ASSERT(stats.invalidations == 4);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 10);
+	ut_complete_sq_entry(&qpair, 9);
+
+	/* A write through another qpair is caught when the block is next looked up. */
+	CU_ASSERT(ctrlr.num_caching_qpairs == 1);
+	nvme_qpair_construct(&qpair2, 2, 128, 32, &ctrlr, NVME_SOCKET_ID_ANY);
+	qpair2.is_enabled = true;
+	ut_submit_write_lba(&qpair2, 10, 1);
+	ut_complete_sq_entry(&qpair2, 0);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 11);
+	ut_complete_sq_entry(&qpair, 10);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 11);
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 1);
+
+	/* So is one that completes while the block is being read. */
+	ut_submit_write_lba(&qpair2, 8, 8);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 12);
+	ut_complete_sq_entry(&qpair2, 1);
+	ut_complete_sq_entry(&qpair, 11);
+	CU_ASSERT(nvme_qpair_read_cache_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 13);
+	ut_complete_sq_entry(&qpair, 12);
+	CU_ASSERT(spdk_nvme_qpair_get_read_cache_stats(&qpair, &stats) == 0);
+	CU_ASSERT(stats.invalidations == 7);
+
+	CU_ASSERT(spdk_nvme_qpair_set_read_cache(&qpair, 0) == 0);
+	CU_ASSERT(qpair.read_cache == NULL);
+	CU_ASSERT(!qpair.read_caching);
+	CU_ASSERT(ctrlr.num_caching_qpairs == 0);
+
+	nvme_qpair_destroy(&qpair2);
+	cleanup_submit_request_test(&qpair);
+}
+
+static void
+test_readahead(void)
+{
+	struct spdk_nvme_qpair			qpair = {}, qpair2 = {};
+	struct spdk_nvme_ctrlr			ctrlr = {};
+	struct spdk_nvme_registers		regs = {};
+	struct spdk_nvme_ns			ns = {};
+	struct spdk_nvme_readahead_stats	stats;
+	uint8_t					*buf, *data;
+	uint32_t				i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	ns.ctrlr = &ctrlr;
+	ns.id = 1;
+	ns.sector_size = 512;
+	ns.sectors_per_max_io = 256;
+	ctrlr.ns = &ns;
+	ctrlr.num_ns = 1;
+	g_merged_cb_count = 0;
+	buf = calloc(1, 3 * 4096);
+	SPDK_CU_ASSERT_FATAL(buf != NULL);
+
+	CU_ASSERT(spdk_nvme_qpair_get_readahead_stats(&qpair, &stats) == -EINVAL);
+	CU_ASSERT(spdk_nvme_qpair_set_readahead(&qpair, NVME_READAHEAD_MAX_STREAMS + 1, 0) == -EINVAL);
+	CU_ASSERT(spdk_nvme_qpair_set_readahead(&qpair, 1, SPDK_NVME_READAHEAD_BUFFER_SIZE) == 0);
+	CU_ASSERT(qpair.reading_ahead);
+	CU_ASSERT(qpair.readahead->num_buffers == 2);
+
+	/* The first read of a stream is not read ahead. */
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 0, 8, merged_callback, NULL, 0) == 1);
+	CU_ASSERT(qpair.sq_tail == 0);
+
+	/* The second read starts a window of four reads, and waits for its fill. */
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 8, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 1);
+	CU_ASSERT(qpair.cmd[0].opc == SPDK_NVME_OPC_READ);
+	CU_ASSERT(qpair.cmd[0].cdw10 == 8);
+	CU_ASSERT(qpair.cmd[0].cdw12 == 39);
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf + 4096, 16, 8, merged_callback, NULL,
+					    0) == 0);
+	CU_ASSERT(qpair.sq_tail == 1);
+
+	data = qpair.readahead->buffers[0].data;
+	for (i = 0; i < 40; i++) {
+		memset(data + i * 512, i, 512);
+	}
+	ut_complete_sq_entry(&qpair, 0);
+	CU_ASSERT(g_merged_cb_count == 2);
+	CU_ASSERT(buf[0] == 0 && buf[4095] == 7);
+	CU_ASSERT(buf[4096] == 8 && buf[8191] == 15);
+
+	/* Filled data is copied right away and completes from process_completions. */
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 24, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(buf[0] == 16 && buf[4095] == 23);
+	CU_ASSERT(g_merged_cb_count == 2);
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 1);
+	CU_ASSERT(g_merged_cb_count == 3);
+
+	/* Consuming half of the window doubles it. */
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 32, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 2);
+	CU_ASSERT(qpair.cmd[1].cdw10 == 48);
+	CU_ASSERT(qpair.cmd[1].cdw12 == 55);
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 40, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(buf[0] == 32 && buf[4095] == 39);
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 2);
+	CU_ASSERT(g_merged_cb_count == 5);
+
+	/* Flagged reads and reads larger than a buffer bypass readahead. */
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 48, 8, merged_callback, NULL,
+					    SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS) == 1);
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 48, 257, merged_callback, NULL, 0) == 1);
+
+	/* A random read takes the stream over and collapses its window. */
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 1000, 8, merged_callback, NULL, 0) == 1);
+	CU_ASSERT(qpair.readahead->streams[0].window == 0);
+
+	/* A write to a filling buffer lets its waiters finish, then drops it. */
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 48, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(spdk_nvme_qpair_set_readahead(&qpair, 1, 0) == -EBUSY);
+	ut_submit_write_lba(&qpair, 60, 1);
+	CU_ASSERT(qpair.sq_tail == 3);
+	ut_complete_sq_entry(&qpair, 1);
+	CU_ASSERT(g_merged_cb_count == 6);
+	ut_complete_sq_entry(&qpair, 2);
+	CU_ASSERT(qpair.readahead->buffers[1].ns == NULL);
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 48, 8, merged_callback, NULL, 0) == 1);
+
+	/* A write to a filled buffer drops it. */
+	ut_submit_write_lba(&qpair, 10, 1);
+	ut_complete_sq_entry(&qpair, 3);
+	CU_ASSERT(qpair.readahead->buffers[0].ns == NULL);
+
+	CU_ASSERT(spdk_nvme_qpair_get_readahead_stats(&qpair, &stats) == 0);
+	CU_ASSERT(stats.hits == 3);
+	CU_ASSERT(stats.waits == 3);
+	CU_ASSERT(stats.misses == 3);
+	CU_ASSERT(stats.readaheads == 2);
+	CU_ASSERT(stats.collapses == 1);
+	CU_ASSERT(stats.invalidations == 2);
+
+	/* A write through another qpair is caught when the buffer is next looked up. */
+	CU_ASSERT(ctrlr.num_caching_qpairs == 1);
+	nvme_qpair_construct(&qpair2, 2, 128, 32, &ctrlr, NVME_SOCKET_ID_ANY);
+	qpair2.is_enabled = true;
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 2000, 8, merged_callback, NULL, 0) == 1);
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 2008, 8, merged_callback, NULL, 0) == 0);
+	CU_ASSERT(qpair.sq_tail == 5);
+	ut_submit_write_lba(&qpair2, 2020, 1);
+	ut_complete_sq_entry(&qpair2, 0);
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 2016, 8, merged_callback, NULL, 0) == 1);
+	ut_complete_sq_entry(&qpair, 4);
+	CU_ASSERT(g_merged_cb_count == 7);
+	CU_ASSERT(qpair.readahead->buffers[0].ns == NULL);
+
+	/* So is one submitted while the buffer is being filled. */
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 2024, 8, merged_callback, NULL, 0) == 1);
+	CU_ASSERT(nvme_qpair_readahead_read(&qpair, &ns, buf, 2032, 8, merged_callback, NULL, 0) == 1);
+	CU_ASSERT(qpair.sq_tail == 6);
+	ut_submit_write_lba(&qpair2, 2050, 1);
+	ut_complete_sq_entry(&qpair, 5);
+	ut_complete_sq_entry(&qpair2, 1);
+	CU_ASSERT(qpair.readahead->buffers[0].ns == NULL);
+	CU_ASSERT(qpair.readahead->buffers[1].ns == NULL);
+	CU_ASSERT(spdk_nvme_qpair_get_readahead_stats(&qpair, &stats) == 0);
+	CU_ASSERT(stats.invalidations == 4);
+
+	CU_ASSERT(spdk_nvme_qpair_set_readahead(&qpair, 0, 0) == 0);
+	CU_ASSERT(qpair.readahead == NULL);
+	CU_ASSERT(!qpair.reading_ahead);
+	CU_ASSERT(ctrlr.num_caching_qpairs == 0);
+
+	nvme_qpair_destroy(&qpair2);
+	free(buf);
+	cleanup_submit_request_test(&qpair);
+}
 
 static void
 test_ctrlr_failed(void)
@@ -525,7 +2044,7 @@ test_ctrlr_failed(void)
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
 
-	req = nvme_allocate_request_contig(payload, sizeof(payload), expected_failure_callback, NULL);
+	req = nvme_allocate_request_contig(&qpair, payload, sizeof(payload), expected_failure_callback, NULL);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 
 	/* Disable the queue and set the controller to failed.
@@ -565,18 +2084,17 @@ static void test_nvme_qpair_fail(void)
 
 	prepare_submit_request_test(&qpair, &ctrlr, &regs);
 
-	tr_temp = LIST_FIRST(&qpair.free_tr);
+	tr_temp = nvme_qpair_get_tracker(&qpair);
 	SPDK_CU_ASSERT_FATAL(tr_temp != NULL);
-	LIST_REMOVE(tr_temp, list);
-	tr_temp->req = nvme_allocate_request_null(expected_failure_callback, NULL);
+	tr_temp->req = nvme_allocate_request_null(&qpair, expected_failure_callback, NULL);
 	SPDK_CU_ASSERT_FATAL(tr_temp->req != NULL);
 	tr_temp->req->cmd.cid = tr_temp->cid;
+	tr_temp->active = true;
 
-	LIST_INSERT_HEAD(&qpair.outstanding_tr, tr_temp, list);
 	nvme_qpair_fail(&qpair);
-	CU_ASSERT_TRUE(LIST_EMPTY(&qpair.outstanding_tr));
+	CU_ASSERT(qpair.num_free_tr == qpair.num_trackers);
 
-	req = nvme_allocate_request_null(expected_failure_callback, NULL);
+	req = nvme_allocate_request_null(&qpair, expected_failure_callback, NULL);
 	SPDK_CU_ASSERT_FATAL(req != NULL);
 
 	STAILQ_INSERT_HEAD(&qpair.queued_req, req, stailq);
@@ -632,6 +2150,49 @@ test_nvme_qpair_process_completions_limit(void)
 	cleanup_submit_request_test(&qpair);
 }
 
+static void
+test_nvme_qpair_process_completions_batch(void)
+{
+	struct spdk_nvme_qpair		qpair = {};
+	struct spdk_nvme_ctrlr		ctrlr = {};
+	struct spdk_nvme_registers	regs = {};
+	uint32_t			i;
+
+	prepare_submit_request_test(&qpair, &ctrlr, &regs);
+	qpair.is_enabled = true;
+
+	/*
+	 * Start near the end of the completion queue so that the entries wrap,
+	 *  and post more completions than fit in a single scan batch.
+	 */
+	qpair.cq_head = 120;
+	for (i = 0; i < 120; i++) {
+		/* Entries left over from the previous pass through the queue. */
+		qpair.cpl[i].status.p = 1;
+	}
+	for (i = 0; i < 8; i++) {
+		ut_insert_cq_entry(&qpair, 120 + i);
+	}
+	qpair.phase = 0;
+	for (i = 0; i < 24; i++) {
+		ut_insert_cq_entry(&qpair, i);
+	}
+	qpair.phase = 1;
+	CU_ASSERT(qpair.num_free_tr == 0);
+
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 32);
+	CU_ASSERT(qpair.cq_head == 24);
+	CU_ASSERT(qpair.phase == 0);
+	CU_ASSERT(*qpair.cq_hdbl == 24);
+	CU_ASSERT(qpair.num_free_tr == 32);
+
+	/* The queue is drained; nothing further should be reaped. */
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&qpair, 0) == 0);
+	CU_ASSERT(qpair.cq_head == 24);
+
+	cleanup_submit_request_test(&qpair);
+}
+
 static void test_nvme_qpair_destroy(void)
 {
 	struct spdk_nvme_qpair		qpair = {};
@@ -644,23 +2205,22 @@ static void test_nvme_qpair_destroy(void)
 	TAILQ_INIT(&ctrlr.free_io_qpairs);
 	TAILQ_INIT(&ctrlr.active_io_qpairs);
 
-	nvme_qpair_construct(&qpair, 1, 128, 32, &ctrlr);
+	nvme_qpair_construct(&qpair, 1, 128, 32, &ctrlr, NVME_SOCKET_ID_ANY);
 	nvme_qpair_destroy(&qpair);
 
 
-	nvme_qpair_construct(&qpair, 0, 128, 32, &ctrlr);
-	tr_temp = LIST_FIRST(&qpair.free_tr);
+	nvme_qpair_construct(&qpair, 0, 128, 32, &ctrlr, NVME_SOCKET_ID_ANY);
+	tr_temp = nvme_qpair_get_tracker(&qpair);
 	SPDK_CU_ASSERT_FATAL(tr_temp != NULL);
-	LIST_REMOVE(tr_temp, list);
-	tr_temp->req = nvme_allocate_request_null(expected_failure_callback, NULL);
+	tr_temp->req = nvme_allocate_request_null(&qpair, expected_failure_callback, NULL);
 	SPDK_CU_ASSERT_FATAL(tr_temp->req != NULL);
 
 	tr_temp->req->cmd.opc = SPDK_NVME_OPC_ASYNC_EVENT_REQUEST;
 	tr_temp->req->cmd.cid = tr_temp->cid;
-	LIST_INSERT_HEAD(&qpair.outstanding_tr, tr_temp, list);
+	tr_temp->active = true;
 
 	nvme_qpair_destroy(&qpair);
-	CU_ASSERT(LIST_EMPTY(&qpair.outstanding_tr));
+	CU_ASSERT(qpair.num_free_tr == 32);
 }
 
 static void test_nvme_completion_is_retry(void)
@@ -766,6 +2326,11 @@ int main(int argc, char **argv)
 		|| CU_add_test(suite, "test2", test2) == NULL
 		|| CU_add_test(suite, "test3", test3) == NULL
 		|| CU_add_test(suite, "test4", test4) == NULL
+		|| CU_add_test(suite, "delay_doorbell", test_delay_doorbell) == NULL
+		|| CU_add_test(suite, "io_timeout", test_io_timeout) == NULL
+		|| CU_add_test(suite, "latency_histogram_buckets", test_latency_histogram_buckets) == NULL
+		|| CU_add_test(suite, "latency_histogram", test_latency_histogram) == NULL
+		|| CU_add_test(suite, "hybrid_polling", test_hybrid_polling) == NULL
 		|| CU_add_test(suite, "ctrlr_failed", test_ctrlr_failed) == NULL
 		|| CU_add_test(suite, "struct_packing", struct_packing) == NULL
 		|| CU_add_test(suite, "nvme_qpair_fail", test_nvme_qpair_fail) == NULL
@@ -773,11 +2338,24 @@ int main(int argc, char **argv)
 			       test_nvme_qpair_process_completions) == NULL
 		|| CU_add_test(suite, "spdk_nvme_qpair_process_completions_limit",
 			       test_nvme_qpair_process_completions_limit) == NULL
+		|| CU_add_test(suite, "spdk_nvme_qpair_process_completions_batch",
+			       test_nvme_qpair_process_completions_batch) == NULL
 		|| CU_add_test(suite, "nvme_qpair_destroy", test_nvme_qpair_destroy) == NULL
 		|| CU_add_test(suite, "nvme_completion_is_retry", test_nvme_completion_is_retry) == NULL
 		|| CU_add_test(suite, "get_status_string", test_get_status_string) == NULL
 		|| CU_add_test(suite, "sgl_request", test_sgl_req) == NULL
 		|| CU_add_test(suite, "hw_sgl_request", test_hw_sgl_req) == NULL
+		|| CU_add_test(suite, "hw_sgl_chained", test_hw_sgl_chained) == NULL
+		|| CU_add_test(suite, "iov_request", test_iov_req) == NULL
+		|| CU_add_test(suite, "contig_request_extents", test_contig_req_extents) == NULL
+		|| CU_add_test(suite, "prp_list_pool", test_prp_list_pool) == NULL
+		|| CU_add_test(suite, "qpair_full", test_qpair_full) == NULL
+		|| CU_add_test(suite, "qos", test_qos) == NULL
+		|| CU_add_test(suite, "qos_high_rate", test_qos_high_rate) == NULL
+		|| CU_add_test(suite, "dsm_coalesce", test_dsm_coalesce) == NULL
+		|| CU_add_test(suite, "write_merge", test_write_merge) == NULL
+		|| CU_add_test(suite, "read_cache", test_read_cache) == NULL
+		|| CU_add_test(suite, "readahead", test_readahead) == NULL
 	) {
 		CU_cleanup_registry();
 		return CU_get_error();
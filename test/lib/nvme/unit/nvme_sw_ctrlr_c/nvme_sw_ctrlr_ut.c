@@ -0,0 +1,467 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "spdk_cunit.h"
+
+#include "nvme/nvme_sw_ctrlr.c"
+
+struct nvme_driver g_nvme_driver = {
+	.lock = NVME_MUTEX_INITIALIZER,
+};
+
+char outbuf[OUTBUF_SIZE];
+
+#define UT_QUEUE_ENTRIES	8
+#define UT_NUM_BLOCKS		128
+#define UT_BLOCK_SIZE		512
+
+static struct spdk_nvme_sw_ctrlr	*g_dev;
+static struct spdk_nvme_cmd	g_sq[3][UT_QUEUE_ENTRIES];
+static struct spdk_nvme_cpl	g_cq[3][UT_QUEUE_ENTRIES];
+static uint16_t			g_sq_tail[3];
+static uint16_t			g_cq_head[3];
+static uint8_t			g_phase[3];
+static uint16_t			g_cq_size[3];
+
+static void
+ut_submit(uint16_t qid, struct spdk_nvme_cmd *cmd)
+{
+	cmd->cid = g_sq_tail[qid];
+	g_sq[qid][g_sq_tail[qid]] = *cmd;
+	g_sq_tail[qid] = (g_sq_tail[qid] + 1) % UT_QUEUE_ENTRIES;
+	g_dev->regs->doorbell[qid].sq_tdbl = g_sq_tail[qid];
+}
+
+static struct spdk_nvme_cpl *
+ut_get_cpl(uint16_t qid)
+{
+	struct spdk_nvme_cpl *cpl = &g_cq[qid][g_cq_head[qid]];
+
+	if (cpl->status.p != g_phase[qid]) {
+		return NULL;
+	}
+
+	if (++g_cq_head[qid] == g_cq_size[qid]) {
+		g_cq_head[qid] = 0;
+		g_phase[qid] = !g_phase[qid];
+	}
+	g_dev->regs->doorbell[qid].cq_hdbl = g_cq_head[qid];
+	return cpl;
+}
+
+static struct spdk_nvme_cpl *
+ut_execute(uint16_t qid, struct spdk_nvme_cmd *cmd)
+{
+	ut_submit(qid, cmd);
+	CU_ASSERT(nvme_sw_dev_poll(g_dev) == 1);
+	return ut_get_cpl(qid);
+}
+
+static void
+ut_dev_free(struct spdk_nvme_sw_ctrlr *dev)
+{
+	free(dev->ns_buf);
+	free((void *)dev->regs);
+	free(dev);
+}
+
+static void
+ut_dev_setup(void)
+{
+	union spdk_nvme_cc_register	cc;
+	union spdk_nvme_aqa_register	aqa;
+	int				i;
+
+	g_dev = nvme_sw_dev_create(UT_NUM_BLOCKS, UT_BLOCK_SIZE);
+	SPDK_CU_ASSERT_FATAL(g_dev != NULL);
+
+	memset(g_sq, 0, sizeof(g_sq));
+	memset(g_cq, 0, sizeof(g_cq));
+	for (i = 0; i < 3; i++) {
+		g_sq_tail[i] = 0;
+		g_cq_head[i] = 0;
+		g_phase[i] = 1;
+		g_cq_size[i] = UT_QUEUE_ENTRIES;
+	}
+
+	aqa.raw = 0;
+	aqa.bits.asqs = UT_QUEUE_ENTRIES - 1;
+	aqa.bits.acqs = UT_QUEUE_ENTRIES - 1;
+	g_dev->regs->aqa.raw = aqa.raw;
+	g_dev->regs->asq = (uintptr_t)g_sq[0];
+	g_dev->regs->acq = (uintptr_t)g_cq[0];
+
+	cc.raw = 0;
+	cc.bits.en = 1;
+	cc.bits.iosqes = 6;
+	cc.bits.iocqes = 4;
+	g_dev->regs->cc.raw = cc.raw;
+
+	CU_ASSERT(nvme_sw_dev_poll(g_dev) == 0);
+	CU_ASSERT(g_dev->regs->csts.bits.rdy == 1);
+}
+
+static void
+ut_create_io_queues(uint16_t qid, uint16_t cq_size)
+{
+	struct spdk_nvme_cmd	cmd = {};
+	struct spdk_nvme_cpl	*cpl;
+
+	g_cq_size[qid] = cq_size;
+
+	cmd.opc = SPDK_NVME_OPC_CREATE_IO_CQ;
+	cmd.cdw10 = ((cq_size - 1) << 16) | qid;
+	cmd.cdw11 = 0x1;
+	cmd.dptr.prp.prp1 = (uintptr_t)g_cq[qid];
+	cpl = ut_execute(0, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(cpl));
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_CREATE_IO_SQ;
+	cmd.cdw10 = ((UT_QUEUE_ENTRIES - 1) << 16) | qid;
+	cmd.cdw11 = (qid << 16) | 0x1;
+	cmd.dptr.prp.prp1 = (uintptr_t)g_sq[qid];
+	cpl = ut_execute(0, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(cpl));
+}
+
+static int
+ut_count_enum_cb(void *enum_ctx, struct spdk_nvme_sw_ctrlr *sw_dev)
+{
+	(*(int *)enum_ctx)++;
+	return 0;
+}
+
+static void
+test_sw_ctrlr_create(void)
+{
+	struct spdk_nvme_sw_ctrlr	*dev;
+	int			count;
+
+	CU_ASSERT(spdk_nvme_sw_ctrlr_create(0, UT_BLOCK_SIZE) == NULL);
+	CU_ASSERT(spdk_nvme_sw_ctrlr_create(UT_NUM_BLOCKS, 256) == NULL);
+	CU_ASSERT(spdk_nvme_sw_ctrlr_create(UT_NUM_BLOCKS, 1000) == NULL);
+
+	dev = spdk_nvme_sw_ctrlr_create(UT_NUM_BLOCKS, 4096);
+	SPDK_CU_ASSERT_FATAL(dev != NULL);
+	CU_ASSERT(TAILQ_FIRST(&g_nvme_sw_devs) == dev);
+	CU_ASSERT(dev->regs->cap.bits.mqes == NVME_SW_MAX_QUEUE_ENTRIES - 1);
+	CU_ASSERT(dev->regs->vs.bits.mjr == 1);
+
+	count = 0;
+	CU_ASSERT(nvme_sw_enumerate(ut_count_enum_cb, &count) == 0);
+	CU_ASSERT(count == 1);
+
+	/* Attached controllers are not reported again, and cannot be destroyed. */
+	CU_ASSERT(nvme_sw_dev_attach(dev) == dev->regs);
+	count = 0;
+	CU_ASSERT(nvme_sw_enumerate(ut_count_enum_cb, &count) == 0);
+	CU_ASSERT(count == 0);
+	CU_ASSERT(spdk_nvme_sw_ctrlr_destroy(dev) == -EBUSY);
+
+	nvme_sw_dev_detach(dev);
+	CU_ASSERT(!dev->attached);
+	count = 0;
+	CU_ASSERT(nvme_sw_enumerate(ut_count_enum_cb, &count) == 0);
+	CU_ASSERT(count == 1);
+
+	CU_ASSERT(spdk_nvme_sw_ctrlr_destroy(dev) == 0);
+	CU_ASSERT(TAILQ_EMPTY(&g_nvme_sw_devs));
+}
+
+static void
+test_sw_ctrlr_enable_disable(void)
+{
+	union spdk_nvme_cc_register	cc;
+
+	ut_dev_setup();
+
+	cc.raw = g_dev->regs->cc.raw;
+	cc.bits.shn = SPDK_NVME_SHN_NORMAL;
+	g_dev->regs->cc.raw = cc.raw;
+	nvme_sw_dev_poll(g_dev);
+	CU_ASSERT(g_dev->regs->csts.bits.shst == SPDK_NVME_SHST_COMPLETE);
+
+	cc.bits.shn = 0;
+	cc.bits.en = 0;
+	g_dev->regs->cc.raw = cc.raw;
+	nvme_sw_dev_poll(g_dev);
+	CU_ASSERT(g_dev->regs->csts.bits.rdy == 0);
+	CU_ASSERT(g_dev->regs->csts.bits.shst == SPDK_NVME_SHST_NORMAL);
+	CU_ASSERT(!g_dev->sq[0].valid);
+
+	/* An untranslatable admin queue address is a fatal controller error. */
+	g_dev->regs->asq = 0;
+	cc.bits.en = 1;
+	g_dev->regs->cc.raw = cc.raw;
+	nvme_sw_dev_poll(g_dev);
+	CU_ASSERT(g_dev->regs->csts.bits.rdy == 0);
+	CU_ASSERT(g_dev->regs->csts.bits.cfs == 1);
+
+	ut_dev_free(g_dev);
+}
+
+static void
+test_sw_ctrlr_admin_cmds(void)
+{
+	struct spdk_nvme_cmd		cmd = {};
+	struct spdk_nvme_cpl		*cpl;
+	struct spdk_nvme_ctrlr_data	*cdata;
+	struct spdk_nvme_ns_data	*nsdata;
+	void				*buf;
+
+	ut_dev_setup();
+	SPDK_CU_ASSERT_FATAL(posix_memalign(&buf, 4096, 4096) == 0);
+
+	cmd.opc = SPDK_NVME_OPC_IDENTIFY;
+	cmd.cdw10 = SPDK_NVME_IDENTIFY_CTRLR;
+	cmd.dptr.prp.prp1 = (uintptr_t)buf;
+	cpl = ut_execute(0, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(cpl));
+	CU_ASSERT(cpl->cid == 0);
+	CU_ASSERT(cpl->sqhd == 1);
+	cdata = buf;
+	CU_ASSERT(cdata->nn == 1);
+	CU_ASSERT(cdata->oncs.dsm == 1);
+	CU_ASSERT(cdata->oncs.write_zeroes == 1);
+	CU_ASSERT(cdata->vid != SPDK_PCI_VID_INTEL);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_IDENTIFY;
+	cmd.cdw10 = SPDK_NVME_IDENTIFY_NS;
+	cmd.nsid = 1;
+	cmd.dptr.prp.prp1 = (uintptr_t)buf;
+	cpl = ut_execute(0, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(cpl));
+	nsdata = buf;
+	CU_ASSERT(nsdata->nsze == UT_NUM_BLOCKS);
+	CU_ASSERT(nsdata->ncap == UT_NUM_BLOCKS);
+	CU_ASSERT(1u << nsdata->lbaf[0].lbads == UT_BLOCK_SIZE);
+
+	cmd.nsid = 2;
+	cpl = ut_execute(0, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(cpl->status.sc == SPDK_NVME_SC_INVALID_NAMESPACE_OR_FORMAT);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_SET_FEATURES;
+	cmd.cdw10 = SPDK_NVME_FEAT_NUMBER_OF_QUEUES;
+	cmd.cdw11 = (63 << 16) | 63;
+	cpl = ut_execute(0, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(cpl));
+	CU_ASSERT((cpl->cdw0 & 0xFFFF) + 1 == NVME_SW_MAX_IO_QUEUES);
+	CU_ASSERT((cpl->cdw0 >> 16) + 1 == NVME_SW_MAX_IO_QUEUES);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_FORMAT_NVM;
+	cpl = ut_execute(0, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(cpl->status.sct == SPDK_NVME_SCT_GENERIC);
+	CU_ASSERT(cpl->status.sc == SPDK_NVME_SC_INVALID_OPCODE);
+
+	/* Asynchronous event requests are held by the controller. */
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_ASYNC_EVENT_REQUEST;
+	ut_submit(0, &cmd);
+	CU_ASSERT(nvme_sw_dev_poll(g_dev) == 1);
+	CU_ASSERT(ut_get_cpl(0) == NULL);
+	CU_ASSERT(g_dev->num_aers == 1);
+
+	/* An I/O SQ may only be created on an existing CQ. */
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_CREATE_IO_SQ;
+	cmd.cdw10 = ((UT_QUEUE_ENTRIES - 1) << 16) | 1;
+	cmd.cdw11 = (1 << 16) | 0x1;
+	cmd.dptr.prp.prp1 = (uintptr_t)g_sq[1];
+	cpl = ut_execute(0, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(cpl->status.sct == SPDK_NVME_SCT_COMMAND_SPECIFIC);
+	CU_ASSERT(cpl->status.sc == SPDK_NVME_SC_COMPLETION_QUEUE_INVALID);
+
+	free(buf);
+	ut_dev_free(g_dev);
+}
+
+static void
+test_sw_ctrlr_io_cmds(void)
+{
+	struct spdk_nvme_cmd	cmd = {};
+	struct spdk_nvme_cpl	*cpl;
+	uint8_t			*wbuf, *rbuf;
+	uint64_t		prp_list[2];
+	uint32_t		i;
+
+	ut_dev_setup();
+	ut_create_io_queues(1, UT_QUEUE_ENTRIES);
+
+	SPDK_CU_ASSERT_FATAL(posix_memalign((void **)&wbuf, 4096, 3 * 4096) == 0);
+	SPDK_CU_ASSERT_FATAL(posix_memalign((void **)&rbuf, 4096, 2 * 4096) == 0);
+	for (i = 0; i < 3 * 4096; i++) {
+		wbuf[i] = i % 251;
+	}
+
+	/* 16 blocks starting mid-page - needs PRP1 plus a two-entry PRP list. */
+	prp_list[0] = (uintptr_t)wbuf + 4096;
+	prp_list[1] = (uintptr_t)wbuf + 2 * 4096;
+	cmd.opc = SPDK_NVME_OPC_WRITE;
+	cmd.nsid = 1;
+	cmd.cdw10 = 8;
+	cmd.cdw12 = 16 - 1;
+	cmd.dptr.prp.prp1 = (uintptr_t)wbuf + 512;
+	cmd.dptr.prp.prp2 = (uintptr_t)prp_list;
+	cpl = ut_execute(1, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(cpl));
+	CU_ASSERT(cpl->sqid == 1);
+	CU_ASSERT(memcmp(g_dev->ns_buf + 8 * UT_BLOCK_SIZE, wbuf + 512, 16 * UT_BLOCK_SIZE) == 0);
+
+	/* Read the same 16 blocks back into two pages - PRP2 is a data pointer. */
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_READ;
+	cmd.nsid = 1;
+	cmd.cdw10 = 8;
+	cmd.cdw12 = 16 - 1;
+	cmd.dptr.prp.prp1 = (uintptr_t)rbuf;
+	cmd.dptr.prp.prp2 = (uintptr_t)rbuf + 4096;
+	cpl = ut_execute(1, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(cpl));
+	CU_ASSERT(memcmp(rbuf, wbuf + 512, 16 * UT_BLOCK_SIZE) == 0);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_WRITE_ZEROES;
+	cmd.nsid = 1;
+	cmd.cdw10 = 8;
+	cmd.cdw12 = 1 - 1;
+	cpl = ut_execute(1, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(cpl));
+	for (i = 0; i < UT_BLOCK_SIZE; i++) {
+		CU_ASSERT_FATAL(g_dev->ns_buf[8 * UT_BLOCK_SIZE + i] == 0);
+	}
+	CU_ASSERT(g_dev->ns_buf[9 * UT_BLOCK_SIZE] == wbuf[512 + UT_BLOCK_SIZE]);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_READ;
+	cmd.nsid = 1;
+	cmd.cdw10 = UT_NUM_BLOCKS - 1;
+	cmd.cdw12 = 2 - 1;
+	cmd.dptr.prp.prp1 = (uintptr_t)rbuf;
+	cpl = ut_execute(1, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(cpl->status.sc == SPDK_NVME_SC_LBA_OUT_OF_RANGE);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opc = SPDK_NVME_OPC_FLUSH;
+	cmd.nsid = 1;
+	cpl = ut_execute(1, &cmd);
+	SPDK_CU_ASSERT_FATAL(cpl != NULL);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(cpl));
+
+	free(wbuf);
+	free(rbuf);
+	ut_dev_free(g_dev);
+}
+
+static void
+test_sw_ctrlr_cq_full(void)
+{
+	struct spdk_nvme_cmd	cmd = {};
+	struct spdk_nvme_cpl	*cpl;
+	int			i;
+
+	ut_dev_setup();
+
+	/* A 2-entry CQ holds only one completion at a time. */
+	ut_create_io_queues(2, 2);
+
+	cmd.opc = SPDK_NVME_OPC_FLUSH;
+	cmd.nsid = 1;
+	for (i = 0; i < 3; i++) {
+		ut_submit(2, &cmd);
+	}
+
+	for (i = 0; i < 3; i++) {
+		CU_ASSERT(nvme_sw_dev_poll(g_dev) == 1);
+		CU_ASSERT(nvme_sw_dev_poll(g_dev) == 0);
+		cpl = ut_get_cpl(2);
+		SPDK_CU_ASSERT_FATAL(cpl != NULL);
+		CU_ASSERT(cpl->cid == i);
+		CU_ASSERT(ut_get_cpl(2) == NULL);
+	}
+
+	/* The controller wrapped the CQ once and flipped its phase tag. */
+	CU_ASSERT(g_dev->cq[2].phase == 0);
+	CU_ASSERT(g_phase[2] == 0);
+
+	ut_dev_free(g_dev);
+}
+
+int main(int argc, char **argv)
+{
+	CU_pSuite	suite = NULL;
+	unsigned int	num_failures;
+
+	if (CU_initialize_registry() != CUE_SUCCESS) {
+		return CU_get_error();
+	}
+
+	suite = CU_add_suite("nvme_sw_ctrlr", NULL, NULL);
+	if (suite == NULL) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if (
+		CU_add_test(suite, "test_sw_ctrlr_create", test_sw_ctrlr_create) == NULL
+		|| CU_add_test(suite, "test_sw_ctrlr_enable_disable", test_sw_ctrlr_enable_disable) == NULL
+		|| CU_add_test(suite, "test_sw_ctrlr_admin_cmds", test_sw_ctrlr_admin_cmds) == NULL
+		|| CU_add_test(suite, "test_sw_ctrlr_io_cmds", test_sw_ctrlr_io_cmds) == NULL
+		|| CU_add_test(suite, "test_sw_ctrlr_cq_full", test_sw_ctrlr_cq_full) == NULL
+	) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	num_failures = CU_get_number_of_failures();
+	CU_cleanup_registry();
+	return num_failures;
+}
@@ -0,0 +1,441 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "spdk_cunit.h"
+
+#include "nvme/nvme_vns.c"
+
+#define UT_NUM_NS	4
+#define UT_MAX_PARTS	64
+
+struct ut_part {
+	struct spdk_nvme_ns	*ns;
+	struct spdk_nvme_qpair	*qpair;
+	void			*payload;
+	uint64_t		lba;
+	uint32_t		lba_count;
+	bool			is_write;
+	spdk_nvme_cmd_cb	cb_fn;
+	void			*cb_arg;
+};
+
+static struct spdk_nvme_ctrlr	g_ctrlr[UT_NUM_NS];
+static struct spdk_nvme_ns	g_ns[UT_NUM_NS];
+static uint64_t			g_ns_sectors[UT_NUM_NS];
+static uint32_t			g_ns_sector_size[UT_NUM_NS];
+static struct spdk_nvme_qpair	g_qpair[UT_NUM_NS];
+static bool			g_qpair_allocated[UT_NUM_NS];
+
+static struct ut_part		g_parts[UT_MAX_PARTS];
+static uint32_t			g_num_parts;
+
+/* Submission number (1-based) to reject, and whether to call back before rejecting. */
+static uint32_t			g_fail_part;
+static bool			g_fail_with_cb;
+
+static uint32_t			g_num_cb;
+static struct spdk_nvme_cpl	g_cb_cpl;
+
+uint32_t
+spdk_nvme_ns_get_sector_size(struct spdk_nvme_ns *ns)
+{
+	return g_ns_sector_size[ns - g_ns];
+}
+
+uint32_t
+spdk_nvme_ns_get_md_size(struct spdk_nvme_ns *ns)
+{
+	return 0;
+}
+
+uint64_t
+spdk_nvme_ns_get_num_sectors(struct spdk_nvme_ns *ns)
+{
+	return g_ns_sectors[ns - g_ns];
+}
+
+struct spdk_nvme_qpair *
+spdk_nvme_ctrlr_alloc_io_qpair(struct spdk_nvme_ctrlr *ctrlr, enum spdk_nvme_qprio qprio)
+{
+	uint32_t i = ctrlr - g_ctrlr;
+
+	CU_ASSERT(!g_qpair_allocated[i]);
+	g_qpair_allocated[i] = true;
+	memset(&g_qpair[i], 0, sizeof(g_qpair[i]));
+	g_qpair[i].num_trackers = 8;
+	g_qpair[i].num_free_tr = 8;
+	return &g_qpair[i];
+}
+
+int
+spdk_nvme_ctrlr_free_io_qpair(struct spdk_nvme_qpair *qpair)
+{
+	uint32_t i = qpair - g_qpair;
+
+	CU_ASSERT(g_qpair_allocated[i]);
+	g_qpair_allocated[i] = false;
+	return 0;
+}
+
+static int
+ut_submit(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair, void *payload,
+	  uint64_t lba, uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg, bool is_write)
+{
+	struct spdk_nvme_cpl	cpl = {};
+	struct ut_part		*part;
+
+	if (g_num_parts + 1 == g_fail_part) {
+		g_fail_part = 0;
+		if (g_fail_with_cb) {
+			cpl.status.sct = SPDK_NVME_SCT_GENERIC;
+			cpl.status.sc = SPDK_NVME_SC_INVALID_FIELD;
+			cb_fn(cb_arg, &cpl);
+		}
+		return -ENOMEM;
+	}
+
+	SPDK_CU_ASSERT_FATAL(g_num_parts < UT_MAX_PARTS);
+	part = &g_parts[g_num_parts++];
+	part->ns = ns;
+	part->qpair = qpair;
+	part->payload = payload;
+	part->lba = lba;
+	part->lba_count = lba_count;
+	part->is_write = is_write;
+	part->cb_fn = cb_fn;
+	part->cb_arg = cb_arg;
+	qpair->num_free_tr--;
+	return 0;
+}
+
+int
+spdk_nvme_ns_cmd_read(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair, void *payload,
+		      uint64_t lba, uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg,
+		      uint32_t io_flags)
+{
+	return ut_submit(ns, qpair, payload, lba, lba_count, cb_fn, cb_arg, false);
+}
+
+int
+spdk_nvme_ns_cmd_write(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair, void *payload,
+		       uint64_t lba, uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg,
+		       uint32_t io_flags)
+{
+	return ut_submit(ns, qpair, payload, lba, lba_count, cb_fn, cb_arg, true);
+}
+
+/* Completes the parts submitted to qpair, in order. */
+int32_t
+spdk_nvme_qpair_process_completions(struct spdk_nvme_qpair *qpair, uint32_t max_completions)
+{
+	struct spdk_nvme_cpl	cpl = {};
+	struct ut_part		part;
+	int32_t			num_completions = 0;
+	uint32_t		i = 0;
+
+	while (i < g_num_parts) {
+		if (g_parts[i].qpair != qpair) {
+			i++;
+			continue;
+		}
+		part = g_parts[i];
+		memmove(&g_parts[i], &g_parts[i + 1], (g_num_parts - i - 1) * sizeof(g_parts[0]));
+		g_num_parts--;
+		qpair->num_free_tr++;
+		part.cb_fn(part.cb_arg, &cpl);
+		num_completions++;
+	}
+
+	return num_completions;
+}
+
+static void
+ut_io_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	g_num_cb++;
+	g_cb_cpl = *cpl;
+}
+
+static void
+ut_reset(uint32_t num_ns, uint64_t sectors)
+{
+	uint32_t i;
+
+	for (i = 0; i < UT_NUM_NS; i++) {
+		g_ns[i].ctrlr = &g_ctrlr[i];
+		g_ns_sectors[i] = (i < num_ns) ? sectors : 0;
+		g_ns_sector_size[i] = 512;
+	}
+	g_num_parts = 0;
+	g_fail_part = 0;
+	g_fail_with_cb = false;
+	g_num_cb = 0;
+	memset(&g_cb_cpl, 0, sizeof(g_cb_cpl));
+}
+
+static void
+test_vns_create(void)
+{
+	struct spdk_nvme_ns	*ns[UT_NUM_NS] = { &g_ns[0], &g_ns[1], &g_ns[2], &g_ns[3] };
+	struct spdk_nvme_vns	*vns;
+
+	ut_reset(UT_NUM_NS, 1000);
+
+	CU_ASSERT(spdk_nvme_vns_create(SPDK_NVME_VNS_RAID0, ns, 0, 8) == NULL);
+	CU_ASSERT(spdk_nvme_vns_create(SPDK_NVME_VNS_RAID0, ns, NVME_VNS_MAX_MEMBERS + 1, 8) == NULL);
+	CU_ASSERT(spdk_nvme_vns_create(SPDK_NVME_VNS_RAID0, ns, 2, 0) == NULL);
+	CU_ASSERT(spdk_nvme_vns_create((enum spdk_nvme_vns_level)7, ns, 2, 8) == NULL);
+
+	/* Members must share a sector size. */
+	g_ns_sector_size[1] = 4096;
+	CU_ASSERT(spdk_nvme_vns_create(SPDK_NVME_VNS_RAID1, ns, 2, 0) == NULL);
+	g_ns_sector_size[1] = 512;
+
+	/* RAID-0 capacity is whole strips of the smallest member. */
+	g_ns_sectors[2] = 900;
+	vns = spdk_nvme_vns_create(SPDK_NVME_VNS_RAID0, ns, 3, 64);
+	SPDK_CU_ASSERT_FATAL(vns != NULL);
+	CU_ASSERT(spdk_nvme_vns_get_num_sectors(vns) == 3 * 14 * 64);
+	CU_ASSERT(spdk_nvme_vns_get_sector_size(vns) == 512);
+	spdk_nvme_vns_destroy(vns);
+
+	/* RAID-1 capacity is the smallest member. */
+	vns = spdk_nvme_vns_create(SPDK_NVME_VNS_RAID1, ns, 3, 0);
+	SPDK_CU_ASSERT_FATAL(vns != NULL);
+	CU_ASSERT(spdk_nvme_vns_get_num_sectors(vns) == 900);
+	spdk_nvme_vns_destroy(vns);
+
+	/* A strip larger than the members leaves no capacity. */
+	CU_ASSERT(spdk_nvme_vns_create(SPDK_NVME_VNS_RAID0, ns, 2, 2048) == NULL);
+}
+
+static void
+test_vns_raid0(void)
+{
+	struct spdk_nvme_ns		*ns[2] = { &g_ns[0], &g_ns[1] };
+	struct spdk_nvme_vns		*vns;
+	struct spdk_nvme_vns_qpair	*vqpair;
+	uint8_t				*buf = (uint8_t *)0x100000;
+
+	ut_reset(2, 1024);
+
+	vns = spdk_nvme_vns_create(SPDK_NVME_VNS_RAID0, ns, 2, 8);
+	SPDK_CU_ASSERT_FATAL(vns != NULL);
+	vqpair = spdk_nvme_vns_alloc_qpair(vns, 0);
+	SPDK_CU_ASSERT_FATAL(vqpair != NULL);
+	CU_ASSERT(vqpair->num_ios == 16);
+
+	/* Within one strip: strip 3 is the second strip of member 1. */
+	CU_ASSERT(spdk_nvme_vns_cmd_read(vns, vqpair, buf, 26, 4, ut_io_done, NULL, 0) == 0);
+	SPDK_CU_ASSERT_FATAL(g_num_parts == 1);
+	CU_ASSERT(g_parts[0].ns == &g_ns[1]);
+	CU_ASSERT(g_parts[0].qpair == &g_qpair[1]);
+	CU_ASSERT(g_parts[0].lba == 10);
+	CU_ASSERT(g_parts[0].lba_count == 4);
+	CU_ASSERT(g_parts[0].payload == buf);
+	CU_ASSERT(!g_parts[0].is_write);
+	CU_ASSERT(spdk_nvme_vns_qpair_process_completions(vqpair, 0) == 1);
+	CU_ASSERT(g_num_cb == 1);
+	CU_ASSERT(vqpair->num_free_ios == vqpair->num_ios);
+
+	/* Across strips: 4 + 8 + 8 + 2 sectors on members 0, 1, 0, 1. */
+	g_num_cb = 0;
+	CU_ASSERT(spdk_nvme_vns_cmd_write(vns, vqpair, buf, 4, 22, ut_io_done, NULL, 0) == 0);
+	SPDK_CU_ASSERT_FATAL(g_num_parts == 4);
+	CU_ASSERT(g_parts[0].ns == &g_ns[0] && g_parts[0].lba == 4 && g_parts[0].lba_count == 4);
+	CU_ASSERT(g_parts[0].payload == buf);
+	CU_ASSERT(g_parts[1].ns == &g_ns[1] && g_parts[1].lba == 0 && g_parts[1].lba_count == 8);
+	CU_ASSERT(g_parts[1].payload == buf + 4 * 512);
+	CU_ASSERT(g_parts[2].ns == &g_ns[0] && g_parts[2].lba == 8 && g_parts[2].lba_count == 8);
+	CU_ASSERT(g_parts[2].payload == buf + 12 * 512);
+	CU_ASSERT(g_parts[3].ns == &g_ns[1] && g_parts[3].lba == 8 && g_parts[3].lba_count == 2);
+	CU_ASSERT(g_parts[3].payload == buf + 20 * 512);
+	CU_ASSERT(g_parts[3].is_write);
+	CU_ASSERT(vqpair->num_free_ios == vqpair->num_ios - 1);
+
+	/* The virtual I/O completes only after all parts have. */
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&g_qpair[0], 0) == 2);
+	CU_ASSERT(g_num_cb == 0);
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&g_qpair[1], 0) == 2);
+	CU_ASSERT(g_num_cb == 1);
+	CU_ASSERT(!spdk_nvme_cpl_is_error(&g_cb_cpl));
+	CU_ASSERT(vqpair->num_free_ios == vqpair->num_ios);
+
+	/* Out of range. */
+	CU_ASSERT(spdk_nvme_vns_cmd_read(vns, vqpair, buf, 2048, 1, ut_io_done, NULL, 0) == -EINVAL);
+	CU_ASSERT(spdk_nvme_vns_cmd_read(vns, vqpair, buf, 2040, 9, ut_io_done, NULL, 0) == -EINVAL);
+	CU_ASSERT(spdk_nvme_vns_cmd_read(vns, vqpair, buf, 0, 0, ut_io_done, NULL, 0) == -EINVAL);
+	CU_ASSERT(g_num_parts == 0);
+
+	spdk_nvme_vns_free_qpair(vqpair);
+	CU_ASSERT(!g_qpair_allocated[0] && !g_qpair_allocated[1]);
+	spdk_nvme_vns_destroy(vns);
+}
+
+static void
+test_vns_raid1(void)
+{
+	struct spdk_nvme_ns		*ns[3] = { &g_ns[0], &g_ns[1], &g_ns[2] };
+	struct spdk_nvme_vns		*vns;
+	struct spdk_nvme_vns_qpair	*vqpair;
+	uint8_t				*buf = (uint8_t *)0x100000;
+	uint32_t			i;
+
+	ut_reset(3, 1024);
+
+	vns = spdk_nvme_vns_create(SPDK_NVME_VNS_RAID1, ns, 3, 0);
+	SPDK_CU_ASSERT_FATAL(vns != NULL);
+	vqpair = spdk_nvme_vns_alloc_qpair(vns, 0);
+	SPDK_CU_ASSERT_FATAL(vqpair != NULL);
+
+	/* Writes go to every member at the same LBA. */
+	CU_ASSERT(spdk_nvme_vns_cmd_write(vns, vqpair, buf, 100, 16, ut_io_done, NULL, 0) == 0);
+	SPDK_CU_ASSERT_FATAL(g_num_parts == 3);
+	for (i = 0; i < 3; i++) {
+		CU_ASSERT(g_parts[i].ns == &g_ns[i]);
+		CU_ASSERT(g_parts[i].lba == 100);
+		CU_ASSERT(g_parts[i].lba_count == 16);
+		CU_ASSERT(g_parts[i].payload == buf);
+		CU_ASSERT(g_parts[i].is_write);
+	}
+
+	/* Reads go to the least busy member: member 0 once its write completes. */
+	CU_ASSERT(spdk_nvme_qpair_process_completions(&g_qpair[0], 0) == 1);
+	CU_ASSERT(spdk_nvme_vns_cmd_read(vns, vqpair, buf, 0, 1, ut_io_done, NULL, 0) == 0);
+	SPDK_CU_ASSERT_FATAL(g_num_parts == 3);
+	CU_ASSERT(g_parts[2].ns == &g_ns[0]);
+	CU_ASSERT(!g_parts[2].is_write);
+
+	/* Drain everything; equally idle members then take reads in turn. */
+	CU_ASSERT(spdk_nvme_vns_qpair_process_completions(vqpair, 0) == 3);
+	CU_ASSERT(g_num_cb == 2);
+	for (i = 0; i < 3; i++) {
+		CU_ASSERT(spdk_nvme_vns_cmd_read(vns, vqpair, buf, 0, 1, ut_io_done, NULL, 0) == 0);
+		SPDK_CU_ASSERT_FATAL(g_num_parts == 1);
+		CU_ASSERT(g_parts[0].ns == &g_ns[(i + 1) % 3]);
+		CU_ASSERT(spdk_nvme_vns_qpair_process_completions(vqpair, 0) == 1);
+	}
+	CU_ASSERT(vqpair->num_free_ios == vqpair->num_ios);
+
+	spdk_nvme_vns_free_qpair(vqpair);
+	spdk_nvme_vns_destroy(vns);
+}
+
+static void
+test_vns_submit_errors(void)
+{
+	struct spdk_nvme_ns		*ns[2] = { &g_ns[0], &g_ns[1] };
+	struct spdk_nvme_vns		*vns;
+	struct spdk_nvme_vns_qpair	*vqpair;
+	uint8_t				*buf = (uint8_t *)0x100000;
+	uint32_t			i;
+
+	ut_reset(2, 1024);
+
+	vns = spdk_nvme_vns_create(SPDK_NVME_VNS_RAID1, ns, 2, 0);
+	SPDK_CU_ASSERT_FATAL(vns != NULL);
+	vqpair = spdk_nvme_vns_alloc_qpair(vns, 0);
+	SPDK_CU_ASSERT_FATAL(vqpair != NULL);
+
+	/* Nothing submitted: the error is returned and cb_fn is not called. */
+	g_fail_part = 1;
+	CU_ASSERT(spdk_nvme_vns_cmd_write(vns, vqpair, buf, 0, 1, ut_io_done, NULL, 0) == -ENOMEM);
+	CU_ASSERT(g_num_cb == 0);
+	CU_ASSERT(g_num_parts == 0);
+	CU_ASSERT(vqpair->num_free_ios == vqpair->num_ios);
+
+	/* Second mirror rejected: the first completes, then cb_fn reports an error. */
+	g_fail_part = 2;
+	CU_ASSERT(spdk_nvme_vns_cmd_write(vns, vqpair, buf, 0, 1, ut_io_done, NULL, 0) == 0);
+	CU_ASSERT(g_num_parts == 1);
+	CU_ASSERT(g_num_cb == 0);
+	CU_ASSERT(spdk_nvme_vns_qpair_process_completions(vqpair, 0) == 1);
+	CU_ASSERT(g_num_cb == 1);
+	CU_ASSERT(spdk_nvme_cpl_is_error(&g_cb_cpl));
+	CU_ASSERT(vqpair->num_free_ios == vqpair->num_ios);
+
+	/* A part that fails by calling back during submission is counted once. */
+	g_num_cb = 0;
+	g_fail_part = 1;
+	g_fail_with_cb = true;
+	CU_ASSERT(spdk_nvme_vns_cmd_read(vns, vqpair, buf, 0, 1, ut_io_done, NULL, 0) == 0);
+	CU_ASSERT(g_num_cb == 1);
+	CU_ASSERT(g_cb_cpl.status.sc == SPDK_NVME_SC_INVALID_FIELD);
+	CU_ASSERT(vqpair->num_free_ios == vqpair->num_ios);
+
+	/* Running out of virtual I/O contexts. */
+	g_num_cb = 0;
+	for (i = 0; i < vqpair->num_ios; i++) {
+		CU_ASSERT(spdk_nvme_vns_cmd_read(vns, vqpair, buf, 0, 1, ut_io_done, NULL, 0) == 0);
+	}
+	CU_ASSERT(spdk_nvme_vns_cmd_read(vns, vqpair, buf, 0, 1, ut_io_done, NULL, 0) == -ENOMEM);
+	CU_ASSERT(spdk_nvme_vns_qpair_process_completions(vqpair, 0) == (int32_t)vqpair->num_ios);
+	CU_ASSERT(g_num_cb == vqpair->num_ios);
+
+	spdk_nvme_vns_free_qpair(vqpair);
+	spdk_nvme_vns_destroy(vns);
+}
+
+int main(int argc, char **argv)
+{
+	CU_pSuite	suite = NULL;
+	unsigned int	num_failures;
+
+	if (CU_initialize_registry() != CUE_SUCCESS) {
+		return CU_get_error();
+	}
+
+	suite = CU_add_suite("nvme_vns", NULL, NULL);
+	if (suite == NULL) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if (
+		CU_add_test(suite, "test_vns_create", test_vns_create) == NULL
+		|| CU_add_test(suite, "test_vns_raid0", test_vns_raid0) == NULL
+		|| CU_add_test(suite, "test_vns_raid1", test_vns_raid1) == NULL
+		|| CU_add_test(suite, "test_vns_submit_errors", test_vns_submit_errors) == NULL
+	) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	num_failures = CU_get_number_of_failures();
+	CU_cleanup_registry();
+	return num_failures;
+}
@@ -0,0 +1,675 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "spdk_cunit.h"
+
+#include "util/crc32.c"
+#include "nvme/nvme_wal.c"
+
+char outbuf[OUTBUF_SIZE];
+
+#define UT_SECTOR_SIZE	512
+#define UT_MAX_CMDS	64
+
+#define UT_LOG		0
+#define UT_DATA		1
+
+enum ut_opc {
+	UT_READ,
+	UT_WRITE,
+	UT_FLUSH,
+};
+
+struct ut_cmd {
+	struct spdk_nvme_ns	*ns;
+	struct spdk_nvme_qpair	*qpair;
+	enum ut_opc		opc;
+	void			*buf;
+	uint64_t		lba;
+	uint32_t		lba_count;
+	uint32_t		io_flags;
+	spdk_nvme_cmd_cb	cb_fn;
+	void			*cb_arg;
+};
+
+static struct spdk_nvme_ctrlr	g_ctrlr[2];
+static struct spdk_nvme_ns	g_ns[2];
+static struct spdk_nvme_qpair	g_qpair[2];
+static bool			g_qpair_allocated[2];
+static uint64_t			g_ns_sectors[2];
+static uint32_t			g_ns_sector_size[2];
+static uint8_t			*g_disk[2];
+
+static struct ut_cmd		g_cmds[UT_MAX_CMDS];
+static uint32_t			g_num_cmds;
+static uint32_t			g_num_flushes;
+
+/* Submission number (1-based) to complete with an error. */
+static uint32_t			g_fail_cmd;
+static uint32_t			g_num_submitted;
+
+static uint32_t			g_num_cb;
+static uint32_t			g_num_cb_errors;
+static uintptr_t		g_cb_order[UT_MAX_CMDS];
+
+uint32_t
+spdk_nvme_ns_get_sector_size(struct spdk_nvme_ns *ns)
+{
+	return g_ns_sector_size[ns - g_ns];
+}
+
+uint32_t
+spdk_nvme_ns_get_md_size(struct spdk_nvme_ns *ns)
+{
+	return 0;
+}
+
+uint64_t
+spdk_nvme_ns_get_num_sectors(struct spdk_nvme_ns *ns)
+{
+	return g_ns_sectors[ns - g_ns];
+}
+
+struct spdk_nvme_qpair *
+spdk_nvme_ctrlr_alloc_io_qpair(struct spdk_nvme_ctrlr *ctrlr, enum spdk_nvme_qprio qprio)
+{
+	uint32_t i = ctrlr - g_ctrlr;
+
+	CU_ASSERT(!g_qpair_allocated[i]);
+	g_qpair_allocated[i] = true;
+	memset(&g_qpair[i], 0, sizeof(g_qpair[i]));
+	g_qpair[i].num_trackers = 8;
+	return &g_qpair[i];
+}
+
+int
+spdk_nvme_ctrlr_free_io_qpair(struct spdk_nvme_qpair *qpair)
+{
+	uint32_t i = qpair - g_qpair;
+
+	CU_ASSERT(g_qpair_allocated[i]);
+	g_qpair_allocated[i] = false;
+	return 0;
+}
+
+void
+nvme_completion_poll_cb(void *arg, const struct spdk_nvme_cpl *cpl)
+{
+	struct nvme_completion_poll_status *status = arg;
+
+	status->cpl = *cpl;
+	status->done = true;
+}
+
+static int
+ut_submit(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair, enum ut_opc opc, void *buf,
+	  uint64_t lba, uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg, uint32_t io_flags)
+{
+	struct ut_cmd *cmd;
+
+	SPDK_CU_ASSERT_FATAL(g_num_cmds < UT_MAX_CMDS);
+	CU_ASSERT(qpair == &g_qpair[ns - g_ns]);
+	if (opc != UT_FLUSH) {
+		SPDK_CU_ASSERT_FATAL(lba + lba_count <= g_ns_sectors[ns - g_ns]);
+	}
+
+	cmd = &g_cmds[g_num_cmds++];
+	cmd->ns = ns;
+	cmd->qpair = qpair;
+	cmd->opc = opc;
+	cmd->buf = buf;
+	cmd->lba = lba;
+	cmd->lba_count = lba_count;
+	cmd->io_flags = io_flags;
+	cmd->cb_fn = cb_fn;
+	cmd->cb_arg = cb_arg;
+	g_num_submitted++;
+	return 0;
+}
+
+int
+spdk_nvme_ns_cmd_read(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair, void *payload,
+		      uint64_t lba, uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg,
+		      uint32_t io_flags)
+{
+	return ut_submit(ns, qpair, UT_READ, payload, lba, lba_count, cb_fn, cb_arg, io_flags);
+}
+
+int
+spdk_nvme_ns_cmd_write(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair, void *payload,
+		       uint64_t lba, uint32_t lba_count, spdk_nvme_cmd_cb cb_fn, void *cb_arg,
+		       uint32_t io_flags)
+{
+	return ut_submit(ns, qpair, UT_WRITE, payload, lba, lba_count, cb_fn, cb_arg, io_flags);
+}
+
+int
+spdk_nvme_ns_cmd_flush(struct spdk_nvme_ns *ns, struct spdk_nvme_qpair *qpair,
+		       spdk_nvme_cmd_cb cb_fn, void *cb_arg)
+{
+	return ut_submit(ns, qpair, UT_FLUSH, NULL, 0, 0, cb_fn, cb_arg, 0);
+}
+
+/* Executes the commands that were queued on qpair when called, in order. */
+int32_t
+spdk_nvme_qpair_process_completions(struct spdk_nvme_qpair *qpair, uint32_t max_completions)
+{
+	struct spdk_nvme_cpl	cpl;
+	struct ut_cmd		cmd;
+	uint8_t			*disk;
+	uint32_t		remaining = g_num_cmds;
+	uint32_t		i = 0;
+	int32_t			num_completions = 0;
+
+	while (remaining-- > 0) {
+		if (g_cmds[i].qpair != qpair) {
+			i++;
+			continue;
+		}
+		cmd = g_cmds[i];
+		memmove(&g_cmds[i], &g_cmds[i + 1], (g_num_cmds - i - 1) * sizeof(g_cmds[0]));
+		g_num_cmds--;
+
+		memset(&cpl, 0, sizeof(cpl));
+		if (g_fail_cmd != 0 && --g_fail_cmd == 0) {
+			cpl.status.sct = SPDK_NVME_SCT_GENERIC;
+			cpl.status.sc = SPDK_NVME_SC_DATA_TRANSFER_ERROR;
+		} else {
+			disk = g_disk[cmd.ns - g_ns] + cmd.lba * UT_SECTOR_SIZE;
+			if (cmd.opc == UT_WRITE) {
+				memcpy(disk, cmd.buf, cmd.lba_count * UT_SECTOR_SIZE);
+			} else if (cmd.opc == UT_READ) {
+				memcpy(cmd.buf, disk, cmd.lba_count * UT_SECTOR_SIZE);
+			} else {
+				g_num_flushes++;
+			}
+		}
+
+		cmd.cb_fn(cmd.cb_arg, &cpl);
+		num_completions++;
+	}
+
+	return num_completions;
+}
+
+static void
+ut_io_done(void *cb_arg, const struct spdk_nvme_cpl *cpl)
+{
+	g_cb_order[g_num_cb++] = (uintptr_t)cb_arg;
+	if (spdk_nvme_cpl_is_error(cpl)) {
+		g_num_cb_errors++;
+	}
+}
+
+static void
+ut_reset(uint64_t log_sectors, uint64_t data_sectors)
+{
+	uint32_t i;
+
+	for (i = 0; i < 2; i++) {
+		g_ns[i].ctrlr = &g_ctrlr[i];
+		g_ns_sector_size[i] = UT_SECTOR_SIZE;
+		free(g_disk[i]);
+	}
+	g_ns_sectors[UT_LOG] = log_sectors;
+	g_ns_sectors[UT_DATA] = data_sectors;
+	g_disk[UT_LOG] = calloc(log_sectors, UT_SECTOR_SIZE);
+	g_disk[UT_DATA] = calloc(data_sectors, UT_SECTOR_SIZE);
+	SPDK_CU_ASSERT_FATAL(g_disk[UT_LOG] != NULL && g_disk[UT_DATA] != NULL);
+
+	g_num_cmds = 0;
+	g_num_flushes = 0;
+	g_fail_cmd = 0;
+	g_num_submitted = 0;
+	g_num_cb = 0;
+	g_num_cb_errors = 0;
+}
+
+static struct spdk_nvme_wal *
+ut_create(uint64_t log_size, bool format)
+{
+	struct spdk_nvme_wal_opts opts;
+
+	spdk_nvme_wal_get_default_opts(&opts);
+	opts.log_size = log_size;
+	opts.format = format;
+	/* Destage only when a test asks for it. */
+	opts.destage_threshold = UINT32_MAX;
+	return spdk_nvme_wal_create(&g_ns[UT_LOG], &g_ns[UT_DATA], &opts);
+}
+
+static void
+ut_fill(uint8_t *buf, uint8_t val, uint32_t lba_count)
+{
+	memset(buf, val, lba_count * UT_SECTOR_SIZE);
+}
+
+/* Check that lba_count sectors of the data namespace starting at lba hold val. */
+static bool
+ut_data_is(uint64_t lba, uint32_t lba_count, uint8_t val)
+{
+	uint8_t	*p = g_disk[UT_DATA] + lba * UT_SECTOR_SIZE;
+	size_t	i;
+
+	for (i = 0; i < (size_t)lba_count * UT_SECTOR_SIZE; i++) {
+		if (p[i] != val) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static struct nvme_wal_superblock *
+ut_superblock(void)
+{
+	return (struct nvme_wal_superblock *)g_disk[UT_LOG];
+}
+
+static void
+ut_poll_until_idle(struct spdk_nvme_wal *wal)
+{
+	while (g_num_cmds > 0) {
+		spdk_nvme_wal_process_completions(wal);
+	}
+}
+
+static void
+test_wal_crc32c(void)
+{
+	CU_ASSERT(spdk_crc32c(0, "123456789", 9) == 0xe3069283);
+	CU_ASSERT(spdk_crc32c(0, "", 0) == 0);
+	CU_ASSERT(spdk_crc32c(spdk_crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+}
+
+static void
+test_wal_create(void)
+{
+	struct spdk_nvme_wal	*wal;
+	struct spdk_nvme_wal_opts opts;
+
+	ut_reset(65, 1024);
+
+	CU_ASSERT(spdk_nvme_wal_create(NULL, &g_ns[UT_DATA], NULL) == NULL);
+	CU_ASSERT(spdk_nvme_wal_create(&g_ns[UT_DATA], &g_ns[UT_DATA], NULL) == NULL);
+
+	/* Sector sizes must match. */
+	g_ns_sector_size[UT_LOG] = 4096;
+	CU_ASSERT(ut_create(32 * UT_SECTOR_SIZE, true) == NULL);
+	g_ns_sector_size[UT_LOG] = UT_SECTOR_SIZE;
+
+	/* A blank log namespace is only used when formatting is allowed. */
+	spdk_nvme_wal_get_default_opts(&opts);
+	CU_ASSERT(!opts.format);
+	CU_ASSERT(spdk_nvme_wal_create(&g_ns[UT_LOG], &g_ns[UT_DATA], &opts) == NULL);
+	CU_ASSERT(!g_qpair_allocated[UT_LOG] && !g_qpair_allocated[UT_DATA]);
+
+	wal = ut_create(32 * UT_SECTOR_SIZE, true);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+	CU_ASSERT(wal->ring_sectors == 32);
+	CU_ASSERT(wal->num_records == 16);
+	CU_ASSERT(spdk_nvme_wal_get_max_write_sectors(wal) == 31);
+	CU_ASSERT(ut_superblock()->magic == NVME_WAL_SB_MAGIC);
+	CU_ASSERT(ut_superblock()->ring_sectors == 32);
+	CU_ASSERT(ut_superblock()->epoch == 1);
+	CU_ASSERT(ut_superblock()->tail_seq == 0);
+	CU_ASSERT(g_num_cmds == 0);
+	spdk_nvme_wal_destroy(wal);
+	CU_ASSERT(!g_qpair_allocated[UT_LOG] && !g_qpair_allocated[UT_DATA]);
+
+	/* An existing log keeps its ring size and moves to a new epoch. */
+	wal = ut_create(64 * UT_SECTOR_SIZE, false);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+	CU_ASSERT(wal->ring_sectors == 32);
+	CU_ASSERT(ut_superblock()->epoch == 2);
+	spdk_nvme_wal_destroy(wal);
+
+	/* A corrupted superblock is not trusted. */
+	g_disk[UT_LOG][8]++;
+	CU_ASSERT(ut_create(64 * UT_SECTOR_SIZE, false) == NULL);
+
+	/* Formatting limits the ring to the log namespace. */
+	wal = ut_create(1024 * UT_SECTOR_SIZE, true);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+	CU_ASSERT(wal->ring_sectors == 64);
+	spdk_nvme_wal_destroy(wal);
+}
+
+static void
+test_wal_write_destage(void)
+{
+	struct spdk_nvme_wal	*wal;
+	uint8_t			buf[4 * UT_SECTOR_SIZE];
+
+	ut_reset(65, 1024);
+	wal = ut_create(64 * UT_SECTOR_SIZE, true);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+
+	/* Each write is one FUA log write of a header sector and the data. */
+	ut_fill(buf, 'a', 2);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 100, 2, ut_io_done, (void *)1) == 0);
+	ut_fill(buf, 'b', 1);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 10, 1, ut_io_done, (void *)2) == 0);
+	ut_fill(buf, 'c', 2);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 101, 2, ut_io_done, (void *)3) == 0);
+	SPDK_CU_ASSERT_FATAL(g_num_cmds == 3);
+	CU_ASSERT(g_cmds[0].ns == &g_ns[UT_LOG] && g_cmds[0].lba == 1 && g_cmds[0].lba_count == 3);
+	CU_ASSERT(g_cmds[1].lba == 4 && g_cmds[1].lba_count == 2);
+	CU_ASSERT(g_cmds[2].lba == 6 && g_cmds[2].lba_count == 3);
+	CU_ASSERT(g_cmds[2].io_flags & SPDK_NVME_IO_FLAGS_FORCE_UNIT_ACCESS);
+	CU_ASSERT(g_num_cb == 0);
+
+	/* Writes complete in order once logged; nothing is destaged below the threshold. */
+	CU_ASSERT(spdk_nvme_wal_process_completions(wal) == 3);
+	CU_ASSERT(g_num_cb == 3);
+	CU_ASSERT(g_cb_order[0] == 1 && g_cb_order[1] == 2 && g_cb_order[2] == 3);
+	CU_ASSERT(g_num_cmds == 0);
+	CU_ASSERT(wal->pending_sectors == 5);
+
+	/* One write per run of overlapping or adjacent LBAs, with the later write winning. */
+	nvme_wal_destage(wal, true);
+	SPDK_CU_ASSERT_FATAL(g_num_cmds == 2);
+	CU_ASSERT(g_cmds[0].ns == &g_ns[UT_DATA] && g_cmds[0].opc == UT_WRITE);
+	CU_ASSERT(g_cmds[0].lba == 10 && g_cmds[0].lba_count == 1);
+	CU_ASSERT(g_cmds[1].lba == 100 && g_cmds[1].lba_count == 3);
+	CU_ASSERT(wal->pending_sectors == 0);
+
+	/* Then a flush of the data namespace, then the superblock, then the records retire. */
+	CU_ASSERT(spdk_nvme_wal_process_completions(wal) == 2);
+	SPDK_CU_ASSERT_FATAL(g_num_cmds == 1);
+	CU_ASSERT(g_cmds[0].opc == UT_FLUSH && g_cmds[0].ns == &g_ns[UT_DATA]);
+	CU_ASSERT(spdk_nvme_wal_process_completions(wal) == 1);
+	SPDK_CU_ASSERT_FATAL(g_num_cmds == 1);
+	CU_ASSERT(g_cmds[0].ns == &g_ns[UT_LOG] && g_cmds[0].lba == 0 && g_cmds[0].lba_count == 1);
+	CU_ASSERT(wal->tail_seq == 0);
+	CU_ASSERT(spdk_nvme_wal_process_completions(wal) == 1);
+	CU_ASSERT(wal->tail_seq == 3 && wal->head_seq == 3);
+	CU_ASSERT(ut_superblock()->tail_seq == 3);
+	CU_ASSERT(ut_superblock()->tail_pos == 8);
+	CU_ASSERT(g_num_flushes == 1);
+
+	CU_ASSERT(ut_data_is(10, 1, 'b'));
+	CU_ASSERT(ut_data_is(100, 1, 'a'));
+	CU_ASSERT(ut_data_is(101, 2, 'c'));
+	CU_ASSERT(ut_data_is(103, 1, 0));
+
+	/* Destaging also starts on its own once half of the ring is in use. */
+	ut_fill(buf, 'd', 4);
+	while (nvme_wal_ring_used(wal) < wal->ring_sectors / 2) {
+		CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 200, 4, ut_io_done, NULL) == 0);
+	}
+	CU_ASSERT(!wal->destaging);
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(wal->destaging);
+	ut_poll_until_idle(wal);
+	CU_ASSERT(nvme_wal_is_empty(wal));
+	CU_ASSERT(ut_data_is(200, 4, 'd'));
+
+	spdk_nvme_wal_destroy(wal);
+}
+
+static void
+test_wal_read_overlay(void)
+{
+	struct spdk_nvme_wal	*wal;
+	uint8_t			buf[8 * UT_SECTOR_SIZE];
+
+	ut_reset(65, 1024);
+	wal = ut_create(64 * UT_SECTOR_SIZE, true);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+
+	ut_fill(g_disk[UT_DATA] + 18 * UT_SECTOR_SIZE, 'o', 8);
+	ut_fill(buf, 'x', 4);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 20, 4, ut_io_done, NULL) == 0);
+	ut_fill(buf, 'y', 1);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 22, 1, ut_io_done, NULL) == 0);
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(g_num_cb == 2);
+
+	/* Reads that miss the staged range go straight to the data namespace. */
+	CU_ASSERT(spdk_nvme_wal_cmd_read(wal, buf, 0, 4, ut_io_done, NULL) == 0);
+	SPDK_CU_ASSERT_FATAL(g_num_cmds == 1);
+	CU_ASSERT(g_cmds[0].cb_fn == ut_io_done && g_cmds[0].buf == buf);
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(wal->num_free_reads == wal->num_reads);
+
+	/* Staged data is copied over what the data namespace returns, newest last. */
+	ut_fill(buf, 0xff, 8);
+	g_num_cb = 0;
+	CU_ASSERT(spdk_nvme_wal_cmd_read(wal, buf, 18, 8, ut_io_done, NULL) == 0);
+	SPDK_CU_ASSERT_FATAL(g_num_cmds == 1);
+	CU_ASSERT(g_cmds[0].cb_fn == nvme_wal_read_done);
+	CU_ASSERT(wal->num_free_reads == wal->num_reads - 1);
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(g_num_cb == 1);
+	CU_ASSERT(memcmp(buf, g_disk[UT_DATA] + 18 * UT_SECTOR_SIZE, 2 * UT_SECTOR_SIZE) == 0);
+	CU_ASSERT(buf[2 * UT_SECTOR_SIZE] == 'x' && buf[4 * UT_SECTOR_SIZE - 1] == 'x');
+	CU_ASSERT(buf[4 * UT_SECTOR_SIZE] == 'y' && buf[5 * UT_SECTOR_SIZE - 1] == 'y');
+	CU_ASSERT(buf[5 * UT_SECTOR_SIZE] == 'x' && buf[6 * UT_SECTOR_SIZE - 1] == 'x');
+	CU_ASSERT(buf[6 * UT_SECTOR_SIZE] == 'o' && buf[8 * UT_SECTOR_SIZE - 1] == 'o');
+
+	/* Destaged records are only retired once no overlaid read can still use them. */
+	wal->num_free_reads--;
+	nvme_wal_destage(wal, true);
+	ut_poll_until_idle(wal);
+	CU_ASSERT(wal->retire_pending);
+	CU_ASSERT(wal->tail_seq == 0);
+	CU_ASSERT(ut_superblock()->tail_seq == 2);
+	wal->num_free_reads++;
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(!wal->retire_pending);
+	CU_ASSERT(nvme_wal_is_empty(wal));
+
+	/* With nothing staged, every read goes straight to the data namespace. */
+	CU_ASSERT(spdk_nvme_wal_cmd_read(wal, buf, 20, 4, ut_io_done, NULL) == 0);
+	SPDK_CU_ASSERT_FATAL(g_num_cmds == 1);
+	CU_ASSERT(g_cmds[0].cb_fn == ut_io_done);
+	spdk_nvme_wal_process_completions(wal);
+
+	CU_ASSERT(spdk_nvme_wal_cmd_read(wal, buf, 1020, 5, ut_io_done, NULL) == -EINVAL);
+	CU_ASSERT(spdk_nvme_wal_cmd_read(wal, buf, 0, 0, ut_io_done, NULL) == -EINVAL);
+
+	spdk_nvme_wal_destroy(wal);
+}
+
+static void
+test_wal_recovery(void)
+{
+	struct spdk_nvme_wal	*wal;
+	uint8_t			buf[4 * UT_SECTOR_SIZE];
+	uint32_t		data_writes;
+
+	ut_reset(17, 1024);
+	wal = ut_create(16 * UT_SECTOR_SIZE, true);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+
+	/* Fill and destage the first half of the ring. */
+	ut_fill(buf, '0', 3);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 0, 3, ut_io_done, NULL) == 0);
+	ut_fill(buf, '1', 3);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 5, 3, ut_io_done, NULL) == 0);
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(nvme_wal_drain(wal) == 0);
+	CU_ASSERT(wal->tail_pos == 8);
+	memset(g_disk[UT_DATA], 0, 1024 * UT_SECTOR_SIZE);
+
+	/* The second record does not fit before the end of the ring and wraps. */
+	ut_fill(buf, '2', 4);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 7, 4, ut_io_done, NULL) == 0);
+	ut_fill(buf, '3', 3);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 50, 3, ut_io_done, NULL) == 0);
+	ut_fill(buf, '4', 1);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 60, 1, ut_io_done, NULL) == 0);
+	CU_ASSERT(nvme_wal_record(wal, 3)->pos == 0);
+	CU_ASSERT(nvme_wal_record(wal, 4)->pos == 4);
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(g_num_cb == 5);
+
+	/* Not acknowledged: its log write never completes.  The ring is now full. */
+	ut_fill(buf, '5', 1);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 70, 1, ut_io_done, NULL) == 0);
+	CU_ASSERT(wal->head_pos == wal->tail_pos);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 70, 1, ut_io_done, NULL) == -ENOMEM);
+
+	/* Crash. */
+	nvme_wal_free(wal);
+	g_num_cmds = 0;
+	CU_ASSERT(ut_data_is(7, 4, 0));
+
+	/* Attaching replays every acknowledged write and empties the log. */
+	wal = ut_create(0, false);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+	CU_ASSERT(ut_data_is(7, 4, '2'));
+	CU_ASSERT(ut_data_is(50, 3, '3'));
+	CU_ASSERT(ut_data_is(60, 1, '4'));
+	CU_ASSERT(ut_data_is(70, 1, 0));
+	CU_ASSERT(ut_data_is(0, 3, 0));
+	CU_ASSERT(nvme_wal_is_empty(wal));
+	CU_ASSERT(ut_superblock()->epoch == 2);
+	CU_ASSERT(ut_superblock()->tail_pos == 6);
+
+	/* A torn record ends the replay. */
+	ut_fill(buf, '6', 2);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 80, 2, ut_io_done, NULL) == 0);
+	ut_fill(buf, '7', 1);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 90, 1, ut_io_done, NULL) == 0);
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(nvme_wal_record(wal, 5)->pos == 6);
+	nvme_wal_free(wal);
+	g_disk[UT_LOG][(1 + 6 + 1) * UT_SECTOR_SIZE + 100] ^= 0x5a;
+
+	memset(g_disk[UT_DATA], 0, 1024 * UT_SECTOR_SIZE);
+	wal = ut_create(0, false);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+	CU_ASSERT(ut_data_is(80, 2, 0));
+	CU_ASSERT(ut_data_is(90, 1, 0));
+	CU_ASSERT(ut_data_is(7, 4, 0));
+	nvme_wal_free(wal);
+
+	/* Records of earlier epochs are never replayed again. */
+	data_writes = g_num_submitted;
+	wal = ut_create(0, false);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+	CU_ASSERT(ut_data_is(80, 2, 0));
+	/* Superblock read and write, and the headers at the tail and at the start of the ring. */
+	CU_ASSERT(g_num_submitted - data_writes == 4);
+	spdk_nvme_wal_destroy(wal);
+}
+
+static void
+test_wal_errors(void)
+{
+	struct spdk_nvme_wal	*wal;
+	uint8_t			buf[4 * UT_SECTOR_SIZE];
+
+	ut_reset(9, 1024);
+	wal = ut_create(8 * UT_SECTOR_SIZE, true);
+	SPDK_CU_ASSERT_FATAL(wal != NULL);
+	CU_ASSERT(spdk_nvme_wal_get_max_write_sectors(wal) == 7);
+
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 0, 0, ut_io_done, NULL) == -EINVAL);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 0, 8, ut_io_done, NULL) == -EINVAL);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 1023, 2, ut_io_done, NULL) == -EINVAL);
+
+	/* The ring is full until records are destaged and retired. */
+	ut_fill(buf, 'f', 3);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 0, 3, ut_io_done, NULL) == 0);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 3, 3, ut_io_done, NULL) == 0);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 6, 1, ut_io_done, NULL) == -ENOMEM);
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(g_num_cb == 2);
+
+	/* A failed destage write puts the batch back, and it is destaged again. */
+	nvme_wal_destage(wal, true);
+	SPDK_CU_ASSERT_FATAL(g_num_cmds == 1);
+	g_fail_cmd = 1;
+	CU_ASSERT(spdk_nvme_qpair_process_completions(wal->data_qpair, 0) == 1);
+	CU_ASSERT(wal->destage_failures == 1);
+	CU_ASSERT(!wal->destaging);
+	CU_ASSERT(wal->destage_seq == wal->tail_seq);
+	CU_ASSERT(wal->pending_sectors == 6);
+	CU_ASSERT(g_num_flushes == 0);
+	CU_ASSERT(nvme_wal_drain(wal) == 0);
+	CU_ASSERT(ut_data_is(0, 6, 'f'));
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 6, 1, ut_io_done, NULL) == 0);
+	spdk_nvme_wal_process_completions(wal);
+
+	/* A failed log write fails it and every later write. */
+	g_num_cb = 0;
+	g_num_cb_errors = 0;
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 10, 1, ut_io_done, NULL) == 0);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 11, 1, ut_io_done, NULL) == 0);
+	g_fail_cmd = 1;
+	spdk_nvme_wal_process_completions(wal);
+	CU_ASSERT(g_num_cb == 2);
+	CU_ASSERT(g_num_cb_errors == 2);
+	CU_ASSERT(spdk_nvme_wal_cmd_write(wal, buf, 12, 1, ut_io_done, NULL) == -EIO);
+
+	/* Failed writes are never destaged. */
+	spdk_nvme_wal_destroy(wal);
+	CU_ASSERT(ut_data_is(6, 1, 'f'));
+	CU_ASSERT(ut_data_is(10, 2, 0));
+}
+
+int main(int argc, char **argv)
+{
+	CU_pSuite	suite = NULL;
+	unsigned int	num_failures;
+
+	if (CU_initialize_registry() != CUE_SUCCESS) {
+		return CU_get_error();
+	}
+
+	suite = CU_add_suite("nvme_wal", NULL, NULL);
+	if (suite == NULL) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if (
+		CU_add_test(suite, "test_wal_crc32c", test_wal_crc32c) == NULL
+		|| CU_add_test(suite, "test_wal_create", test_wal_create) == NULL
+		|| CU_add_test(suite, "test_wal_write_destage", test_wal_write_destage) == NULL
+		|| CU_add_test(suite, "test_wal_read_overlay", test_wal_read_overlay) == NULL
+		|| CU_add_test(suite, "test_wal_recovery", test_wal_recovery) == NULL
+		|| CU_add_test(suite, "test_wal_errors", test_wal_errors) == NULL
+	) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	num_failures = CU_get_number_of_failures();
+	CU_cleanup_registry();
+	return num_failures;
+}
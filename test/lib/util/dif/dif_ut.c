@@ -0,0 +1,337 @@
+/*-
+ *   BSD LICENSE
+ *
+ *   Copyright (c) Intel Corporation.
+ *   All rights reserved.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "spdk_cunit.h"
+
+#include "util/crc16.c"
+#include "util/dif.c"
+
+#define DATA_SIZE	512
+
+static void
+fill_pattern(uint8_t *buf, size_t len, uint32_t seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+}
+
+static void
+crc16_test(void)
+{
+	uint8_t		buf[4096 + 16];
+	uint16_t	init, crc;
+	size_t		len, off;
+
+	CU_ASSERT(spdk_crc16_t10dif(0, "123456789", 9) == 0xd0db);
+	CU_ASSERT(spdk_crc16_t10dif(0, buf, 0) == 0);
+
+	/* The accelerated path agrees with the table for every length, alignment and seed. */
+	fill_pattern(buf, sizeof(buf), 1);
+	for (len = 0; len <= 600; len++) {
+		for (off = 0; off < 3; off++) {
+			init = off * 0x5a5a;
+			CU_ASSERT(spdk_crc16_t10dif(init, buf + off, len) ==
+				  crc16_t10dif_table(init, buf + off, len));
+		}
+	}
+	CU_ASSERT(spdk_crc16_t10dif(0, buf, 4096) == crc16_t10dif_table(0, buf, 4096));
+
+	/* A checksum can be continued over more data. */
+	crc = spdk_crc16_t10dif(0, buf, 1000);
+	CU_ASSERT(spdk_crc16_t10dif(crc, buf + 1000, 3000) == spdk_crc16_t10dif(0, buf, 4000));
+}
+
+static void
+dif_ctx_init_test(void)
+{
+	struct spdk_dif_ctx ctx;
+
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, 520, 4, true, false, SPDK_DIF_TYPE1, 0, 0, 0, 0) == -EINVAL);
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, 8, 8, true, false, SPDK_DIF_TYPE1, 0, 0, 0, 0) == -EINVAL);
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, 520, 8, true, false, SPDK_DIF_DISABLE, 0, 0, 0, 0) == -EINVAL);
+
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, 528, 16, true, false, SPDK_DIF_TYPE1, 0, 0, 0, 0) == 0);
+	CU_ASSERT(ctx.dif_offset == 8);
+	CU_ASSERT(ctx.guard_interval == 520);
+
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, 528, 16, true, true, SPDK_DIF_TYPE1, 0, 0, 0, 0) == 0);
+	CU_ASSERT(ctx.dif_offset == 0);
+	CU_ASSERT(ctx.guard_interval == 512);
+
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, 512, 16, false, false, SPDK_DIF_TYPE2, 0, 0, 0, 0) == 0);
+	CU_ASSERT(ctx.guard_interval == 520);
+
+	/* Generation and verification refuse a context of the other layout. */
+	CU_ASSERT(spdk_dif_generate(NULL, 0, &ctx) == -EINVAL);
+	CU_ASSERT(spdk_dif_verify(NULL, 0, &ctx, NULL) == -EINVAL);
+}
+
+static void
+dif_generate_verify(uint32_t md_size, bool dif_loc_first)
+{
+	struct spdk_dif_ctx	ctx;
+	struct spdk_dif_error	err;
+	uint32_t		block_size = DATA_SIZE + md_size;
+	uint32_t		dif_flags = SPDK_DIF_FLAGS_GUARD_CHECK | SPDK_DIF_FLAGS_APPTAG_CHECK |
+					    SPDK_DIF_FLAGS_REFTAG_CHECK;
+	uint8_t			*buf, *pi;
+	uint32_t		i;
+
+	buf = calloc(4, block_size);
+	SPDK_CU_ASSERT_FATAL(buf != NULL);
+	for (i = 0; i < 4; i++) {
+		fill_pattern(buf + i * block_size, block_size, i);
+	}
+
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, block_size, md_size, true, dif_loc_first, SPDK_DIF_TYPE1,
+				    dif_flags, 100, 0xFFFF, 0x55aa) == 0);
+	CU_ASSERT(spdk_dif_generate(buf, 4, &ctx) == 0);
+	CU_ASSERT(spdk_dif_verify(buf, 4, &ctx, NULL) == 0);
+
+	for (i = 0; i < 4; i++) {
+		pi = buf + i * block_size + DATA_SIZE + (dif_loc_first ? 0 : md_size - 8);
+		CU_ASSERT(dif_load_be16(pi) == spdk_crc16_t10dif(0, buf + i * block_size,
+				ctx.guard_interval));
+		CU_ASSERT(dif_load_be16(pi + 2) == 0x55aa);
+		CU_ASSERT(dif_load_be32(pi + 4) == 100 + i);
+	}
+
+	/* Metadata in front of the PI is covered by the guard; metadata after it is not. */
+	buf[2 * block_size + DATA_SIZE] ^= 0x1;
+	if (dif_loc_first) {
+		CU_ASSERT(spdk_dif_verify(buf, 4, &ctx, &err) == -EIO);
+		CU_ASSERT(err.err_type == SPDK_DIF_GUARD_ERROR);
+		buf[2 * block_size + DATA_SIZE] ^= 0x1;
+		buf[2 * block_size + block_size - 1] ^= 0x1;
+		CU_ASSERT(spdk_dif_verify(buf, 4, &ctx, NULL) == 0);
+		buf[2 * block_size + block_size - 1] ^= 0x1;
+	} else if (md_size > 8) {
+		CU_ASSERT(spdk_dif_verify(buf, 4, &ctx, &err) == -EIO);
+		CU_ASSERT(err.err_type == SPDK_DIF_GUARD_ERROR);
+		CU_ASSERT(err.err_offset == 2);
+		buf[2 * block_size + DATA_SIZE] ^= 0x1;
+	} else {
+		/* With 8 bytes of metadata that byte is the guard itself. */
+		CU_ASSERT(spdk_dif_verify(buf, 4, &ctx, &err) == -EIO);
+		CU_ASSERT(err.err_type == SPDK_DIF_GUARD_ERROR);
+		buf[2 * block_size + DATA_SIZE] ^= 0x1;
+	}
+	CU_ASSERT(spdk_dif_verify(buf, 4, &ctx, NULL) == 0);
+
+	free(buf);
+}
+
+static void
+dif_generate_verify_test(void)
+{
+	dif_generate_verify(8, false);
+	dif_generate_verify(16, false);
+	dif_generate_verify(16, true);
+}
+
+static void
+dif_error_test(void)
+{
+	struct spdk_dif_ctx	ctx;
+	struct spdk_dif_error	err;
+	uint32_t		block_size = DATA_SIZE + 8;
+	uint32_t		dif_flags = SPDK_DIF_FLAGS_GUARD_CHECK | SPDK_DIF_FLAGS_APPTAG_CHECK |
+					    SPDK_DIF_FLAGS_REFTAG_CHECK;
+	uint8_t			*buf;
+
+	buf = calloc(3, block_size);
+	SPDK_CU_ASSERT_FATAL(buf != NULL);
+	fill_pattern(buf, 3 * block_size, 7);
+
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, block_size, 8, true, false, SPDK_DIF_TYPE1, dif_flags,
+				    0x10, 0xFF00, 0x1200) == 0);
+	CU_ASSERT(spdk_dif_generate(buf, 3, &ctx) == 0);
+
+	/* Data corruption is a guard error. */
+	buf[block_size + 3] ^= 0x80;
+	CU_ASSERT(spdk_dif_verify(buf, 3, &ctx, &err) == -EIO);
+	CU_ASSERT(err.err_type == SPDK_DIF_GUARD_ERROR);
+	CU_ASSERT(err.err_offset == 1);
+	CU_ASSERT(err.expected == spdk_crc16_t10dif(0, buf + block_size, DATA_SIZE));
+	CU_ASSERT(err.actual == dif_load_be16(buf + block_size + DATA_SIZE));
+	buf[block_size + 3] ^= 0x80;
+
+	/* The application tag is compared under the mask. */
+	dif_store_be16(buf + 2 * block_size + DATA_SIZE + 2, 0x12FF);
+	CU_ASSERT(spdk_dif_verify(buf, 3, &ctx, NULL) == 0);
+	dif_store_be16(buf + 2 * block_size + DATA_SIZE + 2, 0x13FF);
+	CU_ASSERT(spdk_dif_verify(buf, 3, &ctx, &err) == -EIO);
+	CU_ASSERT(err.err_type == SPDK_DIF_APPTAG_ERROR);
+	CU_ASSERT(err.err_offset == 2);
+	CU_ASSERT(err.expected == 0x1200);
+	CU_ASSERT(err.actual == 0x1300);
+
+	/* An application tag of all ones escapes every check of a Type 1 block. */
+	dif_store_be16(buf + 2 * block_size + DATA_SIZE + 2, 0xFFFF);
+	buf[2 * block_size] ^= 0x1;
+	CU_ASSERT(spdk_dif_verify(buf, 3, &ctx, NULL) == 0);
+	buf[2 * block_size] ^= 0x1;
+	dif_store_be16(buf + 2 * block_size + DATA_SIZE + 2, 0x1200);
+
+	/* The reference tag increments per block. */
+	dif_store_be32(buf + DATA_SIZE + 4, 0x11);
+	CU_ASSERT(spdk_dif_verify(buf, 3, &ctx, &err) == -EIO);
+	CU_ASSERT(err.err_type == SPDK_DIF_REFTAG_ERROR);
+	CU_ASSERT(err.err_offset == 0);
+	CU_ASSERT(err.expected == 0x10);
+	CU_ASSERT(err.actual == 0x11);
+
+	/* Unselected tags are not checked. */
+	ctx.dif_flags = SPDK_DIF_FLAGS_GUARD_CHECK;
+	CU_ASSERT(spdk_dif_verify(buf, 3, &ctx, NULL) == 0);
+
+	free(buf);
+}
+
+static void
+dif_type3_test(void)
+{
+	struct spdk_dif_ctx	ctx;
+	uint32_t		block_size = DATA_SIZE + 8;
+	uint32_t		dif_flags = SPDK_DIF_FLAGS_GUARD_CHECK | SPDK_DIF_FLAGS_APPTAG_CHECK |
+					    SPDK_DIF_FLAGS_REFTAG_CHECK;
+	uint8_t			*buf;
+
+	buf = calloc(2, block_size);
+	SPDK_CU_ASSERT_FATAL(buf != NULL);
+	fill_pattern(buf, 2 * block_size, 3);
+
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, block_size, 8, true, false, SPDK_DIF_TYPE3, dif_flags,
+				    0xabcd, 0xFFFF, 0x1) == 0);
+	CU_ASSERT(spdk_dif_generate(buf, 2, &ctx) == 0);
+
+	/* The Type 3 reference tag is not incremented and not checked. */
+	CU_ASSERT(dif_load_be32(buf + DATA_SIZE + 4) == 0xabcd);
+	CU_ASSERT(dif_load_be32(buf + block_size + DATA_SIZE + 4) == 0xabcd);
+	dif_store_be32(buf + block_size + DATA_SIZE + 4, 0x1234);
+	CU_ASSERT(spdk_dif_verify(buf, 2, &ctx, NULL) == 0);
+
+	/* Only both tags all ones escape the checks. */
+	buf[block_size] ^= 0x1;
+	dif_store_be16(buf + block_size + DATA_SIZE + 2, 0xFFFF);
+	CU_ASSERT(spdk_dif_verify(buf, 2, &ctx, NULL) == -EIO);
+	dif_store_be32(buf + block_size + DATA_SIZE + 4, 0xFFFFFFFF);
+	CU_ASSERT(spdk_dif_verify(buf, 2, &ctx, NULL) == 0);
+
+	free(buf);
+}
+
+static void
+dix_generate_verify_test(void)
+{
+	struct spdk_dif_ctx	ctx;
+	struct spdk_dif_error	err;
+	uint32_t		dif_flags = SPDK_DIF_FLAGS_GUARD_CHECK | SPDK_DIF_FLAGS_APPTAG_CHECK |
+					    SPDK_DIF_FLAGS_REFTAG_CHECK;
+	uint8_t			*buf, *md;
+	uint16_t		crc;
+
+	buf = calloc(4, DATA_SIZE);
+	md = calloc(4, 16);
+	SPDK_CU_ASSERT_FATAL(buf != NULL && md != NULL);
+	fill_pattern(buf, 4 * DATA_SIZE, 5);
+	fill_pattern(md, 4 * 16, 6);
+
+	CU_ASSERT(spdk_dif_ctx_init(&ctx, DATA_SIZE, 16, false, false, SPDK_DIF_TYPE2, dif_flags,
+				    0x40, 0xFFFF, 0x7) == 0);
+	CU_ASSERT(spdk_dif_generate(buf, 4, &ctx) == -EINVAL);
+	CU_ASSERT(spdk_dix_generate(buf, md, 4, &ctx) == 0);
+	CU_ASSERT(spdk_dix_verify(buf, md, 4, &ctx, NULL) == 0);
+
+	/* The guard covers the data and the metadata in front of the PI. */
+	crc = spdk_crc16_t10dif(0, buf + 3 * DATA_SIZE, DATA_SIZE);
+	crc = spdk_crc16_t10dif(crc, md + 3 * 16, 8);
+	CU_ASSERT(dif_load_be16(md + 3 * 16 + 8) == crc);
+	CU_ASSERT(dif_load_be16(md + 3 * 16 + 10) == 0x7);
+	CU_ASSERT(dif_load_be32(md + 3 * 16 + 12) == 0x43);
+
+	md[3 * 16 + 1] ^= 0x4;
+	CU_ASSERT(spdk_dix_verify(buf, md, 4, &ctx, &err) == -EIO);
+	CU_ASSERT(err.err_type == SPDK_DIF_GUARD_ERROR);
+	CU_ASSERT(err.err_offset == 3);
+	md[3 * 16 + 1] ^= 0x4;
+
+	buf[DATA_SIZE - 1] ^= 0x4;
+	CU_ASSERT(spdk_dix_verify(buf, md, 4, &ctx, &err) == -EIO);
+	CU_ASSERT(err.err_offset == 0);
+
+	free(buf);
+	free(md);
+}
+
+int
+main(int argc, char **argv)
+{
+	CU_pSuite	suite = NULL;
+	unsigned int	num_failures;
+
+	if (CU_initialize_registry() != CUE_SUCCESS) {
+		return CU_get_error();
+	}
+
+	suite = CU_add_suite("dif", NULL, NULL);
+	if (suite == NULL) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if (
+		CU_add_test(suite, "crc16", crc16_test) == NULL
+		|| CU_add_test(suite, "dif_ctx_init", dif_ctx_init_test) == NULL
+		|| CU_add_test(suite, "dif_generate_verify", dif_generate_verify_test) == NULL
+		|| CU_add_test(suite, "dif_error", dif_error_test) == NULL
+		|| CU_add_test(suite, "dif_type3", dif_type3_test) == NULL
+		|| CU_add_test(suite, "dix_generate_verify", dix_generate_verify_test) == NULL
+	) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	num_failures = CU_get_number_of_failures();
+	CU_cleanup_registry();
+	return num_failures;
+}
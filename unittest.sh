@@ -11,6 +11,9 @@ test/lib/nvme/unit/nvme_ctrlr_c/nvme_ctrlr_ut
 test/lib/nvme/unit/nvme_ctrlr_cmd_c/nvme_ctrlr_cmd_ut
 test/lib/nvme/unit/nvme_ns_cmd_c/nvme_ns_cmd_ut
 test/lib/nvme/unit/nvme_qpair_c/nvme_qpair_ut
+test/lib/nvme/unit/nvme_sw_ctrlr_c/nvme_sw_ctrlr_ut
+test/lib/nvme/unit/nvme_vns_c/nvme_vns_ut
+test/lib/nvme/unit/nvme_wal_c/nvme_wal_ut
 
 make -C test/lib/ioat/unit CONFIG_WERROR=y
 
@@ -22,6 +25,10 @@ test/lib/json/parse/json_parse_ut
 test/lib/json/util/json_util_ut
 test/lib/json/write/json_write_ut
 
+make -C test/lib/util CONFIG_WERROR=y
+
+test/lib/util/dif/dif_ut
+
 make -C lib/log CONFIG_WERROR=y
 make -C lib/json CONFIG_WERROR=y
 make -C test/lib/jsonrpc CONFIG_WERROR=y